@@ -38,15 +38,15 @@ std::vector<note> patternify(const char* path) {
     return ret;
 }
 
-int scorify(const std::vector<scale*>& results) {
+int scorify(const s2table& K, const std::vector<int>& results) {
     int ret = 0;
 	for(int i = 0; i < sz(results); ++i) {
         std::set<int> ind;
-		scale* s = results[i];
-		while(s != NULL) {
-			ind.insert(s->a);
-			ind.insert(s->b);
-			s = s->y;
+		int e = results[i];
+		while(e >= 0) {
+			ind.insert(K.links[e].a);
+			ind.insert(K.links[e].b);
+			e = K.links[e].y;
 		}
         if(sz(ind) > ret) ret = ind.size();
 	}
@@ -64,19 +64,21 @@ int main(int argc, char** argv) {
     std::vector<file> db(1);
     std::vector<note> dNotes;
 
+    // The arrays of the K table are reused for all the files
+    s2table K;
+    init_s2_table(&K);
+
     while(fin>>db.back().wholePath) {
         fin>>db.back().path;
         dNotes = patternify(db.back().wholePath.c_str());
-        std::vector<std::vector<scale> > K;
-        PQV Q;
-        int W = 10;
-        create_K_table(W,qNotes,dNotes,K,Q);
-        std::vector<scale*> results = solve(3,sz(qNotes),K,Q);
-        db.back().score = scorify(results);
+        create_K_table(S2_WINDOW,qNotes,dNotes,K);
+        std::vector<int> results = solve(S2_MIN_CHAIN,sz(qNotes),K);
+        db.back().score = scorify(K,results);
         db.resize(sz(db) + 1);
     }
 
     db.pop_back();
+    free_s2_table(&K);
 
     std::stable_sort(db.begin(),db.end());
     std::reverse(db.begin(),db.end());
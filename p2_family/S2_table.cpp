@@ -0,0 +1,65 @@
+#include <iostream>
+#include <vector>
+#include <cstring>
+
+#include "song.h"
+#include "partial.hpp"
+
+std::ostream& operator << (std::ostream& o, const scale& s) {
+	o<<s.a<<" "<<s.b<<" "<<s.c<<" "<<s.w<<" "<<s.s;
+	return o;
+}
+
+// Converts notes to the song note format, dropping the end markers.
+static std::vector<vector> songNotes(const std::vector<note>& N) {
+	std::vector<vector> ret;
+	for(int i = 0; i < sz(N); ++i) {
+		if(N[i].x == INF) continue;
+		vector v;
+		memset(&v,0,sizeof(v));
+		v.strt = N[i].x;
+		v.ptch = (char) N[i].y;
+		ret.push_back(v);
+	}
+	return ret;
+}
+
+void create_K_table(int W, const std::vector<note>& P, const std::vector<note>& T,
+        s2table& K) {
+	std::vector<vector> p = songNotes(P);
+	std::vector<vector> t = songNotes(T);
+	build_s2_table(&K,p.data(),sz(p),t.data(),sz(t),W);
+}
+
+std::vector<int> solve(int alpha, int m, s2table& K) {
+	solve_s2_table(&K);
+
+	std::vector<char> continued(K.size,0);
+	for(int i = 0; i < K.size; ++i) {
+		if(K.links[i].y >= 0) continued[K.links[i].y] = 1;
+	}
+
+	std::vector<int> ret;
+	for(int i = 0; i < K.size; ++i) {
+		if(!continued[i] && K.links[i].w >= alpha) ret.push_back(i);
+	}
+	return ret;
+}
+
+void reportOccurences(const std::vector<note>& T, const s2table& K,
+        const std::vector<int>& Kaa) {
+	for(int i = 0; i < sz(Kaa); ++i) {
+		std::vector<int> ind;
+		int e = Kaa[i];
+		std::cout<<"Occurrence "<<i<<" (scale "<<K.links[e].s<<"):";
+		while(e >= 0) {
+			ind.push_back(K.links[e].b);
+			if(K.links[e].y < 0) ind.push_back(K.links[e].a);
+			e = K.links[e].y;
+		}
+		for(int j = sz(ind) - 1; j >= 0; --j) {
+			std::cout<<" ("<<T[ind[j]].x<<","<<T[ind[j]].y<<")";
+		}
+		std::cout<<std::endl;
+	}
+}
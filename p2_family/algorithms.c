@@ -104,13 +104,9 @@ static const alg_info ALGORITHM_INFO[] = {
     "P2F5g",    "P2/F5 (global select)",
     "Same as P2/F5 except that the least frequent vectors used in the search are selected globally--not within each window position."},
 
-#ifdef ENABLE_BLOSSOM4
     {FILTER_P2_PH,                  PROBLEM_2, 1, DATA_VINDEX,
     "P2F6",     "P2/F6",
-    "P2 index filter based on the pigeonhole principle and use of P1 index filters. This version uses the blossom4 graph matching algorithm to retrieve an optimal set of vectors from the pattern."},
-#else
-    {0, 0, 0, 0, "", "", ""},
-#endif
+    "P2 index filter based on the pigeonhole principle and use of P1 index filters. This version retrieves the set of disjoint search vectors with the smallest total occurrence count from the pattern."},
 
     {FILTER_P2_GREEDY_PH,           PROBLEM_2, 1, DATA_VINDEX,
     "P2F6g",    "P2/F6 (greedy)",
@@ -144,15 +140,15 @@ static const alg_info ALGORITHM_INFO[] = {
 
     {ALG_MSM_FFT,                   PROBLEM_2, 1, DATA_MSM,
     "MSMFFT",   "MSM (FFT)",
-    "The full MSM algorithm with FFT."},
+    "The full MSM algorithm with FFT. Cross-correlates hashed piano rolls and verifies the correlation peaks until the result is exact."},
 
     {ALG_MSM_FFT_LOOKUP_1,          PROBLEM_2, 1, DATA_MSM,
     "MSMFFTl1", "MSM (FFT lookup 1)",
-    "A variation of the MSM FFT algorithm."},
+    "A variation of the MSM FFT algorithm that only verifies the strongest correlation peak in each song."},
 
     {ALG_MSM_FFT_LOOKUP_2,          PROBLEM_2, 1, DATA_MSM,
     "MSMFFTl2", "MSM (FFT lookup 2)",
-    "A variation of the MSM FFT algorithm."},
+    "A variation of the MSM FFT algorithm that verifies at most msm_r correlation peaks in each song."},
 
 #else
     {0, 0, 0, 0, "", "", ""},
@@ -183,6 +179,22 @@ static const alg_info ALGORITHM_INFO[] = {
     "AP3", "Align P3",
     "Finds the maximal overlapping of two sets of horizontal line segments."},
 
+    {FILTER_P2_PLANNED,             PROBLEM_2, 1, DATA_VINDEX,
+    "P2F8",     "P2/F8 (planned)",
+    "P2 index filter that chooses between the greedy pigeonhole and window filters and their vectors by estimating the verification cost of each from index bucket sizes."},
+
+    {ALG_S2,                        PROBLEM_4, 1, DATA_NONE,
+    "S2",       "S2",
+    "Time-scale invariant algorithm that finds the longest chain of note pairs with a common transposition and time scale."},
+
+    {ALG_SIA,                       PROBLEM_2, 1, DATA_NONE,
+    "SIA",      "SIA",
+    "Finds the largest partial match by sorting the difference vectors between pattern and song notes."},
+
+    {ALG_SYNC_P3,                   PROBLEM_3, 1, DATA_P3,
+    "SYNC",     "Sync P3",
+    "Finds the section of each song that best follows the pattern by chaining P3 correlations of sliding pattern windows."},
+
     {-1, 0, 0, 0, NULL, NULL, NULL}
 };
 
@@ -43,7 +43,7 @@ extern "C" {
 
 /** Number of algorithms in geometric-cbmr. Remember to edit
   * the SEARCH_FUNCTIONS array in search.c when changing this constant. */
-#define NUM_ALGORITHMS 27
+#define NUM_ALGORITHMS 31
 
 /* Algorithms and index filters that are available in geometric-cbmr. */
 
@@ -148,6 +148,37 @@ extern "C" {
 #define ALG_ALIGN_P3 27
 
 
+/* Planned index filters */
+
+/** P2 index filter that estimates the verification cost of the pigeonhole
+  * and window filters from index bucket sizes and runs the cheaper one with
+  * the smallest set of vectors that tolerates the given error rate. */
+#define FILTER_P2_PLANNED 28
+
+
+/* Time-scale invariant algorithms */
+
+/** S2: finds the longest chain of note pairs that occurs with a common
+  * transposition and time scale. See geometric_S2.c. */
+#define ALG_S2 29
+
+
+/* Pattern discovery algorithms */
+
+/** SIA: finds the largest pattern that a song contains with one translation
+  * from sorted difference vectors. The same vectors give the maximal
+  * translatable patterns of a song with sia_song() and siatec_song(). See
+  * geometric_SIA.c. */
+#define ALG_SIA 30
+
+
+/* Synchronization algorithms */
+
+/** Finds the section of each song that best follows the pattern by chaining
+  * P3 correlations of sliding pattern windows. See sync_P3.c. */
+#define ALG_SYNC_P3 31
+
+
 /* Problem types */
 
 #define PROBLEM_1 1
@@ -34,6 +34,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "config.h"
 #include "midifile.h"
@@ -52,9 +57,14 @@
 #define SKIP_LINES 10
 
 
-/*#define KEEP_SLOPE 1
+/** Backpointer codes of the initial alignment path. Smaller codes are
+  * distances to the previous column of the path. */
+#define ALIGN_BP_START 255
+#define ALIGN_BP_SKIP 254
+#define ALIGN_MAX_STEP 253
 
-#define SLOPE_UPDATE 0.3F*/
+/** Sum of a path that does not exist */
+#define ALIGN_DP_NONE INT_MIN
 
 /* #define KEEP_TRANSPOSITION 1 */
 
@@ -155,6 +165,8 @@ static void (* const ALIGNMENT_MAP_FUNCTIONS[])(const songcollection *sc,
 #define ALIGN_ARG_P3_NUM_SCALES      'x'
 #define ALIGN_ARG_SONG_TEMPO         't'
 #define ALIGN_ARG_ALIGNMENT_DELAY    'd'
+#define ALIGN_ARG_THREADS            'T'
+#define ALIGN_ARG_MAP_LEVELS         'L'
 
 
 static const struct option LONG_OPTIONS[] = {
@@ -173,6 +185,8 @@ static const struct option LONG_OPTIONS[] = {
     {"p3-num-scales",       required_argument,  0, ALIGN_ARG_P3_NUM_SCALES},
     {"song-tempo",          required_argument,  0, ALIGN_ARG_SONG_TEMPO},
     {"delay",               required_argument,  0, ALIGN_ARG_ALIGNMENT_DELAY},
+    {"threads",             required_argument,  0, ALIGN_ARG_THREADS},
+    {"map-levels",          required_argument,  0, ALIGN_ARG_MAP_LEVELS},
     {0, 0, 0, 0}
 };
 
@@ -211,13 +225,17 @@ static void align_print_usage(const alignparameters *p) {
     fputs( "  -c, --skip-cost [int]             Alignment skip cost [400]\n", stdout);
 
     fputs( "  -M, --map-accuracy [int]          Map accuracy in milliseconds [200]\n", stdout);
+    fputs( "  -L, --map-levels [int]            Number of map resolution levels [1]\n", stdout);
 
     fputs( "  -w, --p3-window-size [int]        AP3 window size [2000]\n", stdout);
     fputs( "  -x, --p3-num-scales [int]         Number of scale variations scanned [1]\n", stdout);
 
     fputs( "  -t, --song-tempo [float]          Adjust song tempo [1.0]\n", stdout);
 
-    fputs( "  -d, --delay [int]                 Alignment delay in milliseconds [0]\n\n", stdout);
+    fputs( "  -d, --delay [int]                 Alignment delay in milliseconds [0]\n", stdout);
+
+    fputs( "  -T, --threads [int]               Number of threads for alignment map\n", stdout);
+    fputs( "                                    generation, 0 for one per processor [0]\n\n", stdout);
 }
 
 
@@ -247,6 +265,8 @@ void align_init_parameters(alignparameters *p) {
 
     p->song_tempo = 1.0F;
     p->delay = 0;
+    p->num_threads = 0;
+    p->map_levels = 1;
 }
 
 void align_free_parameters(alignparameters *p) {
@@ -334,6 +354,12 @@ int align_parse_arguments(int argc, char **argv, alignparameters *p) {
             case ALIGN_ARG_ALIGNMENT_DELAY:
                 p->delay = atoi(optarg);
                 break;
+            case ALIGN_ARG_THREADS:
+                p->num_threads = MAX2(0, atoi(optarg));
+                break;
+            case ALIGN_ARG_MAP_LEVELS:
+                p->map_levels = MAX2(1, atoi(optarg));
+                break;
             case ALIGN_ARG_MAX_PATTERN_SIZE:
                 p->max_pattern_size = atoi(optarg);
                 break;
@@ -422,6 +448,7 @@ alignmentmap *init_alignmentmap(void) {
 }
 
 void free_alignmentmap(alignmentmap *map) {
+    if (map->coarser != NULL) free_alignmentmap(map->coarser);
     free(map->lines);
     free(map->vbuffer);
     free(map->tbuffer);
@@ -496,7 +523,8 @@ void write_alignmentmap_pgm(const char *filename, const alignmentmap *map,
             int j, k;
             unsigned char *mapvalues = mapline->values;
             /*char *maptransp = (char *) mapline->transpositions;*/
-            for (j=pos, k=0; j<pos+width; ++j, ++k) {
+            for (j=pos+mapline->first_column, k=0;
+                    j<pos+mapline->end_column; ++j, ++k) {
                 buffer[j] = MAX2(buffer[j], mapvalues[k]);
                 /*buffer[j] = (unsigned char) (maptransp[k] + 128);*/
             }
@@ -533,225 +561,436 @@ void write_alignmentmap_pgm(const char *filename, const alignmentmap *map,
 
 
 /**
- * Calculates an initial alignment from an alignment map.
+ * Finds the best path through an alignment map, or through a band of it,
+ * with dynamic programming. Each map line may continue the path of the
+ * previous line from a window of columns that the slope limits allow, or
+ * skip from the best column of the previous line at the cost of skip_cost.
+ * A column may not stay in place for longer than max_slope map lines.
+ * Window maxima are calculated for all columns of a line at once, four at
+ * a time with SSE2 when it is available. Only the two latest lines of
+ * sums are kept, and the path is stored as one-byte backpointers, so the
+ * memory use is one byte per band cell.
  *
  * @param parameters alignment parameters
  * @param map alignment map. See map_alignments().
- * @param a the calculated initial alignment
+ * @param first first column of the band on each map line, or NULL to use
+ *        whole lines. The band must be within the stored columns of the
+ *        line.
+ * @param end end of the band on each map line, or NULL to use whole lines
+ * @param path column of the path on each map line. Lines that are reached
+ *        by a skip are stored as (-2 - column), and lines before the start
+ *        of the path as -1.
+ *
+ * @return 1 if successful, 0 otherwise
  */
-void calculate_initial_alignment(const alignparameters *parameters,
-        const alignmentmap *map, alignment *a) {
-    int i, p, mp, skiplines;
+static int calculate_alignment_path(const alignparameters *parameters,
+        const alignmentmap *map, const int *first, const int *end,
+        int *path) {
+    int i, j;
     int width = map->width;
     int height = map->height;
-    int *lines, *sum, *lastsum, *lastline, *stationarytime;
-    unsigned char *mvalues = map->lines[0].values;
-    int max = 0, maxpos = 0;
     float rres = 1.0F / (float) parameters->map_accuracy;
     float slope = rres * parameters->max_slope;
     float rslope = rres / parameters->max_slope;
     int skip_cost = (int) (rres * 1000.0F * (float) parameters->skip_cost);
     int max_stationarytime = parameters->max_slope * parameters->map_accuracy;
-#ifdef KEEP_SLOPE
-    float *lineslope, *lastlineslope;
-    int slope_depth = parameters->max_slope + 2;
-#endif
-
-    if (height == 0) return;
-
-    lines = (int *) malloc(width * height * sizeof(int));
-    sum = (int *) malloc(width * sizeof(int));
-    lastsum = (int *) malloc(width * sizeof(int));
-    stationarytime = (int *) malloc(width * sizeof(int));
-#ifdef KEEP_SLOPE
-    lineslope = (float *) malloc(width * sizeof(float));
-    lastlineslope = (float *) malloc(width * sizeof(float));
-#endif
-    lastline = &lines[0];
-
-    if ((lines == NULL) || (sum == NULL) || (lastsum == NULL) ||
-            (stationarytime == NULL)
-#ifdef KEEP_SLOPE
-            || (lineslope == NULL) || (lastlineslope == NULL)
-#endif
-            ) {
-        fputs("Error in calculate_initial_alignment: unable to allocate memory for buffers", stderr);
-        free(lines);
+    int max = 0, maxpos;
+    int bandsize = 0;
+    size_t cells = 0;
+    size_t *offsets = (size_t *) malloc(height * sizeof(size_t));
+    int *maxposes = (int *) malloc(height * sizeof(int));
+    int *sum, *lastsum, *stationarytime, *laststationarytime;
+    int *window, *best, *bestpos;
+    unsigned char *bp;
+
+    for (i=0; i<height; ++i) {
+        int size = first ? end[i] - first[i] : width;
+        bandsize = MAX2(bandsize, size);
+        cells += size;
+    }
+    bp = (unsigned char *) malloc(cells);
+    /* Window values reach ALIGN_MAX_STEP columns to the left of the band */
+    window = (int *) malloc((bandsize + ALIGN_MAX_STEP + 2) * sizeof(int));
+    sum = (int *) malloc(bandsize * sizeof(int));
+    lastsum = (int *) malloc(bandsize * sizeof(int));
+    stationarytime = (int *) malloc(bandsize * sizeof(int));
+    laststationarytime = (int *) malloc(bandsize * sizeof(int));
+    best = (int *) malloc((bandsize + 1) * sizeof(int));
+    bestpos = (int *) malloc((bandsize + 1) * sizeof(int));
+    if ((offsets == NULL) || (maxposes == NULL) || (bp == NULL) ||
+            (window == NULL) || (sum == NULL) || (lastsum == NULL) ||
+            (stationarytime == NULL) || (laststationarytime == NULL) ||
+            (best == NULL) || (bestpos == NULL)) {
+        fputs("Error in calculate_initial_alignment: unable to allocate memory for buffers\n", stderr);
+        free(offsets);
+        free(maxposes);
+        free(bp);
+        free(window);
         free(sum);
         free(lastsum);
         free(stationarytime);
-#ifdef KEEP_SLOPE
-        free(lineslope);
-        free(lastlineslope);
-#endif
-        return;
+        free(laststationarytime);
+        free(best);
+        free(bestpos);
+        return 0;
     }
 
-    for (i=0; i<width; ++i) {
-        lastsum[i] = mvalues[i];
-        lastline[i] = -1;
-        stationarytime[i] = 0;
-#ifdef KEEP_SLOPE
-        lastlineslope[i] = 1.0F;
-#endif
-        if (lastsum[i] > max) {
-            max = lastsum[i];
-            maxpos = i;
+    /* The first line starts the paths */
+    {
+        int f = first ? first[0] : 0;
+        int e = first ? end[0] : width;
+        unsigned char *mvalues = map->lines[0].values;
+        int mf = map->lines[0].first_column;
+        maxpos = f;
+        offsets[0] = 0;
+        for (j=f; j<e; ++j) {
+            lastsum[j-f] = mvalues[j-mf];
+            laststationarytime[j-f] = 0;
+            bp[j-f] = ALIGN_BP_START;
+            if (lastsum[j-f] > max) {
+                max = lastsum[j-f];
+                maxpos = j;
+            }
         }
+        maxposes[0] = maxpos;
     }
     max = max - skip_cost;
+
     for (i=1; i<height; ++i) {
-        int j, lstart;
+        int lf = first ? first[i-1] : 0;
+        int le = first ? end[i-1] : width;
+        int f = first ? first[i] : 0;
+        int e = first ? end[i] : width;
         int newmax = 0;
         int newmaxpos = -1;
-        int *line = &lines[i * width];
+        int lstart, kmin, wfirst, n, d;
+        unsigned char *mvalues = map->lines[i].values;
+        int mf = map->lines[i].first_column;
+        unsigned char *line;
         float dt = map->lines[i].pattern_time - map->lines[i-1].pattern_time;
-        int w1 = (int) (dt * rslope);
+        int w1 = MIN2((int) (dt * rslope), ALIGN_MAX_STEP - 1);
         int w2 = (int) (dt * slope);
-        int pqsize = MAX2(1, w2 - w1 + 1);
-        int n = 0;
+        int wsize = MIN2(MAX2(1, w2 - w1 + 1), ALIGN_MAX_STEP - w1);
 #ifdef KEEP_TRANSPOSITION
         char *transp = map->lines[i].transpositions;
         char *lasttransp = map->lines[i-1].transpositions;
+        int lmf = map->lines[i-1].first_column;
 #endif
-        pqroot *pq = pq_create(pqsize);
 
-        mvalues = map->lines[i].values;
+        offsets[i] = offsets[i-1] + (le - lf);
+        line = &bp[offsets[i]];
 
         /* The first entries of each map line may not have predecessors */
-        if ((w1 < width) && ((stationarytime[w1] + dt) >= max_stationarytime))
-            lstart = w1+1;
-        else lstart = w1;
-        for (j=0; j<MIN2(lstart, width); ++j) {
-            sum[j] = mvalues[j];
-            line[j] = -1;
-            stationarytime[j] = 0;
-#ifdef KEEP_SLOPE
-            lineslope[j] = 1.0F;
-#endif
+        lstart = w1;
+        if ((w1 < width) && (w1 >= lf) && (w1 < le) &&
+                ((laststationarytime[w1-lf] + dt) >= max_stationarytime))
+            lstart = w1 + 1;
+        kmin = MAX2(lf, lstart - w1);
+
+        /* Sums of the previous line from column wfirst on, with a sentinel
+         * for the columns that are not available */
+        wfirst = f - 1 - w1 - (wsize - 1);
+        n = e - wfirst - w1;
+        for (j=0; j<n; ++j) {
+            int k = wfirst + j;
+            window[j] = ((k >= kmin) && (k < le)) ? lastsum[k-lf] :
+                    ALIGN_DP_NONE;
         }
-        for (j=lstart; j<width; ++j) {
-            int newsum;
-            int newpos;
-            if ((stationarytime[j] + dt) < max_stationarytime) {
-                pqnode *node;
-
-                /* Add a new value to the window queue */
-                node = pq_getnode(pq, n);
-                node->key1 = INT_MAX - 1 - lastsum[j-w1];
-                node->key2 = j-w1;
-                pq_update_key1_p3(pq, node);
-
-                /* Get maximum sum within the window */
-                node = pq_getmin(pq);
-                newsum = INT_MAX - 1 - node->key1;
-                newpos = node->key2;
-            } else {
-                pqnode *node;
-
-                /* Get maximum sum within the window */
-                node = pq_getmin(pq);
-                newsum = INT_MAX - 1 - node->key1;
-                newpos = node->key2;
-
-                /* Add a new value to the window queue */
-                node = pq_getnode(pq, n);
-                node->key1 = INT_MAX - 1 - lastsum[j-w1];
-                node->key2 = j-w1;
-                pq_update_key1_p3(pq, node);
+
+        /* Window maxima for columns f-1 to e-1. Equal sums are resolved
+         * in favour of the longer step. */
+        n = e - f + 1;
+        for (j=0; j<n; ++j) {
+            best[j] = window[j];
+            bestpos[j] = wsize - 1;
+        }
+        for (d=wsize-2; d>=0; --d) {
+            const int *w = &window[wsize - 1 - d];
+            j = 0;
+#ifdef __SSE2__
+            {
+                __m128i vd = _mm_set1_epi32(d);
+                for (; j + 4 <= n; j += 4) {
+                    __m128i v = _mm_loadu_si128((const __m128i *) &w[j]);
+                    __m128i b = _mm_loadu_si128((const __m128i *) &best[j]);
+                    __m128i p = _mm_loadu_si128(
+                            (const __m128i *) &bestpos[j]);
+                    __m128i gt = _mm_cmpgt_epi32(v, b);
+                    b = _mm_or_si128(_mm_and_si128(gt, v),
+                            _mm_andnot_si128(gt, b));
+                    p = _mm_or_si128(_mm_and_si128(gt, vd),
+                            _mm_andnot_si128(gt, p));
+                    _mm_storeu_si128((__m128i *) &best[j], b);
+                    _mm_storeu_si128((__m128i *) &bestpos[j], p);
+                }
             }
-            if (newsum < max) {
-                sum[j] = max + mvalues[j];
-                line[j] = -2 - maxpos;
-#ifdef KEEP_SLOPE
-                lineslope[j] = lastlineslope[maxpos];
 #endif
+            for (; j<n; ++j) {
+                if (w[j] > best[j]) {
+                    best[j] = w[j];
+                    bestpos[j] = d;
+                }
+            }
+        }
+
+        for (j=f; j<e; ++j) {
+            int c = j - f;
+            int st = ((j >= lf) && (j < le)) ? laststationarytime[j-lf] : 0;
+            if (j < lstart) {
+                sum[c] = mvalues[j-mf];
+                line[c] = ALIGN_BP_START;
+                stationarytime[c] = 0;
             } else {
-                sum[j] = mvalues[j];
-#ifdef KEEP_TRANSPOSITION
-                if (ABS((int) transp[j] - (int) lasttransp[newpos]) >
-                        KEEP_TRANSPOSITION) {
-                    sum[j] = 0;
+                int newsum, step, newpos;
+
+                /* A column that has stayed in place for too long must
+                 * move */
+                if ((st + dt) < max_stationarytime) {
+                    newsum = best[c+1];
+                    step = bestpos[c+1];
+                } else {
+                    newsum = best[c];
+                    step = bestpos[c] + 1;
                 }
+                newpos = j - w1 - step;
+                if ((newsum < max) || (newsum == ALIGN_DP_NONE)) {
+                    sum[c] = max + mvalues[j-mf];
+                    line[c] = (maxposes[i-1] >= 0) ? ALIGN_BP_SKIP :
+                            ALIGN_BP_START;
+                } else {
+                    sum[c] = mvalues[j-mf];
+#ifdef KEEP_TRANSPOSITION
+                    if (ABS((int) transp[j-mf] -
+                            (int) lasttransp[newpos-lmf]) >
+                            KEEP_TRANSPOSITION) {
+                        sum[c] = 0;
+                    }
 #endif
-#ifdef KEEP_SLOPE
-                {
-                float slp, slpmul;
-                int depth;
-                int *ll = lastline;
-                int lpos = newpos;
-                for (depth=0; (depth<slope_depth) && (i-depth-1>=0) && (ll >= lines); ++depth) {
-                    if (ll[lpos] < 0) break;
-                    lpos = ll[lpos];
-                    ll -= width * sizeof(int);
+                    sum[c] += newsum;
+                    line[c] = (unsigned char) (w1 + step);
                 }
-                slpmul = (float) (map->lines[i].pattern_time -
-                        map->lines[i-depth].pattern_time);
-                slp = (float) (j - lpos);
-                if ((slpmul > 0.0F) && (slp > 0.0F)) slp = rres * slpmul / slp;
-                else slp = 1.0;
-                slpmul = slp / lastlineslope[newpos];
-                if (slpmul > 1.0F) slpmul = 1.0F / slpmul;
-                /*printf("pos: %d  slp: %f, slpmul: %f\n", j, slp, slpmul);*/
-                sum[j] = slpmul * (float) sum[j];
-                lineslope[j] = lastlineslope[newpos] +
-                        SLOPE_UPDATE * (slp - lastlineslope[newpos]);
-                }
-#endif
-                sum[j] += newsum;
-                line[j] = newpos;
+                if ((newpos == j) && (newsum != ALIGN_DP_NONE))
+                    stationarytime[c] = st + (int) dt;
+                else stationarytime[c] = 0;
             }
-
-            if (newpos == j) stationarytime[j] += (int) dt;
-            else stationarytime[j] = 0;
-
-            if (sum[j] > newmax) {
-                newmax = sum[j];
+            if (sum[c] > newmax) {
+                newmax = sum[c];
                 newmaxpos = j;
             }
-            ++n;
-            if (n == pqsize) n = 0;
         }
         max = newmax - skip_cost;
-        maxpos = newmaxpos;
+        maxposes[i] = newmaxpos;
         VOIDPTR_SWAP(sum, lastsum);
-#ifdef KEEP_SLOPE
-        VOIDPTR_SWAP(lineslope, lastlineslope);
-#endif
-        lastline = line;
-        pq_free(pq);
+        VOIDPTR_SWAP(stationarytime, laststationarytime);
     }
 
+    /* Follow the backpointers from the best column of the last line */
+    maxpos = maxposes[height-1];
+    if (maxpos < 0) maxpos = first ? first[height-1] : 0;
+    for (i=height-1; i>=0; --i) {
+        int f = first ? first[i] : 0;
+        int b = bp[offsets[i] + maxpos - f];
+        if (b == ALIGN_BP_SKIP) {
+            path[i] = -2 - maxpos;
+            maxpos = maxposes[i-1];
+        } else {
+            path[i] = maxpos;
+            if (b == ALIGN_BP_START) break;
+            maxpos -= b;
+        }
+    }
+    for (--i; i>=0; --i) path[i] = -1;
+
+    free(offsets);
+    free(maxposes);
+    free(bp);
+    free(window);
     free(sum);
     free(lastsum);
     free(stationarytime);
-#ifdef KEEP_SLOPE
-    free(lineslope);
-    free(lastlineslope);
-#endif
+    free(laststationarytime);
+    free(best);
+    free(bestpos);
+    return 1;
+}
+
+
+/**
+ * Calculates the band of a map around the path of a map that is scale
+ * times coarser. The band of each line covers the path on the same and the
+ * neighbouring lines of the coarser map, and ALIGN_DP_BAND columns on both
+ * sides. Lines before the start of the path use the first line of the
+ * path.
+ *
+ * @param cpath path on the coarser map. See calculate_alignment_path().
+ * @param cheight height of the coarser map
+ * @param scale resolution ratio of the maps
+ * @param width width of the map
+ * @param height height of the map
+ * @param first first column of the band on each line
+ * @param end end of the band on each line
+ */
+static void alignment_path_band(const int *cpath, int cheight, int scale,
+        int width, int height, int *first, int *end) {
+    int i, j, start;
+    for (start=0; (start<cheight-1) && (cpath[start] == -1); ++start);
+    for (i=0; i<height; ++i) {
+        int ci = MIN2(i / scale, cheight - 1);
+        int lo = INT_MAX, hi = -1;
+        for (j=MAX2(ci-1, 0); j<=MIN2(ci+1, cheight-1); ++j) {
+            int c = cpath[MAX2(j, start)];
+            if (c < -1) c = -2 - c;
+            lo = MIN2(lo, c);
+            hi = MAX2(hi, c);
+        }
+        first[i] = MIN2(MAX2(0, lo * scale - ALIGN_DP_BAND), width - 1);
+        end[i] = MAX2(MIN2(width, (hi + 1) * scale + ALIGN_DP_BAND),
+                first[i] + 1);
+    }
+}
+
+
+/**
+ * Calculates the path of an initial alignment. The path through a
+ * multi-resolution map stays in the corridor of its lines. Otherwise a map
+ * that has more than ALIGN_DP_MAX_CELLS cells is first downsampled by
+ * ALIGN_DP_SCALE in both directions, keeping the highest value of each
+ * block. The path through the smaller map is calculated recursively, and
+ * the full map is then only searched in a band around it.
+ *
+ * @param parameters alignment parameters
+ * @param map alignment map. See map_alignments().
+ * @param path path of the alignment. See calculate_alignment_path().
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int calculate_multiscale_alignment_path(
+        const alignparameters *parameters, const alignmentmap *map,
+        int *path) {
+    alignparameters cparameters;
+    alignmentmap cmap;
+    int *cpath, *first, *end;
+    int scale = ALIGN_DP_SCALE;
+    int width = map->width;
+    int height = map->height;
+    int cwidth = (width + scale - 1) / scale;
+    int cheight = (height + scale - 1) / scale;
+    int i, j, ret = 0;
+
+    if (map->coarser != NULL) {
+        first = (int *) malloc(height * sizeof(int));
+        end = (int *) malloc(height * sizeof(int));
+        if ((first == NULL) || (end == NULL)) {
+            fputs("Error in calculate_initial_alignment: unable to allocate memory for buffers\n", stderr);
+        } else {
+            for (i=0; i<height; ++i) {
+                first[i] = map->lines[i].first_column;
+                end[i] = map->lines[i].end_column;
+            }
+            ret = calculate_alignment_path(parameters, map, first, end, path);
+        }
+        free(first);
+        free(end);
+        return ret;
+    }
+    if ((size_t) width * height <= ALIGN_DP_MAX_CELLS)
+        return calculate_alignment_path(parameters, map, NULL, NULL, path);
+
+    cparameters = *parameters;
+    cparameters.map_accuracy *= scale;
+    cmap = *map;
+    cmap.width = cwidth;
+    cmap.height = cheight;
+    cmap.accuracy = map->accuracy * scale;
+    cmap.lines = (alignmentline *) malloc(cheight * sizeof(alignmentline));
+    cmap.vbuffer = (unsigned char *) calloc((size_t) cwidth * cheight,
+            sizeof(unsigned char));
+    cmap.tbuffer = (char *) calloc((size_t) cwidth * cheight, sizeof(char));
+    cpath = (int *) malloc(cheight * sizeof(int));
+    first = (int *) malloc(height * sizeof(int));
+    end = (int *) malloc(height * sizeof(int));
+    if ((cmap.lines == NULL) || (cmap.vbuffer == NULL) ||
+            (cmap.tbuffer == NULL) || (cpath == NULL) || (first == NULL) ||
+            (end == NULL)) {
+        fputs("Error in calculate_initial_alignment: unable to allocate memory for buffers\n", stderr);
+        goto EXIT;
+    }
+
+    /* Downsampled map */
+    for (i=0; i<cheight; ++i) {
+        alignmentline *cline = &cmap.lines[i];
+        int y;
+        *cline = map->lines[i * scale];
+        cline->values = &cmap.vbuffer[(size_t) i * cwidth];
+        cline->transpositions = &cmap.tbuffer[(size_t) i * cwidth];
+        cline->first_column = 0;
+        cline->end_column = cwidth;
+        for (y=i*scale; y<MIN2((i+1) * scale, height); ++y) {
+            const alignmentline *line = &map->lines[y];
+            for (j=line->first_column; j<line->end_column; ++j) {
+                int c = j / scale;
+                int v = line->values[j - line->first_column];
+                if (v > cline->values[c]) {
+                    cline->values[c] = v;
+                    cline->transpositions[c] =
+                            line->transpositions[j - line->first_column];
+                }
+            }
+        }
+    }
+    if (!calculate_multiscale_alignment_path(&cparameters, &cmap, cpath))
+        goto EXIT;
+
+    alignment_path_band(cpath, cheight, scale, width, height, first, end);
+    ret = calculate_alignment_path(parameters, map, first, end, path);
+
+EXIT:
+    free(cmap.lines);
+    free(cmap.vbuffer);
+    free(cmap.tbuffer);
+    free(cpath);
+    free(first);
+    free(end);
+    return ret;
+}
+
+
+/**
+ * Calculates an initial alignment from an alignment map.
+ *
+ * @param parameters alignment parameters
+ * @param map alignment map. See map_alignments().
+ * @param a the calculated initial alignment
+ */
+void calculate_initial_alignment(const alignparameters *parameters,
+        const alignmentmap *map, alignment *a) {
+    int i, mp, skiplines;
+    int height = map->height;
+    int *path;
+
+    if (height == 0) return;
+
+    path = (int *) malloc(height * sizeof(int));
+    if (path == NULL) {
+        fputs("Error in calculate_initial_alignment: unable to allocate memory for buffers\n", stderr);
+        return;
+    }
+    if (!calculate_multiscale_alignment_path(parameters, map, path)) {
+        free(path);
+        return;
+    }
 
     /* Calculate the number of alignment points */
-    p = (height - 1) * width;
     skiplines = 0;
     a->size = 0;
-    i = maxpos;
-    for (mp=height-1; (mp>=0); --mp,p-=width) {
-        int tt;
-        if (lines[p+maxpos] < -1) {
-            tt = -1 - maxpos * map->accuracy;
-            skiplines = 0;
-        } else tt = maxpos * map->accuracy;
+    for (mp=height-1; (mp>=0) && (path[mp] != -1); --mp) {
+        if (path[mp] < -1) skiplines = 0;
         if (skiplines <= 0) {
             skiplines = SKIP_LINES;
             ++a->size;
         }
-        maxpos = lines[p + maxpos];
-        if (maxpos == -1) {
-            break;
-        } else if (maxpos < -1) maxpos = -2 - maxpos;
         --skiplines;
     }
-    maxpos = i;
 
     a->pattern = map->pattern;
     a->target = map->target;
@@ -760,110 +999,261 @@ void calculate_initial_alignment(const alignparameters *parameters,
     a->quality = (unsigned char *) calloc(a->size,
             sizeof(unsigned char));
 
-    p = (height - 1) * width;
     skiplines = 0;
-    for (mp=height-1,i=a->size-1; (mp>=0) && (i>=0); --mp,p-=width) {
+    for (mp=height-1,i=a->size-1; (mp>=0) && (i>=0); --mp) {
+        int col = path[mp];
         int tt;
-        if (lines[p+maxpos] < -1) {
-            tt = -1 - maxpos * map->accuracy;
+        if (col < -1) {
+            col = -2 - col;
+            tt = -1 - col * map->accuracy;
             skiplines = 0;
-        } else tt = maxpos * map->accuracy;
+        } else tt = col * map->accuracy;
         if (skiplines <= 0) {
             a->pattern_times[i] = map->lines[mp].pattern_time;
             a->target_times[i] = tt;
-            a->quality[i] = map->lines[mp].values[maxpos];
+            a->quality[i] = map->lines[mp].values[col -
+                    map->lines[mp].first_column];
             skiplines = SKIP_LINES;
             --i;
         }
-        maxpos = lines[p + maxpos];
-        if (maxpos == -1) {
-            fputs("Warning in calculate_initial_alignment: unexpected end of alignment line\n", stderr);
-            break;
-        } else if (maxpos < -1) maxpos = -2 - maxpos;
         --skiplines;
     }
-    free(lines);
+    free(path);
+}
+
+
+/**
+ * Calculates the corridor of a finer level of a multi-resolution alignment
+ * map. The best path through a normalized copy of the coarser map is
+ * calculated and each line of the finer map gets a band of columns around
+ * it. The coarser map itself is not modified.
+ *
+ * @param parameters alignment parameters of the coarser map
+ * @param coarse the coarser alignment map
+ * @param scale resolution ratio of the maps
+ * @param width width of the finer map
+ * @param height height of the finer map
+ * @param first first column of the band on each line of the finer map
+ * @param end end of the band on each line of the finer map
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int calculate_alignment_corridor(const alignparameters *parameters,
+        const alignmentmap *coarse, int scale, int width, int height,
+        int *first, int *end) {
+    alignmentmap copy;
+    int *cpath;
+    size_t size = 0;
+    int i, ret = 0;
+
+    if ((coarse->width <= 0) || (coarse->height <= 0)) return 0;
+    for (i=0; i<coarse->height; ++i) {
+        size += coarse->lines[i].end_column - coarse->lines[i].first_column;
+    }
+    copy = *coarse;
+    copy.lines = (alignmentline *) malloc(coarse->height *
+            sizeof(alignmentline));
+    copy.vbuffer = (unsigned char *) malloc(size * sizeof(unsigned char));
+    copy.tbuffer = (char *) malloc(size * sizeof(char));
+    cpath = (int *) malloc(coarse->height * sizeof(int));
+    if ((copy.lines == NULL) || (copy.vbuffer == NULL) ||
+            (copy.tbuffer == NULL) || (cpath == NULL)) {
+        fputs("Error in calculate_alignment_corridor: unable to allocate memory for buffers\n", stderr);
+        goto EXIT;
+    }
+    memcpy(copy.lines, coarse->lines, coarse->height * sizeof(alignmentline));
+    memcpy(copy.vbuffer, coarse->vbuffer, size * sizeof(unsigned char));
+    memcpy(copy.tbuffer, coarse->tbuffer, size * sizeof(char));
+    for (i=0; i<coarse->height; ++i) {
+        copy.lines[i].values = copy.vbuffer +
+                (coarse->lines[i].values - coarse->vbuffer);
+        copy.lines[i].transpositions = copy.tbuffer +
+                (coarse->lines[i].transpositions - coarse->tbuffer);
+    }
+
+    normalize_alignmentmap(&copy, 0);
+    if (!calculate_multiscale_alignment_path(parameters, &copy, cpath))
+        goto EXIT;
+    alignment_path_band(cpath, coarse->height, scale, width, height,
+            first, end);
+    ret = 1;
+
+EXIT:
+    free(copy.lines);
+    free(copy.vbuffer);
+    free(copy.tbuffer);
+    free(cpath);
+    return ret;
+}
+
+
+/**
+ * Calculates the mean, minimum and maximum of each column of an alignment
+ * map. The values outside the corridor of a multi-resolution map are
+ * estimated from the corresponding column of the coarser level, so the
+ * statistics describe the full column at every level.
+ *
+ * @param map the alignment map
+ * @param colmean the mean of each column will be stored here
+ * @param colmin the minimum of each column will be stored here
+ * @param colmax the maximum of each column will be stored here
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int alignmentmap_column_statistics(const alignmentmap *map,
+        int *colmean, unsigned char *colmin, unsigned char *colmax) {
+    const alignmentmap *coarse = map->coarser;
+    int i, j;
+    int width = map->width;
+    int height = map->height;
+    int *cmean = NULL, *colcount;
+    unsigned char *cmin = NULL, *cmax;
+    long long *colsum;
+
+    colsum = (long long *) calloc(width, sizeof(long long));
+    colcount = (int *) calloc(width, sizeof(int));
+    if ((colsum == NULL) || (colcount == NULL)) goto NO_MEMORY;
+    if ((coarse != NULL) && (coarse->width > 0)) {
+        cmean = (int *) malloc(coarse->width * sizeof(int));
+        cmin = (unsigned char *) malloc(2 * coarse->width *
+                sizeof(unsigned char));
+        if ((cmean == NULL) || (cmin == NULL)) goto NO_MEMORY;
+        cmax = &cmin[coarse->width];
+        if (!alignmentmap_column_statistics(coarse, cmean, cmin, cmax)) {
+            free(cmean);
+            free(cmin);
+            cmean = NULL;
+            cmin = NULL;
+        }
+    }
+    memset(colmin, 255, width * sizeof(unsigned char));
+    memset(colmax, 0, width * sizeof(unsigned char));
+
+    for (i=0; i<height; ++i) {
+        const alignmentline *line = &map->lines[i];
+        const unsigned char *values = line->values;
+        int f = line->first_column;
+        for (j=f; j<line->end_column; ++j) {
+            colsum[j] += values[j-f];
+            ++colcount[j];
+            colmin[j] = MIN2(values[j-f], colmin[j]);
+            colmax[j] = MAX2(values[j-f], colmax[j]);
+        }
+    }
+    for (j=0; j<width; ++j) {
+        int missing = height - colcount[j];
+        if ((missing > 0) && (cmean != NULL)) {
+            int c = MIN2((int) ((long long) j * map->accuracy /
+                    coarse->accuracy), coarse->width - 1);
+            colsum[j] += (long long) missing * cmean[c];
+            colcount[j] = height;
+            colmin[j] = MIN2(cmin[c], colmin[j]);
+            colmax[j] = MAX2(cmax[c], colmax[j]);
+        }
+        colmean[j] = (colcount[j] > 0) ? (int) (colsum[j] / colcount[j]) :
+                128;
+    }
+    free(colsum);
+    free(colcount);
+    free(cmean);
+    free(cmin);
+    return 1;
+
+NO_MEMORY:
+    fputs("Error in alignmentmap_column_statistics: unable to allocate memory for buffers\n", stderr);
+    free(colsum);
+    free(colcount);
+    free(cmean);
+    free(cmin);
+    return 0;
 }
 
 
 /**
  * Normalizes first each column and then each row of an alignment map to have
  * a mean value of 128 (there will be variation if values are clipped).
+ * The columns of a multi-resolution map are normalized with the statistics
+ * of the full column, which are estimated from the coarser levels outside
+ * the corridor (see alignmentmap_column_statistics()), so that the values
+ * are close to those of a single-level map. The rows are normalized within
+ * the corridor.
  *
  * @param map the alignment map to normalize
  * @param avoid_clipping set to 1 to avoid clipping the highest and lowest
  *        values
  */
 void normalize_alignmentmap(alignmentmap *map, int avoid_clipping) {
-    int i;
+    int i, j;
     int width = map->width;
     int height = map->height;
-    int mapsize = width * height;
-    unsigned char *buffer = map->vbuffer;
+    int *colmean;
+    unsigned char *colmin, *colmax;
+
+    colmean = (int *) malloc(width * sizeof(int));
+    colmin = (unsigned char *) malloc(2 * width * sizeof(unsigned char));
+    if ((colmean == NULL) || (colmin == NULL)) {
+        fputs("Error in normalize_alignmentmap: unable to allocate memory for buffers\n", stderr);
+        free(colmean);
+        free(colmin);
+        return;
+    }
+    colmax = &colmin[width];
 
     /* Column-wise normalization: shift the values in each column so that
      * the mean is 128 */
-    for (i=0; i<width; ++i) {
-        int pos = i;
-        int min = 255;
-        int max = 0;
-        int adjust;
-        int colmean = 0;
-        while (pos < mapsize) {
-            colmean += buffer[pos];
-            min = MIN2(buffer[pos], min);
-            max = MAX2(buffer[pos], max);
-            pos += width;
-        }
-        colmean = colmean / height;
-        adjust = (int) (128 - colmean);
-
-        pos = i; 
-        if (avoid_clipping && ((min + adjust < 0) || (max + adjust > 255))) {
-            float scale = 127.0F / (127.0F + (float) ABS(adjust));
-            while (pos < mapsize) {
-                buffer[pos] = MIN2(255, MAX2(0, (int) (((float) buffer[pos] -
-                        (float) colmean) * scale + 127.0F)));
-                pos += width;
-            }
-        } else {
-            while (pos < mapsize) {
-                buffer[pos] = MIN2(255, MAX2(0, ((int) buffer[pos]) + adjust));
-                pos += width;
+    if (!alignmentmap_column_statistics(map, colmean, colmin, colmax)) {
+        free(colmean);
+        free(colmin);
+        return;
+    }
+    for (i=0; i<height; ++i) {
+        alignmentline *line = &map->lines[i];
+        unsigned char *values = line->values;
+        int f = line->first_column;
+        for (j=f; j<line->end_column; ++j) {
+            int adjust = 128 - colmean[j];
+            if (avoid_clipping && ((colmin[j] + adjust < 0) ||
+                    (colmax[j] + adjust > 255))) {
+                float scale = 127.0F / (127.0F + (float) ABS(adjust));
+                values[j-f] = MIN2(255, MAX2(0, (int) (((float) values[j-f] -
+                        (float) colmean[j]) * scale + 127.0F)));
+            } else {
+                values[j-f] = MIN2(255, MAX2(0, ((int) values[j-f]) +
+                        adjust));
             }
         }
     }
+    free(colmean);
+    free(colmin);
 
     /* Row-wise normalization: shift the values in each row so that
      * the mean is 128 */
-    i = 0;
-    while (i < mapsize) {
-        int lastpos = i + width;
+    for (i=0; i<height; ++i) {
+        alignmentline *line = &map->lines[i];
+        unsigned char *values = line->values;
+        int size = line->end_column - line->first_column;
         int min = 255;
         int max = 0;
         int adjust;
         int rowmean = 0;
-        while (i < lastpos) {
-            rowmean += buffer[i];
-            min = MIN2(buffer[i], min);
-            max = MAX2(buffer[i], max);
-            ++i;
+        if (size <= 0) continue;
+        for (j=0; j<size; ++j) {
+            rowmean += values[j];
+            min = MIN2(values[j], min);
+            max = MAX2(values[j], max);
         }
-        rowmean = rowmean / width;
+        rowmean = rowmean / size;
         adjust = (int) (128 - rowmean);
 
-        i -= width;
         if (avoid_clipping && ((min + adjust < 0) || (max + adjust > 255))) {
             float scale = 127.0F / (127.0F + (float) ABS(adjust));
-            while (i < lastpos) {
-                buffer[i] = MIN2(255, MAX2(0, (int) (((float) buffer[i] -
+            for (j=0; j<size; ++j) {
+                values[j] = MIN2(255, MAX2(0, (int) (((float) values[j] -
                         (float) rowmean) * scale + 127.0F)));
-                ++i;
             }
         } else {
-            while (i < lastpos) {
-                buffer[i] = MIN2(255, MAX2(0, ((int) buffer[i]) + adjust));
-                ++i;
+            for (j=0; j<size; ++j) {
+                values[j] = MIN2(255, MAX2(0, ((int) values[j]) + adjust));
             }
         }
     }
@@ -1125,6 +1515,9 @@ int main(int argc, char **argv) {
     data_parameters.c_window = 30;
     data_parameters.avindex_vector_max_width = 10000;
     data_parameters.avindex_vector_max_height = 128;
+    data_parameters.vindex_file = NULL;
+    data_parameters.compress_vindex = 0;
+    data_parameters.num_threads = 0;
 
     init_song_collection(&sc, 0);
     init_song_collection(&pc, 0);
@@ -1174,12 +1567,6 @@ int main(int argc, char **argv) {
     if (p.verbose >= LOG_IMPORTANT)
         fprintf(stderr,"Time: %f\n", timediff(&end, &start));
 
-    srand(1234);
-    for (i=0; i<sc.size; ++i) {
-        test_song_window(&sc.songs[i], 30, 30, 1, 30000);
-    }
-
-#if 0
     for (i=0; i<pc.size; ++i) {
         song *pattern = &pc.songs[i];
         song *target = &sc.songs[0];
@@ -1225,7 +1612,6 @@ int main(int argc, char **argv) {
         free_alignmentmap(map);
         free_alignment(a);
     }
-#endif
 EXIT:
     align_free_parameters(&p);
     free_song_collection(&sc);
@@ -66,11 +66,19 @@ typedef struct {
 
     float song_tempo;
     int delay;
+    int num_threads;
+
+    /* Number of alignment map resolution levels. Each level is
+     * ALIGN_MAP_SCALE times coarser than the previous one, and the finer
+     * levels are only calculated near the alignment of the coarser level. */
+    int map_levels;
 } alignparameters;
 
 
 /**
- * Alignment line within an alignment map.
+ * Alignment line within an alignment map. Only the columns from
+ * first_column to end_column - 1 are stored: values[j - first_column] is
+ * the value of column j.
  */
 typedef struct {
     int pattern_position;
@@ -79,14 +87,18 @@ typedef struct {
     float initial_slope;
     unsigned char *values;
     char *transpositions;
+    int first_column;
+    int end_column;
 } alignmentline;
 
 
 /**
  * Alignment map: a similarity matrix for all possible unscaled
- * alignments of small song segments.
+ * alignments of small song segments. A map that is calculated in levels
+ * points to the next coarser level, and its lines only cover a corridor
+ * around the alignment of that level.
  */
-typedef struct {
+typedef struct alignmentmap {
     int width;
     int height;
     int accuracy;
@@ -97,6 +109,7 @@ typedef struct {
     int pattern_duration;
     const song *target;
     const song *pattern;
+    struct alignmentmap *coarser;
 } alignmentmap;
 
 
@@ -127,6 +140,10 @@ void write_alignmentmap_pgm(const char *filename, const alignmentmap *map,
 void calculate_initial_alignment(const alignparameters *parameters,
         const alignmentmap *map, alignment *a);
 
+int calculate_alignment_corridor(const alignparameters *parameters,
+        const alignmentmap *coarse, int scale, int width, int height,
+        int *first, int *end);
+
 void normalize_alignmentmap(alignmentmap *map, int avoid_clipping);
 
 void align_midi_song(midisong *midi_s, alignment *a);
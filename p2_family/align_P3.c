@@ -32,515 +32,507 @@
  */
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "search.h"
 #include "song.h"
 #include "geometric_P3.h"
-#include "priority_queue.h"
 #include "util.h"
 #include "align.h"
 #include "align_P3.h"
-#include "song_window.h"
 #include "song_window_P3.h"
 
 
-/*#define MAP_VALUE_AVERAGE 1*/
+/**
+ * A part of an alignment map that is calculated by one thread.
+ */
+typedef struct {
+    const p3song *target;
+    const p3song *pattern;
+    const alignparameters *parameters;
+    alignmentmap *map;
+    int target_max_duration;
+    int first_line;
+    int end_line;
+} ap3part;
+
+
+/* A pattern window is scanned in two parts, each with its own incremental
+ * scan: turning points at pattern times, and turning points at the window
+ * edges. Notes that overlap a window edge are cut there, and the cut points
+ * are relative to the window start so that they stay the same while the
+ * window slides. */
+#define AP3_NUM_FRAMES 2
+#define AP3_FRAME_PATTERN 0
+#define AP3_FRAME_WINDOW 1
 
 
 /** 
  * A modified version of the geometric P3 symbolic music retrieval algorithm
- * for score alignment.
+ * for score alignment. The translation events of a pattern window against
+ * the target song are kept sorted by incremental scans as the window
+ * slides (see update_p3s_scan()), so this function only merges the events
+ * of the two window parts and updates the vertical translation table with
+ * them in the same order as scan_p3(). Translation x places the window
+ * start at time x in the target song, and the best overlap of each
+ * translation is written to the map column that contains x. Events before
+ * the first stored column only set the initial values and slopes of the
+ * table.
  *
- * @param p3s song to scan
- * @param pattern pattern song
- * @param aline_size length of the alignment score array
- * @param aline_shift accuracy of the score array is calculated as
- *        1 << aline_shift. For example, aline_shift=8 results in each
- *        array slot representing 256 milliseconds of time.
- * @param aline the resulting alignment score for each position of the
- *        pattern within the target song will be written to this array.
- *        The array should contain negative values by default so that
- *        gaps can be filled afterwards.
- * @param transpositions pattern transposition for each aline value.
+ * @param pattern_scan incremental scan of the turning points at pattern
+ *        times
+ * @param pattern_offset translation of the window start for the events of
+ *        pattern_scan
+ * @param window_scan incremental scan of the turning points at the window
+ *        edges
+ * @param valuemul multiplier that converts overlap durations to map values
+ * @param accuracy time span of a map column
+ * @param values map line values
+ * @param transpositions map line transpositions
+ * @param first_column first stored column of the map line
+ * @param end_column end of the stored columns of the map line
+ * @param verticaltranslationtable work space for 2 * NOTE_PITCHES items
  */
-static void align_turningpoints_p3(const p3song *p3s, const song *pattern,
-        int aline_size, int aline_shift, int *aline, char *transpositions) {
+static void align_turningpoints_p3(const p3s_scan *pattern_scan,
+        int pattern_offset, const p3s_scan *window_scan, float valuemul,
+        int accuracy, unsigned char *values, char *transpositions,
+        int first_column, int end_column,
+        VerticalTranslationTableItem *verticaltranslationtable) {
+
+    static const unsigned long long no_events = P3S_SCAN_END;
+    const unsigned long long *e1 = (pattern_scan->size > 0) ?
+            pattern_scan->events : &no_events;
+    const unsigned long long *e2 = (window_scan->size > 0) ?
+            window_scan->events : &no_events;
+    unsigned long long end = P3S_SCAN_EVENT(end_column * accuracy,
+            -NOTE_PITCHES, 0, 0);
+    /* Adding the offset to the x bits keeps the event order */
+    unsigned long long adjust = ((unsigned long long) (unsigned int)
+            pattern_offset) << 32;
+    int start = first_column * accuracy;
+    int column = 0, column_end = start + accuracy;
+
+    memset(verticaltranslationtable, 0, NOTE_PITCHES * 2 *
+            sizeof(VerticalTranslationTableItem));
+
+    while (1) {
+        unsigned long long k1 = *e1 + adjust;
+        unsigned long long k2 = *e2;
+        unsigned long long event;
+        int second, x, y;
+        VerticalTranslationTableItem *item;
+
+        /* Branchless merge; the end markers stop it */
+        second = (k2 < k1);
+        event = second ? k2 : k1;
+        if (event >= end) break;
+        e1 += 1 - second;
+        e2 += second;
+
+        x = P3S_SCAN_EVENT_X(event);
+        y = P3S_SCAN_EVENT_Y(event);
+        item = &verticaltranslationtable[NOTE_PITCHES + y];
 
-    int i, j, num_loops;
-    int best = 0;
-    float pattern_duration = 0.0;
-    VerticalTranslationTableItem *verticaltranslationtable;
-    VerticalTranslationTableItem *item = NULL;
-    TurningPoint *startpoints = p3s->startpoints;
-    TurningPoint *endpoints = p3s->endpoints;
-    int num_tpoints = p3s->size;
-    int pattern_size = pattern->size;
-    vector *pnotes = pattern->notes;
-
-    /* Create a priority queue */
-    pqroot *pq;
-    pqnode *min;
-    TranslationVector *translation_vectors;
-    
-    if ((pattern_size <= 0) || (num_tpoints <= 0)) return;
-
-    pq = pq_create(pattern_size * 4);
-    translation_vectors = (TranslationVector *)
-            malloc(pattern_size * 4 * sizeof(TranslationVector));
-
-    /* Initialize a vertical translation array */
-    verticaltranslationtable = (VerticalTranslationTableItem *) malloc(
-            NOTE_PITCHES * 2 * sizeof(VerticalTranslationTableItem));
-    for (i = 0; i < (NOTE_PITCHES * 2); i++) {
-        verticaltranslationtable[i].value = 0;
-        verticaltranslationtable[i].slope = 0;
-        verticaltranslationtable[i].prev_x = 0;
+        /* Update value */
+        item->value += item->slope * (x - item->prev_x);
+        item->prev_x = x;
+
+        /* Adjust slope */
+        item->slope += 2 * P3S_SCAN_EVENT_UP(event) - 1;
+
+        /* Check for a match. Translations only grow, so the column is
+         * advanced instead of dividing x. */
+        if ((x >= start) && (item->value > 0)) {
+            int value;
+            while (x >= column_end) {
+                ++column;
+                column_end += accuracy;
+            }
+            value = MIN2(255, (int) (valuemul * (float) item->value));
+            if (values[column] < value) {
+                values[column] = (unsigned char) value;
+                transpositions[column] = (char) y;
+            }
+        }
     }
+}
 
-    /*printf("P3 Notes: %d\n", p3s->size);*/
-
-    /* Create an array whose items have two pointers each: one for startpoints
-     * and one for endpoints. Each item points to turning point array item Also
-     * populate the priority queue with initial items. */
-    for (i = 0, j = 0; i < pattern_size; i++) {
-        TranslationVector *v;
-        pattern_duration += (float) pnotes[i].dur;
-
-
-        /* Add translation vectors calculated from the note start points */
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) startpoints[0].y - (int) pnotes[i].ptch;
-        v->x = (int) startpoints[0].x -
-                (int) (pnotes[i].strt + pnotes[i].dur);
-        v->pattern_is_start = 0;
-        v->text_is_start = 1;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) startpoints[0].y - (int) pnotes[i].ptch;
-        v->x = (int) startpoints[0].x - (int) pnotes[i].strt;
-        v->pattern_is_start = 1;
-        v->text_is_start = 1;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
-
-
-        /* Add translation vectors calculated from the note end points */
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) endpoints[0].y - (int) pnotes[i].ptch;
-        v->x = (int) endpoints[0].x - (int) (pnotes[i].strt +
-                pnotes[i].dur);
-        v->pattern_is_start = 0;
-        v->text_is_start = 0;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) endpoints[0].y - (int) pnotes[i].ptch;
-        v->x = (int) endpoints[0].x - (int) pnotes[i].strt;
-        v->pattern_is_start = 1;
-        v->text_is_start = 0;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
+
+/**
+ * Collects the target notes that can overlap a pattern window placed within
+ * a range of translations. Notes outside the range do not change the map
+ * values of the range, so a map line that only covers a corridor can be
+ * scanned against this subset. The turning points are stored in the same
+ * order as in song_to_p3().
+ *
+ * @param target the target song
+ * @param max_duration longest note duration in the target song
+ * @param first first translation
+ * @param end end of the translations
+ * @param startpoints buffer for target->size start points
+ * @param endpoints buffer for target->size end points
+ *
+ * @return number of notes in the subset
+ */
+static int select_target_notes_p3(const p3song *target, int max_duration,
+        int first, int end, TurningPoint *startpoints,
+        TurningPoint *endpoints) {
+    const vector *notes = target->song->notes;
+    int lo = 0, hi = target->size;
+    int i, size = 0;
+
+    /* Notes that start before first - max_duration end before first */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (notes[mid].strt + max_duration <= first) lo = mid + 1;
+        else hi = mid;
+    }
+    for (i=lo; (i<target->size) && (notes[i].strt < end); ++i) {
+        const vector *n = &notes[i];
+        int e = MIN2(n->strt + n->dur, P3_TIME_LIMIT - 1);
+        if (e <= first) continue;
+        startpoints[size].x = n->strt;
+        startpoints[size].y = n->ptch;
+        endpoints[size].x = e;
+        endpoints[size].y = n->ptch;
+        ++size;
     }
+    sort_turningpoints(endpoints, size);
+    return size;
+}
 
-    best = 0;
-    num_loops = (pattern_size * num_tpoints) << 2;
 
-    for (i = 0; i < num_loops; i++) {
-        int x, y;
-        int start;
-        /* Get the minimum element */
-        TranslationVector *v;
-        min = pq_getmin(pq);
-        v = (TranslationVector *) min->pointer;
-        x = v->x;
-        y = v->y;
+/**
+ * Calculates a range of alignment map lines. The pattern window slides
+ * over the pattern with move_p3s_window(), and each time scale has its own
+ * incremental scans that follow the window. The lines are written to the
+ * map in place. Lines that only cover a corridor of the map are scanned
+ * against the target notes near the corridor; the scans are restarted
+ * whenever the corridor changes.
+ *
+ * @param arg an ap3part struct
+ *
+ * @return NULL
+ */
+static void *map_alignment_lines_p3(void *arg) {
+    const ap3part *part = (const ap3part *) arg;
+    const alignparameters *parameters = part->parameters;
+    const p3song *target = part->target;
+    const p3song *pattern = part->pattern;
+    alignmentmap *map = part->map;
+    int accuracy = map->accuracy;
+    int w_size = parameters->p3_pattern_window_size;
+    int num_scans = AP3_NUM_FRAMES * parameters->p3_num_scales;
+    int i, extent = 0;
+    p3s_window w;
+    p3s_scan *scans;
+    TurningPoint *startpoints[AP3_NUM_FRAMES], *endpoints[AP3_NUM_FRAMES];
+    TurningPoint *tstartpoints, *tendpoints;
+    int tsize = 0, tfirst = -1, tend = -1;
+    VerticalTranslationTableItem *verticaltranslationtable;
+    int ok = 1;
 
-        /* Update value */
-        item = &verticaltranslationtable[NOTE_PITCHES + y];
-        item->value += item->slope * (x - item->prev_x);
-        item->prev_x = x;
+    if ((part->first_line >= part->end_line) || (num_scans <= 0))
+        return NULL;
 
-        /* Adjust slope */
-        if (v->text_is_start != v->pattern_is_start)
-            item->slope++;
-        else
-            item->slope--;
-
-        /* Check for a match */
-        start = x + pnotes[0].strt;
-        if (start >= 0) {
-            start >>= aline_shift;
-            if ((start < aline_size) && (aline[start] < item->value)) {
-                aline[start] = item->value;
-                transpositions[start] = y;
+    init_p3s_window(&w, pattern);
+    scans = (p3s_scan *) malloc(num_scans * sizeof(p3s_scan));
+    verticaltranslationtable = (VerticalTranslationTableItem *) malloc(
+            NOTE_PITCHES * 2 * sizeof(VerticalTranslationTableItem));
+    for (i=0; i<AP3_NUM_FRAMES; ++i) {
+        startpoints[i] = (TurningPoint *) malloc(pattern->size *
+                sizeof(TurningPoint));
+        endpoints[i] = (TurningPoint *) malloc(pattern->size *
+                sizeof(TurningPoint));
+        if ((startpoints[i] == NULL) || (endpoints[i] == NULL)) ok = 0;
+    }
+    tstartpoints = (TurningPoint *) malloc(target->size *
+            sizeof(TurningPoint));
+    tendpoints = (TurningPoint *) malloc(target->size * sizeof(TurningPoint));
+    if ((w.startpoints == NULL) || (w.endpoints == NULL) || (scans == NULL) ||
+            (verticaltranslationtable == NULL) || (tstartpoints == NULL) ||
+            (tendpoints == NULL) || !ok) {
+        fputs("Error in align_p3(): failed to allocate memory\n", stderr);
+        free(scans);
+        scans = NULL;
+        num_scans = 0;
+        goto EXIT;
+    }
+    for (i=0; i<num_scans; ++i) init_p3s_scan(&scans[i]);
+
+    /* Longest scaled window in the target song */
+    for (i=0; i<parameters->p3_num_scales; ++i) {
+        extent = MAX2(extent, (int) ((float) w_size /
+                parameters->p3_scales[i]) + 1);
+    }
+
+    for (i=part->first_line; i<part->end_line; ++i) {
+        alignmentline *mapline = &map->lines[i];
+        const p3song *window = &w.window;
+        const TurningPoint *tsp = target->startpoints;
+        const TurningPoint *tep = target->endpoints;
+        int tnum = target->size;
+        int w_start = mapline->pattern_time;
+        int w_end = w_start + w_size;
+        int ns;
+
+        if ((mapline->first_column > 0) ||
+                (mapline->end_column < map->width)) {
+            if ((mapline->first_column != tfirst) ||
+                    (mapline->end_column != tend)) {
+                tfirst = mapline->first_column;
+                tend = mapline->end_column;
+                tsize = select_target_notes_p3(target,
+                        part->target_max_duration, (tfirst - 1) * accuracy,
+                        (tend + 1) * accuracy + extent, tstartpoints,
+                        tendpoints);
+                for (ns=0; ns<num_scans; ++ns) clear_p3s_scan(&scans[ns]);
             }
+            tsp = tstartpoints;
+            tep = tendpoints;
+            tnum = tsize;
+        } else if (tfirst >= 0) {
+            tfirst = -1;
+            tend = -1;
+            for (ns=0; ns<num_scans; ++ns) clear_p3s_scan(&scans[ns]);
         }
 
-        /* Move the pointer and insert a new translation vector according to
-         * the turning point type. */
-        if (v->tpindex < num_tpoints - 1) {
-            const vector *patp = &pnotes[v->patternindex];
-            v->tpindex++;
- 
-            if (v->text_is_start) {
-                const TurningPoint *startp = &startpoints[v->tpindex];
-                v->x = (int) startp->x - (int) patp->strt;
-                v->y = (int) startp->y - (int) patp->ptch;
-            } else {
-                const TurningPoint *endp = &endpoints[v->tpindex];
-                v->x = (int) endp->x - (int) patp->strt;
-                v->y = (int) endp->y - (int) patp->ptch;
+        move_p3s_window(&w, w_start, w_end);
+
+        for (ns=0; ns<parameters->p3_num_scales; ++ns) {
+            p3s_scan *s = &scans[AP3_NUM_FRAMES * ns];
+            float rscale = 1.0F / parameters->p3_scales[ns];
+            int offsets[AP3_NUM_FRAMES];
+            int num_start[AP3_NUM_FRAMES], num_end[AP3_NUM_FRAMES];
+            int duration = 0;
+            int j, f;
+
+            /* Window parts scaled to the target tempo */
+            memset(num_start, 0, sizeof(num_start));
+            memset(num_end, 0, sizeof(num_end));
+            offsets[AP3_FRAME_PATTERN] = (int) (rscale * (float) w_start);
+            offsets[AP3_FRAME_WINDOW] = 0;
+            for (j=0; j<window->size; ++j) {
+                const TurningPoint *tp = &window->startpoints[j];
+                TurningPoint *p;
+                if (tp->x == w_start) {
+                    f = AP3_FRAME_WINDOW;
+                    p = &startpoints[f][num_start[f]++];
+                    p->x = 0;
+                } else {
+                    f = AP3_FRAME_PATTERN;
+                    p = &startpoints[f][num_start[f]++];
+                    p->x = (int) (rscale * (float) tp->x);
+                }
+                p->y = tp->y;
+                duration -= p->x - offsets[f];
+
+                tp = &window->endpoints[j];
+                if (tp->x == w_end) {
+                    f = AP3_FRAME_WINDOW;
+                    p = &endpoints[f][num_end[f]++];
+                    p->x = (int) (rscale * (float) w_size);
+                } else {
+                    f = AP3_FRAME_PATTERN;
+                    p = &endpoints[f][num_end[f]++];
+                    p->x = (int) (rscale * (float) tp->x);
+                }
+                p->y = tp->y;
+                duration += p->x - offsets[f];
             }
-            if (!v->pattern_is_start) {
-                v->x -= (int) patp->dur;
+            for (f=0; f<AP3_NUM_FRAMES; ++f) {
+                if (!update_p3s_scan(&s[f], tsp, tep, tnum, startpoints[f],
+                        num_start[f], endpoints[f], num_end[f])) goto EXIT;
             }
-            min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-            pq_update_key1_p3(pq, min);
-        } else {
-            /* 'Remove' a translation vector by making it very large.
-             * It won't be extracted since there will be only as many loops as 
-             * there are real vectors. */
-            min->key1 = INT_MAX;
-            pq_update_key1_p3(pq, min);
+            if (duration <= 0) continue;
+
+            align_turningpoints_p3(&s[AP3_FRAME_PATTERN],
+                    offsets[AP3_FRAME_PATTERN], &s[AP3_FRAME_WINDOW],
+                    255.0F / (float) duration, accuracy, mapline->values,
+                    mapline->transpositions, mapline->first_column,
+                    mapline->end_column, verticaltranslationtable);
         }
     }
 
-    /* Free the reserved memory. */
-    pq_free(pq);
-    free(translation_vectors);
+EXIT:
+    for (i=0; i<num_scans; ++i) free_p3s_scan(&scans[i]);
+    free(scans);
+    free_p3s_window(&w);
     free(verticaltranslationtable);
+    free(tstartpoints);
+    free(tendpoints);
+    for (i=0; i<AP3_NUM_FRAMES; ++i) {
+        free(startpoints[i]);
+        free(endpoints[i]);
+    }
+    return NULL;
 }
 
 
 /**
- * Aligns a pattern with a song with the geometric P3 algorithm, by using
- * an initial alignment as a bootstrap. Alignment scores will be calculated
- * for each position and returned as a list of start times for each pattern
- * note.
+ * Maps local alignments of two songs with the geometric P3 algorithm. Each
+ * map line compares a window of p3_pattern_window_size milliseconds of the
+ * pattern, starting at the line's pattern time, to every position of the
+ * target song with each of the p3_num_scales time scales. Map values are
+ * the longest common durations relative to the scaled window duration,
+ * from 0 to 255. The lines are divided between threads.
  *
- * @param sc song collection that possibly contains the song in the p3song
- *        format that this function uses. If sc is NULL, necessary conversions
- *        will be made before further processing.
- * @param s song to align with the pattern
- * @param p pattern
- * @param parameters alignment parameters
- * @param initial_align initial alignment
- * @param result_align resulting refined alignment
- */
-/*void align_p3(const songcollection *sc, const song *s, const song *p, int alg,
-        const alignparameters *parameters, const alignment *initial_align,
-        alignment *result_align) {
-
-}*/
-
-/**
- * Maps local alignments of two songs with the geometric P3 algorithm.
+ * With more than one map level, a map that is ALIGN_MAP_SCALE times coarser
+ * is calculated first and stored in map->coarser. The lines of this map
+ * then only cover a corridor around the best alignment path of the coarser
+ * map (see calculate_alignment_corridor()).
  *
- * @param sc song collection that possibly contains the song in the p3song
- *        format that this function uses. If sc is NULL, necessary conversions
- *        will be made before further processing.
+ * @param sc song collection of the song. The songs are taken from the
+ *        shared P3 song cache (see acquire_p3_song()), so the P3 data of sc
+ *        is reused when it exists. May be NULL.
  * @param s song to align the pattern with. If either of the aligned songs
  *        is the "correct" score, it should be given here to improve alignment
  *        results of the P3 algorithm
  * @param p a pattern song that is aligned with the other song. This should
  *        be the piece that may contain more errors.
+ * @param alg the algorithm ID as defined in algorithms.h
  * @param parameters alignment parameters
  * @param map the resulting alignment map will be written to this structure 
  */
 void align_p3(const songcollection *sc, const song *s, const song *p,
         int alg, const alignparameters *parameters, alignmentmap *map) {
-
-
-    
-}
-
-#if 0
-    p3songcollection *p3sc = sc->data[DATA_P3];
-    p3song *p3s;
-    p3song *scaled_p3s;
-    int *aline;
-    char *transpositions;
-    int map_height, map_width;
+    const p3song *p3s, *pattern;
+    ap3part parts[ALIGN_MAX_THREADS];
+    pthread_t threads[ALIGN_MAX_THREADS];
+    int started[ALIGN_MAX_THREADS];
     int accuracy = parameters->map_accuracy;
+    int num_threads = parameters->num_threads;
+    int pduration = 0, tmaxduration = 0;
+    int *first = NULL, *end = NULL;
+    size_t size = 0;
     int i;
-    int w_start, w_end;
-    int w_size = parameters->p3_pattern_window_size;
-    int buffer_pos = 0;
-    int pduration = 0, sduration = 0;
-    int num_scales = parameters->p3_num_scales;
-    float max_scale = 1.0F;
-    TurningPoint *orig_sp, *orig_ep;
-
-    /* Buffer that is used when calculating map lines */
-    unsigned char **tmplines;
-    unsigned int **curline;
-    int tmplines_num = MIN2(4095, (1 + w_size / accuracy));
-    int tmplines_pos, tmplines_patternpos;
-    int tmplines_used = 0;
-    float *tmpmultipliers;
-
-    /* Pattern window */
-    song pw;
-    vector *pw_notes = (vector *) malloc(p->size * sizeof(vector));
-    pw.notes = pw_notes;
-
-    if ((p3sc == NULL) || (s->id >= p3sc->size)) {
-        fputs("Error in map_alignments_p3: song collection does not contain P3 data.\nUse update_song_collection_data() to generate it.\n", stderr);
-        return;
+
+    p3s = acquire_p3_song(s);
+    pattern = acquire_p3_song(p);
+    if ((p3s == NULL) || (pattern == NULL)) goto EXIT;
+    if ((p3s->size <= 0) || (pattern->size <= 0)) {
+        fputs("Error in align_p3(): empty song\n", stderr);
+        goto EXIT;
     }
-    p3s = &p3sc->p3_songs[s->id];
-    if (p3s == NULL) {
-        fputs("Error in map_alignments_p3: empty P3 song data", stderr);
-        return;
+
+    for (i=0; i<pattern->size; ++i) {
+        pduration = MAX2(pduration, pattern->endpoints[i].x);
     }
 
-    tmplines = (unsigned char **) malloc(num_scales * sizeof(unsigned char *));
-    curline = (unsigned int **) malloc(num_scales * sizeof(unsigned int *));
-    tmpmultipliers = (float *) malloc((tmplines_num+2) * sizeof(float *));
-    tmplines_pos = 0;
-    tmplines_patternpos = 0;
-    tmpmultipliers[0] = 0.0F;
-    for (i=1; i<tmplines_num+2; ++i) {
-        tmpmultipliers[i] = 1.0F / ((float) i);
+    map->width = 1 + p3s->endpoints[p3s->size-1].x / accuracy;
+    map->height = 1 + pduration / accuracy;
+    map->accuracy = accuracy;
+    first = (int *) malloc(map->height * sizeof(int));
+    end = (int *) malloc(map->height * sizeof(int));
+    if ((first == NULL) || (end == NULL)) {
+        fputs("Error in align_p3(): failed to allocate memory\n", stderr);
+        map->height = 0;
+        goto EXIT;
     }
 
-    /*strt = 0;
-    ppos = (int *) malloc(p->size * sizeof(int));*/
-    for (i=0; i<p->size; ++i) {
-        int e = p->notes[i].strt + p->notes[i].dur;
-        if (e > pduration) pduration = e;
-        /*if (p->notes[i].strt >= strt) {
-            strt += accuracy;
-            ppos[map_height] = i;
-            map_height++;
-        }*/
+    /* Corridor of the map lines */
+    map->coarser = NULL;
+    if (parameters->map_levels > 1) {
+        alignparameters cparameters = *parameters;
+        cparameters.map_accuracy = accuracy * ALIGN_MAP_SCALE;
+        cparameters.map_levels = parameters->map_levels - 1;
+        map->coarser = init_alignmentmap();
+        if (map->coarser != NULL) {
+            align_p3(sc, s, p, alg, &cparameters, map->coarser);
+            if (!calculate_alignment_corridor(&cparameters, map->coarser,
+                    ALIGN_MAP_SCALE, map->width, map->height, first, end)) {
+                free_alignmentmap(map->coarser);
+                map->coarser = NULL;
+            }
+        }
     }
-    map_height = 1 + pduration / accuracy;
-
-    sduration = p3s->endpoints[p3s->size-1].x;
-    map_width = 1 + sduration / accuracy;
-
-    /* Make scaled versions of the song */
-    scaled_p3s = (p3song *) malloc(num_scales * sizeof(p3song));
-    orig_sp = p3s->startpoints;
-    orig_ep = p3s->endpoints;
-    for (i=0; i<num_scales; ++i) {
-        int j;
-        float scale = parameters->p3_scales[i];
-        int scaled_sduration = (int) ((float) sduration * scale) + 1;
-        TurningPoint *sp, *ep;
-
-        if (scale > max_scale) max_scale = scale;
-        sp = (TurningPoint *) malloc(p3s->size *
-                sizeof(TurningPoint));
-        ep = (TurningPoint *) malloc(p3s->size *
-                sizeof(TurningPoint));
-        scaled_p3s[i].song = NULL;
-        scaled_p3s[i].size = p3s->size;
-        scaled_p3s[i].startpoints = sp;
-        scaled_p3s[i].endpoints = ep;
-        for (j=0; j<p3s->size; ++j) {
-            sp[j].x = (int) ((float) orig_sp[j].x * scale);
-            sp[j].y = orig_sp[j].y;
-            ep[j].x = (int) ((float) orig_ep[j].x * scale);
-            ep[j].y = orig_ep[j].y;
+    for (i=0; i<map->height; ++i) {
+        if (map->coarser == NULL) {
+            first[i] = 0;
+            end[i] = map->width;
         }
-        tmplines[i] = (unsigned char *) calloc(tmplines_num * scaled_sduration,
-                sizeof(unsigned char));
-        curline[i] = (unsigned int *) calloc(scaled_sduration,
-                sizeof(unsigned int));
+        size += end[i] - first[i];
     }
 
-    aline = (int *) calloc((int) (1.0F + max_scale *
-            (float) sduration), sizeof(int));
-    transpositions = (char *) malloc((int) (1.0F + max_scale *
-            (float) sduration) * sizeof(char));
-
-    map->width = map_width;
-    map->height = map_height;
-    map->accuracy = accuracy;
-    map->lines = malloc(map_height * sizeof(alignmentline));
-    map->vbuffer = (unsigned char *) calloc(map_height * map_width,
-            sizeof(unsigned char));
-    map->tbuffer = (char *) calloc(map_height * map_width, sizeof(char));
+    map->lines = (alignmentline *) malloc(map->height *
+            sizeof(alignmentline));
+    map->vbuffer = (unsigned char *) calloc(size, sizeof(unsigned char));
+    map->tbuffer = (char *) calloc(size, sizeof(char));
     map->target = s;
     map->pattern = p;
-    map->target_duration = sduration;
+    map->target_duration = p3s->endpoints[p3s->size-1].x;
     map->pattern_duration = pduration;
+    if ((map->lines == NULL) || (map->vbuffer == NULL) ||
+            (map->tbuffer == NULL)) {
+        fputs("Error in align_p3(): failed to allocate memory for the alignment map\n", stderr);
+        free(map->lines);
+        free(map->vbuffer);
+        free(map->tbuffer);
+        map->lines = NULL;
+        map->vbuffer = NULL;
+        map->tbuffer = NULL;
+        map->height = 0;
+        goto EXIT;
+    }
 
-    w_start = 0;
-    w_end = w_size;
-    for (i=0; i<map_height; ++i, w_start+=accuracy, w_end+=accuracy) {
-        int j, k, ns;
-        float durationmul;
+    size = 0;
+    for (i=0; i<map->height; ++i) {
         alignmentline *mapline = &map->lines[i];
-
-        if (parameters->verbose) {
-            fprintf(stderr, "  %d / %d\r", i, map_height);
-        }
-
-        mapline->pattern_position = 0;
-        mapline->pattern_time = w_start;
-        mapline->values = &map->vbuffer[buffer_pos];
-        mapline->transpositions = &map->tbuffer[buffer_pos];
-        buffer_pos += map_width;
-
-        /* Pick notes that fall within the window */
-        k = 0;
-        ns = 0;
-        pw.duration = 0;
-        for (j=0; j<p->size; ++j) {
-            vector *note = &p->notes[j];
-            if ((note->strt < w_end) &&
-                    ((note->strt + note->dur) > w_start)) {
-                vector *pwnote = &pw_notes[k];
-                pwnote->strt = MAX2(w_start, note->strt);
-                pwnote->dur = (MIN2(w_end, (note->strt + note->dur))) -
-                        pwnote->strt;
-                pwnote->ptch = note->ptch;
-                if (k == 0) {
-                    mapline->pattern_position = j;
-                    ns = pwnote->strt;
-                }
-                pwnote->strt -= ns;
-                pw.duration += pwnote->dur;
-                ++k;
-            } else if (note->strt > w_end) break;
-        }
-        if (k == 0) {
-            continue;
+        int ppos = (i > 0) ? map->lines[i-1].pattern_position : 0;
+        mapline->pattern_time = i * accuracy;
+        while ((ppos < p->size - 1) &&
+                (p->notes[ppos].strt < mapline->pattern_time)) ++ppos;
+        mapline->pattern_position = ppos;
+        mapline->target_time = 0;
+        mapline->initial_slope = 1.0F;
+        mapline->values = &map->vbuffer[size];
+        mapline->transpositions = &map->tbuffer[size];
+        mapline->first_column = first[i];
+        mapline->end_column = end[i];
+        size += end[i] - first[i];
+    }
+    if (map->coarser != NULL) {
+        const vector *notes = p3s->song->notes;
+        for (i=0; i<p3s->size; ++i) {
+            tmaxduration = MAX2(tmaxduration, notes[i].dur);
         }
-        pw.size = k;
-        lexicographic_sort(&pw);
-        durationmul = 255.0F / ((float) pw.duration);
-        
-        for (ns=0; ns<num_scales; ++ns) {
-            float scale = parameters->p3_scales[ns];
-            int scaled_sduration = (int) ((float) sduration * scale) + 1;
-            unsigned char *tmpline =
-                    &tmplines[ns][tmplines_pos*scaled_sduration];
-            unsigned int *cline = curline[ns];
-
-            memset(aline, 0, scaled_sduration * sizeof(int));
-            /*memset(transpositions, 0, scaled_sduration * sizeof(char));*/
-
-            align_turningpoints_p3(&scaled_p3s[ns], &pw, scaled_sduration,
-                    aline, transpositions);
-
-            for (j=0; j<scaled_sduration; ++j) {
-                aline[j] = (int) (durationmul * ((float) aline[j]));
-                cline[j] += (unsigned int) (1<<20) + ((unsigned int) aline[j]);
-            }
+    }
 
-            /* Read the current finished map line */
-            j = 0;
-            k = 0;
-            while ((j < scaled_sduration) && (k < map_width)) {
-                int end = MIN2(j + (int) (scale * (float) accuracy),
-                        scaled_sduration);
-                int val = 0;
-               /* char transp = 0;*/
-
-#ifdef MAP_VALUE_AVERAGE
-                int num = 0;
-                for (; j<end; ++j) {
-                    int cval = ((float) (cline[j] & 0xFFFFF)) *
-                            tmpmultipliers[cline[j] >> 20];
-                    if (cval > 0) {
-                        val += cval;
-                        ++num;
-                    }
-                }
-                val = ((float) val) / ((float) num);
-#else
-                for (; j<end; ++j) {
-                    unsigned char tmp;
-                    tmp = (unsigned char) (((float)
-                            (cline[j] & 0xFFFFF)) * tmpmultipliers[cline[j] >> 20]);
-                    val = MAX2(val, tmp);
-                }
-#endif
+    if (num_threads <= 0) num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = MIN2(MAX2(num_threads, 1), ALIGN_MAX_THREADS);
+    num_threads = MIN2(num_threads, map->height);
+
+    for (i=0; i<num_threads; ++i) {
+        parts[i].target = p3s;
+        parts[i].pattern = pattern;
+        parts[i].parameters = parameters;
+        parts[i].map = map;
+        parts[i].target_max_duration = tmaxduration;
+        parts[i].first_line = (int) ((long long) map->height * i /
+                num_threads);
+        parts[i].end_line = (int) ((long long) map->height * (i + 1) /
+                num_threads);
+    }
 
-                mapline->values[k] = (unsigned char) MAX2(mapline->values[k],
-                        val);
-                ++k;
-            }
-            if (tmplines_used >= tmplines_num) {
-                int l;
-                int start = accuracy * (tmplines_num + 1);
-                j = scaled_sduration - accuracy - 1;
-                k = scaled_sduration - 1;
-                l = scaled_sduration - start - 1;
-                for (; l >= 0; --j,--k,--l) {
-                    cline[k] = cline[j] - (unsigned int) (1<<20) -
-                            ((unsigned int) tmpline[l]);
-                }
-                for (; j >= 0; --j,--k) {
-                    cline[k] = cline[j];
-                }
-                for (; k >= 0; --k) {
-                    cline[k] = 0;
-                }
-            } else {
-                /* Shift the line */
-                j = scaled_sduration - accuracy - 1;
-                k = scaled_sduration - 1;
-                for(; j >= 0; --j,--k) {
-                    cline[k] = cline[j];
-                }
-                for(; k >= 0; --k) {
-                    cline[k] = 0;
-                }
-            }
-            for (j=0; j<scaled_sduration; ++j) {
-                tmpline[j] = (unsigned char) aline[j];
-            }
-        }
-        ++tmplines_used;
-        ++tmplines_pos;
-        if (tmplines_pos >= tmplines_num) tmplines_pos = 0;
+    /* The calling thread calculates the first part */
+    for (i=1; i<num_threads; ++i) {
+        started[i] = (pthread_create(&threads[i], NULL,
+                map_alignment_lines_p3, &parts[i]) == 0);
     }
-    for (i=0; i<num_scales; ++i) {
-        free(scaled_p3s[i].startpoints);
-        free(scaled_p3s[i].endpoints);
-        free(tmplines[i]);
-        free(curline[i]);
+    map_alignment_lines_p3(&parts[0]);
+    for (i=1; i<num_threads; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else map_alignment_lines_p3(&parts[i]);
     }
-    free(curline);
-    free(tmplines);
-    free(scaled_p3s);
-    free(pw_notes);
-    free(aline);
-    free(transpositions);
-    free(tmpmultipliers);
-}
-#endif
 
+EXIT:
+    free(first);
+    free(end);
+    release_p3_song(p3s);
+    release_p3_song(pattern);
+}
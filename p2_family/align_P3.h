@@ -48,14 +48,6 @@ extern "C" {
 void align_p3(const songcollection *sc, const song *s, const song *p,
         int alg, const alignparameters *parameters, alignmentmap *map);
 
-/*void align_p3(const songcollection *sc, const song *s, const song *p, int alg,
-        const alignparameters *parameters, const alignment *initial_align,
-        alignment *result_align);
-
-void map_alignments_p3(const songcollection *sc, const song *s, const song *p,
-        int alg, const alignparameters *parameters, alignmentmap *map);
-*/
-
 #ifdef __cplusplus
 }
 #endif
@@ -59,6 +59,28 @@
 #define MAX_INDEX_BUCKET_SIZE INT_MAX
 /* #define MAX_INDEX_BUCKET_SIZE 1000 */
 
+/**
+ * Always store vector index records with 32-bit song numbers and note
+ * positions. Otherwise this is done only for song collections that do not
+ * fit in the 16-bit records.
+ */
+/* #define VINDEX_WIDE_RECORDS 1 */
+
+/**
+ * Maximum number of threads for building a vector index or for searching
+ * it with a batch of patterns.
+ */
+#define VINDEX_MAX_THREADS 64
+
+/**
+ * Maximum number of segments in a vector index. Songs appended to an
+ * indexed collection are indexed to new segments, and the newest segments
+ * are merged in the background when there are VINDEX_MERGE_SEGMENTS of
+ * them.
+ */
+#define VINDEX_MAX_SEGMENTS 8
+#define VINDEX_MERGE_SEGMENTS 4
+
 
 /** Gap between joined songs in milliseconds */
 #define SONG_GAP 1000
@@ -81,6 +103,92 @@
 #define ORDER_F4_F5_RESULTS_WITH_P2 1
 
 
+/** Widest d_window for which P2/F6 selects its vectors optimally. The
+  * selection takes O(m * k * 2^d_window) memory for m pattern notes and k
+  * vectors; wider windows use the greedy selection of P2/F6-greedy. */
+#define P2_PIGEONHOLE_MAX_WINDOW 8
+
+/** Largest table of choices, in bytes (m * (k + 1) * 2^d_window), for which
+  * P2/F6 selects its vectors optimally. Larger patterns use the greedy
+  * selection of P2/F6-greedy. */
+#define P2_PIGEONHOLE_MAX_CHOICES (1 << 26)
+
+
+/** Number of candidates that the batched P1 and P2 alignment checks sort
+  * and verify at a time. */
+#define ALIGNMENT_BATCH_SIZE 1024
+
+/** Minimum number of candidates in one song for the batched alignment
+  * checks to compute the packed note keys of the song and compare them with
+  * SIMD instructions. Fewer candidates are verified one by one. */
+#define ALIGNMENT_SHARED_KEYS 64
+
+
+/** Maximum distance, in notes, between the two notes of a pair in the
+  * pattern and in the songs for the time-scale invariant algorithm S2. */
+#define S2_WINDOW 10
+
+/** Minimum number of note pairs in the additional S2 chains that are
+  * reported when multiple matches per song are stored. */
+#define S2_MIN_CHAIN 3
+
+
+/** Minimum number of notes in the maximal translatable patterns that SIA
+  * and SIATEC report, and in the additional SIA matches that are reported
+  * when multiple matches per song are stored. */
+#define SIA_MIN_PATTERN_SIZE 3
+
+/** Number of bits in a digit of the SIA difference vector radix sort */
+#define SIA_RADIX_BITS 8
+
+
+/** Build the MSM algorithms (search_msm.c) and their data format. */
+#define ENABLE_MSM 1
+
+/** Minimum number of piano roll cells per song note in the FFT-based MSM
+  * algorithms. Larger rolls have fewer hash collisions, so fewer
+  * correlation peaks need to be verified, but they take more memory and
+  * transform time. */
+#define MSM_HASH_FACTOR 8
+
+/** Smallest piano roll of the FFT-based MSM algorithms has 2^MSM_MIN_BITS
+  * cells. */
+#define MSM_MIN_BITS 6
+
+
+/** Number of turning points that sort_turningpoints() sorts without
+  * allocating memory */
+#define P3_SORT_BUFFER_POINTS 256
+
+/** Initial number of hash buckets in the shared P3 song cache */
+#define P3_CACHE_BUCKETS 256
+
+
+/** Maximum number of threads that calculate an alignment map with the
+  * alignment algorithm AP3. */
+#define ALIGN_MAX_THREADS 64
+
+/** Largest alignment map, in cells, whose initial alignment is searched
+  * on the whole map. Larger maps are first aligned at a lower resolution,
+  * and then only in a band around the path that was found. */
+#define ALIGN_DP_MAX_CELLS (1 << 24)
+
+/** Downsampling factor of the lower resolution alignment maps */
+#define ALIGN_DP_SCALE 4
+
+/** Number of map columns on both sides of the lower resolution path that
+  * are searched on the higher resolution map, and that are calculated on
+  * the finer levels of a multi-resolution alignment map */
+#define ALIGN_DP_BAND 64
+
+/** Resolution ratio of successive multi-resolution alignment map levels */
+#define ALIGN_MAP_SCALE 4
+
+/** Maximum number of threads that calculate the correlation lines of the
+  * synchronization algorithm sync_P3. */
+#define SYNC_MAX_THREADS 64
+
+
 /** Measure time allocation to algorithm subtasks
   * (index lookup, verification, ...) separately. */
 #define MEASURE_TIME_ALLOCATION 1
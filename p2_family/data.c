@@ -71,6 +71,18 @@ static int (* const CONVERT_SONG_COLLECTION[])(
 #endif
     build_p3_song_collection,
 };
+/* Formats that cannot be extended with new songs are rebuilt */
+static int (* const EXTEND_SONG_COLLECTION[])(void *data,
+        const songcollection *sc, int first_song, const dataparameters *dp) = {
+#ifdef VINDEX_ARRAY
+    append_vectorindex,
+#else
+    NULL,
+#endif
+    NULL,
+    NULL,
+};
+
 
 static void (* const CLEAR_DATA_FORMAT[])(void *data) = {
     clear_vectorindex,
@@ -107,6 +119,17 @@ int convert_song_collection(int format, void *data, const songcollection *sc,
     } else return 0;
 }
 
+int extend_song_collection(int format, void *data, const songcollection *sc,
+        int first_song, const dataparameters *dp) {
+    if ((format > 0) && (format <= NUM_DATA_FORMATS)) {
+        if (EXTEND_SONG_COLLECTION[format-1] != NULL) {
+            return EXTEND_SONG_COLLECTION[format-1](data, sc, first_song, dp);
+        }
+        clear_data_format(format, data);
+        return convert_song_collection(format, data, sc, dp);
+    } else return 0;
+}
+
 void clear_data_format(int format, void *data) {
     if ((format > 0) && (format <= NUM_DATA_FORMATS)) {
         CLEAR_DATA_FORMAT[format-1](data);
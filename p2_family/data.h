@@ -48,6 +48,9 @@ void *init_data_format(int format);
 int convert_song_collection(int format, void *data, const songcollection *sc,
         const dataparameters *dp);
 
+int extend_song_collection(int format, void *data, const songcollection *sc,
+        int first_song, const dataparameters *dp);
+
 void clear_data_format(int format, void *data);
 
 void free_data_format(int format, void *data);
@@ -55,6 +55,15 @@ typedef struct {
     int c_window;
     int avindex_vector_max_width;
     int avindex_vector_max_height;
+    /* Vector index file to load the index from, or to save it to if the file
+     * does not match the song collection. NULL to always build the index
+     * in memory. */
+    const char *vindex_file;
+    /* Set to 1 to store the vector index records compressed */
+    int compress_vindex;
+    /* Number of threads for building the index. Use 0 to start one thread
+     * per online processor. */
+    int num_threads;
 } dataparameters;
 
 
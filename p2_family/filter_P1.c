@@ -44,6 +44,38 @@
 
 #define MAX_TRIES 100
 
+/**
+ * Verifies the positions of an index vector with alignment_check_p1_batch().
+ *
+ * @param sc a song collection
+ * @param pattern the input pattern
+ * @param cursor an opened index cursor
+ * @param count number of records to read from the cursor
+ * @param patternpos pattern position of the first note of the vector
+ * @param ms information about the found matches will be stored here
+ *
+ * @return 1 if the match set became full, 0 otherwise
+ */
+static int check_p1_records(const songcollection *sc, const song *pattern,
+        indexcursor *cursor, int count, int patternpos, matchset *ms) {
+    alignmentcandidate c[ALIGNMENT_BATCH_SIZE];
+    while (count > 0) {
+        int k, n = MIN2(count, ALIGNMENT_BATCH_SIZE);
+        for (k=0; k<n; ++k) {
+            const wideindexrec *r = read_index_record(cursor);
+            c[k].song = r->song;
+            c[k].songpos = r->note;
+            c[k].patternpos = patternpos;
+        }
+        ms->cost.records += n;
+        ms->cost.checks += n;
+        if (alignment_check_p1_batch(sc, pattern, c, n, ms)) return 1;
+        count -= n;
+    }
+    return 0;
+}
+
+
 /**
  * Index filter P1(v1). Picks the first valid vector from the pattern and
  * retrieves positions where it occurs in the song collection.
@@ -60,12 +92,8 @@ void filter_p1_random(const songcollection *sc, const song *pattern,
     int d = parameters->d_window;
     /*int lastsong = -1;*/
     int pattern_index = 0;
-    int ir;
-    int numrecords;
-    indexvector *iv;
-    indexrec *records;
-    match *m;
-    song *songs = sc->songs;
+    int numrecords = 0;
+    indexcursor cursor;
     vectorindex *vindex = sc->data[DATA_VINDEX];
 
 #ifdef MEASURE_TIME_ALLOCATION
@@ -95,46 +123,29 @@ void filter_p1_random(const songcollection *sc, const song *pattern,
 #ifdef MEASURE_TIME_ALLOCATION
         if (ms->time.measure) gettimeofday(&t1, NULL);
 #endif
-        iv = get_index_vector(vindex, x, y);
+        numrecords = open_index_vector(vindex, x, y, &cursor);
 #ifdef MEASURE_TIME_ALLOCATION
         if (ms->time.measure) {
             gettimeofday(&t2, NULL);
             ms->time.indexing += timediff(&t2, &t1);
         }
 #endif
-        if (iv != NULL) {
+        if (numrecords > 0) {
             pattern_index = p1;
             break;
         }
     }
 
-    records = iv->records;
-    numrecords = iv->size;
-    for (ir=0; ir<numrecords; ++ir) {
-        indexrec *r = &records[ir];
-        /*if (r->song == lastsong) continue;*/
-
 #ifdef MEASURE_TIME_ALLOCATION
-        if (ms->time.measure) {
-            gettimeofday(&t1, NULL);
-            ms->time.indexing += timediff(&t1, &t2);
-        }
+    if (ms->time.measure) gettimeofday(&t1, NULL);
 #endif
-        m = alignment_check_p1(&songs[r->song],
-                r->note, pattern, pattern_index, ms);
-        if (m != NULL) {
-            /* Match found, skip to the next song. */
-            /*lastsong = r->song;*/
-            /*m->song = r->song;*/
-            if (ms->num_matches == ms->size) return;
-        }
+    check_p1_records(sc, pattern, &cursor, numrecords, pattern_index, ms);
 #ifdef MEASURE_TIME_ALLOCATION
-        if (ms->time.measure) {
-            gettimeofday(&t2, NULL);
-            ms->time.verifying += timediff(&t2, &t1);
-        }
-#endif
+    if (ms->time.measure) {
+        gettimeofday(&t2, NULL);
+        ms->time.verifying += timediff(&t2, &t1);
     }
+#endif
 }
 
 
@@ -150,13 +161,10 @@ void filter_p1_random(const songcollection *sc, const song *pattern,
  */
 void filter_p1_select_1(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms) {
-    int i, j, ir;
+    int i, j;
     int patternpos = -1;
     int smallestcount = INT_MAX;
-    indexvector *smallestiv = NULL;
-    indexrec *records;
-    song *songs = sc->songs;
-    match *m;
+    indexcursor cursor, c;
     vectorindex *vindex = sc->data[DATA_VINDEX];
 
     if (vindex == NULL) {
@@ -166,39 +174,24 @@ void filter_p1_select_1(const songcollection *sc, const song *pattern,
 
     for (i=0; i<pattern->size-1; ++i) {
         for (j=i+1; j<pattern->size; ++j) {
-            int x, y;
-            indexvector *iv;
+            int x, y, size;
             if (j >= i + parameters->d_window) break;
             x = pattern->notes[j].strt - pattern->notes[i].strt;
             y = pattern->notes[j].ptch - pattern->notes[i].ptch;
-            iv = get_index_vector(vindex, x, y);
-            if ((iv != NULL) && (iv->size < smallestcount)) {
-                smallestcount = iv->size;
-                smallestiv = iv;
+            size = open_index_vector(vindex, x, y, &c);
+            if ((size > 0) && (size < smallestcount)) {
+                smallestcount = size;
+                cursor = c;
                 patternpos = i;
             }
         }
     }
-    if (smallestiv == NULL) {
+    if (patternpos < 0) {
         fputs("Error in filter_p1_select_1(): failed to pick an index vector\n", stderr);
         return;
     }
 
-    records = smallestiv->records;
-
-    j = -1;
-    for (ir=0; ir<smallestcount; ++ir) {
-        indexrec *r = &records[ir];
-        /*if (r->song == j) continue;*/
-        m = alignment_check_p1(&songs[r->song], r->note, pattern, patternpos,
-                ms);
-        if (m != NULL) {
-            /* Match found, skip to the next song. */
-            /*j = r->song;*/
-            /*m->song = r->song;*/
-            if (ms->num_matches == ms->size) return;
-        }
-    }   
+    check_p1_records(sc, pattern, &cursor, smallestcount, patternpos, ms);
 }
 
 
@@ -215,14 +208,13 @@ void filter_p1_select_1(const songcollection *sc, const song *pattern,
  */
 void filter_p1_select_2(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms) {
-    int i, j, k, limit = INT_MAX;
-    indexvector *iv1 = NULL;
-    indexvector *iv2 = NULL;
+    int i, j, limit = INT_MAX;
+    int size1 = 0, size2 = 0;
     int iv1_patternpos = -1, iv2_patternpos = -1;
     int patternstrt, patternptch;
     /*int lastsong = -1;*/
 
-    indexrec *records;
+    indexcursor cursor, ocursor, c;
     vector *note;
     song *songs = sc->songs;
     match *m;
@@ -241,55 +233,58 @@ void filter_p1_select_2(const songcollection *sc, const song *pattern,
     /* Pick the two least common vectors from the pattern. */
     for (i=0; i<pattern->size-1; ++i) {
         for (j=i+1; j<pattern->size; ++j) {
-            int x, y;
-            indexvector *iv;
+            int x, y, size;
             if (j >= i + parameters->d_window) break;
             x = pattern->notes[j].strt - pattern->notes[i].strt;
             y = pattern->notes[j].ptch - pattern->notes[i].ptch;
-            iv = get_index_vector(vindex, x, y);
-            if (iv != NULL) {
-                if (iv1 == NULL) {
-                    iv1 = iv;
+            size = open_index_vector(vindex, x, y, &c);
+            if (size > 0) {
+                if (size1 == 0) {
+                    cursor = c;
+                    size1 = size;
                     iv1_patternpos = i;
-                    limit = iv->size;
-                } else if (iv2 == NULL) {
-                    iv2 = iv;
+                    limit = size;
+                } else if (size2 == 0) {
+                    ocursor = c;
+                    size2 = size;
                     iv2_patternpos = i;
-                    if (iv->size < limit) limit = iv->size;
-                } else if (iv->size < limit) {
-                    if (iv2->size < iv1->size) {
-                        iv1 = iv;
+                    if (size < limit) limit = size;
+                } else if (size < limit) {
+                    if (size2 < size1) {
+                        cursor = c;
+                        size1 = size;
                         iv1_patternpos = i;
                     } else {
-                        iv2 = iv;
+                        ocursor = c;
+                        size2 = size;
                         iv2_patternpos = i;
                     }
-                    limit = iv->size;
+                    limit = size;
                 }
             }
         }
     }
-    if ((iv1 == NULL) || (iv2 == NULL)) {
+    if ((size1 == 0) || (size2 == 0)) {
         fputs("Error in filter_p1_select_2(): failed to pick index vectors\n", stderr);
         return;
     }
 
     /* Switch the vectors so that v1 is the less frequent one */
-    if (iv1->size > iv2->size) {
-        indexvector *tmp = iv1;
-        iv1 = iv2;
-        iv2 = tmp;
+    if (size1 > size2) {
+        c = cursor;
+        cursor = ocursor;
+        ocursor = c;
+        size1 = cursor.size;
+        size2 = ocursor.size;
 
         i = iv2_patternpos;
         iv2_patternpos = iv1_patternpos;
         iv1_patternpos = i;
     }
 
-    records = iv1->records;
     note = &pattern->notes[iv1_patternpos];
     patternstrt = note->strt;
     patternptch = note->ptch;
-    k = 0;
 
 #ifdef MEASURE_TIME_ALLOCATION
     if (ms->time.measure) {
@@ -299,14 +294,14 @@ void filter_p1_select_2(const songcollection *sc, const song *pattern,
 #endif
 
     /* Merge the location lists */
-    for (i=0; i<iv1->size; ++i) {
-        int songnumber = records[i].song;
-        int songpos = records[i].note;
+    for (i=0; i<size1; ++i) {
+        const wideindexrec *r = read_index_record(&cursor);
+        int songnumber = r->song;
+        int songpos = r->note;
         song *s = &songs[songnumber];
         int songstrt, songptch;
         int failed = 0;
         int patterndelta;
-        indexrec *orecords;
 
         note = &s->notes[songpos];
         songstrt = note->strt;
@@ -317,23 +312,22 @@ void filter_p1_select_2(const songcollection *sc, const song *pattern,
         note = &pattern->notes[iv2_patternpos];
         patterndelta = ((patternstrt - note->strt) << 8) +
                 (patternptch - note->ptch);
-        orecords = iv2->records;
-        for (j=k; j<iv2->size; ++j) {
-            int osongnumber = orecords[j].song;
-            if (osongnumber < songnumber) k = j + 1;
-            else if (osongnumber == songnumber) {
-                int osongpos = orecords[j].note;
-                song *os = &songs[osongnumber];
+        skip_index_records(&ocursor, songnumber);
+        while (ocursor.position < size2) {
+            indexcursor ahead = ocursor;
+            const wideindexrec *orec = read_index_record(&ahead);
+            if (orec->song == songnumber) {
+                song *os = &songs[orec->song];
                 int songdelta;
 
-                note = &os->notes[osongpos];
+                note = &os->notes[orec->note];
                 songdelta = ((songstrt - note->strt) << 8) +
                         (songptch - note->ptch);
                 /* Break if found a pair. */
                 if (patterndelta < songdelta) {
-                    k = j + 1;
+                    ocursor = ahead;
                 } else if (patterndelta == songdelta) {
-                    k = j + 1;
+                    ocursor = ahead;
                     break;
                 } else {
                     failed = 1;
@@ -352,7 +346,6 @@ void filter_p1_select_2(const songcollection *sc, const song *pattern,
         }
 #endif
         if (!failed) {
-            indexrec *r = &records[i];
             /*if (r->song == lastsong) continue;*/
             m = alignment_check_p1(&songs[r->song], r->note, pattern,
                     iv1_patternpos, ms);
@@ -386,17 +379,12 @@ void filter_p1_select_2(const songcollection *sc, const song *pattern,
  */
 void filter_p1_sample(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms) {
-    int i, lastsong;
-    indexrec *records;
-    song *songs = sc->songs;
-    match *m;
-    indexvector _best_iv;
-    indexvector *best_iv = &_best_iv;
+    int i;
+    indexcursor cursor, c;
+    int best_size = INT_MAX;
     int best_pattern_pos = 0;
     vectorindex *vindex = sc->data[DATA_VINDEX];
 
-    _best_iv.size = INT_MAX;
-
     if (vindex == NULL) {
         fputs("Error in filter_p1_sample: song collection does not contain vectorindex data.\nUse update_song_collection_data() before calling this function.\n", stderr);
         return;
@@ -406,8 +394,7 @@ void filter_p1_sample(const songcollection *sc, const song *pattern,
 
     /* Pick vcount random vectors from the pattern */
     for (i=0; i<parameters->p1_sample_size; ++i) {
-        int j, k, x, y;
-        indexvector *iv;
+        int j, k, x, y, size;
         j = (int) (randd() * ((double) pattern->size - 2));
         if (j < 0) j = 0;
         k = j + (int) (randd() * ((double) parameters->d_window));
@@ -416,34 +403,21 @@ void filter_p1_sample(const songcollection *sc, const song *pattern,
 
         x = pattern->notes[k].strt - pattern->notes[j].strt;
         y = pattern->notes[k].ptch - pattern->notes[j].ptch;
-        iv = get_index_vector(vindex, x, y);
-        if ((iv != NULL) && (iv->size < best_iv->size)) {
-            best_iv = iv;
+        size = open_index_vector(vindex, x, y, &c);
+        if ((size > 0) && (size < best_size)) {
+            best_size = size;
+            cursor = c;
             best_pattern_pos = j;
         }
     }
 
     /* If there were no valid vectors in the random group, try P1/F2 */
-    if (best_iv->size == INT_MAX) {
+    if (best_size == INT_MAX) {
         fputs("Warning in filter_p1_sample(): no valid vectors found. Trying again with P1/F2...", stderr);
         filter_p1_select_1(sc, pattern, alg, parameters, ms);
         return;
     }
 
-    records = best_iv->records;
-
-    lastsong = -1;
-    for (i=0; i<best_iv->size; ++i) {
-        indexrec *r = &records[i];
-        /*if (r->song == lastsong) continue;*/
-        m = alignment_check_p1(&songs[r->song], r->note, pattern,
-                best_pattern_pos, ms);
-        if (m != NULL) {
-            /* Match found, skip to the next song. */
-            /*lastsong = r->song;*/
-            /*m->song = r->song;*/
-            if (ms->num_matches == ms->size) return;
-        }
-    }   
+    check_p1_records(sc, pattern, &cursor, best_size, best_pattern_pos, ms);
 }
 
@@ -34,6 +34,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "priority_queue.h"
 
 #include "config.h"
@@ -44,12 +47,38 @@
 #include "results.h"
 #include "vindex.h"
 
-#ifdef ENABLE_BLOSSOM4
-#include "match.h"
-#endif
 
+/* Digit size of the radix sort in batched searches */
+#define BATCH_RADIX_BITS 11
+
+/**
+ * Verifies the positions of an index vector with alignment_check_p2_batch().
+ *
+ * @param sc a song collection
+ * @param pattern the input pattern
+ * @param cursor an opened index cursor
+ * @param count number of records to read from the cursor
+ * @param patternpos pattern position of the first note of the vector
+ * @param ms information about the found matches will be stored here
+ */
+static void check_p2_records(const songcollection *sc, const song *pattern,
+        indexcursor *cursor, int count, int patternpos, matchset *ms) {
+    alignmentcandidate c[ALIGNMENT_BATCH_SIZE];
+    while (count > 0) {
+        int k, n = MIN2(count, ALIGNMENT_BATCH_SIZE);
+        for (k=0; k<n; ++k) {
+            const wideindexrec *r = read_index_record(cursor);
+            c[k].song = r->song;
+            c[k].songpos = r->note;
+            c[k].patternpos = patternpos;
+        }
+        alignment_check_p2_batch(sc, pattern, c, n, ms);
+        ms->cost.records += n;
+        ms->cost.checks += n;
+        count -= n;
+    }
+}
 
-#define MAX_EDGE_WEIGHT 1000000
 
 /**
  * P2/F6-greedy, index filter that is based on the pigeonhole principle and
@@ -78,7 +107,6 @@ void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
     patternvector *chosenvectors = (patternvector *) malloc(pattern->size *
             sizeof(patternvector));
     vectorindex *vindex = sc->data[DATA_VINDEX];
-    song *songs = sc->songs;
 
     if ((vindex == NULL) || (selected == NULL) || (chosenvectors == NULL)) {
         free(selected);
@@ -96,25 +124,25 @@ void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
         int j;
         int end = i + parameters->d_window;
         chosenvectors[i].patternpos = i;
-        chosenvectors[i].iv = NULL;
+        chosenvectors[i].cursor.size = 0;
         if (selected[i]) continue;
         if (end >= pattern->size) end = pattern->size - 1;
         for (j=i+1; j<=end; ++j) {
-            int x, y;
-            indexvector *iv;
+            int x, y, size;
+            indexcursor cursor;
             if (selected[j]) continue;
             x = pnotes[j].strt - pnotes[i].strt;
             y = pnotes[j].ptch - pnotes[i].ptch;
-            iv = get_index_vector(vindex, x, y);
-            if (iv != NULL) {
-                if ((chosenvectors[i].iv == NULL) ||
-                        (iv->size < chosenvectors[i].iv->size)) {
+            size = open_index_vector(vindex, x, y, &cursor);
+            if (size > 0) {
+                if ((chosenvectors[i].cursor.size == 0) ||
+                        (size < chosenvectors[i].cursor.size)) {
                     chosenvectors[i].t = j;
-                    chosenvectors[i].iv = iv;
+                    chosenvectors[i].cursor = cursor;
                 }
             }
         }
-        if (chosenvectors[i].iv != NULL) {
+        if (chosenvectors[i].cursor.size > 0) {
             selected[chosenvectors[i].t] = 1;
             ++vcount;
         }
@@ -130,9 +158,9 @@ void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
     pq = pq_create(vcount);
     vcount = 0;
     for (i=0; i<pattern->size-1; ++i) {
-        if (chosenvectors[i].iv != NULL) {
+        if (chosenvectors[i].cursor.size > 0) {
             pqnode *node = pq_getnode(pq, vcount);
-            node->key1 = chosenvectors[i].iv->size;
+            node->key1 = chosenvectors[i].cursor.size;
             node->key2 = i;
             pq_update_key1_p3(pq, node);
             ++vcount;
@@ -141,19 +169,15 @@ void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
 
     vcount = 0;
     while (vcount < num_pattern_vectors) {
-        int k;
-        indexrec *records;
+        indexcursor *cursor;
 
         pqnode *min = pq_getmin(pq);
 
         if (min->key1 == INT_MAX) break;
         i = min->key2;
 
-        records = chosenvectors[i].iv->records;
-        for (k=0; k<chosenvectors[i].iv->size; ++k) {
-            song *s = &songs[records[k].song];
-            alignment_check_p2(s, records[k].note, pattern, i, ms); 
-        }
+        cursor = &chosenvectors[i].cursor;
+        check_p2_records(sc, pattern, cursor, cursor->size, i, ms);
 
         min->key1 = INT_MAX;
         min->key2 = INT_MAX;
@@ -166,11 +190,117 @@ void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
 }
 
 
-#ifdef ENABLE_BLOSSOM4
+/**
+ * Selects a set of disjoint pattern vectors with the smallest total index
+ * bucket size. Vectors connect pattern notes that are at most d_window notes
+ * apart, so the graph of possible vectors is banded and a minimum-weight
+ * matching of a given size can be found with dynamic programming over the
+ * pattern notes. The state at each note consists of the number of vectors
+ * chosen so far and a bit mask of the following d_window notes that are
+ * already used as vector endpoints.
+ *
+ * @param sizes bucket sizes of the vectors: sizes[i * (d_window + 1) + b] is
+ *        the size of the vector from note i to note i + b, or 0 if the vector
+ *        is not in the index
+ * @param m number of notes in the pattern
+ * @param d_window maximum distance of vector endpoints
+ * @param k maximum number of vectors to select
+ * @param selected the first notes of the chosen vectors will be stored here
+ *        as selected[i] = b, where b is the distance to the second note. The
+ *        array should contain m zeros.
+ *
+ * @return the number of selected vectors, or -1 if memory allocation failed.
+ *         Fewer than k vectors are selected only if the pattern does not
+ *         contain k disjoint vectors.
+ */
+static int select_pigeonhole_vectors(const int *sizes, int m, int d_window,
+        int k, int *selected) {
+    int i, c, mask, count;
+    int num_masks = 1 << d_window;
+    int num_states = (k + 1) * num_masks;
+    long long *cost = (long long *) malloc(num_states * sizeof(long long));
+    long long *next = (long long *) malloc(num_states * sizeof(long long));
+    /* Transition into each state: distance of the chosen vector in the low
+     * bits (0 if none was chosen) and the first note's used bit above them */
+    unsigned char *choice = (unsigned char *) malloc(m * num_states *
+            sizeof(unsigned char));
+
+    if ((cost == NULL) || (next == NULL) || (choice == NULL)) {
+        free(cost);
+        free(next);
+        free(choice);
+        return -1;
+    }
+
+    for (i=0; i<num_states; ++i) cost[i] = LLONG_MAX;
+    cost[0] = 0;
+    for (i=0; i<m; ++i) {
+        unsigned char *ch = &choice[i * num_states];
+        const int *s = &sizes[i * (d_window + 1)];
+        long long *t;
+        for (c=0; c<num_states; ++c) next[c] = LLONG_MAX;
+        for (c=0; c<=k; ++c) {
+            for (mask=0; mask<num_masks; ++mask) {
+                long long v = cost[c * num_masks + mask];
+                int b, used = mask & 1;
+                int nm = mask >> 1;
+                if (v == LLONG_MAX) continue;
+
+                /* Note i is not the first note of a vector */
+                if (v < next[c * num_masks + nm]) {
+                    next[c * num_masks + nm] = v;
+                    ch[c * num_masks + nm] = (unsigned char) (used << 4);
+                }
+                if (used || (c == k)) continue;
+
+                /* Vector from note i to note i + b */
+                for (b=1; b<=d_window; ++b) {
+                    int dest;
+                    if ((s[b] == 0) || (mask & (1 << b))) continue;
+                    dest = (c + 1) * num_masks + ((mask | (1 << b)) >> 1);
+                    if (v + s[b] < next[dest]) {
+                        next[dest] = v + s[b];
+                        ch[dest] = (unsigned char) b;
+                    }
+                }
+            }
+        }
+        t = cost;
+        cost = next;
+        next = t;
+    }
+
+    /* Take the largest possible number of vectors, at most k */
+    for (count=k; count>0; --count) {
+        if (cost[count * num_masks] != LLONG_MAX) break;
+    }
+
+    /* Trace back the chosen vectors */
+    c = count;
+    mask = 0;
+    for (i=m-1; i>=0; --i) {
+        int ch = choice[i * num_states + c * num_masks + mask];
+        int b = ch & 0x0F;
+        mask = (mask << 1) | (ch >> 4);
+        if (b > 0) {
+            selected[i] = b;
+            mask &= ~(1 << b);
+            --c;
+        }
+    }
+
+    free(cost);
+    free(next);
+    free(choice);
+    return count;
+}
+
+
 /**
  * P2/F6, index filter that is based on the pigeonhole principle and
- * use of P1 index filters. This version uses a graph matching algorithm to
- * retrieve an optimal set of vectors.
+ * use of P1 index filters. This version retrieves an optimal set of vectors:
+ * the disjoint vectors within d_window notes whose index buckets have the
+ * smallest total size. See select_pigeonhole_vectors().
  *
  * Error tolerance of this filter is controlled by p2_select_threshold in the
  * search parameters struct. 0.0 means no expected corruption, 0.5 means that
@@ -179,6 +309,10 @@ void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
  * values make the algorithm run faster, and it should still find most of the
  * matches whose error rate is higher than the specified tolerance level.
  *
+ * Windows wider than P2_PIGEONHOLE_MAX_WINDOW, and patterns for which the
+ * selection would need a table larger than P2_PIGEONHOLE_MAX_CHOICES or
+ * fails to allocate it, are searched with filter_p2_greedy_pigeonhole().
+ *
  * @param sc a song collection
  * @param pattern the input pattern to search for
  * @param alg algorithm ID as defined in search.h; not used in this function
@@ -187,13 +321,14 @@ void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
  */
 void filter_p2_pigeonhole(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms) {
-    int i, vcount = 0;
+    int i, vcount;
     int num_pattern_vectors;
-    int *edges, *edgelengths, *graph_match;
+    int d_window = parameters->d_window;
+    int *sizes = NULL, *selected = NULL;
+    indexcursor *cursors = NULL;
     vector *pnotes = pattern->notes;
     pqroot *pq;
     vectorindex *vindex = sc->data[DATA_VINDEX];
-    song *songs = sc->songs;
 #ifdef MEASURE_TIME_ALLOCATION
     struct timeval t1, t2;
 #endif
@@ -202,60 +337,41 @@ void filter_p2_pigeonhole(const songcollection *sc, const song *pattern,
         fputs("Error in filter_p2_pigeonhole(): song collection does not contain vectorindex data.\nUse update_song_collection_data() before calling this function.\n", stderr);
         return;
     }
+    if (pattern->size < 2) return;
 
-    edges = (int *) malloc((1 + 2 * pattern->size * parameters->d_window) *
-            sizeof(int));
-    edgelengths = (int *) malloc((1 + pattern->size * parameters->d_window) *
-            sizeof(int));
-    graph_match = (int *) calloc(pattern->size * 2, sizeof(int));
+    num_pattern_vectors = parameters->p2_select_threshold * pattern->size;
+    if (num_pattern_vectors <= 0) num_pattern_vectors = 1;
+    if (num_pattern_vectors > pattern->size / 2)
+        num_pattern_vectors = pattern->size / 2;
 
-    if ((edges == NULL) || (edgelengths == NULL) || (graph_match == NULL)) {
-        fputs("Error in filter_p2_pigeonhole: failed to allocate memory", stderr);
-        goto EXIT;
+    if ((d_window > P2_PIGEONHOLE_MAX_WINDOW) || (((long long)
+            pattern->size * (num_pattern_vectors + 1) << d_window) >
+            P2_PIGEONHOLE_MAX_CHOICES)) {
+        filter_p2_greedy_pigeonhole(sc, pattern, alg, parameters, ms);
+        return;
     }
 
-    num_pattern_vectors = parameters->p2_select_threshold * pattern->size;
-    if (num_pattern_vectors <= 0) num_pattern_vectors = 1;
+    sizes = (int *) calloc(pattern->size * (d_window + 1), sizeof(int));
+    selected = (int *) calloc(pattern->size, sizeof(int));
+    if ((sizes == NULL) || (selected == NULL)) {
+        fputs("Error in filter_p2_pigeonhole(): failed to allocate memory\n",
+                stderr);
+        goto EXIT;
+    }
 
 #ifdef MEASURE_TIME_ALLOCATION
     if (ms->time.measure) gettimeofday(&t1, NULL);
 #endif
 
-    for(i=0; i<pattern->size; ++i) {
+    for (i=0; i<pattern->size-1; ++i) {
         int j;
-        /* Keep track of vertices so that those with no connecting
-           edges can be located. */
-        for (j=i+1; j<=i+parameters->d_window; ++j) {
-            int x, y;
-            indexvector *iv;
-            if (j >= pattern->size) break;
-            x = pnotes[j].strt - pnotes[i].strt;
-            y = pnotes[j].ptch - pnotes[i].ptch;
-            iv = get_index_vector(vindex, x, y);
-            if (iv != NULL) {
-                /* Mark these vertices connected */
-                graph_match[i] = 1;
-                graph_match[j] = 1;
-
-                edgelengths[vcount >> 1] = iv->size;
-                edges[vcount] = i;
-                ++vcount;
-                edges[vcount] = j;
-                ++vcount;
-                /*printf("edge: %d->%d, %d\n", i, j, iv->size);*/
-            }
+        for (j=i+1; (j<=i+d_window) && (j<pattern->size); ++j) {
+            indexcursor cursor;
+            int x = pnotes[j].strt - pnotes[i].strt;
+            int y = pnotes[j].ptch - pnotes[i].ptch;
+            sizes[i * (d_window + 1) + j - i] = open_index_vector(vindex,
+                    x, y, &cursor);
         }
-        if (graph_match[i] == 0) {
-            fputs("Warning: Unconnected vertex -- adding a dummy edge\n",
-                    stderr);
-/*
-            edgelengths[vcount >> 1] = MAX_EDGE_WEIGHT;
-            edges[vcount] = i;
-            ++vcount;
-            edges[vcount] = pattern->size;
-            ++vcount;
-*/
-        } else graph_match[i] = 0;
     }
 
 #ifdef MEASURE_TIME_ALLOCATION
@@ -265,29 +381,14 @@ void filter_p2_pigeonhole(const songcollection *sc, const song *pattern,
     }
 #endif
 
-    vcount >>= 1;
-    if (blossom4_match(pattern->size, vcount, edges, edgelengths, 0, 0, 0, 0,
-            graph_match)) {
-#ifdef MEASURE_TIME_ALLOCATION
-        if (ms->time.measure) {
-            gettimeofday(&t1, NULL);
-            ms->time.other += timediff(&t1, &t2);
-        }
-#endif
-        fputs("Error in filter_p2_pigeonhole: graph matching failed.\nRunning a greedy search instead.\n", stderr);
+    vcount = select_pigeonhole_vectors(sizes, pattern->size, d_window,
+            num_pattern_vectors, selected);
+    if (vcount < 0) {
+        free(sizes);
+        free(selected);
         filter_p2_greedy_pigeonhole(sc, pattern, alg, parameters, ms);
-#ifdef MEASURE_TIME_ALLOCATION
-        if (ms->time.measure) {
-            gettimeofday(&t2, NULL);
-            ms->time.verifying += timediff(&t2, &t1);
-        }
-#endif
-        goto EXIT;
+        return;
     }
-    free(edges);
-    free(edgelengths);
-    edges = NULL;
-    edgelengths = NULL;
 
 #ifdef MEASURE_TIME_ALLOCATION
     if (ms->time.measure) {
@@ -295,31 +396,29 @@ void filter_p2_pigeonhole(const songcollection *sc, const song *pattern,
         ms->time.other += timediff(&t1, &t2);
     }
 #endif
+    if (vcount == 0) goto EXIT;
 
     /* Sort the vectors by their frequencies */
-    pq = pq_create((pattern->size >> 1) + 1);
+    cursors = (indexcursor *) malloc(vcount * sizeof(indexcursor));
+    if (cursors == NULL) {
+        fputs("Error in filter_p2_pigeonhole(): failed to allocate memory\n",
+                stderr);
+        goto EXIT;
+    }
+    pq = pq_create(vcount);
     vcount = 0;
-    for (i=0; i<pattern->size; i+=2) {
-        int x, y;
-        indexvector *iv;
+    for (i=0; i<pattern->size; ++i) {
+        int x, y, j;
         pqnode *node;
 
-        if ((graph_match[i] >= pattern->size) ||
-                (graph_match[i+1] >= pattern->size)) {
-            /* Dummy edge */
-            continue;
-        }
-
-        if (graph_match[i] == graph_match[i+1]) break;
-
-        x = pnotes[graph_match[i+1]].strt - pnotes[graph_match[i]].strt;
-        y = pnotes[graph_match[i+1]].ptch - pnotes[graph_match[i]].ptch;
-        iv = get_index_vector(vindex, x, y);
-
+        if (selected[i] == 0) continue;
+        j = i + selected[i];
+        x = pnotes[j].strt - pnotes[i].strt;
+        y = pnotes[j].ptch - pnotes[i].ptch;
         node = pq_getnode(pq, vcount);
-        node->key1 = iv->size;
-        node->key2 = graph_match[i];
-        node->pointer = iv->records;
+        node->key1 = open_index_vector(vindex, x, y, &cursors[vcount]);
+        node->key2 = i;
+        node->pointer = &cursors[vcount];
         pq_update_key1_p3(pq, node);
         ++vcount;
     }
@@ -331,26 +430,20 @@ void filter_p2_pigeonhole(const songcollection *sc, const song *pattern,
     }
 #endif
 
-    if (vcount > num_pattern_vectors) vcount = num_pattern_vectors;
-    while (vcount >= 0) {
-        int k;
-        indexrec *records;
+    while (1) {
+        indexcursor *cursor;
 
         pqnode *min = pq_getmin(pq);
 
         if (min->key1 == INT_MAX) break;
         i = min->key2;
 
-        records = (indexrec *) min->pointer;
-        for (k=0; k<min->key1; ++k) {
-            song *s = &songs[records[k].song];
-            alignment_check_p2(s, records[k].note, pattern, i, ms); 
-        }
+        cursor = (indexcursor *) min->pointer;
+        check_p2_records(sc, pattern, cursor, min->key1, i, ms);
 
         min->key1 = INT_MAX;
         min->key2 = INT_MAX;
         pq_update_key1_p3(pq, min);
-        --vcount;
     }
 
 #ifdef MEASURE_TIME_ALLOCATION
@@ -360,78 +453,40 @@ void filter_p2_pigeonhole(const songcollection *sc, const song *pattern,
     }
 #endif
 
-    /*fprintf(stderr, "Vectors: %d\n", vcount);*/
     pq_free(pq);
 EXIT:
-    free(edges);
-    free(edgelengths);
-    free(graph_match);
+    free(cursors);
+    free(sizes);
+    free(selected);
 }
 
-#endif
-
 
 /**
- * Index filter P2/F4. Picks all valid vectors from the pattern and scans them
- * (or their starting points) in the same way that the actual P2 algorithm scans
- * notes.
+ * Merges the record lists of the chosen pattern vectors in the order of
+ * songs and translations, and reports the positions where the largest
+ * number of vectors are in the same relative positions as in the pattern.
+ * This is the scanning phase shared by P2/F4 and the filters that select
+ * a subset of its vectors.
  *
  * @param sc a song collection
- * @param pattern the input pattern to search for
- * @param alg algorithm ID as defined in search.h; not used in this function
- * @param parameters search parameters
+ * @param pattern the input pattern
+ * @param chosenvectors pattern vectors with opened index cursors. Every
+ *        cursor must contain at least one record.
+ * @param vcount number of vectors
  * @param ms information about the found matches will be stored here
  */
-void filter_p2_window(const songcollection *sc, const song *pattern,
-        int alg, const searchparameters *parameters, matchset *ms) {
-    int i, j;
-    int vcount = pattern->size * parameters->p2_window;
-
+static void scan_p2_vectors(const songcollection *sc, const song *pattern,
+        patternvector *chosenvectors, int vcount, matchset *ms) {
+    int i;
     int songid = INT_MIN;
     int previous_key = INT_MIN;
     int previous_spos = -1;
     int previous_ppos = -1;
     int count = 0;
     int maxcount = 0;
-    /* int matchstart = 0; */
     vector *pnotes = pattern->notes;
-    vectorindex *vindex = sc->data[DATA_VINDEX];
-    pqroot *pq;
     song *songs = sc->songs;
-    patternvector *chosenvectors = (patternvector *) malloc(vcount *
-            sizeof(patternvector));
-    vcount = 0;
-
-    if (vindex == NULL) {
-        fputs("Error in filter_p2_window(): song collection does not contain vectorindex data.\nUse update_song_collection_data() before calling this function.\n", stderr);
-        free(chosenvectors);
-        return;
-    }
-
-    /* Pick all the valid vectors from the pattern. */
-    for (i=0; i<pattern->size - 1; ++i) {
-        int end = i + parameters->p2_window;
-        if (end >= pattern->size) end = pattern->size - 1;
-        for (j=i+1; j<=end; ++j) {
-            int x = pnotes[j].strt - pnotes[i].strt;
-            int y = pnotes[j].ptch - pnotes[i].ptch;
-            indexvector *iv = get_index_vector(vindex, x, y);
-            if (iv != NULL) {
-                chosenvectors[vcount].iv = iv;
-                chosenvectors[vcount].patternpos = i;
-                chosenvectors[vcount].shift = (((int) pnotes[i].strt -
-                    (int) pnotes[0].strt) << 8) +
-                    (int) pnotes[i].ptch -
-                    (int) pnotes[0].ptch + NOTE_PITCHES;
-                chosenvectors[vcount].t = 0;
-                ++vcount;
-            }
-        }
-    }
-    if (vcount == 0) {
-        free(chosenvectors);
-        return;
-    }
+    pqroot *pq;
 
     /* Initialize a priority queue. */
     pq = pq_create(vcount);
@@ -439,16 +494,18 @@ void filter_p2_window(const songcollection *sc, const song *pattern,
     /* Merge the location lists by inserting them to the priority queue. */
     for (i=0; i<vcount; ++i) {
         pqnode *node = pq_getnode(pq, i);
-        indexrec *ir = chosenvectors[i].iv->records;
-        song *s = &songs[ir->song];
-        vector *textnote = &s->notes[ir->note];
+        const wideindexrec *ir;
+        song *s;
+        vector *textnote;
         vector *patternnote = &pnotes[chosenvectors[i].patternpos];
+        ir = read_index_record(&chosenvectors[i].cursor);
+        ++ms->cost.records;
+        s = &songs[ir->song];
+        textnote = &s->notes[ir->note];
         node->key1 = ir->song;
         node->key2 = ((int) (textnote->strt - patternnote->strt) << 8) +
                 (int) (textnote->ptch - patternnote->ptch) + NOTE_PITCHES;
-        node->pointer = ir;
         pq_update(pq, node);
-        chosenvectors[i].t = 1;
     }
 
     /* Scan through the data and mark the location where the largest number
@@ -463,6 +520,7 @@ void filter_p2_window(const songcollection *sc, const song *pattern,
         } else {
             /* Check if the previous match was a good one */
             if ((count == maxcount) && (count > 1)) {
+                ++ms->cost.checks;
 #ifdef ORDER_F4_F5_RESULTS_WITH_P2
                 alignment_check_p2(&songs[songid], previous_spos,
                         pattern, previous_ppos, ms);
@@ -487,30 +545,491 @@ void filter_p2_window(const songcollection *sc, const song *pattern,
             }
             previous_key = min->key2;
             previous_ppos = chosenvectors[i].patternpos;
-            previous_spos = ((indexrec *) min->pointer)->note;
+            /* The record that was just taken from the queue */
+            previous_spos = chosenvectors[i].cursor.record.note;
         }
-        if (chosenvectors[i].t < chosenvectors[i].iv->size) {    
-            indexrec *ir = &chosenvectors[i].iv->records[chosenvectors[i].t];
+        if (chosenvectors[i].cursor.position < chosenvectors[i].cursor.size) {
+            const wideindexrec *ir = read_index_record(&chosenvectors[i].cursor);
+            ++ms->cost.records;
             song *s = &songs[ir->song];
             vector *textnote = &s->notes[ir->note];
             vector *patternnote = &pnotes[chosenvectors[i].patternpos];
             min->key1 = ir->song;
             min->key2 = ((int) (textnote->strt - patternnote->strt) << 8) +
                     (int) (textnote->ptch - patternnote->ptch) + NOTE_PITCHES;
-            min->pointer = ir;
             pq_update(pq, min);
-            ++chosenvectors[i].t;
         } else {
             min->key1 = INT_MAX;
             min->key2 = INT_MAX;
             pq_update(pq, min);
         }
     }
-    free(chosenvectors);
     pq_free(pq);
 }
 
 
+/**
+ * Index filter P2/F4. Picks all valid vectors from the pattern and scans them
+ * (or their starting points) in the same way that the actual P2 algorithm scans
+ * notes.
+ *
+ * @param sc a song collection
+ * @param pattern the input pattern to search for
+ * @param alg algorithm ID as defined in search.h; not used in this function
+ * @param parameters search parameters
+ * @param ms information about the found matches will be stored here
+ */
+void filter_p2_window(const songcollection *sc, const song *pattern,
+        int alg, const searchparameters *parameters, matchset *ms) {
+    int i, j;
+    int vcount = pattern->size * parameters->p2_window;
+
+    vector *pnotes = pattern->notes;
+    vectorindex *vindex = sc->data[DATA_VINDEX];
+    patternvector *chosenvectors = (patternvector *) malloc(vcount *
+            sizeof(patternvector));
+    vcount = 0;
+
+    if (vindex == NULL) {
+        fputs("Error in filter_p2_window(): song collection does not contain vectorindex data.\nUse update_song_collection_data() before calling this function.\n", stderr);
+        free(chosenvectors);
+        return;
+    }
+
+    /* Pick all the valid vectors from the pattern. */
+    for (i=0; i<pattern->size - 1; ++i) {
+        int end = i + parameters->p2_window;
+        if (end >= pattern->size) end = pattern->size - 1;
+        for (j=i+1; j<=end; ++j) {
+            int x = pnotes[j].strt - pnotes[i].strt;
+            int y = pnotes[j].ptch - pnotes[i].ptch;
+            if (open_index_vector(vindex, x, y,
+                    &chosenvectors[vcount].cursor) > 0) {
+                chosenvectors[vcount].patternpos = i;
+                chosenvectors[vcount].shift = (((int) pnotes[i].strt -
+                    (int) pnotes[0].strt) << 8) +
+                    (int) pnotes[i].ptch -
+                    (int) pnotes[0].ptch + NOTE_PITCHES;
+                chosenvectors[vcount].t = 0;
+                ++vcount;
+            }
+        }
+    }
+    if (vcount == 0) {
+        free(chosenvectors);
+        return;
+    }
+
+    scan_p2_vectors(sc, pattern, chosenvectors, vcount, ms);
+    free(chosenvectors);
+}
+
+
+/**
+ * A pattern vector in a batched P2/F4 search.
+ */
+typedef struct {
+    int x;
+    int y;
+    /* Index vector key; vectors with the same key share a posting list */
+    int key;
+    int pattern;
+    /* Vector number in the pattern; ties are resolved in this order */
+    int vector;
+    int patternpos;
+} batchvector;
+
+/**
+ * A posting list that is traversed once for all the patterns of a batch.
+ */
+typedef struct {
+    indexcursor cursor;
+    /* Range of the vectors that use the list in the vector array */
+    int first_vector;
+    int end_vector;
+} batchlist;
+
+/**
+ * A candidate match position of a pattern in the current song.
+ */
+typedef struct {
+    int key;
+    int vector;
+    int songpos;
+    int patternpos;
+} batchcandidate;
+
+/**
+ * Per-pattern state of a batched search.
+ */
+typedef struct {
+    batchcandidate *candidates;
+    int num_candidates;
+    int size;
+    /* Number of pattern vectors minus one, as in filter_p2_window() */
+    int vcount;
+} batchpattern;
+
+/**
+ * A part of a batched search that is run in a separate thread.
+ */
+typedef struct {
+    const songcollection *sc;
+    const songcollection *patterns;
+    const searchparameters *parameters;
+    matchset *ms;
+    int first_pattern;
+    int end_pattern;
+} batchpart;
+
+
+/**
+ * Comparison function for sorting pattern vectors by their index keys.
+ *
+ * @param a a pattern vector
+ * @param b another pattern vector
+ *
+ * @return a negative value if a should come first, a positive value if b
+ *         should come first, 0 if the vectors are equal
+ */
+static int compare_batch_vectors(const void *a, const void *b) {
+    const batchvector *va = (const batchvector *) a;
+    const batchvector *vb = (const batchvector *) b;
+    if (va->key != vb->key) return (va->key < vb->key) ? -1 : 1;
+    if (va->pattern != vb->pattern) return va->pattern - vb->pattern;
+    return va->vector - vb->vector;
+}
+
+/**
+ * Sorts candidates by their keys. Large arrays are sorted with a radix
+ * sort that skips the digits that are the same in all keys. The order of
+ * candidates with equal keys is not defined.
+ *
+ * @param c the candidates
+ * @param tmp a buffer of the same size
+ * @param n number of candidates
+ *
+ * @return pointer to the sorted candidates, either c or tmp
+ */
+static batchcandidate *sort_batch_candidates(batchcandidate *c,
+        batchcandidate *tmp, int n) {
+    int counts[1 << BATCH_RADIX_BITS];
+    int i, shift;
+
+    if (n < 64) {
+        for (i=1; i<n; ++i) {
+            batchcandidate x = c[i];
+            int j = i - 1;
+            while ((j >= 0) && (c[j].key > x.key)) {
+                c[j+1] = c[j];
+                --j;
+            }
+            c[j+1] = x;
+        }
+        return c;
+    }
+    for (shift=0; shift<32; shift+=BATCH_RADIX_BITS) {
+        const unsigned int mask = (1 << BATCH_RADIX_BITS) - 1;
+        batchcandidate *t;
+        int sum = 0;
+        memset(counts, 0, sizeof(counts));
+        /* Flip the sign bit so that negative keys come first */
+        for (i=0; i<n; ++i)
+            ++counts[(((unsigned int) c[i].key ^ 0x80000000U) >> shift) & mask];
+        if (counts[(((unsigned int) c[0].key ^ 0x80000000U) >> shift) &
+                mask] == n) continue;
+        for (i=0; i<=(int) mask; ++i) {
+            int k = counts[i];
+            counts[i] = sum;
+            sum += k;
+        }
+        for (i=0; i<n; ++i) {
+            tmp[counts[(((unsigned int) c[i].key ^ 0x80000000U) >> shift) &
+                    mask]++] = c[i];
+        }
+        t = c;
+        c = tmp;
+        tmp = t;
+    }
+    return c;
+}
+
+
+/**
+ * Reports the matches of a pattern in a song from the candidates collected
+ * for it. This is the same as what filter_p2_window() does for one song:
+ * candidates with the same key form a run, and the run is checked starting
+ * from the candidate that the priority queue would return first.
+ *
+ * @param s the song
+ * @param songid song number
+ * @param pattern the pattern
+ * @param bp the pattern's candidates
+ * @param tmp a buffer for sorting the candidates
+ * @param ms matches will be stored here
+ */
+static void check_batch_candidates(const song *s, int songid,
+        const song *pattern, batchpattern *bp, batchcandidate *tmp,
+        matchset *ms) {
+    int n = bp->num_candidates;
+    batchcandidate *c = sort_batch_candidates(bp->candidates, tmp, n);
+    int k = 0, count, maxcount = 0;
+
+    while (k < n) {
+        int first = k;
+        int end = k + 1;
+        while ((end < n) && (c[end].key == c[k].key)) {
+            if ((c[end].vector < c[first].vector) ||
+                    ((c[end].vector == c[first].vector) &&
+                    (c[end].songpos < c[first].songpos))) first = end;
+            ++end;
+        }
+        count = end - k - 1;
+        if (count > maxcount) maxcount = count;
+        if ((count == maxcount) && (count > 1)) {
+#ifdef ORDER_F4_F5_RESULTS_WITH_P2
+            alignment_check_p2(s, c[first].songpos, pattern,
+                    c[first].patternpos, ms);
+#else
+            vector *pnotes = pattern->notes;
+            int match_start = (c[k].key >> 8) + pnotes[0].strt;
+            int match_end = (c[k].key >> 8) +
+                    pnotes[pattern->size - 1].strt +
+                    pnotes[pattern->size - 1].dur;
+            char transposition = (char) ((c[k].key & 0xFF) - NOTE_PITCHES);
+            float similarity = ((float) maxcount) / ((float) bp->vcount);
+            insert_match(ms, songid, match_start, match_end, transposition,
+                    similarity);
+#endif
+        }
+        k = end;
+    }
+    bp->num_candidates = 0;
+}
+
+
+/**
+ * Runs a batched P2/F4 search for a range of patterns.
+ *
+ * @param arg pointer to a batchpart structure
+ *
+ * @return NULL
+ */
+static void *search_batch_part(void *arg) {
+    const batchpart *part = (const batchpart *) arg;
+    const songcollection *sc = part->sc;
+    const searchparameters *parameters = part->parameters;
+    const vectorindex *vindex = sc->data[DATA_VINDEX];
+    int num_patterns = part->end_pattern - part->first_pattern;
+    batchvector *vectors = NULL;
+    batchlist *lists = NULL;
+    batchpattern *bps = NULL;
+    batchcandidate *tmp = NULL;
+    int *touched = NULL;
+    pqroot *pq = NULL;
+    int i, j, p, num_vectors = 0, num_lists = 0, size = 0, tmp_size = 0;
+
+    for (p=part->first_pattern; p<part->end_pattern; ++p)
+        size += part->patterns->songs[p].size * parameters->p2_window;
+    vectors = (batchvector *) malloc(MAX2(size, 1) * sizeof(batchvector));
+    bps = (batchpattern *) calloc(MAX2(num_patterns, 1),
+            sizeof(batchpattern));
+    touched = (int *) malloc(MAX2(num_patterns, 1) * sizeof(int));
+    if ((vectors == NULL) || (bps == NULL) || (touched == NULL))
+        goto NO_MEMORY;
+
+    /* Pick all the valid vectors from the patterns */
+    for (p=part->first_pattern; p<part->end_pattern; ++p) {
+        const song *pattern = &part->patterns->songs[p];
+        vector *pnotes = pattern->notes;
+        int vcount = 0;
+        for (i=0; i<pattern->size - 1; ++i) {
+            int end = i + parameters->p2_window;
+            if (end >= pattern->size) end = pattern->size - 1;
+            for (j=i+1; j<=end; ++j) {
+                batchvector *v = &vectors[num_vectors];
+                indexcursor cursor;
+                v->x = pnotes[j].strt - pnotes[i].strt;
+                v->y = pnotes[j].ptch - pnotes[i].ptch;
+                if (open_index_vector(vindex, v->x, v->y, &cursor) > 0) {
+                    v->key = cursor.key;
+                    v->pattern = p - part->first_pattern;
+                    v->vector = vcount;
+                    v->patternpos = i;
+                    ++vcount;
+                    ++num_vectors;
+                }
+            }
+        }
+        bps[p - part->first_pattern].vcount = vcount - 1;
+    }
+    if (num_vectors == 0) goto EXIT;
+
+    /* Group the vectors by their posting lists */
+    qsort(vectors, num_vectors, sizeof(batchvector), compare_batch_vectors);
+    lists = (batchlist *) malloc(num_vectors * sizeof(batchlist));
+    if (lists == NULL) goto NO_MEMORY;
+    for (i=0; i<num_vectors; i=j) {
+        batchlist *l = &lists[num_lists];
+        for (j=i+1; (j<num_vectors) && (vectors[j].key == vectors[i].key); ++j);
+        open_index_vector(vindex, vectors[i].x, vectors[i].y, &l->cursor);
+        l->first_vector = i;
+        l->end_vector = j;
+        ++num_lists;
+    }
+
+    pq = pq_create(num_lists);
+    for (i=0; i<num_lists; ++i) {
+        pqnode *node = pq_getnode(pq, i);
+        node->key1 = read_index_record(&lists[i].cursor)->song;
+        node->key2 = 0;
+        pq_update(pq, node);
+    }
+
+    /* Traverse the lists one song at a time and give the records to the
+     * patterns that use them */
+    while (1) {
+        pqnode *min = pq_getmin(pq);
+        int songid = min->key1;
+        const song *s;
+        int num_touched = 0;
+
+        if (songid == INT_MAX) break;
+        s = &sc->songs[songid];
+        do {
+            batchlist *l = &lists[min->index];
+            indexcursor *cursor = &l->cursor;
+            do {
+                const vector *textnote = &s->notes[cursor->record.note];
+                for (i=l->first_vector; i<l->end_vector; ++i) {
+                    const batchvector *v = &vectors[i];
+                    batchpattern *bp = &bps[v->pattern];
+                    const vector *patternnote = &part->patterns->songs[
+                            part->first_pattern + v->pattern].notes[
+                            v->patternpos];
+                    batchcandidate *c;
+                    if (bp->num_candidates == bp->size) {
+                        int newsize = MAX2(bp->size << 1, 64);
+                        c = (batchcandidate *) realloc(bp->candidates,
+                                newsize * sizeof(batchcandidate));
+                        if (c == NULL) goto NO_MEMORY;
+                        bp->candidates = c;
+                        bp->size = newsize;
+                    }
+                    if (bp->num_candidates == 0) {
+                        touched[num_touched] = v->pattern;
+                        ++num_touched;
+                    }
+                    c = &bp->candidates[bp->num_candidates];
+                    c->key = ((int) (textnote->strt - patternnote->strt) << 8) +
+                            (int) (textnote->ptch - patternnote->ptch) +
+                            NOTE_PITCHES;
+                    c->vector = v->vector;
+                    c->songpos = cursor->record.note;
+                    c->patternpos = v->patternpos;
+                    ++bp->num_candidates;
+                }
+                if (cursor->position == cursor->size) {
+                    min->key1 = INT_MAX;
+                    break;
+                }
+                min->key1 = read_index_record(cursor)->song;
+            } while (min->key1 == songid);
+            pq_update(pq, min);
+            min = pq_getmin(pq);
+        } while (min->key1 == songid);
+
+        for (i=0; i<num_touched; ++i) {
+            batchpattern *bp = &bps[touched[i]];
+            p = touched[i];
+            if (bp->num_candidates > tmp_size) {
+                free(tmp);
+                tmp_size = bp->size;
+                tmp = (batchcandidate *) malloc(tmp_size *
+                        sizeof(batchcandidate));
+                if (tmp == NULL) goto NO_MEMORY;
+            }
+            check_batch_candidates(s, songid,
+                    &part->patterns->songs[part->first_pattern + p], bp, tmp,
+                    &part->ms[part->first_pattern + p]);
+        }
+    }
+    goto EXIT;
+
+NO_MEMORY:
+    fputs("Error in filter_p2_window_batch(): failed to allocate memory\n",
+            stderr);
+EXIT:
+    if (pq != NULL) pq_free(pq);
+    if (bps != NULL) {
+        for (p=0; p<num_patterns; ++p) free(bps[p].candidates);
+    }
+    free(bps);
+    free(tmp);
+    free(touched);
+    free(lists);
+    free(vectors);
+    return NULL;
+}
+
+
+/**
+ * Batched version of index filter P2/F4 for searching many patterns at
+ * once, such as when comparing a collection against itself. Pattern
+ * vectors that map to the same index vector share a single traversal of
+ * its posting list, and the records are given to per-pattern counters one
+ * song at a time. The matches are the same as with filter_p2_window().
+ * The patterns are divided between threads.
+ *
+ * @param sc a song collection
+ * @param patterns the patterns to search for
+ * @param parameters search parameters
+ * @param ms an array of match sets, one for each pattern. Found matches are
+ *        added to them.
+ * @param num_threads number of threads to use, 0 for one per processor
+ */
+void filter_p2_window_batch(const songcollection *sc,
+        const songcollection *patterns, const searchparameters *parameters,
+        matchset *ms, int num_threads) {
+    batchpart parts[VINDEX_MAX_THREADS];
+    pthread_t threads[VINDEX_MAX_THREADS];
+    int started[VINDEX_MAX_THREADS];
+    int i;
+
+    if (sc->data[DATA_VINDEX] == NULL) {
+        fputs("Error in filter_p2_window_batch(): song collection does not contain vectorindex data.\nUse update_song_collection_data() before calling this function.\n", stderr);
+        return;
+    }
+    if (patterns->size <= 0) return;
+
+    if (num_threads <= 0) num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = MIN2(MAX2(num_threads, 1), VINDEX_MAX_THREADS);
+    num_threads = MIN2(num_threads, patterns->size);
+
+    for (i=0; i<num_threads; ++i) {
+        parts[i].sc = sc;
+        parts[i].patterns = patterns;
+        parts[i].parameters = parameters;
+        parts[i].ms = ms;
+        parts[i].first_pattern = (int) ((long long) patterns->size * i /
+                num_threads);
+        parts[i].end_pattern = (int) ((long long) patterns->size * (i + 1) /
+                num_threads);
+    }
+
+    /* The calling thread searches the first part */
+    for (i=1; i<num_threads; ++i) {
+        started[i] = (pthread_create(&threads[i], NULL, search_batch_part,
+                &parts[i]) == 0);
+    }
+    search_batch_part(&parts[0]);
+    for (i=1; i<num_threads; ++i) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else search_batch_part(&parts[i]);
+    }
+}
+
+
 /**
  * Index filter P2/F5. Picks locally a group of least frequent vectors in the
  * pattern to approximate P2. Seach parameter p2_select_threshold controls the
@@ -529,17 +1048,9 @@ void filter_p2_select_local(const songcollection *sc, const song *pattern,
     int i, j;
     int vcount = pattern->size * parameters->p2_window;
 
-    int songid = INT_MIN;
-    int previous_key = INT_MIN;
-    int previous_spos = -1;
-    int previous_ppos = -1;
-    int count = 0;
     int maxcount = 0;
-    /* int matchstart = 0; */
     vector *pnotes = pattern->notes;
     vectorindex *vindex = sc->data[DATA_VINDEX];
-    pqroot *pq;
-    song *songs = sc->songs;
     patternvector *chosenvectors = (patternvector *) malloc(vcount *
             sizeof(patternvector));
     int *bucket_size = (int *) malloc(parameters->p2_window * sizeof(int));
@@ -563,9 +1074,10 @@ void filter_p2_select_local(const songcollection *sc, const song *pattern,
         for (j=i+1; j<=end; ++j) {
             int x = pnotes[j].strt - pnotes[i].strt;
             int y = pnotes[j].ptch - pnotes[i].ptch;
-            indexvector *iv = get_index_vector(vindex, x, y);
-            if (iv != NULL) {
-                bucket_size[c] = iv->size;
+            indexcursor cursor;
+            int size = open_index_vector(vindex, x, y, &cursor);
+            if (size > 0) {
+                bucket_size[c] = size;
                 ++c;
             }
         }
@@ -577,9 +1089,9 @@ void filter_p2_select_local(const songcollection *sc, const song *pattern,
         for (j=i+1; j<=end; ++j) {
             int x = pnotes[j].strt - pnotes[i].strt;
             int y = pnotes[j].ptch - pnotes[i].ptch;
-            indexvector *iv = get_index_vector(vindex, x, y);
-            if ((iv != NULL) && (iv->size <= maxcount)) {
-                chosenvectors[vcount].iv = iv;
+            indexcursor *cursor = &chosenvectors[vcount].cursor;
+            int size = open_index_vector(vindex, x, y, cursor);
+            if ((size > 0) && (size <= maxcount)) {
                 chosenvectors[vcount].patternpos = i;
                 chosenvectors[vcount].shift = (((int) pnotes[i].strt -
                     (int) pnotes[0].strt) << 8) +
@@ -596,84 +1108,8 @@ void filter_p2_select_local(const songcollection *sc, const song *pattern,
         return;
     }
 
-    /* Initialize a priority queue. */
-    pq = pq_create(vcount);
-
-    /* Merge the location lists by inserting them to the priority queue. */
-    for (i=0; i<vcount; ++i) {
-        pqnode *node = pq_getnode(pq, i);
-        indexrec *ir = chosenvectors[i].iv->records;
-        song *s = &songs[ir->song];
-        vector *textnote = &s->notes[ir->note];
-        vector *patternnote = &pnotes[chosenvectors[i].patternpos];
-        node->key1 = ir->song;
-        node->key2 = ((int) (textnote->strt - patternnote->strt) << 8) +
-                (int) (textnote->ptch - patternnote->ptch) + NOTE_PITCHES;
-        node->pointer = ir;
-        pq_update(pq, node);
-        chosenvectors[i].t = 1;
-    }
-
-    /* Scan through the data and mark the location where the largest number
-     * of vectors are in the same relative positions as in the pattern. */
-    --vcount;
-    maxcount = 0;
-    while (1) {
-        pqnode *min = pq_getmin(pq);
-        i = min->index;
-        if ((min->key1 == songid) && (min->key2 == previous_key)) {
-            ++count;
-            if (count > maxcount) maxcount = count;
-        } else {
-            /* Check if the previous match was a good one */
-            if ((count == maxcount) && (count > 1)) {
-#ifdef ORDER_F4_F5_RESULTS_WITH_P2
-                alignment_check_p2(&songs[songid], previous_spos,
-                        pattern, previous_ppos, ms);
-#else
-                int match_start = (previous_key >> 8) + pnotes[0].strt;
-                int match_end = (previous_key >> 8) +
-                        pnotes[pattern->size - 1].strt +
-                        pnotes[pattern->size - 1].dur;
-                char transposition = (char) ((previous_key & 0xFF) -
-                        NOTE_PITCHES);
-                float similarity = ((float) maxcount) / ((float) vcount);
-
-                insert_match(ms, songid, match_start, match_end, transposition,
-                        similarity);
-#endif
-    /*printf("%d, %d\n", songid + 1, maxcount);*/
-            }
-            if (min->key1 == INT_MAX) break;
-            count = 0;
-            if (songid != min->key1) {
-                /* Next song, reset counter */
-                songid = min->key1;
-                maxcount = 0;
-            }
-            previous_key = min->key2;
-            previous_ppos = chosenvectors[i].patternpos;
-            previous_spos = ((indexrec *) min->pointer)->note;
-        }
-        if (chosenvectors[i].t < chosenvectors[i].iv->size) {    
-            indexrec *ir = &chosenvectors[i].iv->records[chosenvectors[i].t];
-            song *s = &songs[ir->song];
-            vector *textnote = &s->notes[ir->note];
-            vector *patternnote = &pnotes[chosenvectors[i].patternpos];
-            min->key1 = ir->song;
-            min->key2 = ((int) (textnote->strt - patternnote->strt) << 8) +
-                    (int) (textnote->ptch - patternnote->ptch) + NOTE_PITCHES;
-            min->pointer = ir;
-            pq_update(pq, min);
-            ++chosenvectors[i].t;
-        } else {
-            min->key1 = INT_MAX;
-            min->key2 = INT_MAX;
-            pq_update(pq, min);
-        }
-    }
+    scan_p2_vectors(sc, pattern, chosenvectors, vcount, ms);
     free(chosenvectors);
-    pq_free(pq);
 }
 
 
@@ -695,16 +1131,10 @@ void filter_p2_select_global(const songcollection *sc, const song *pattern,
     int i, j;
     int vcount = pattern->size * parameters->p2_window;
 
-    int songid = INT_MIN;
-    int previous_key = INT_MIN;
-    int previous_spos = -1;
-    int previous_ppos = -1;
     int count = 0;
     int maxcount;
     vector *pnotes = pattern->notes;
     vectorindex *vindex = sc->data[DATA_VINDEX];
-    pqroot *pq;
-    song *songs = sc->songs;
     patternvector *chosenvectors;
     int *bucket_size = (int *) malloc(vcount * sizeof(int));
     if (bucket_size == NULL) return;
@@ -724,9 +1154,10 @@ void filter_p2_select_global(const songcollection *sc, const song *pattern,
         for (j=i+1; j<=end; ++j) {
             int x = pattern->notes[j].strt - pattern->notes[i].strt;
             int y = pattern->notes[j].ptch - pattern->notes[i].ptch;
-            indexvector *iv = get_index_vector(vindex, x, y);
-            if (iv != NULL) {
-                bucket_size[vcount] = iv->size;
+            indexcursor cursor;
+            int size = open_index_vector(vindex, x, y, &cursor);
+            if (size > 0) {
+                bucket_size[vcount] = size;
                 ++vcount;
             }
         }
@@ -752,9 +1183,9 @@ void filter_p2_select_global(const songcollection *sc, const song *pattern,
         for (j=i+1; j<=end; ++j) {
             int x = pnotes[j].strt - pnotes[i].strt;
             int y = pnotes[j].ptch - pnotes[i].ptch;
-            indexvector *iv = get_index_vector(vindex, x, y);
-            if ((iv != NULL) && (iv->size <= maxcount)) {
-                chosenvectors[count].iv = iv;
+            indexcursor *cursor = &chosenvectors[count].cursor;
+            int size = open_index_vector(vindex, x, y, cursor);
+            if ((size > 0) && (size <= maxcount)) {
                 chosenvectors[count].patternpos = i;
                 chosenvectors[count].shift = (((int) pnotes[i].strt -
                     (int) pnotes[0].strt) << 8) +
@@ -769,84 +1200,259 @@ void filter_p2_select_global(const songcollection *sc, const song *pattern,
             }
         }
     }
-    /* Initialize a priority queue. */
-    pq = pq_create(vcount);
+    scan_p2_vectors(sc, pattern, chosenvectors, vcount, ms);
+    free(chosenvectors);
+}
 
-    /* Merge the location lists by inserting them to the priority queue. */
-    for (i=0; i<vcount; ++i) {
-        pqnode *node = pq_getnode(pq, i);
-        indexrec *ir = chosenvectors[i].iv->records;
-        song *s = &songs[ir->song];
-        vector *textnote = &s->notes[ir->note];
-        vector *patternnote = &pnotes[chosenvectors[i].patternpos];
-        node->key1 = ir->song;
-        node->key2 = ((int) (textnote->strt - patternnote->strt) << 8) +
-                (int) (textnote->ptch - patternnote->ptch) + NOTE_PITCHES;
-        node->pointer = ir;
-        pq_update(pq, node);
-        chosenvectors[i].t = 1;
+
+/**
+ * A pattern vector candidate in filter_p2_planned().
+ */
+typedef struct {
+    /* Index bucket size */
+    int size;
+    /* Position in the order of enumeration */
+    int order;
+    int i;
+    int j;
+} plannedvector;
+
+
+/**
+ * Compares planned vectors by their bucket sizes. Ties are resolved by
+ * the order of enumeration to keep the selection deterministic.
+ *
+ * @param a a plannedvector
+ * @param b another plannedvector
+ *
+ * @return negative if a should be used before b, positive otherwise
+ */
+static int compare_planned_vectors(const void *a, const void *b) {
+    const plannedvector *va = (const plannedvector *) a;
+    const plannedvector *vb = (const plannedvector *) b;
+    if (va->size != vb->size) return va->size - vb->size;
+    return va->order - vb->order;
+}
+
+
+/**
+ * Calculates a lower bound for the number of chosen vectors that remain
+ * intact when the given number of pattern notes are replaced with wrong
+ * ones. The worst case is that the notes with the most chosen vectors are
+ * wrong.
+ *
+ * @param histogram number of pattern notes for each count of chosen
+ *        vectors that use the note
+ * @param max_degree largest index in the histogram
+ * @param errors number of wrong notes to tolerate
+ * @param vcount number of chosen vectors
+ *
+ * @return the number of vectors that are guaranteed to survive
+ */
+static int surviving_vectors(const int *histogram, int max_degree,
+        int errors, int vcount) {
+    int d;
+    for (d=max_degree; (d > 0) && (errors > 0); --d) {
+        int n = MIN2(histogram[d], errors);
+        vcount -= n * d;
+        errors -= n;
     }
+    return MAX2(vcount, 0);
+}
 
-    /* Scan through the data and mark the location where the largest number
-     * of vectors are in the same relative positions as in the pattern. */
-    count = 0;
-    maxcount = 0;
-    --vcount;
-    while (1) {
-        pqnode *min = pq_getmin(pq);
-        i = min->index;
-        if ((min->key1 == songid) && (min->key2 == previous_key)) {
-            ++count;
-            if (count > maxcount) maxcount = count;
-        } else {
-            /* Check if the previous match was a good one */
-            if ((count == maxcount) && (count > 1)) {
-#ifdef ORDER_F4_F5_RESULTS_WITH_P2
-                alignment_check_p2(&songs[songid], previous_spos,
-                        pattern, previous_ppos, ms);
-#else
-                int match_start = (previous_key >> 8) + pnotes[0].strt;
-                int match_end = (previous_key >> 8) +
-                        pnotes[pattern->size - 1].strt +
-                        pnotes[pattern->size - 1].dur;
-                char transposition = (char) ((previous_key & 0xFF) -
-                        NOTE_PITCHES);
-                float similarity = ((float) maxcount) / ((float) vcount);
-                insert_match(ms, songid, match_start, match_end, transposition,
-                        similarity);
-#endif
-            }
-            if (min->key1 == INT_MAX) break;
 
-            count = 0;
-            if (songid != min->key1) {
-                /* Next song, reset counter */
-                songid = min->key1;
-                maxcount = 0;
+/**
+ * Index filter P2/F8, a cost-based planner for the P2 index filters.
+ * Bucket sizes of the pattern vectors are read from the index and used to
+ * estimate the number of index records read and candidate positions
+ * verified with alignment_check_p2() by two plans:
+ *
+ *  - Pigeonhole: as in P2/F6-greedy, disjoint vectors are chosen within
+ *    d_window notes, and the e+1 rarest ones are scanned so that a match
+ *    with at most e wrong notes always keeps one of them. Every record is
+ *    verified.
+ *
+ *  - Window: vectors within p2_window notes are scanned as in P2/F4, but
+ *    only the shortest prefix of the vectors sorted by bucket size that
+ *    keeps at least three vectors of a match with e wrong notes intact.
+ *    Records are merged with a priority queue and only positions where
+ *    three or more vectors coincide are verified.
+ *
+ * The tolerated number of wrong notes e is p2_select_threshold times the
+ * pattern size. The plan with the lower estimated cost is run. If neither
+ * plan can give the guarantee, all window vectors are scanned. The chosen
+ * plan and the estimates are added to ms->cost.
+ *
+ * @param sc a song collection
+ * @param pattern the input pattern to search for
+ * @param alg algorithm ID as defined in search.h; not used in this function
+ * @param parameters search parameters
+ * @param ms information about the found matches will be stored here
+ */
+void filter_p2_planned(const songcollection *sc, const song *pattern,
+        int alg, const searchparameters *parameters, matchset *ms) {
+    int i, j, k;
+    int m = pattern->size;
+    int errors = (int) (parameters->p2_select_threshold * (float) m);
+    int ph_count = 0, ph_needed, w_total = 0, w_count = 0;
+    double ph_records = 0.0, w_records = 0.0, w_checks;
+    double ph_cost, w_cost;
+    int ph_ok, w_ok = 0;
+    vector *pnotes = pattern->notes;
+    vectorindex *vindex = sc->data[DATA_VINDEX];
+    plannedvector *ph, *w;
+    int *degree, *histogram;
+    int max_degree = 2 * MAX2(parameters->p2_window, 1);
+    char *selected;
+
+    if (vindex == NULL) {
+        fputs("Error in filter_p2_planned(): song collection does not contain vectorindex data.\nUse update_song_collection_data() before calling this function.\n", stderr);
+        return;
+    }
+    if (m < 2) return;
+    if (errors < 0) errors = 0;
+    if (errors > m - 1) errors = m - 1;
+
+    ph = (plannedvector *) malloc(m * sizeof(plannedvector));
+    w = (plannedvector *) malloc(m * MAX2(parameters->p2_window, 1) *
+            sizeof(plannedvector));
+    degree = (int *) calloc(m, sizeof(int));
+    histogram = (int *) calloc(max_degree + 1, sizeof(int));
+    selected = (char *) calloc(m, sizeof(char));
+    if ((ph == NULL) || (w == NULL) || (degree == NULL) ||
+            (histogram == NULL) || (selected == NULL)) {
+        fputs("Error in filter_p2_planned(): failed to allocate memory\n",
+                stderr);
+        free(ph);
+        free(w);
+        free(degree);
+        free(histogram);
+        free(selected);
+        return;
+    }
+
+    /* Pigeonhole plan: disjoint vectors chosen greedily as in
+     * filter_p2_greedy_pigeonhole(). */
+    for (i=0; i<m-1; ++i) {
+        int end = i + parameters->d_window;
+        if (selected[i]) continue;
+        if (end >= m) end = m - 1;
+        ph[ph_count].size = 0;
+        for (j=i+1; j<=end; ++j) {
+            indexcursor cursor;
+            int size;
+            if (selected[j]) continue;
+            size = open_index_vector(vindex, pnotes[j].strt - pnotes[i].strt,
+                    pnotes[j].ptch - pnotes[i].ptch, &cursor);
+            if ((size > 0) && ((ph[ph_count].size == 0) ||
+                    (size < ph[ph_count].size))) {
+                ph[ph_count].size = size;
+                ph[ph_count].order = ph_count;
+                ph[ph_count].i = i;
+                ph[ph_count].j = j;
             }
-            previous_key = min->key2;
-            previous_ppos = chosenvectors[i].patternpos;
-            previous_spos = ((indexrec *) min->pointer)->note;
         }
-        if (chosenvectors[i].t < chosenvectors[i].iv->size) {    
-            indexrec *ir = &chosenvectors[i].iv->records[chosenvectors[i].t];
-            song *s = &songs[ir->song];
-            vector *textnote = &s->notes[ir->note];
-            vector *patternnote = &pnotes[chosenvectors[i].patternpos];
-            min->key1 = ir->song;
-            min->key2 = ((int) (textnote->strt - patternnote->strt) << 8) +
-                    (int) (textnote->ptch - patternnote->ptch) + NOTE_PITCHES;
-            min->pointer = ir;
-            pq_update(pq, min);
-            ++chosenvectors[i].t;
+        if (ph[ph_count].size > 0) {
+            selected[ph[ph_count].j] = 1;
+            ++ph_count;
+        }
+    }
+    qsort(ph, ph_count, sizeof(plannedvector), compare_planned_vectors);
+    ph_needed = errors + 1;
+    ph_ok = (ph_count >= ph_needed);
+    for (k=0; k<MIN2(ph_count, ph_needed); ++k)
+        ph_records += (double) ph[k].size;
+    /* Every record is verified in O(m) time */
+    ph_cost = ph_records * (double) m;
+
+    /* Window plan: all vectors within the window, rarest first. */
+    for (i=0; i<m-1; ++i) {
+        int end = i + parameters->p2_window;
+        if (end >= m) end = m - 1;
+        for (j=i+1; j<=end; ++j) {
+            indexcursor cursor;
+            int size = open_index_vector(vindex,
+                    pnotes[j].strt - pnotes[i].strt,
+                    pnotes[j].ptch - pnotes[i].ptch, &cursor);
+            if (size > 0) {
+                w[w_total].size = size;
+                w[w_total].order = w_total;
+                w[w_total].i = i;
+                w[w_total].j = j;
+                ++w_total;
+            }
+        }
+    }
+    qsort(w, w_total, sizeof(plannedvector), compare_planned_vectors);
+    histogram[0] = m;
+    for (k=0; k<w_total; ++k) {
+        --histogram[degree[w[k].i]];
+        ++histogram[++degree[w[k].i]];
+        --histogram[degree[w[k].j]];
+        ++histogram[++degree[w[k].j]];
+        w_records += (double) w[k].size;
+        w_count = k + 1;
+        if ((w_count >= 3) && (surviving_vectors(histogram, max_degree,
+                errors, w_count) >= 3)) {
+            w_ok = 1;
+            break;
+        }
+    }
+    /* Overestimate: each alignment of all chosen vectors is verified */
+    w_checks = (w_count > 0) ? w_records / (double) w_count : 0.0;
+    w_cost = w_records * log2((double) w_count + 1.0) +
+            w_checks * (double) m;
+
+    if (ph_ok && (!w_ok || (ph_cost <= w_cost))) {
+        ms->cost.plan = P2_PLAN_PIGEONHOLE;
+        ms->cost.estimated_records += ph_records;
+        ms->cost.estimated_checks += ph_records;
+        /* ph is sorted by bucket size, so the rarest vectors go first */
+        for (k=0; k<ph_needed; ++k) {
+            indexcursor cursor;
+            int size = open_index_vector(vindex,
+                    pnotes[ph[k].j].strt - pnotes[ph[k].i].strt,
+                    pnotes[ph[k].j].ptch - pnotes[ph[k].i].ptch, &cursor);
+            check_p2_records(sc, pattern, &cursor, size, ph[k].i, ms);
+        }
+    } else if (w_total > 0) {
+        patternvector *chosenvectors = (patternvector *) malloc(w_count *
+                sizeof(patternvector));
+        if (chosenvectors == NULL) {
+            fputs("Error in filter_p2_planned(): failed to allocate memory\n",
+                    stderr);
         } else {
-            min->key1 = INT_MAX;
-            min->key2 = INT_MAX;
-            pq_update(pq, min);
+            ms->cost.plan = P2_PLAN_WINDOW;
+            ms->cost.estimated_records += w_records;
+            ms->cost.estimated_checks += w_checks;
+
+            /* Scan in the order of enumeration, as P2/F4 does. With equal
+             * sizes the vectors are sorted by their enumeration order. */
+            for (k=0; k<w_count; ++k) w[k].size = 0;
+            qsort(w, w_count, sizeof(plannedvector), compare_planned_vectors);
+            for (k=0; k<w_count; ++k) {
+                i = w[k].i;
+                j = w[k].j;
+                open_index_vector(vindex, pnotes[j].strt - pnotes[i].strt,
+                        pnotes[j].ptch - pnotes[i].ptch,
+                        &chosenvectors[k].cursor);
+                chosenvectors[k].patternpos = i;
+                chosenvectors[k].shift = (((int) pnotes[i].strt -
+                        (int) pnotes[0].strt) << 8) +
+                        (int) pnotes[i].ptch -
+                        (int) pnotes[0].ptch + NOTE_PITCHES;
+                chosenvectors[k].t = 0;
+            }
+            scan_p2_vectors(sc, pattern, chosenvectors, w_count, ms);
+            free(chosenvectors);
         }
     }
-    free(chosenvectors);
-    pq_free(pq);
+
+    free(ph);
+    free(w);
+    free(degree);
+    free(histogram);
+    free(selected);
 }
 
 
@@ -885,27 +1491,28 @@ void filter_p2_points(const songcollection *sc, const song *pattern,
         int smallestcount = INT_MAX;
         int smallestpos = -1;
         int ppos = -1;
-        indexvector *smallestiv;
+        indexcursor smallestcursor;
         for (i=0; i<num_points; ++i) {
             int j;
             for (j=i+1; j<num_points; ++j) {
                 int x, y;
                 int pj = points[j];
                 int pi = points[i];
-                indexvector *iv;
+                int size;
+                indexcursor cursor;
                 if (pj >= pi + parameters->d_window) break;
                 x = pnotes[pj].strt - pnotes[pi].strt;
                 y = pnotes[pj].ptch - pnotes[pi].ptch;
-                iv = get_index_vector(vindex, x, y);
-                if ((iv != NULL) && (iv->size < smallestcount)) {
-                    smallestcount = iv->size;
-                    smallestiv = iv;
+                size = open_index_vector(vindex, x, y, &cursor);
+                if ((size > 0) && (size < smallestcount)) {
+                    smallestcount = size;
+                    smallestcursor = cursor;
                     ppos = pi;
                 }
             }
         }
         if (smallestpos >= 0) {
-            chosenvectors[vcount].iv = smallestiv;
+            chosenvectors[vcount].cursor = smallestcursor;
             chosenvectors[vcount].patternpos = ppos;
             chosenvectors[vcount].shift = (((int) pnotes[ppos].strt -
                     (int) pnotes[0].strt) << 8) +
@@ -926,7 +1533,6 @@ void filter_p2_points(const songcollection *sc, const song *pattern,
         if (end >= pattern->size) end = pattern->size - 1;
         for (i=start; i<=end; ++i) {
             int x, y, pstart;
-            indexvector *iv;
             /*printf("%d %d %d %d\n", i, p, start, end);*/
             if (i < p) {
                 pstart = i;
@@ -937,9 +1543,8 @@ void filter_p2_points(const songcollection *sc, const song *pattern,
                 x = pnotes[i].strt - pnotes[p].strt;
                 y = pnotes[i].ptch - pnotes[p].ptch;
             } else continue;
-            iv = get_index_vector(vindex, x, y);
-            if (iv != NULL) {
-                chosenvectors[vcount].iv = iv;
+            if (open_index_vector(vindex, x, y,
+                    &chosenvectors[vcount].cursor) > 0) {
                 chosenvectors[vcount].patternpos = pstart;
                 chosenvectors[vcount].shift = (((int) pnotes[pstart].strt -
                     (int) pnotes[0].strt) << 8) +
@@ -949,14 +1554,10 @@ void filter_p2_points(const songcollection *sc, const song *pattern,
             }
         }
         for (i=0; i<vcount; ++i) {
-            int j;
-            indexvector *iv = chosenvectors[i].iv;
+            indexcursor *cursor = &chosenvectors[i].cursor;
             /*printf("%d: %d\n", i, chosenvectors[i].patternpos);*/
-            for (j=0; j<iv->size; ++j) {
-                alignment_check_p2(&songs[iv->records[j].song],
-                        iv->records[j].note, pattern,
-                        chosenvectors[i].patternpos, ms);
-            }
+            check_p2_records(sc, pattern, cursor, cursor->size,
+                    chosenvectors[i].patternpos, ms);
         }
     } else {
         song subpat;
@@ -973,11 +1574,12 @@ void filter_p2_points(const songcollection *sc, const song *pattern,
  
         for (i=0; i<vcount; ++i) {
             int j;
-            indexvector *iv = chosenvectors[i].iv;
+            indexcursor *cursor = &chosenvectors[i].cursor;
             /*printf("%d: %d\n", i, chosenvectors[i].patternpos);*/
-            for (j=0; j<iv->size; ++j) {
-                song *s = &songs[iv->records[j].song];
-                int spos = iv->records[j].note;
+            for (j=0; j<cursor->size; ++j) {
+                const wideindexrec *r = read_index_record(cursor);
+                song *s = &songs[r->song];
+                int spos = r->note;
                 int ppos = chosenvectors[i].patternpos;
                 if (alignment_check_p1(s, spos, pattern, ppos, NULL))
                     alignment_check_p2(s, spos, pattern, ppos, ms);
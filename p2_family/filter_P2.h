@@ -44,6 +44,11 @@ extern "C" {
 #endif
 
 
+/* Plans chosen by filter_p2_planned(), stored in matchset.cost.plan */
+#define P2_PLAN_PIGEONHOLE 1
+#define P2_PLAN_WINDOW 2
+
+
 /**
  * A helper structure used by some index-accessing methods.
  */
@@ -52,30 +57,37 @@ typedef struct {
     int indexpos;
     int indexsize;
     indexrec *rec;*/
-    indexvector *iv;
     int patternpos;
     int shift;
     int t;
+    /* Cursor for the records of the vector; cursor.size is the number
+     * of records */
+    indexcursor cursor;
 } patternvector;
 
 
 void filter_p2_greedy_pigeonhole(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms);
 
-#ifdef ENABLE_BLOSSOM4
 void filter_p2_pigeonhole(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms);
-#endif
 
 void filter_p2_window(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms);
 
+void filter_p2_window_batch(const songcollection *sc,
+        const songcollection *patterns, const searchparameters *parameters,
+        matchset *ms, int num_threads);
+
 void filter_p2_select_local(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms);
 
 void filter_p2_select_global(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms);
 
+void filter_p2_planned(const songcollection *sc, const song *pattern,
+        int alg, const searchparameters *parameters, matchset *ms);
+
 void filter_p2_points(const songcollection *sc, const song *pattern,
         int alg, const searchparameters *parameters, matchset *ms);
 
@@ -43,6 +43,7 @@
 #include "search.h"
 #include "song.h"
 #include "geometric_P1.h"
+#include "util.h"
 
 
 /**
@@ -153,25 +154,93 @@ int scan_song_p1(const song *s, const song *p, matchset *ms) {
 
 
 /**
- * Checks if there is an exact match to a pattern in the given position.
+ * Stores an exact match that was found with the P1 alignment check.
+ *
+ * @param s a song
+ * @param p the matching pattern
+ * @param first position of the first matching note in the song
+ * @param end position of the last matching note in the song
+ * @param ms structure where the match information is stored to. If NULL,
+ *        nothing is stored.
+ *
+ * @return match information item, or 1 cast to a match pointer if ms is NULL
+ */
+static match *report_alignment_p1(const song *s, const song *p, int first,
+        int end, matchset *ms) {
+    int i, j, p0, v0;
+    vector *pnotes = p->notes;
+    vector *snotes = s->notes;
+    match *m;
+
+    j = first;
+    if (ms == NULL) return (match *) 1;
+
+    m = insert_match(ms, s->id, snotes[j].strt,
+            snotes[end].strt + snotes[end].dur,
+            snotes[j].ptch - pnotes[0].ptch, 1.0F);
+    if (m == NULL) return NULL;
+
+    /* Match found */
+/*    if (ms->num_matches >= ms->size) i = ms->size - 1;
+    else {
+        i = ms->num_matches;
+        ++ms->num_matches;
+    }
+
+    m = &ms->matches[i];
+    m->song = s->id;
+    m->start = snotes[j].strt;
+    m->end = snotes[end].strt + snotes[end].dur;
+    m->transposition = snotes[j].ptch - pnotes[0].ptch;
+    m->similarity = 1.0F;
+*/
+    /* Find out matching note positions if they are requested */
+    if ((m->num_notes > 0) && (m->notes != NULL)) {
+        m->notes[0] = j;
+        p0 = ((int) pnotes[0].strt << 8) +
+                (int) pnotes[0].ptch;
+        v0 = ((int) snotes[j].strt << 8) +
+                (int) snotes[j].ptch;
+
+        /*if (m->num_notes > p->size) m->num_notes = p->size;*/
+        for (i = 1; i < m->num_notes; ++i) {
+            int pi = ((int) pnotes[i].strt << 8) + (int) pnotes[i].ptch - p0;
+            int vi;
+
+            /* Skip over notes that are not in the pattern. */
+            do {
+                ++j;
+                if (j >= s->size) return m;
+                vi = ((int) snotes[j].strt << 8) + (int) snotes[j].ptch - v0;
+            } while (vi < pi);
+
+            /* Is there a matching note? If not, exit. */
+            if (vi != pi) return m;
+            m->notes[i] = j;
+        }
+    }
+    return m;
+}
+
+
+/**
+ * Finds the notes of an exact match to a pattern in the given position.
  *
  * @param s a song
  * @param songpos position in the song
  * @param p pattern to match
  * @param patternpos position in the pattern that aligns with songpos
- * @param ms structure where the match information is stored to
+ * @param first position of the first matching note is stored here
+ * @param end position of the last matching note is stored here
  *
- * @return match information item
+ * @return 1 if there is a match, 0 otherwise
  */
-match *alignment_check_p1(const song *s, unsigned short songpos,
-        const song *p, unsigned short patternpos, matchset *ms) {
+static int find_alignment_p1(const song *s, int songpos, const song *p,
+        int patternpos, int *first, int *end) {
 
-    int i, j, p0, v0, end;
+    int i, j, p0, v0;
     vector *pnotes = p->notes;
     vector *snotes = s->notes;
-    match *m;
-
-    if ((songpos >= s->size) || (patternpos >= p->size)) return NULL;
 
     /* Scan the end */
     i = patternpos + 1;
@@ -187,14 +256,14 @@ match *alignment_check_p1(const song *s, unsigned short songpos,
         /* Skip over notes that are not in the pattern. */
         do {
             ++j;
-            if (j >= s->size) return NULL;
+            if (j >= s->size) return 0;
             vi = ((int) snotes[j].strt << 8) + (int) snotes[j].ptch - v0;
         } while (vi < pi);
 
         /* Is there a matching note? If not, exit. */
-        if (vi != pi) return NULL;
+        if (vi != pi) return 0;
     }
-    end = j;
+    *end = j;
 
     /* Scan the beginning */
     i = patternpos - 1;
@@ -206,61 +275,182 @@ match *alignment_check_p1(const song *s, unsigned short songpos,
         /* Skip over notes that are not in the pattern. */
         do {
             --j;
-            if (j < 0) return NULL;
+            if (j < 0) return 0;
             vi = v0 - ((int) snotes[j].strt << 8) - (int) snotes[j].ptch;
         } while (vi < pi);
 
         /* Is there a matching note? If not, exit. */
-        if (vi != pi) return NULL;
+        if (vi != pi) return 0;
     }
 
-    if (ms == NULL) return (match *) 1;
+    *first = j;
+    return 1;
+}
 
-    m = insert_match(ms, s->id, snotes[j].strt,
-            snotes[end].strt + snotes[end].dur,
-            snotes[j].ptch - pnotes[0].ptch, 1.0F);
-    if (m == NULL) return NULL;
 
-    /* Match found */
-/*    if (ms->num_matches >= ms->size) i = ms->size - 1;
-    else {
-        i = ms->num_matches;
-        ++ms->num_matches;
+/**
+ * Checks if there is an exact match to a pattern in the given position.
+ *
+ * @param s a song
+ * @param songpos position in the song
+ * @param p pattern to match
+ * @param patternpos position in the pattern that aligns with songpos
+ * @param ms structure where the match information is stored to
+ *
+ * @return match information item
+ */
+match *alignment_check_p1(const song *s, int songpos,
+        const song *p, int patternpos, matchset *ms) {
+    int first, end;
+
+    if ((songpos < 0) || (patternpos < 0) || (songpos >= s->size) ||
+            (patternpos >= p->size)) return NULL;
+
+    if (!find_alignment_p1(s, songpos, p, patternpos, &first, &end))
+        return NULL;
+    return report_alignment_p1(s, p, first, end, ms);
+}
+
+
+/**
+ * Finds the notes of an exact match like find_alignment_p1(), but compares
+ * the packed keys of the song notes four at a time.
+ *
+ * @param k song keys of the song
+ * @param songpos position in the song
+ * @param pkeys packed keys of the pattern notes
+ * @param psize pattern size
+ * @param patternpos position in the pattern that aligns with songpos
+ * @param first position of the first matching note is stored here
+ * @param end position of the last matching note is stored here
+ *
+ * @return 1 if there is a match, 0 otherwise
+ */
+static int find_alignment_p1_keys(songkeys *k, int songpos,
+        const int *pkeys, int psize, int patternpos, int *first, int *end) {
+    int j, l;
+    int p0 = pkeys[patternpos];
+    int v0 = song_key(k, songpos);
+
+    /* Scan the end */
+    j = songpos;
+    for (l=patternpos+1; l<psize; ++l) {
+        int pi = pkeys[l] - p0;
+        j = next_song_key(k, j, v0, pi);
+        if ((j >= k->s->size) || (k->keys[j] - v0 != pi)) return 0;
     }
+    *end = j;
 
-    m = &ms->matches[i];
-    m->song = s->id;
-    m->start = snotes[j].strt;
-    m->end = snotes[end].strt + snotes[end].dur;
-    m->transposition = snotes[j].ptch - pnotes[0].ptch;
-    m->similarity = 1.0F;
-*/
-    /* Find out matching note positions if they are requested */
-    if ((m->num_notes > 0) && (m->notes != NULL)) {
-        m->notes[0] = j;
-        p0 = ((int) pnotes[0].strt << 8) +
-                (int) pnotes[0].ptch;
-        v0 = ((int) snotes[j].strt << 8) +
-                (int) snotes[j].ptch;
+    /* Scan the beginning */
+    j = songpos;
+    for (l=patternpos-1; l>=0; --l) {
+        int pi = p0 - pkeys[l];
+        j = previous_song_key(k, j, v0, pi);
+        if ((j < 0) || (v0 - k->keys[j] != pi)) return 0;
+    }
+    *first = j;
+    return 1;
+}
 
-        /*if (m->num_notes > p->size) m->num_notes = p->size;*/
-        for (i = 1; i < m->num_notes; ++i) {
-            int pi = ((int) pnotes[i].strt << 8) + (int) pnotes[i].ptch - p0;
-            int vi;
 
-            /* Skip over notes that are not in the pattern. */
-            do {
-                ++j;
-                if (j >= s->size) return m;
-                vi = ((int) snotes[j].strt << 8) + (int) snotes[j].ptch - v0;
-            } while (vi < pi);
+/**
+ * Batched version of alignment_check_p1(). Candidates are verified in
+ * blocks of ALIGNMENT_BATCH_SIZE in the order of songs and song positions.
+ * When at least ALIGNMENT_SHARED_KEYS candidates fall into the same song,
+ * the packed keys of its notes are computed once and compared four at a
+ * time (see next_song_key()). The matches are then stored in the original
+ * order of the candidates, so the results are the same as calling
+ * alignment_check_p1() for each candidate until the match set is full.
+ *
+ * @param sc a song collection
+ * @param p pattern to match
+ * @param c candidate positions
+ * @param n number of candidates
+ * @param ms structure where the match information is stored to
+ *
+ * @return 1 if the match set became full, 0 otherwise
+ */
+int alignment_check_p1_batch(const songcollection *sc, const song *p,
+        const alignmentcandidate *c, int n, matchset *ms) {
+    int b, i;
+    int full = 0;
+    int order[ALIGNMENT_BATCH_SIZE];
+    int first[ALIGNMENT_BATCH_SIZE];
+    int last[ALIGNMENT_BATCH_SIZE];
+    int *pkeys;
+    songkeys k;
+
+    /* Small batches are not worth sorting */
+    if (n < ALIGNMENT_SHARED_KEYS) {
+        for (i=0; i<n; ++i) {
+            if ((alignment_check_p1(&sc->songs[c[i].song], c[i].songpos, p,
+                    c[i].patternpos, ms) != NULL) &&
+                    (ms->num_matches == ms->size)) return 1;
+        }
+        return 0;
+    }
 
-            /* Is there a matching note? If not, exit. */
-            if (vi != pi) return m;
-            m->notes[i] = j;
+    pkeys = (int *) malloc(p->size * sizeof(int));
+    init_song_keys(&k);
+    if (pkeys == NULL) {
+        fputs("Error in alignment_check_p1_batch(): failed to allocate memory\n",
+                stderr);
+        return 0;
+    }
+    for (i=0; i<p->size; ++i)
+        pkeys[i] = ((int) p->notes[i].strt << 8) + (int) p->notes[i].ptch;
+
+    for (b=0; b<n; b+=ALIGNMENT_BATCH_SIZE) {
+        const alignmentcandidate *cb = &c[b];
+        int bn = MIN2(n - b, ALIGNMENT_BATCH_SIZE);
+        int g, gend;
+        if (!sort_alignment_candidates(cb, bn, order)) goto EXIT;
+
+        for (g=0; g<bn; g=gend) {
+            const song *s = &sc->songs[cb[order[g]].song];
+            int shared;
+
+            for (gend=g+1; (gend < bn) &&
+                    (cb[order[gend]].song == cb[order[g]].song); ++gend);
+            shared = (gend - g >= ALIGNMENT_SHARED_KEYS);
+            if (shared && !set_song_keys(&k, s)) goto EXIT;
+
+            for (i=g; i<gend; ++i) {
+                int o = order[i];
+                int songpos = cb[o].songpos;
+                int patternpos = cb[o].patternpos;
+                int found;
+
+                first[o] = -1;
+                if ((songpos < 0) || (patternpos < 0) ||
+                        (songpos >= s->size) || (patternpos >= p->size))
+                    continue;
+                if (shared) {
+                    found = find_alignment_p1_keys(&k, songpos, pkeys,
+                            p->size, patternpos, &first[o], &last[o]);
+                } else {
+                    found = find_alignment_p1(s, songpos, p, patternpos,
+                            &first[o], &last[o]);
+                }
+                if (!found) first[o] = -1;
+            }
+        }
+
+        /* Store the matches in the original order */
+        for (i=0; i<bn; ++i) {
+            if (first[i] < 0) continue;
+            if ((report_alignment_p1(&sc->songs[cb[i].song], p, first[i],
+                    last[i], ms) != NULL) && (ms->num_matches == ms->size)) {
+                full = 1;
+                goto EXIT;
+            }
         }
     }
-    return m;
+
+EXIT:
+    free_song_keys(&k);
+    free(pkeys);
+    return full;
 }
 
 
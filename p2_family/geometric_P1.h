@@ -45,8 +45,11 @@ void alg_p1(const songcollection *sc, const song *pattern, int alg,
 
 int scan_song_p1(const song *s, const song *p, matchset *ms);
 
-match *alignment_check_p1(const song *s, unsigned short songpos,
-        const song *p, unsigned short patternpos, matchset *ms);
+match *alignment_check_p1(const song *s, int songpos,
+        const song *p, int patternpos, matchset *ms);
+
+int alignment_check_p1_batch(const songcollection *sc, const song *p,
+        const alignmentcandidate *c, int n, matchset *ms);
 
 #ifdef __cplusplus
 }
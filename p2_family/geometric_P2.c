@@ -61,11 +61,6 @@ void alg_p2(const songcollection *sc, const song *pattern, int alg,
     song *q_pattern = NULL;
     const song *pat;
 
-    if (!init_match_set(ms, 500000, 0, 0)) {
-    
-        fprintf(stderr, "Error to allocate memory \n");
-    }
-
     if (parameters->quantization > 0) {
         q_pattern = p2_compensate_quantization(pattern,
                 parameters->quantization);
@@ -141,6 +136,8 @@ song *p2_compensate_quantization(const song *p, const int q) {
 
     if (newp == NULL) return NULL;
     memcpy(newp, p, sizeof(song));
+    /* The title belongs to the original pattern; free_song() skips it */
+    newp->title = NULL;
     newp->size = p->size * COMPENSATION_FACTOR;
     newp->notes = (vector *) malloc(newp->size *
             sizeof(vector));
@@ -345,22 +342,22 @@ int scan_song_p2(const song *s, const song *p, const int errors,
 
 
 /**
- * Counts the number of matching notes for a given pattern and data
- * position.
+ * Stores a match that was found with the P2 alignment check.
  *
  * @param s a song
  * @param songpos position in the song
  * @param p pattern to match
  * @param patternpos position in the pattern that aligns with songpos
+ * @param count number of matching notes
+ * @param first position of the first matching note in the song, or the
+ *        position where the backward scan stopped
  * @param ms structure where the match information is stored to
  *
  * @return match information item
  */
-match *alignment_check_p2(const song *s, unsigned short songpos,
-        const song *p, unsigned short patternpos, matchset *ms) {
-
-    int i, j, end, count;
-    int p0, v0;
+static match *report_alignment_p2(const song *s, int songpos, const song *p,
+        int patternpos, int count, int first, matchset *ms) {
+    int i, j, p0, v0;
     int mstart, mend;
     char mtransposition;
     float msimilarity;
@@ -368,7 +365,61 @@ match *alignment_check_p2(const song *s, unsigned short songpos,
     vector *snotes = s->notes;
     match *m;
 
-    if ((songpos >= s->size) || (patternpos >= p->size)) return NULL;
+    mstart = snotes[songpos].strt - pnotes[patternpos].strt;
+    mend = mstart + pnotes[p->size-1].strt + pnotes[p->size-1].dur;
+    mtransposition = snotes[songpos].ptch - pnotes[patternpos].ptch;
+    msimilarity = ((float) count) / ((float) p->size);
+    m = insert_match(ms, s->id, mstart, mend, mtransposition, msimilarity);
+
+    /* Find out matching note positions if they are requested */
+    if ((m != NULL) && (m->num_notes > 0) && (m->notes != NULL)) {
+        j = first;
+        m->notes[0] = j;
+        p0 = ((int) pnotes[0].strt << 8) +
+                (int) pnotes[0].ptch;
+        v0 = ((int) snotes[j].strt << 8) +
+                (int) snotes[j].ptch;
+
+        /*if (m->num_notes > p->size) m->num_notes = p->size;*/
+        for (i = 1; i < m->num_notes; ++i) {
+            int pi = ((int) pnotes[i].strt << 8) + (int) pnotes[i].ptch - p0;
+            int vi;
+
+            /* Skip over notes that are not in the pattern. */
+            do {
+                ++j;
+                if (j >= s->size) return m;
+                vi = ((int) snotes[j].strt << 8) + (int) snotes[j].ptch - v0;
+            } while (vi < pi);
+
+            /* Is there a matching note? If not, exit. */
+            if (vi != pi) m->notes[i] = -1;
+            else m->notes[i] = j;
+        }
+    }
+    return m;
+}
+
+
+/**
+ * Counts the number of matching notes for a given pattern and data
+ * position.
+ *
+ * @param s a song
+ * @param songpos position in the song
+ * @param p pattern to match
+ * @param patternpos position in the pattern that aligns with songpos
+ * @param first the position where the backward scan stopped is stored here
+ *
+ * @return number of matching notes
+ */
+static int count_alignment_p2(const song *s, int songpos, const song *p,
+        int patternpos, int *first) {
+
+    int i, j, count;
+    int p0, v0;
+    vector *pnotes = p->notes;
+    vector *snotes = s->notes;
 
     /* Scan the end */
     count = 1;
@@ -395,7 +446,6 @@ match *alignment_check_p2(const song *s, unsigned short songpos,
         if (vi == pi) ++count;
         else --j;
     }
-    end = j;
 
     /* Scan the beginning */
     i = patternpos - 1;
@@ -415,38 +465,170 @@ match *alignment_check_p2(const song *s, unsigned short songpos,
         else ++j;
     }
 
-    mstart = snotes[songpos].strt - pnotes[patternpos].strt;
-    mend = mstart + pnotes[p->size-1].strt + pnotes[p->size-1].dur;
-    mtransposition = snotes[songpos].ptch - pnotes[patternpos].ptch;
-    msimilarity = ((float) count) / ((float) p->size);
-    m = insert_match(ms, s->id, mstart, mend, mtransposition, msimilarity);
+    *first = j;
+    return count;
+}
 
-    /* Find out matching note positions if they are requested */
-    if ((m != NULL) && (m->num_notes > 0) && (m->notes != NULL)) {
-        m->notes[0] = j;
-        p0 = ((int) pnotes[0].strt << 8) +
-                (int) pnotes[0].ptch;
-        v0 = ((int) snotes[j].strt << 8) +
-                (int) snotes[j].ptch;
 
-        /*if (m->num_notes > p->size) m->num_notes = p->size;*/
-        for (i = 1; i < m->num_notes; ++i) {
-            int pi = ((int) pnotes[i].strt << 8) + (int) pnotes[i].ptch - p0;
-            int vi;
+/**
+ * Counts the number of matching notes for a given pattern and data
+ * position.
+ *
+ * @param s a song
+ * @param songpos position in the song
+ * @param p pattern to match
+ * @param patternpos position in the pattern that aligns with songpos
+ * @param ms structure where the match information is stored to
+ *
+ * @return match information item
+ */
+match *alignment_check_p2(const song *s, int songpos,
+        const song *p, int patternpos, matchset *ms) {
+    int count, first;
 
-            /* Skip over notes that are not in the pattern. */
-            do {
-                ++j;
-                if (j >= s->size) return m;
-                vi = ((int) snotes[j].strt << 8) + (int) snotes[j].ptch - v0;
-            } while (vi < pi);
+    if ((songpos < 0) || (patternpos < 0) || (songpos >= s->size) ||
+            (patternpos >= p->size)) return NULL;
 
-            /* Is there a matching note? If not, exit. */
-            if (vi != pi) m->notes[i] = -1;
-            else m->notes[i] = j;
+    count = count_alignment_p2(s, songpos, p, patternpos, &first);
+    return report_alignment_p2(s, songpos, p, patternpos, count, first, ms);
+}
+
+
+/**
+ * Counts the number of matching notes like count_alignment_p2(), but
+ * compares the packed keys of the song notes four at a time.
+ *
+ * @param k song keys of the song
+ * @param songpos position in the song
+ * @param pkeys packed keys of the pattern notes
+ * @param psize pattern size
+ * @param patternpos position in the pattern that aligns with songpos
+ * @param first the position where the backward scan stopped is stored here
+ *
+ * @return number of matching notes
+ */
+static int count_alignment_p2_keys(songkeys *k, int songpos,
+        const int *pkeys, int psize, int patternpos, int *first) {
+    int j, l;
+    int count = 1;
+    int p0 = pkeys[patternpos];
+    int v0 = song_key(k, songpos);
+
+    /* Scan the end */
+    j = songpos;
+    for (l=patternpos+1; l<psize; ++l) {
+        int pi = pkeys[l] - p0;
+        int next = next_song_key(k, j, v0, pi);
+        if ((next < k->s->size) && (k->keys[next] - v0 == pi)) {
+            ++count;
+            j = next;
+        } else j = next - 1;
+    }
+
+    /* Scan the beginning */
+    j = songpos;
+    for (l=patternpos-1; l>=0; --l) {
+        int pi = p0 - pkeys[l];
+        int prev = previous_song_key(k, j, v0, pi);
+        if ((prev >= 0) && (v0 - k->keys[prev] == pi)) {
+            ++count;
+            j = prev;
+        } else j = prev + 1;
+    }
+    *first = j;
+    return count;
+}
+
+
+/**
+ * Batched version of alignment_check_p2(). Candidates are verified in
+ * blocks of ALIGNMENT_BATCH_SIZE in the order of songs and song positions,
+ * which keeps the song notes in cache. When at least
+ * ALIGNMENT_SHARED_KEYS candidates fall into the same song, the packed keys
+ * of its notes are computed once and compared four at a time (see
+ * next_song_key()). The matches are then stored in the original order of
+ * the candidates, so the results are the same as calling
+ * alignment_check_p2() for each candidate.
+ *
+ * @param sc a song collection
+ * @param p pattern to match
+ * @param c candidate positions
+ * @param n number of candidates
+ * @param ms structure where the match information is stored to
+ */
+void alignment_check_p2_batch(const songcollection *sc, const song *p,
+        const alignmentcandidate *c, int n, matchset *ms) {
+    int b, i;
+    int order[ALIGNMENT_BATCH_SIZE];
+    int count[ALIGNMENT_BATCH_SIZE];
+    int first[ALIGNMENT_BATCH_SIZE];
+    int *pkeys;
+    songkeys k;
+
+    /* Small batches are not worth sorting */
+    if (n < ALIGNMENT_SHARED_KEYS) {
+        for (i=0; i<n; ++i) {
+            alignment_check_p2(&sc->songs[c[i].song], c[i].songpos, p,
+                    c[i].patternpos, ms);
         }
+        return;
     }
-    return m;
+
+    pkeys = (int *) malloc(p->size * sizeof(int));
+    init_song_keys(&k);
+    if (pkeys == NULL) {
+        fputs("Error in alignment_check_p2_batch(): failed to allocate memory\n",
+                stderr);
+        return;
+    }
+    for (i=0; i<p->size; ++i)
+        pkeys[i] = ((int) p->notes[i].strt << 8) + (int) p->notes[i].ptch;
+
+    for (b=0; b<n; b+=ALIGNMENT_BATCH_SIZE) {
+        const alignmentcandidate *cb = &c[b];
+        int bn = MIN2(n - b, ALIGNMENT_BATCH_SIZE);
+        int g, gend;
+        if (!sort_alignment_candidates(cb, bn, order)) goto EXIT;
+
+        for (g=0; g<bn; g=gend) {
+            const song *s = &sc->songs[cb[order[g]].song];
+            int shared;
+
+            for (gend=g+1; (gend < bn) &&
+                    (cb[order[gend]].song == cb[order[g]].song); ++gend);
+            shared = (gend - g >= ALIGNMENT_SHARED_KEYS);
+            if (shared && !set_song_keys(&k, s)) goto EXIT;
+
+            for (i=g; i<gend; ++i) {
+                int o = order[i];
+                int songpos = cb[o].songpos;
+                int patternpos = cb[o].patternpos;
+
+                count[o] = 0;
+                if ((songpos < 0) || (patternpos < 0) ||
+                        (songpos >= s->size) || (patternpos >= p->size))
+                    continue;
+                if (shared) {
+                    count[o] = count_alignment_p2_keys(&k, songpos, pkeys,
+                            p->size, patternpos, &first[o]);
+                } else {
+                    count[o] = count_alignment_p2(s, songpos, p, patternpos,
+                            &first[o]);
+                }
+            }
+        }
+
+        /* Store the matches in the original order */
+        for (i=0; i<bn; ++i) {
+            if (count[i] == 0) continue;
+            report_alignment_p2(&sc->songs[cb[i].song], cb[i].songpos, p,
+                    cb[i].patternpos, count[i], first[i], ms);
+        }
+    }
+
+EXIT:
+    free_song_keys(&k);
+    free(pkeys);
 }
 
 
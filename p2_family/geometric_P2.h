@@ -53,8 +53,11 @@ int scan_song_p2(const song *s, const song *p, const int errors,
 
 song *p2_compensate_quantization(const song *p, const int q);
 
-match *alignment_check_p2(const song *s, unsigned short songpos,
-        const song *p, unsigned short patternpos, matchset *ms);
+match *alignment_check_p2(const song *s, int songpos,
+        const song *p, int patternpos, matchset *ms);
+
+void alignment_check_p2_batch(const songcollection *sc, const song *p,
+        const alignmentcandidate *c, int n, matchset *ms);
 
 int scan_song_p2_points(const song *s, const song *p,
         int num_points, const int *points, matchset *ms);
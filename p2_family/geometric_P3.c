@@ -30,8 +30,11 @@
  */
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "search.h"
 #include "song.h"
@@ -68,6 +71,67 @@ void free_p3_song(p3song *p3s) {
     p3s->song = NULL;
 }
 
+/**
+ * Sorts turning points lexicographically, in the same order as
+ * compare_turningpoints(). The points are packed to 64-bit keys that are
+ * sorted with a radix sort, skipping the digits that are the same in all
+ * keys. Points with equal keys are identical, so they are unpacked from
+ * the sorted keys.
+ *
+ * @param points the turning points
+ * @param size number of points
+ */
+void sort_turningpoints(TurningPoint *points, int size) {
+    unsigned long long buffer[2 * P3_SORT_BUFFER_POINTS];
+    unsigned long long *keys = buffer, *tmp;
+    int counts[8][256];
+    int i, d;
+
+    if (size <= 1) return;
+    if (size > P3_SORT_BUFFER_POINTS) {
+        keys = (unsigned long long *) malloc(2 * (size_t) size *
+                sizeof(unsigned long long));
+        if (keys == NULL) {
+            qsort(points, size, sizeof(TurningPoint), compare_turningpoints);
+            return;
+        }
+    }
+    tmp = &keys[size];
+
+    /* Flipping the sign bits keeps the order of negative values */
+    memset(counts, 0, sizeof(counts));
+    for (i=0; i<size; ++i) {
+        unsigned long long k = (((unsigned long long) ((unsigned int)
+                points[i].x ^ 0x80000000U)) << 32) |
+                (unsigned long long) ((unsigned int) points[i].y ^
+                0x80000000U);
+        keys[i] = k;
+        for (d=0; d<8; ++d) ++counts[d][(k >> (8 * d)) & 0xFF];
+    }
+    for (d=0; d<8; ++d) {
+        int *c = counts[d];
+        int shift = 8 * d;
+        int sum = 0;
+        unsigned long long *t;
+        if (c[(keys[0] >> shift) & 0xFF] == size) continue;
+        for (i=0; i<256; ++i) {
+            int k = c[i];
+            c[i] = sum;
+            sum += k;
+        }
+        for (i=0; i<size; ++i) tmp[c[(keys[i] >> shift) & 0xFF]++] = keys[i];
+        t = keys;
+        keys = tmp;
+        tmp = t;
+    }
+    for (i=0; i<size; ++i) {
+        points[i].x = (int) ((unsigned int) (keys[i] >> 32) ^ 0x80000000U);
+        points[i].y = (int) ((unsigned int) keys[i] ^ 0x80000000U);
+    }
+    if (size > P3_SORT_BUFFER_POINTS) free((keys < tmp) ? keys : tmp);
+}
+
+
 /**
  * Converts a song to the P3 format.
  *
@@ -103,7 +167,188 @@ void song_to_p3(const song *s, p3song *p3s) {
     }
 
     /* Sort the endpoints */
-    qsort(endpoints, i, sizeof(TurningPoint), compare_turningpoints);
+    sort_turningpoints(endpoints, i);
+}
+
+
+/**
+ * Shared P3 song that is built from a song on demand. See acquire_p3_song().
+ */
+typedef struct p3songcacheentry {
+    p3song p3s;
+    int references;
+    /* Song size and note array when the P3 data was built */
+    int song_size;
+    const vector *song_notes;
+    struct p3songcacheentry *next;
+} p3songcacheentry;
+
+
+/** P3 songs that are currently referenced, hashed by the song address */
+static p3songcacheentry **p3_cache = NULL;
+static int p3_cache_buckets = 0;
+static int p3_cache_size = 0;
+static pthread_mutex_t p3_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Hashes a song address to a P3 cache bucket.
+ *
+ * @param s the song
+ * @param buckets number of buckets, a power of two
+ *
+ * @return bucket index
+ */
+static int p3_cache_bucket(const song *s, int buckets) {
+    unsigned long long h = (unsigned long long) (size_t) s;
+    h = (h >> 4) * 0x9E3779B97F4A7C15ULL;
+    return (int) (h >> 32) & (buckets - 1);
+}
+
+
+/**
+ * Doubles the number of P3 cache buckets. The cache keeps working with the
+ * old buckets if memory runs out.
+ */
+static void grow_p3_cache(void) {
+    int buckets = (p3_cache_buckets > 0) ? 2 * p3_cache_buckets :
+            P3_CACHE_BUCKETS;
+    p3songcacheentry **table = (p3songcacheentry **) calloc(buckets,
+            sizeof(p3songcacheentry *));
+    int i;
+    if (table == NULL) return;
+    for (i=0; i<p3_cache_buckets; ++i) {
+        p3songcacheentry *e = p3_cache[i];
+        while (e != NULL) {
+            p3songcacheentry *next = e->next;
+            int b = p3_cache_bucket(e->p3s.song, buckets);
+            e->next = table[b];
+            table[b] = e;
+            e = next;
+        }
+    }
+    free(p3_cache);
+    p3_cache = table;
+    p3_cache_buckets = buckets;
+}
+
+
+/**
+ * Finds a cached P3 song that was built from the current contents of the
+ * given song and adds a reference to it. The cache mutex must be held.
+ *
+ * @param s the song
+ *
+ * @return the cache entry, or NULL if there is none
+ */
+static p3songcacheentry *find_p3_song(const song *s) {
+    p3songcacheentry *e;
+    if (p3_cache_buckets <= 0) return NULL;
+    for (e = p3_cache[p3_cache_bucket(s, p3_cache_buckets)]; e != NULL;
+            e = e->next) {
+        if ((e->p3s.song == s) && (e->song_size == s->size) &&
+                (e->song_notes == s->notes)) {
+            ++e->references;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+/**
+ * Gets a song in the P3 format. The P3 data of each song is built when it
+ * is first needed and then shared by all users of the song, for example
+ * the P3 song collection and the alignment and synchronization algorithms,
+ * until the last reference is released. If the size or the note array of
+ * the song has changed since its P3 data was built, new data is built for
+ * the new contents; existing references keep the old data. Notes must not
+ * be edited in place while their P3 data is referenced. This function is
+ * thread-safe.
+ *
+ * @param s the song
+ *
+ * @return the song in the P3 format, or NULL if memory runs out. Release it
+ *         with release_p3_song().
+ */
+const p3song *acquire_p3_song(const song *s) {
+    p3songcacheentry *e, *built;
+    int b;
+
+    pthread_mutex_lock(&p3_cache_mutex);
+    e = find_p3_song(s);
+    pthread_mutex_unlock(&p3_cache_mutex);
+    if (e != NULL) return &e->p3s;
+
+    /* Convert the song without holding the lock so that other threads
+     * can use the cache meanwhile */
+    built = (p3songcacheentry *) malloc(sizeof(p3songcacheentry));
+    if (built == NULL) goto NO_MEMORY;
+    song_to_p3(s, &built->p3s);
+    built->references = 1;
+    built->song_size = s->size;
+    built->song_notes = s->notes;
+
+    pthread_mutex_lock(&p3_cache_mutex);
+    e = find_p3_song(s);
+    if (e == NULL) {
+        if (p3_cache_size >= 2 * p3_cache_buckets) grow_p3_cache();
+        if (p3_cache_buckets > 0) {
+            b = p3_cache_bucket(s, p3_cache_buckets);
+            built->next = p3_cache[b];
+            p3_cache[b] = built;
+            ++p3_cache_size;
+            e = built;
+            built = NULL;
+        }
+    }
+    pthread_mutex_unlock(&p3_cache_mutex);
+
+    /* Another thread inserted the same song first, or the table could not
+     * be allocated */
+    if (built != NULL) {
+        free_p3_song(&built->p3s);
+        free(built);
+    }
+    if (e == NULL) goto NO_MEMORY;
+    return &e->p3s;
+
+NO_MEMORY:
+    fputs("Error in acquire_p3_song(): failed to allocate memory\n", stderr);
+    return NULL;
+}
+
+
+/**
+ * Releases a song that was returned by acquire_p3_song(). The P3 data is
+ * freed when it has no more references.
+ *
+ * @param p3s the P3 song, or NULL
+ */
+void release_p3_song(const p3song *p3s) {
+    p3songcacheentry **prev;
+    int b;
+
+    if (p3s == NULL) return;
+    pthread_mutex_lock(&p3_cache_mutex);
+    b = p3_cache_bucket(p3s->song, p3_cache_buckets);
+    for (prev = &p3_cache[b]; *prev != NULL; prev = &(*prev)->next) {
+        p3songcacheentry *e = *prev;
+        if (&e->p3s != p3s) continue;
+        if (--e->references <= 0) {
+            *prev = e->next;
+            --p3_cache_size;
+            free_p3_song(&e->p3s);
+            free(e);
+        }
+        break;
+    }
+    if (p3_cache_size == 0) {
+        free(p3_cache);
+        p3_cache = NULL;
+        p3_cache_buckets = 0;
+    }
+    pthread_mutex_unlock(&p3_cache_mutex);
 }
 
 
@@ -120,10 +365,13 @@ void *init_p3_song_collection(void) {
 
 
 /**
- * Converts a song collection to the P3 format.
+ * Converts a song collection to the P3 format. The collection keeps a
+ * reference to the shared P3 data of each song (see acquire_p3_song()).
  *
  * @param sc song collection to convert
  * @param p3sc target P3 song collection
+ *
+ * @return 1 if successful, 0 otherwise
  */
 int build_p3_song_collection(void *p3sc, const songcollection *sc,
         const dataparameters *dp) {
@@ -131,11 +379,17 @@ int build_p3_song_collection(void *p3sc, const songcollection *sc,
     p3songcollection *_p3sc = (p3songcollection *) p3sc;
 
     _p3sc->song_collection = sc;
-    _p3sc->size = sc->size;
-    _p3sc->p3_songs = calloc(sc->size, sizeof(p3song));
+    _p3sc->p3_songs = (const p3song **) calloc(sc->size,
+            sizeof(const p3song *));
+    if (_p3sc->p3_songs == NULL) return 0;
     for (i=0; i<sc->size; ++i) {
-        song_to_p3(&sc->songs[i], &_p3sc->p3_songs[i]);
+        _p3sc->p3_songs[i] = acquire_p3_song(&sc->songs[i]);
+        if (_p3sc->p3_songs[i] == NULL) {
+            _p3sc->size = i;
+            return 0;
+        }
     }
+    _p3sc->size = sc->size;
     return 1;
 }
 
@@ -150,7 +404,7 @@ void clear_p3_song_collection(void *p3sc) {
     p3songcollection *_p3sc = (p3songcollection *) p3sc;
 
     for (i=0; i<_p3sc->size; ++i) {
-        free_p3_song(&_p3sc->p3_songs[i]);
+        release_p3_song(_p3sc->p3_songs[i]);
     }
     free(_p3sc->p3_songs);
     _p3sc->p3_songs = NULL;
@@ -189,7 +443,7 @@ void alg_p3(const songcollection *sc, const song *pattern, int alg,
     }
 
     for (i=0; i<p3sc->size; ++i) {
-        scan_p3(&p3sc->p3_songs[i], pattern, parameters, ms);
+        scan_p3(p3sc->p3_songs[i], pattern, parameters, ms);
     }
 }
 
@@ -104,7 +104,7 @@ typedef struct {
  */
 typedef struct {
     int size;
-    p3song *p3_songs;
+    const p3song **p3_songs;
     const songcollection *song_collection;
 } p3songcollection;
 
@@ -122,6 +122,8 @@ int scan_p3(const p3song *p3s, const song *pattern,
 
 int compare_turningpoints(const void *aa, const void *bb);
 
+void sort_turningpoints(TurningPoint *points, int size);
+
 
 void *init_p3_song_collection(void);
 int build_p3_song_collection(void *p3_songcollection, const songcollection *sc,
@@ -133,6 +135,9 @@ void init_p3_song(p3song *p3s);
 void free_p3_song(p3song *p3s);
 void song_to_p3(const song *s, p3song *p3s);
 
+const p3song *acquire_p3_song(const song *s);
+void release_p3_song(const p3song *p3s);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,357 @@
+/*
+ * geometric_S2.c - Time-scale invariant geometric algorithm S2
+ *
+ * Version 2010-08-20
+ *
+ *
+ * Copyright (C) 2007 Niko Mikkila
+ *
+ * University of Helsinki, Department of Computer Science, C-BRAHMS project
+ *
+ * Contact: mikkila@cs.helsinki.fi
+ *
+ *
+ * This file is part of geometric-cbmr,
+ * C-BRAHMS Geometric algorithms for Content-Based Music Retrieval.
+ *
+ * Geometric-cbmr is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Geometric-cbmr is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * geometric-cbmr; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#include "config.h"
+#include "search.h"
+#include "song.h"
+#include "util.h"
+#include "geometric_S2.h"
+
+
+/**
+ * Initializes an empty K table.
+ *
+ * @param k the table
+ */
+void init_s2_table(s2table *k) {
+    memset(k, 0, sizeof(s2table));
+}
+
+
+/**
+ * Frees the arrays of a K table and re-initializes it.
+ *
+ * @param k the table
+ */
+void free_s2_table(s2table *k) {
+    free(k->links);
+    free(k->first);
+    free(k->pairs);
+    free(k->next);
+    free(k->head);
+    free(k->stamp);
+    init_s2_table(k);
+}
+
+
+/**
+ * Makes sure that an int array has room for the given number of items.
+ *
+ * @param array pointer to the array
+ * @param allocated pointer to the allocated size
+ * @param size required size
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int reserve(int **array, int *allocated, int size) {
+    int *a;
+    if (size <= *allocated) return 1;
+    a = (int *) realloc(*array, size * sizeof(int));
+    if (a == NULL) return 0;
+    *array = a;
+    *allocated = size;
+    return 1;
+}
+
+
+/**
+ * Builds the K table for a pattern and a song: all pairs of pattern notes
+ * at most window notes apart, matched with the pairs of song notes at most
+ * window notes apart that have the same pitch interval. Song pairs are
+ * bucketed by their pitch interval first, so that each pattern pair only
+ * visits the song pairs that it matches, and no sorting is needed. The
+ * arrays of the table are reused between calls.
+ *
+ * @param k the table
+ * @param p pattern notes
+ * @param m number of pattern notes
+ * @param t song notes
+ * @param n number of song notes
+ * @param window maximum distance of paired notes, in notes
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int build_s2_table(s2table *k, const vector *p, int m, const vector *t,
+        int n, int window) {
+    int pos[256];
+    int i, d, a, b, npairs = 0;
+
+    /* Song pairs ordered by pitch interval and by the first note */
+    memset(k->pairfirst, 0, sizeof(k->pairfirst));
+    for (a=0; a<n; ++a) {
+        for (b=a+1; (b < n) && (b <= a + window); ++b) {
+            ++k->pairfirst[t[b].ptch - t[a].ptch + 128 + 1];
+            ++npairs;
+        }
+    }
+    if (!reserve(&k->pairs, &k->pairsallocated, 2 * npairs)) goto ERROR;
+    for (i=1; i<257; ++i) k->pairfirst[i] += k->pairfirst[i-1];
+    memcpy(pos, k->pairfirst, sizeof(pos));
+    for (a=0; a<n; ++a) {
+        for (b=a+1; (b < n) && (b <= a + window); ++b) {
+            int q = pos[t[b].ptch - t[a].ptch + 128]++;
+            k->pairs[2*q] = a;
+            k->pairs[2*q+1] = b;
+        }
+    }
+
+    /* Chain lists of the song notes */
+    if (n > k->notesallocated) {
+        free(k->head);
+        free(k->stamp);
+        k->head = (int *) malloc(n * sizeof(int));
+        k->stamp = (int *) calloc(n, sizeof(int));
+        if ((k->head == NULL) || (k->stamp == NULL)) {
+            k->notesallocated = 0;
+            goto ERROR;
+        }
+        k->notesallocated = n;
+        k->currentstamp = 0;
+    }
+
+    /* Matching pairs, ordered by pattern pair and song note a */
+    if (!reserve(&k->first, &k->firstallocated, m * window + 1)) goto ERROR;
+    k->m = m;
+    k->window = window;
+    k->size = 0;
+    for (i=0; i<m; ++i) {
+        for (d=1; d<=window; ++d) {
+            int j = i + d;
+            int pdt, bucket, q;
+            k->first[i * window + d - 1] = k->size;
+            if (j >= m) continue;
+            pdt = p[j].strt - p[i].strt;
+            bucket = p[j].ptch - p[i].ptch + 128;
+            for (q=k->pairfirst[bucket]; q<k->pairfirst[bucket+1]; ++q) {
+                s2link *l;
+                int tdt;
+                a = k->pairs[2*q];
+                b = k->pairs[2*q+1];
+                tdt = t[b].strt - t[a].strt;
+                if ((pdt == 0) != (tdt == 0)) continue;
+                if (k->size == k->allocated) {
+                    int newsize = MAX2(2 * k->allocated, 1024);
+                    s2link *links = (s2link *) realloc(k->links,
+                            newsize * sizeof(s2link));
+                    if (links == NULL) goto ERROR;
+                    k->links = links;
+                    k->allocated = newsize;
+                }
+                l = &k->links[k->size];
+                l->a = a;
+                l->b = b;
+                l->w = 0;
+                l->c = j;
+                l->z = i;
+                l->y = -1;
+                if (pdt == 0) l->s = 1.0;
+                else l->s = ((double) tdt) / ((double) pdt);
+                ++k->size;
+            }
+        }
+    }
+    k->first[m * window] = k->size;
+    if (!reserve(&k->next, &k->nextallocated, k->size)) goto ERROR;
+    return 1;
+
+ERROR:
+    fputs("Error in build_s2_table(): failed to allocate memory\n", stderr);
+    return 0;
+}
+
+
+/**
+ * Chains the pairs of a K table: a pair (z, c) -> (a, b) continues the
+ * longest chain whose last pair ends at pattern note z and song note a with
+ * the same scale. Pattern notes are processed in order. The chains that end
+ * at the current note are first linked to lists by their last song note,
+ * and each pair that starts from the note then only compares the scales
+ * in the list of its song note a.
+ *
+ * @param k a table built with build_s2_table()
+ *
+ * @return number of pairs in the longest chain
+ */
+int solve_s2_table(s2table *k) {
+    s2link *links = k->links;
+    int *next = k->next, *head = k->head, *stamp = k->stamp;
+    int z, best = 0;
+
+    for (z=0; z<k->m; ++z) {
+        int i, e;
+        if (k->currentstamp == INT_MAX) {
+            memset(stamp, 0, k->notesallocated * sizeof(int));
+            k->currentstamp = 0;
+        }
+        ++k->currentstamp;
+
+        /* Lists of the chains that end at pattern note z */
+        for (i=MAX2(z - k->window, 0); i<z; ++i) {
+            int sub = i * k->window + z - i - 1;
+            for (e=k->first[sub]; e<k->first[sub+1]; ++e) {
+                int b = links[e].b;
+                if (stamp[b] != k->currentstamp) {
+                    stamp[b] = k->currentstamp;
+                    head[b] = -1;
+                }
+                next[e] = head[b];
+                head[b] = e;
+            }
+        }
+
+        /* Pairs that start from pattern note z */
+        for (e=k->first[z * k->window]; e<k->first[(z + 1) * k->window];
+                ++e) {
+            s2link *l = &links[e];
+            l->w = 1;
+            l->y = -1;
+            if (stamp[l->a] == k->currentstamp) {
+                int r;
+                for (r=head[l->a]; r>=0; r=next[r]) {
+                    if ((links[r].s == l->s) && (links[r].w >= l->w)) {
+                        l->w = links[r].w + 1;
+                        l->y = r;
+                    }
+                }
+            }
+            if (l->w > best) best = l->w;
+        }
+    }
+    return best;
+}
+
+
+/**
+ * Reports the chain that ends with the given pair as a match.
+ *
+ * @param k a solved table
+ * @param e index of the last pair of the chain
+ * @param s the song
+ * @param p the pattern
+ * @param ms match set
+ */
+static void report_chain(const s2table *k, int e, const song *s,
+        const song *p, matchset *ms) {
+    const vector *pnotes = p->notes;
+    const vector *snotes = s->notes;
+    const s2link *last = &k->links[e];
+    const s2link *first = last;
+    int start, end, transposition;
+    float similarity;
+    match *m;
+
+    while (first->y >= 0) first = &k->links[first->y];
+    start = snotes[first->a].strt - (int) floor(last->s *
+            (double) (pnotes[first->z].strt - pnotes[0].strt) + 0.5);
+    end = snotes[last->b].strt + (int) floor(last->s *
+            (double) (pnotes[p->size-1].strt + pnotes[p->size-1].dur -
+            pnotes[last->c].strt) + 0.5);
+    transposition = snotes[first->a].ptch - pnotes[first->z].ptch;
+#ifdef P2_NORMALIZE_SIMILARITY
+    similarity = ((float) last->w + 1.0F) / ((float) MIN2(p->size, s->size));
+#else
+    similarity = ((float) last->w + 1.0F) / ((float) p->size);
+#endif
+    m = insert_match(ms, s->id, start, end, (char) transposition,
+            similarity);
+
+    /* Matching note positions */
+    if ((m != NULL) && (m->num_notes > 0) && (m->notes != NULL)) {
+        const s2link *l;
+        int i;
+        for (i=0; i<m->num_notes; ++i) m->notes[i] = -1;
+        for (l=last; ; l=&k->links[l->y]) {
+            if (l->c < m->num_notes) m->notes[l->c] = l->b;
+            if (l->z < m->num_notes) m->notes[l->z] = l->a;
+            if (l->y < 0) break;
+        }
+    }
+}
+
+
+/**
+ * Scans a song with the S2 algorithm. S2 finds the longest chain of note
+ * pairs that occurs in the song with a common transposition and time
+ * scale. Notes of a pair may be at most S2_WINDOW notes apart in the pattern
+ * and in the song. The longest chain is reported. When multiple matches
+ * per song are stored, all chains of at least S2_MIN_CHAIN pairs are also
+ * reported.
+ *
+ * @param s song to scan
+ * @param p pattern that is searched for
+ * @param k K table whose arrays are reused
+ * @param ms match set for the results
+ */
+void scan_song_s2(const song *s, const song *p, s2table *k, matchset *ms) {
+    int e, best, bestpos = -1;
+
+    if ((s->size < 2) || (p->size < 2)) return;
+    if (!build_s2_table(k, p->notes, p->size, s->notes, s->size, S2_WINDOW))
+        return;
+    best = solve_s2_table(k);
+    if (best == 0) return;
+
+    for (e=0; e<k->size; ++e) {
+        if ((bestpos < 0) && (k->links[e].w == best)) bestpos = e;
+        else if (ms->multiple_matches_per_song &&
+                (k->links[e].w >= S2_MIN_CHAIN))
+            report_chain(k, e, s, p, ms);
+    }
+    report_chain(k, bestpos, s, p, ms);
+}
+
+
+/**
+ * Searches a song collection with the S2 algorithm.
+ *
+ * @param sc a song collection to scan
+ * @param pattern pattern to search for
+ * @param alg search algorithm to use. See algorithms.h for algorithm IDs.
+ * @param parameters search parameters
+ * @param ms match set for returning search results
+ */
+void alg_s2(const songcollection *sc, const song *pattern, int alg,
+        const searchparameters *parameters, matchset *ms) {
+    s2table k;
+    int i;
+    init_s2_table(&k);
+    for (i=0; i<sc->size; ++i) {
+        scan_song_s2(&sc->songs[i], pattern, &k, ms);
+    }
+    free_s2_table(&k);
+}
+
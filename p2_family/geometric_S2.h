@@ -0,0 +1,122 @@
+/*
+ * geometric_S2.h - Structures and external declarations for the
+ *                  time-scale invariant geometric algorithm S2
+ *
+ * Version 2010-08-20
+ *
+ *
+ * Copyright (C) 2007 Niko Mikkila
+ *
+ * University of Helsinki, Department of Computer Science, C-BRAHMS project
+ *
+ * Contact: mikkila@cs.helsinki.fi
+ *
+ *
+ * This file is part of geometric-cbmr,
+ * C-BRAHMS Geometric algorithms for Content-Based Music Retrieval.
+ *
+ * Geometric-cbmr is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Geometric-cbmr is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * geometric-cbmr; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#ifndef __GEOMETRIC_S2_H__
+#define __GEOMETRIC_S2_H__
+
+#include "config.h"
+#include "results.h"
+#include "search.h"
+#include "song.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/**
+ * An entry of the K table: a pair of pattern notes (z, c) matched to a pair
+ * of song notes (a, b) with the same pitch interval. The time scale s is
+ * the ratio of the song and pattern time differences.
+ */
+typedef struct {
+    /** Song notes of the pair */
+    int a, b;
+
+    /** Number of pairs in the longest chain that ends with this pair */
+    int w;
+
+    /** Pattern notes of the pair: c is the later one, z the earlier */
+    int c, z;
+
+    /** Previous pair of the chain in the table, or -1 */
+    int y;
+
+    /** Time scale */
+    double s;
+} s2link;
+
+
+/**
+ * K table of the S2 algorithm in flat arrays. The pairs of pattern notes
+ * (z, z+d) are links[first[z*window+d-1]] ... links[first[z*window+d]-1],
+ * ordered by song note a.
+ */
+typedef struct {
+    int m;
+    int window;
+    int size;
+    int allocated;
+    s2link *links;
+    int *first;
+    int firstallocated;
+
+    /* Song pairs ordered by pitch interval (work space) */
+    int *pairs;
+    int pairsallocated;
+    int pairfirst[257];
+
+    /* Lists of the chains that end at each song note (work space). The
+     * list of note a is valid while stamp[a] equals the current stamp. */
+    int *next;
+    int nextallocated;
+    int *head;
+    int *stamp;
+    int notesallocated;
+    int currentstamp;
+} s2table;
+
+
+/* External function declarations */
+
+void init_s2_table(s2table *k);
+
+int build_s2_table(s2table *k, const vector *p, int m, const vector *t,
+        int n, int window);
+
+int solve_s2_table(s2table *k);
+
+void free_s2_table(s2table *k);
+
+void scan_song_s2(const song *s, const song *p, s2table *k, matchset *ms);
+
+void alg_s2(const songcollection *sc, const song *pattern, int alg,
+        const searchparameters *parameters, matchset *ms);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
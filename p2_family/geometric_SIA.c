@@ -0,0 +1,648 @@
+/*
+ * geometric_SIA.c - SIA and SIATEC pattern discovery algorithms
+ *
+ * Version 2010-08-20
+ *
+ *
+ * Copyright (C) 2007 Niko Mikkila
+ *
+ * University of Helsinki, Department of Computer Science, C-BRAHMS project
+ *
+ * Contact: mikkila@cs.helsinki.fi
+ *
+ *
+ * This file is part of geometric-cbmr,
+ * C-BRAHMS Geometric algorithms for Content-Based Music Retrieval.
+ *
+ * Geometric-cbmr is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Geometric-cbmr is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * geometric-cbmr; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "config.h"
+#include "search.h"
+#include "song.h"
+#include "util.h"
+#include "geometric_SIA.h"
+
+
+/**
+ * A pattern key for finding translationally equivalent patterns.
+ */
+typedef struct {
+    int size;
+    unsigned int hash;
+    int index;
+} siapatternkey;
+
+
+/**
+ * Initializes an empty SIA table.
+ *
+ * @param t the table
+ */
+void init_sia_table(siatable *t) {
+    memset(t, 0, sizeof(siatable));
+}
+
+
+/**
+ * Frees the arrays of a SIA table and re-initializes it.
+ *
+ * @param t the table
+ */
+void free_sia_table(siatable *t) {
+    free(t->patterns);
+    free(t->notes);
+    free(t->translators);
+    free(t->vectors);
+    free(t->tmp);
+    init_sia_table(t);
+}
+
+
+/**
+ * Makes room for the difference vectors.
+ *
+ * @param t the table
+ * @param size number of vectors
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int reserve_sia_vectors(siatable *t, size_t size) {
+    if (size <= t->vectorsallocated) return 1;
+    free(t->vectors);
+    free(t->tmp);
+    t->vectors = (unsigned long long *) malloc(size *
+            sizeof(unsigned long long));
+    t->tmp = (unsigned long long *) malloc(size *
+            sizeof(unsigned long long));
+    if ((t->vectors == NULL) || (t->tmp == NULL)) {
+        free(t->vectors);
+        free(t->tmp);
+        t->vectors = NULL;
+        t->tmp = NULL;
+        t->vectorsallocated = 0;
+        return 0;
+    }
+    t->vectorsallocated = size;
+    return 1;
+}
+
+
+/**
+ * Adds an empty pattern to the table.
+ *
+ * @param t the table
+ *
+ * @return the pattern, or NULL if memory runs out
+ */
+static siapattern *add_sia_pattern(siatable *t) {
+    siapattern *p;
+    if (t->num_patterns >= t->patternsallocated) {
+        int size = MAX2(64, 2 * t->patternsallocated);
+        siapattern *patterns = (siapattern *) realloc(t->patterns,
+                size * sizeof(siapattern));
+        if (patterns == NULL) return NULL;
+        t->patterns = patterns;
+        t->patternsallocated = size;
+    }
+    p = &t->patterns[t->num_patterns++];
+    memset(p, 0, sizeof(siapattern));
+    return p;
+}
+
+
+/**
+ * Adds a translator to the table.
+ *
+ * @param t the table
+ * @param dx time difference
+ * @param dy pitch difference
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int add_sia_translator(siatable *t, int dx, int dy) {
+    if (t->num_translators >= t->translatorsallocated) {
+        int size = MAX2(256, 2 * t->translatorsallocated);
+        int *translators = (int *) realloc(t->translators,
+                2 * (size_t) size * sizeof(int));
+        if (translators == NULL) return 0;
+        t->translators = translators;
+        t->translatorsallocated = size;
+    }
+    t->translators[2 * t->num_translators] = dx;
+    t->translators[2 * t->num_translators + 1] = dy;
+    ++t->num_translators;
+    return 1;
+}
+
+
+/**
+ * Sorts difference vectors with a radix sort that skips the digits that
+ * are the same in all vectors. The note index bits are not sorted, and the
+ * sort is stable, so vectors that are equal stay in their original order.
+ *
+ * @param c the vectors
+ * @param tmp work space for n vectors
+ * @param n number of vectors
+ *
+ * @return pointer to the sorted vectors, either c or tmp
+ */
+static unsigned long long *sort_sia_vectors(unsigned long long *c,
+        unsigned long long *tmp, size_t n) {
+    size_t counts[1 << SIA_RADIX_BITS];
+    size_t i;
+    int shift;
+
+    if (n <= 1) return c;
+    for (shift=23; shift<64; shift+=SIA_RADIX_BITS) {
+        const unsigned int mask = (1 << SIA_RADIX_BITS) - 1;
+        unsigned long long *t;
+        size_t sum = 0;
+        memset(counts, 0, sizeof(counts));
+        for (i=0; i<n; ++i) ++counts[(c[i] >> shift) & mask];
+        if (counts[(c[0] >> shift) & mask] == n) continue;
+        for (i=0; i<=mask; ++i) {
+            size_t k = counts[i];
+            counts[i] = sum;
+            sum += k;
+        }
+        for (i=0; i<n; ++i) tmp[counts[(c[i] >> shift) & mask]++] = c[i];
+        t = c;
+        c = tmp;
+        tmp = t;
+    }
+    return c;
+}
+
+
+/**
+ * Finds the maximal translatable patterns (MTP) of a song with the SIA
+ * algorithm of Meredith, Lemstrom and Wiggins. The difference vectors
+ * between all note pairs are packed to integers and sorted, so each run of
+ * equal vectors gives the notes of one MTP. With a note window, only the
+ * pairs of notes that are at most window notes apart are used, which keeps
+ * the number of vectors linear in the song length.
+ *
+ * @param t table for the results. The patterns are ordered by their
+ *        vectors, and the notes of each pattern are in ascending order.
+ * @param s a song whose notes are in lexicographical order
+ * @param window maximum distance between the notes of a pair, in notes,
+ *        or 0 for no limit
+ * @param min_size smallest pattern to report
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int sia_song(siatable *t, const song *s, int window, int min_size) {
+    const vector *notes = s->notes;
+    int n = s->size;
+    unsigned long long *v;
+    size_t num_vectors = 0, num_notes = 0, i, start;
+    int j, k;
+
+    t->num_patterns = 0;
+    t->num_translators = 0;
+    if (n < 2) return 1;
+    if (n > SIA_MAX_NOTES) {
+        fputs("Error in sia_song(): too many notes\n", stderr);
+        return 0;
+    }
+    if (window <= 0) window = n;
+    min_size = MAX2(min_size, 1);
+
+    for (j=0; j<n; ++j) num_vectors += MIN2(n - 1 - j, window);
+    if (!reserve_sia_vectors(t, num_vectors)) {
+        fputs("Error in sia_song(): failed to allocate memory\n", stderr);
+        return 0;
+    }
+
+    /* Vectors from each note to the following notes. Notes at the same
+     * point do not translate anything. */
+    num_vectors = 0;
+    for (j=0; j<n; ++j) {
+        int end = MIN2(n, j + 1 + window);
+        for (k=j+1; k<end; ++k) {
+            int dx = notes[k].strt - notes[j].strt;
+            int dy = (int) notes[k].ptch - (int) notes[j].ptch;
+            if ((dx == 0) && (dy == 0)) continue;
+            t->vectors[num_vectors++] = SIA_VECTOR(dx, dy, j);
+        }
+    }
+    v = sort_sia_vectors(t->vectors, t->tmp, num_vectors);
+
+    /* Runs of equal vectors */
+    for (start=0; start<num_vectors; start=i) {
+        unsigned long long key = SIA_VECTOR_KEY(v[start]);
+        for (i=start+1; (i<num_vectors) && (SIA_VECTOR_KEY(v[i]) == key);
+                ++i);
+        if (i - start >= (size_t) min_size) num_notes += i - start;
+    }
+    if (num_notes > t->notesallocated) {
+        free(t->notes);
+        t->notes = (int *) malloc(num_notes * sizeof(int));
+        if (t->notes == NULL) {
+            t->notesallocated = 0;
+            fputs("Error in sia_song(): failed to allocate memory\n", stderr);
+            return 0;
+        }
+        t->notesallocated = num_notes;
+    }
+
+    num_notes = 0;
+    for (start=0; start<num_vectors; start=i) {
+        unsigned long long key = SIA_VECTOR_KEY(v[start]);
+        siapattern *p;
+        int last = -1;
+        for (i=start+1; (i<num_vectors) && (SIA_VECTOR_KEY(v[i]) == key);
+                ++i);
+        if (i - start < (size_t) min_size) continue;
+        p = add_sia_pattern(t);
+        if (p == NULL) {
+            fputs("Error in sia_song(): failed to allocate memory\n", stderr);
+            return 0;
+        }
+        p->dx = SIA_VECTOR_DX(v[start]);
+        p->dy = SIA_VECTOR_DY(v[start]);
+        p->first = (int) num_notes;
+
+        /* Duplicate notes in the song may give a note twice */
+        for (; start<i; ++start) {
+            int note = SIA_VECTOR_NOTE(v[start]);
+            if (note == last) continue;
+            t->notes[num_notes++] = note;
+            last = note;
+        }
+        p->size = (int) num_notes - p->first;
+        if (p->size < min_size) {
+            num_notes = p->first;
+            --t->num_patterns;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Compares pattern keys by size and hash.
+ */
+static int compare_sia_pattern_keys(const void *aa, const void *bb) {
+    const siapatternkey *a = (const siapatternkey *) aa;
+    const siapatternkey *b = (const siapatternkey *) bb;
+    if (a->size != b->size) return (a->size < b->size) ? -1 : 1;
+    if (a->hash != b->hash) return (a->hash < b->hash) ? -1 : 1;
+    return a->index - b->index;
+}
+
+
+/**
+ * Checks if two patterns are translations of each other.
+ *
+ * @param t the table
+ * @param s the song
+ * @param a a pattern
+ * @param b another pattern of the same size
+ *
+ * @return 1 if the patterns are equivalent, 0 otherwise
+ */
+static int sia_patterns_equivalent(const siatable *t, const song *s,
+        const siapattern *a, const siapattern *b) {
+    const int *na = &t->notes[a->first];
+    const int *nb = &t->notes[b->first];
+    const vector *a0 = &s->notes[na[0]];
+    const vector *b0 = &s->notes[nb[0]];
+    int k;
+    for (k=1; k<a->size; ++k) {
+        const vector *ak = &s->notes[na[k]];
+        const vector *bk = &s->notes[nb[k]];
+        if ((ak->strt - a0->strt != bk->strt - b0->strt) ||
+                (ak->ptch - a0->ptch != bk->ptch - b0->ptch)) return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Finds the translators of a pattern: the vectors that translate all of
+ * its notes onto notes of the song. The candidates are the translations of
+ * the first pattern note onto each song note. They grow in lexicographical
+ * order, so the song position of each translated pattern note only moves
+ * forward, and each pattern note is checked with one merge pass over the
+ * song.
+ *
+ * @param t the table
+ * @param s a song whose notes are in lexicographical order
+ * @param p the pattern
+ * @param positions work space for p->size song positions
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int find_sia_translators(siatable *t, const song *s, siapattern *p,
+        int *positions) {
+    const vector *notes = s->notes;
+    const int *pnotes = &t->notes[p->first];
+    const vector *p0 = &notes[pnotes[0]];
+    int n = s->size;
+    int j, k;
+
+    p->first_translator = t->num_translators;
+    p->num_translators = 0;
+    for (k=0; k<p->size; ++k) positions[k] = 0;
+
+    for (j=0; j<n; ++j) {
+        int dx = notes[j].strt - p0->strt;
+        int dy = (int) notes[j].ptch - (int) p0->ptch;
+        if ((j > 0) && (notes[j].strt == notes[j-1].strt) &&
+                (notes[j].ptch == notes[j-1].ptch)) continue;
+        for (k=1; k<p->size; ++k) {
+            const vector *pk = &notes[pnotes[k]];
+            int x = pk->strt + dx;
+            int y = (int) pk->ptch + dy;
+            int q = positions[k];
+            while ((q < n) && ((notes[q].strt < x) ||
+                    ((notes[q].strt == x) && ((int) notes[q].ptch < y)))) ++q;
+            positions[k] = q;
+            if (q >= n) return 1;
+            if ((notes[q].strt != x) || ((int) notes[q].ptch != y)) break;
+        }
+        if (k < p->size) continue;
+        if (!add_sia_translator(t, dx, dy)) return 0;
+        ++p->num_translators;
+    }
+    return 1;
+}
+
+
+/**
+ * Finds the translational equivalence classes (TEC) of the maximal
+ * translatable patterns of a song with the SIATEC algorithm. The patterns
+ * of sia_song() that are translations of each other are reported once, and
+ * the translators of each pattern are calculated.
+ *
+ * @param t table for the results. See sia_song().
+ * @param s a song whose notes are in lexicographical order
+ * @param window maximum distance between the notes of a pair in the
+ *        pattern discovery, in notes, or 0 for no limit. The translators
+ *        are searched from the whole song.
+ * @param min_size smallest pattern to report
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int siatec_song(siatable *t, const song *s, int window, int min_size) {
+    siapatternkey *keys;
+    int *positions;
+    char *removed;
+    int i, j, k, maxsize = 0, ret = 0;
+
+    if (!sia_song(t, s, window, min_size)) return 0;
+    if (t->num_patterns == 0) return 1;
+
+    keys = (siapatternkey *) malloc(t->num_patterns * sizeof(siapatternkey));
+    removed = (char *) calloc(t->num_patterns, sizeof(char));
+    for (i=0; i<t->num_patterns; ++i) {
+        maxsize = MAX2(maxsize, t->patterns[i].size);
+    }
+    positions = (int *) malloc(maxsize * sizeof(int));
+    if ((keys == NULL) || (removed == NULL) || (positions == NULL)) {
+        fputs("Error in siatec_song(): failed to allocate memory\n", stderr);
+        goto EXIT;
+    }
+
+    /* Translationally equivalent patterns have the same size and hash */
+    for (i=0; i<t->num_patterns; ++i) {
+        const siapattern *p = &t->patterns[i];
+        const int *pnotes = &t->notes[p->first];
+        const vector *p0 = &s->notes[pnotes[0]];
+        unsigned int h = 2166136261U;
+        for (k=1; k<p->size; ++k) {
+            const vector *pk = &s->notes[pnotes[k]];
+            h = (h ^ (unsigned int) (pk->strt - p0->strt)) * 16777619U;
+            h = (h ^ (unsigned int) (pk->ptch - p0->ptch)) * 16777619U;
+        }
+        keys[i].size = p->size;
+        keys[i].hash = h;
+        keys[i].index = i;
+    }
+    qsort(keys, t->num_patterns, sizeof(siapatternkey),
+            compare_sia_pattern_keys);
+    for (i=0; i<t->num_patterns; i=j) {
+        for (j=i+1; (j<t->num_patterns) && (keys[j].size == keys[i].size) &&
+                (keys[j].hash == keys[i].hash); ++j);
+        for (k=i; k<j; ++k) {
+            int l;
+            if (removed[keys[k].index]) continue;
+            for (l=k+1; l<j; ++l) {
+                if (!removed[keys[l].index] && sia_patterns_equivalent(t, s,
+                        &t->patterns[keys[k].index],
+                        &t->patterns[keys[l].index]))
+                    removed[keys[l].index] = 1;
+            }
+        }
+    }
+
+    /* The remaining patterns keep their order */
+    for (i=0, j=0; i<t->num_patterns; ++i) {
+        if (removed[i]) continue;
+        t->patterns[j] = t->patterns[i];
+        if (!find_sia_translators(t, s, &t->patterns[j], positions)) {
+            fputs("Error in siatec_song(): failed to allocate memory\n",
+                    stderr);
+            goto EXIT;
+        }
+        ++j;
+    }
+    t->num_patterns = j;
+    ret = 1;
+
+EXIT:
+    free(keys);
+    free(removed);
+    free(positions);
+    return ret;
+}
+
+
+/**
+ * Finds the song note at a given point.
+ *
+ * @param s a song whose notes are in lexicographical order
+ * @param x onset time
+ * @param y pitch
+ *
+ * @return position of the note, or -1 if there is no note at the point
+ */
+static int find_sia_note(const song *s, int x, int y) {
+    int lo = 0, hi = s->size;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const vector *n = &s->notes[mid];
+        if ((n->strt < x) || ((n->strt == x) && ((int) n->ptch < y)))
+            lo = mid + 1;
+        else hi = mid;
+    }
+    if ((lo < s->size) && (s->notes[lo].strt == x) &&
+            ((int) s->notes[lo].ptch == y)) return lo;
+    return -1;
+}
+
+
+/**
+ * Counts the distinct pattern notes of a run of equal vectors. The vectors
+ * of a run are sorted by the pattern note, but a pattern note may have
+ * several song notes at the same point.
+ *
+ * @param v the vectors of the run
+ * @param size length of the run
+ *
+ * @return number of distinct pattern notes
+ */
+static int count_sia_run_notes(const unsigned long long *v, size_t size) {
+    size_t k;
+    int count = 0, last = -1;
+    for (k=0; k<size; ++k) {
+        if (SIA_VECTOR_NOTE(v[k]) != last) ++count;
+        last = SIA_VECTOR_NOTE(v[k]);
+    }
+    return count;
+}
+
+
+/**
+ * Reports the pattern notes of a run of equal vectors as a match.
+ *
+ * @param s the song
+ * @param p the pattern
+ * @param v the vectors of the run
+ * @param size length of the run
+ * @param ms match set for the results
+ */
+static void report_sia_match(const song *s, const song *p,
+        const unsigned long long *v, int size, matchset *ms) {
+    const vector *pnotes = p->notes;
+    int dx = SIA_VECTOR_DX(v[0]);
+    int dy = SIA_VECTOR_DY(v[0]);
+    int k, count = count_sia_run_notes(v, (size_t) size);
+    match *m;
+
+    m = insert_match(ms, s->id, dx, dx + pnotes[p->size-1].strt +
+            pnotes[p->size-1].dur, (char) dy, (float) count /
+            (float) p->size);
+
+    /* Find out matching note positions if they are requested */
+    if ((m != NULL) && (m->num_notes > 0) && (m->notes != NULL)) {
+        for (k=0; k<m->num_notes; ++k) m->notes[k] = -1;
+        for (k=0; k<size; ++k) {
+            int i = SIA_VECTOR_NOTE(v[k]);
+            if (i >= m->num_notes) continue;
+            m->notes[i] = find_sia_note(s, pnotes[i].strt + dx,
+                    (int) pnotes[i].ptch + dy);
+        }
+    }
+}
+
+
+/**
+ * Scans a song with SIA: the vectors from each pattern note to each song
+ * note are sorted, and the run of equal vectors with the most distinct
+ * pattern notes is the largest pattern that the song contains with one
+ * translation. It is reported as a match with the share of matching pattern
+ * notes as the similarity. When multiple matches per song are stored, the
+ * other runs of at least SIA_MIN_PATTERN_SIZE distinct notes are also
+ * reported.
+ *
+ * @param s song to scan
+ * @param p pattern that is searched for
+ * @param t table whose arrays are reused
+ * @param ms match set for the results
+ */
+void scan_song_sia(const song *s, const song *p, siatable *t, matchset *ms) {
+    const vector *snotes = s->notes;
+    const vector *pnotes = p->notes;
+    size_t num_vectors = (size_t) s->size * p->size;
+    size_t i, start, best = 0, bestsize = 0;
+    unsigned long long *v;
+    int j, k, bestnotes = 0;
+
+    if ((s->size == 0) || (p->size == 0)) return;
+    if (p->size > SIA_MAX_NOTES) {
+        fputs("Error in scan_song_sia(): too many pattern notes\n", stderr);
+        return;
+    }
+    if (!reserve_sia_vectors(t, num_vectors)) {
+        fputs("Error in scan_song_sia(): failed to allocate memory\n",
+                stderr);
+        return;
+    }
+    num_vectors = 0;
+    for (k=0; k<p->size; ++k) {
+        for (j=0; j<s->size; ++j) {
+            t->vectors[num_vectors++] = SIA_VECTOR(
+                    snotes[j].strt - pnotes[k].strt,
+                    (int) snotes[j].ptch - (int) pnotes[k].ptch, k);
+        }
+    }
+    v = sort_sia_vectors(t->vectors, t->tmp, num_vectors);
+
+    for (start=0; start<num_vectors; start=i) {
+        unsigned long long key = SIA_VECTOR_KEY(v[start]);
+        for (i=start+1; (i<num_vectors) && (SIA_VECTOR_KEY(v[i]) == key);
+                ++i);
+        /* A run cannot have more distinct notes than vectors */
+        if ((int) (i - start) > bestnotes) {
+            int notes = count_sia_run_notes(&v[start], i - start);
+            if (notes > bestnotes) {
+                best = start;
+                bestsize = i - start;
+                bestnotes = notes;
+            }
+        }
+    }
+    for (start=0; ms->multiple_matches_per_song && (start<num_vectors);
+            start=i) {
+        unsigned long long key = SIA_VECTOR_KEY(v[start]);
+        for (i=start+1; (i<num_vectors) && (SIA_VECTOR_KEY(v[i]) == key);
+                ++i);
+        if ((start != best) && (i - start >= SIA_MIN_PATTERN_SIZE) &&
+                (count_sia_run_notes(&v[start], i - start) >=
+                SIA_MIN_PATTERN_SIZE))
+            report_sia_match(s, p, &v[start], (int) (i - start), ms);
+    }
+    report_sia_match(s, p, &v[best], (int) bestsize, ms);
+}
+
+
+/**
+ * Searches a song collection with SIA.
+ *
+ * @param sc a song collection to scan
+ * @param pattern pattern to search for
+ * @param alg search algorithm to use. See algorithms.h for algorithm IDs.
+ * @param parameters search parameters
+ * @param ms match set for returning search results
+ */
+void alg_sia(const songcollection *sc, const song *pattern, int alg,
+        const searchparameters *parameters, matchset *ms) {
+    siatable t;
+    int i;
+    init_sia_table(&t);
+    for (i=0; i<sc->size; ++i) {
+        scan_song_sia(&sc->songs[i], pattern, &t, ms);
+    }
+    free_sia_table(&t);
+}
+
@@ -0,0 +1,135 @@
+/*
+ * geometric_SIA.h - Structures and external declarations for the SIA and
+ *                   SIATEC pattern discovery algorithms
+ *
+ * Version 2010-08-20
+ *
+ *
+ * Copyright (C) 2007 Niko Mikkila
+ *
+ * University of Helsinki, Department of Computer Science, C-BRAHMS project
+ *
+ * Contact: mikkila@cs.helsinki.fi
+ *
+ *
+ * This file is part of geometric-cbmr,
+ * C-BRAHMS Geometric algorithms for Content-Based Music Retrieval.
+ *
+ * Geometric-cbmr is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Geometric-cbmr is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * geometric-cbmr; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#ifndef __GEOMETRIC_SIA_H__
+#define __GEOMETRIC_SIA_H__
+
+#include "config.h"
+#include "results.h"
+#include "search.h"
+#include "song.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* A difference vector (dx, dy) from note i is packed to 64 bits so that
+ * sorting the keys sorts the vectors lexicographically: the x difference
+ * with a flipped sign bit is in the upper 32 bits, the y difference plus
+ * 256 in the next 9 bits, and i in the lowest 23 bits. */
+#define SIA_VECTOR(dx, dy, i) ((((unsigned long long) \
+        ((unsigned int) (dx) ^ 0x80000000U)) << 32) | \
+        (((unsigned long long) ((dy) + 256)) << 23) | \
+        (unsigned long long) (i))
+
+#define SIA_VECTOR_DX(v) ((int) (((unsigned int) ((v) >> 32)) ^ 0x80000000U))
+
+#define SIA_VECTOR_DY(v) (((int) (((v) >> 23) & 0x1FF)) - 256)
+
+#define SIA_VECTOR_NOTE(v) ((int) ((v) & 0x7FFFFF))
+
+/* The vector without the note index */
+#define SIA_VECTOR_KEY(v) ((v) >> 23)
+
+/* Largest number of notes in a song or pattern */
+#define SIA_MAX_NOTES 0x800000
+
+
+/**
+ * A maximal translatable pattern (MTP): the notes of a song that are
+ * translated onto other notes of the song by a vector (dx, dy).
+ */
+typedef struct {
+    /** Translation vector */
+    int dx, dy;
+
+    /** Notes of the pattern are notes[first] ... notes[first+size-1] */
+    int first;
+    int size;
+
+    /** Translators of the pattern's translational equivalence class are
+      * translators[2*first_translator] ... in (dx, dy) pairs. They are only
+      * calculated by siatec_song(). */
+    int first_translator;
+    int num_translators;
+} siapattern;
+
+
+/**
+ * Results and work space of the SIA algorithms. The arrays are reused
+ * between songs.
+ */
+typedef struct {
+    int num_patterns;
+    int patternsallocated;
+    siapattern *patterns;
+
+    /* Song note indices of the patterns in ascending order */
+    int *notes;
+    size_t notesallocated;
+
+    /* Translator vectors of the patterns in (dx, dy) pairs */
+    int num_translators;
+    int translatorsallocated;
+    int *translators;
+
+    /* Sorted difference vectors (work space) */
+    unsigned long long *vectors;
+    unsigned long long *tmp;
+    size_t vectorsallocated;
+} siatable;
+
+
+/* External function declarations */
+
+void init_sia_table(siatable *t);
+
+void free_sia_table(siatable *t);
+
+int sia_song(siatable *t, const song *s, int window, int min_size);
+
+int siatec_song(siatable *t, const song *s, int window, int min_size);
+
+void scan_song_sia(const song *s, const song *p, siatable *t, matchset *ms);
+
+void alg_sia(const songcollection *sc, const song *pattern, int alg,
+        const searchparameters *parameters, matchset *ms);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
@@ -35,6 +35,10 @@
 #include <string.h>
 #include <limits.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "config.h"
@@ -45,75 +49,6 @@
 
 
 
-/**
- * Recursive function that scans midi files from a tree of directories.
- *
- * @param path the directory to scan
- * @param sc song collection where the read songs will be stored. Use NULL to
- *        only count the number of files.
- * @param count number of potential MIDI files found will be stored here
- * @param skip_percussion set to 1 to skip percussion channel in the MIDI files
- *        that will be read
- */
-static void scan_midi_files(const char *path, songcollection *sc, int *count,
-        int skip_percussion) {
-    int n;
-    struct stat statbuf;
-
-    if (stat(path, &statbuf) == 0) {
-        if (S_ISDIR(statbuf.st_mode)) {
-            struct dirent **files = NULL;
-            char *p;
-            int pathlen = strlen(path);
-
-            p = (char *) malloc((pathlen + 2) * sizeof(char));
-            if (p == NULL) return;
-            strcpy(p, path);
-            if ((pathlen > 0) && (path[pathlen-1] != '/')) {
-                p[pathlen] = '/';
-                p[pathlen+1] = 0;
-                ++pathlen;
-            }
-
-            n = scandir(p, &files, 0, alphasort);
-            if (n >= 0) {
-                int i;
-                for (i = 0; i < n; ++i) {
-                    char *fn;
-                    if ((strcmp(files[i]->d_name, "..") == 0) ||
-                            (strcmp(files[i]->d_name, ".") == 0)) {
-                        free(files[i]);
-                        continue;
-                    }
-                    fn = (char *) malloc((pathlen +
-                            strlen(files[i]->d_name) + 1) * sizeof(char));
-                    if (fn == NULL) {
-                        for (; i<n; ++i) free(files[i]);
-                        break;
-                    }
-                    strcpy(fn, p);
-                    strcpy(fn + pathlen, files[i]->d_name);
-                    scan_midi_files(fn, sc, count, skip_percussion);
-                    free(fn);
-                    free(files[i]);
-                }
-            } else fprintf(stderr, "Error: couldn't open directory: %s\n", p);
-
-            free(p);
-            free(files);
-        } else if (S_ISREG(statbuf.st_mode)) {
-            if ((sc != NULL) && (*count < sc->size)) {
-                if (read_midi_file(path, &sc->songs[*count], NULL,
-                        skip_percussion)) {
-                    sc->songs[*count].id = *count;
-                    *count += 1;
-                }
-            } else *count += 1;
-        }
-    }
-}
-
-
 /**
  * Reads a directory of MIDI files recursively.
  *
@@ -126,17 +61,7 @@ static void scan_midi_files(const char *path, songcollection *sc, int *count,
  */
 int read_midi_directory(const char *path, songcollection *sc,
         int skip_percussion) {
-    int count = 0;
-    scan_midi_files(path, NULL, &count, skip_percussion);
-    sc->size = count;
-    if (count > 0) {
-        sc->songs = (song *) calloc(count, sizeof(song));
-        count = 0;
-        scan_midi_files(path, sc, &count, skip_percussion);
-        sc->size = count;
-    }
-    fprintf(stderr, "%d MIDI files read\n", count);
-    return count;
+    return read_midi_corpus(path, sc, skip_percussion, 0, 0);
 }
 
 
@@ -377,55 +302,267 @@ static INLINE void midi_write_event(track_event *event, int tick,
 
 
 /**
- * Parses a set of MIDI tracks.
+ * A MIDI event decoded by decode_track_events(). This is a compact version
+ * of track_event for merging the tracks.
+ */
+typedef struct {
+    /* Absolute time in ticks */
+    int tick;
+    /* Offset of the event data in the file buffer */
+    int data;
+    int length;
+    unsigned char status;
+    unsigned char metatype;
+    /* The first two data bytes, for channel events */
+    unsigned char value[2];
+} midi_event;
+
+
+/**
+ * Decodes the events of a MIDI track to an array with absolute tick values
+ * and estimates how many notes the track holds, so that parse_tracks2() can
+ * merge the tracks and store the notes in a buffer of the right size.
+ * The note count is exact for tracks that do not share channels with other
+ * tracks. Otherwise a note-on with zero velocity may be counted as a note
+ * when another track plays the same pitch, or missed when another track
+ * stops it first.
+ *
+ * @param buffer the file buffer that holds the track
+ * @param track track data buffer
+ * @param track_length length of the track buffer
+ * @param skip_percussion set to 1 to skip counting percussion notes
+ * @param events pointer to an event array where the events are appended.
+ *        The array is enlarged when needed.
+ * @param capacity pointer to the allocated size of the event array
+ * @param num_events pointer to the number of events in the array
+ * @param eot set to 1 if an end of track event was appended after the other
+ *        events, 0 otherwise
+ * @param num_notes the estimated number of notes is added here
+ *
+ * @return 1 if successful, 0 if memory allocation failed
+ */
+static int decode_track_events(const unsigned char *buffer,
+        const unsigned char *track, const int track_length,
+        const int skip_percussion, midi_event **events, int *capacity,
+        int *num_events, char *eot, int *num_notes) {
+    unsigned char playing[MIDI_CHANNELS][NOTE_PITCHES];
+    track_event e;
+    int i = 0, r, first = *num_events;
+
+    memset(&e, 0, sizeof(track_event));
+    memset(playing, 0, sizeof(playing));
+    *eot = 0;
+
+    while (1) {
+        midi_event *ev;
+        int channel;
+
+        r = parse_event(track, track_length, &i, &e);
+        /* The end of track event is stored, unless it is the only one */
+        if ((r < 0) || ((r == 0) && (*num_events == first))) break;
+
+        if (*num_events == *capacity) {
+            int c = MAX2(2 * (*capacity), 64);
+            midi_event *ev = (midi_event *) realloc(*events,
+                    c * sizeof(midi_event));
+            if (ev == NULL) {
+                fputs("Error in decode_track_events(): failed to allocate memory\n",
+                        stderr);
+                return 0;
+            }
+            *events = ev;
+            *capacity = c;
+        }
+        ev = &(*events)[(*num_events)++];
+        /* FIXME: Check for a time overflow */
+        ev->tick = (int) e.tick;
+        ev->data = (int) (e.data - buffer);
+        ev->length = e.length;
+        ev->status = e.status;
+        ev->metatype = e.metatype;
+        ev->value[0] = (e.length > 0) ? e.data[0] : 0;
+        ev->value[1] = (e.length > 1) ? e.data[1] : 0;
+        if (r == 0) {
+            *eot = 1;
+            break;
+        }
+
+        channel = e.status & CHANNEL_MASK;
+        switch (e.status & STATUS_MASK) {
+            case EVENT_NOTE_OFF:
+                playing[channel][e.data[0] & 0x7F] = 0;
+                break;
+            case EVENT_NOTE_ON:
+                if (skip_percussion && (channel == MIDI_PERCUSSION_CHANNEL))
+                    break;
+                if ((e.data[1] & 0x7F) == 0) {
+                    if (playing[channel][e.data[0] & 0x7F]) {
+                        playing[channel][e.data[0] & 0x7F] = 0;
+                        break;
+                    }
+                }
+                playing[channel][e.data[0] & 0x7F] = 1;
+                ++(*num_notes);
+                break;
+            case EVENT_CONTROLLER:
+                if ((e.status == CONTROLLER_ALL_NOTES_OFF) ||
+                        (e.status == CONTROLLER_ALL_SOUND_OFF)) {
+                    memset(playing, 0, sizeof(playing));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Doubles the size of a song's note buffer while notes are being read.
+ *
+ * @param s the song
+ * @param note_capacity number of notes allocated for the song
+ * @param playing_notes notes that are playing. The pointers are moved to
+ *        the new buffer.
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int grow_note_buffer(song *s, int *note_capacity,
+        vector *playing_notes[MIDI_CHANNELS][NOTE_PITCHES]) {
+    int i, j;
+    int capacity = MAX2(2 * (*note_capacity), 16);
+    vector *notes = (vector *) malloc(capacity * sizeof(vector));
+    if (notes == NULL) {
+        fputs("Error in parse_tracks: failed to allocate memory for notes\n",
+                stderr);
+        return 0;
+    }
+    memcpy(notes, s->notes, s->size * sizeof(vector));
+    for (i=0; i<MIDI_CHANNELS; ++i) {
+        for (j=0; j<NOTE_PITCHES; ++j) {
+            if (playing_notes[i][j] != NULL) {
+                playing_notes[i][j] = notes + (playing_notes[i][j] - s->notes);
+            }
+        }
+    }
+    free(s->notes);
+    s->notes = notes;
+    *note_capacity = capacity;
+    return 1;
+}
+
+
+static void parse_tracks2(const unsigned char *buffer,
+        const midi_event *events, const int *track_first,
+        const int *track_end, const char *track_eot,
+        const int num_tracks, song * const s,
+        int * const note_capacity, midisong * const midi_s,
+        const int division_type, const int division,
+        const int skip_percussion, const int only_rhythm);
+
+
+/**
+ * Stores a decoded event to the track data of a midisong.
+ *
+ * @param te the event to fill
+ * @param buffer the file buffer that holds the event data
+ * @param e the decoded event
+ * @param time event time in milliseconds
+ */
+static INLINE void store_midi_event(track_event *te,
+        const unsigned char *buffer, const midi_event *e, double time) {
+    te->tick = time;
+    te->status = e->status;
+    te->metatype = e->metatype;
+    te->data = buffer + e->data;
+    te->length = e->length;
+}
+
+
+/**
+ * Sets the tick of the next event of a track in the priority queue that
+ * parse_tracks2() uses for merging many tracks.
+ *
+ * @param pq the priority queue
+ * @param t track number
+ * @param tick tick of the next event, INT_MAX if the track has ended
+ * @param num_tracks number of tracks
+ * @param unique_keys 1 if tick * num_tracks + t fits in an int for all
+ *        events
+ */
+static INLINE void merge_queue_update(pqroot *pq, int t, int tick,
+        int num_tracks, int unique_keys) {
+    pqnode *node = pq_getnode(pq, t);
+    if (unique_keys) {
+        if (tick != INT_MAX) tick = tick * num_tracks + t;
+        node->key1 = tick;
+        pq_update_key1_p3(pq, node);
+    } else {
+        node->key1 = tick;
+        node->key2 = t;
+        pq_update(pq, node);
+    }
+}
+
+/**
+ * Parses a set of MIDI tracks that have been decoded with
+ * decode_track_events().
  *
- * @param tracks track data buffers
- * @param track_lengths lengths of track buffers
+ * @param buffer the file buffer that holds the tracks
+ * @param events decoded events
+ * @param track_first index of the first event of each track
+ * @param track_end index after the last event of each track. The end of
+ *        track event is stored there if track_eot is set.
+ * @param track_eot 1 for the tracks that have an end of track event
  * @param num_tracks number of tracks to parse
  * @param s song where the read music data will be stored
+ * @param note_capacity number of notes allocated for the song. The note
+ *        buffer is enlarged if it turns out to be too small.
+ * @param midi_s MIDI data structure where the events will be stored
  * @param division_type PPQN or SMPTE
  * @param division ppqn division or SMPTE framerate
  * @param skip_percussion set to 1 to skip reading percussion channel events
  */
-static void parse_tracks(const unsigned char **tracks,
-        const int *track_lengths, const int num_tracks, song * const s,
-        midisong * const midi_s, const int division_type, const int division,
+static void parse_tracks(const unsigned char *buffer,
+        const midi_event *events, const int *track_first,
+        const int *track_end, const char *track_eot,
+        const int num_tracks, song * const s,
+        int * const note_capacity, midisong * const midi_s,
+        const int division_type, const int division,
         const int skip_percussion) {
-    parse_tracks2(tracks, track_lengths, num_tracks, s, midi_s, division_type, division, skip_percussion, 0);
+    parse_tracks2(buffer, events, track_first, track_end, track_eot, num_tracks, s, note_capacity, midi_s, division_type, division, skip_percussion, 0);
 } 
-void parse_tracks2(const unsigned char **tracks,
-        const int *track_lengths, const int num_tracks, song * const s,
-        midisong * const midi_s, const int division_type, const int division,
+static void parse_tracks2(const unsigned char *buffer,
+        const midi_event *events, const int *track_first,
+        const int *track_end, const char *track_eot,
+        const int num_tracks, song * const s,
+        int * const note_capacity, midisong * const midi_s,
+        const int division_type, const int division,
         const int skip_percussion, const int only_rhythm) {
-    int i;
+    int i, num_active, t = -1, last_tick = -1;
     vector *playing_notes[MIDI_CHANNELS][NOTE_PITCHES];
     int patch[MIDI_CHANNELS];
-    track_event *track_events;
-    int *track_pointers;
-    /*double *track_last_tick;*/
+    int *track_pos, *head;
     double ms_per_tick;
     double tempo_change_time = 0.0;
     double tempo_change_tick = 0.0;
     double curtime = 0.0;
+    pqroot *pq = NULL;
+    int unique_keys = 0;
 
-    pqroot *pq = pq_create(num_tracks);
-    if (pq == NULL) {
-        fputs("Error in parse_tracks: failed to allocate a priority queue\n", stderr);
-        return;
-    }
-
-    track_events = (track_event *) calloc(num_tracks, sizeof(track_event));
-    track_pointers = (int *) calloc(num_tracks, sizeof(int));
-    /*track_last_tick = (double *) calloc(num_tracks, sizeof(double));*/
+    track_pos = (int *) malloc(2 * num_tracks * sizeof(int));
+    if (num_tracks > MIDI_LINEAR_MERGE_TRACKS) pq = pq_create(num_tracks);
 
-    if ((track_events == NULL) || (track_pointers == NULL)) {
+    if ((track_pos == NULL) ||
+            ((num_tracks > MIDI_LINEAR_MERGE_TRACKS) && (pq == NULL))) {
         fputs("Error in parse_tracks: failed to allocate temporary buffers\n", stderr);
-        pq_free(pq);
-        free(track_events);
-        free(track_pointers);
-        /*free(track_last_tick);*/
+        if (pq != NULL) pq_free(pq);
+        free(track_pos);
         return;
     }
+    head = track_pos + num_tracks;
+    memcpy(track_pos, track_first, num_tracks * sizeof(int));
 
     memset(playing_notes, 0, MIDI_CHANNELS * NOTE_PITCHES * sizeof(vector *));
     memset(patch, 0, MIDI_CHANNELS * sizeof(int));
@@ -434,20 +571,30 @@ void parse_tracks2(const unsigned char **tracks,
     if (division_type == SMPTE) ms_per_tick = 1000.0 / ((double) division);
     else ms_per_tick = MIDI_DEFAULT_TEMPO / ((double) division);
 
-    /* Insert first events from each track to the queue */
+    /* Many tracks are merged with a priority queue, which breaks ties with
+     * the track number as well. When the track number fits in the key,
+     * the keys are unique and the faster single key update can be used. */
+    if (pq != NULL) {
+        int max_tick = 0;
+        for (i=0; i<num_tracks; ++i) {
+            if ((track_end[i] > track_first[i]) &&
+                    (events[track_end[i] - 1].tick > max_tick)) {
+                max_tick = events[track_end[i] - 1].tick;
+            }
+        }
+        unique_keys = (max_tick < INT_MAX / num_tracks - 1);
+    }
+
+    /* Tick of the next event of each track, INT_MAX when the track ends */
+    num_active = 0;
     for (i=0; i<num_tracks; ++i) {
-        pqnode *node = pq_getnode(pq, i);
-        track_event *e = &track_events[i];
-        int r = parse_event(tracks[i], track_lengths[i], &track_pointers[i], e);
-        /* FIXME: Check for a time overflow */
-        if (r > 0) {
-            node->key1 = (int) e->tick;
-            node->key2 = i;
-            node->pointer = e;
-        } else {
-            node->key1 = INT_MAX;
+        int key = INT_MAX;
+        if (track_pos[i] < track_end[i]) {
+            key = events[track_pos[i]].tick;
+            ++num_active;
         }
-        pq_update_key1_p3(pq, node);
+        head[i] = key;
+        if (pq != NULL) merge_queue_update(pq, i, key, num_tracks, unique_keys);
     }
 
     if ((s != NULL) && (s->size > 0)) {
@@ -455,16 +602,31 @@ void parse_tracks2(const unsigned char **tracks,
     }
 
     while (1) {
-        int r, t;
-        track_event *e;
-
-        pqnode *node = pq_getmin(pq);
-        if ((node->key1 == INT_MAX) || (node->pointer == NULL)) break;
-
-        e = node->pointer;
-        t = node->key2; 
+        const midi_event *e;
+
+        /* Take the earliest event. Ties go to the track with the smallest
+         * number, so the previous track still wins while its next event
+         * is at the same tick, and the scan can be skipped. */
+        if (pq == NULL) {
+            if ((t < 0) || (head[t] != last_tick)) {
+                int min_key = head[0];
+                if (num_active == 0) break;
+                t = 0;
+                for (i=1; i<num_tracks; ++i) {
+                    int smaller = (head[i] < min_key);
+                    min_key = smaller ? head[i] : min_key;
+                    t = smaller ? i : t;
+                }
+            }
+        } else {
+            pqnode *node = pq_getmin(pq);
+            if (node->key1 == INT_MAX) break;
+            t = node->index;
+        }
+        e = &events[track_pos[t]];
+        last_tick = e->tick;
 
-        curtime = tempo_change_time + (e->tick - tempo_change_tick) *
+        curtime = tempo_change_time + ((double) e->tick - tempo_change_tick) *
                 ms_per_tick;
 
         if (s != NULL) {
@@ -475,8 +637,8 @@ void parse_tracks2(const unsigned char **tracks,
                     vector *n;
                     if (skip_percussion && (channel == MIDI_PERCUSSION_CHANNEL))
                         break;
-                    pitch = e->data[0];
-                    /* velocity = e->data[1]; */
+                    pitch = e->value[0];
+                    /* velocity = e->value[1]; */
                     n = playing_notes[channel][pitch];
                     if (n != NULL) {
                         n->dur = ((int) curtime) - n->strt;
@@ -491,8 +653,8 @@ void parse_tracks2(const unsigned char **tracks,
                     vector *n;
                     if (skip_percussion && (channel == MIDI_PERCUSSION_CHANNEL))
                         break;
-                    pitch = e->data[0] & 0x7F;
-                    velocity = e->data[1] & 0x7F;
+                    pitch = e->value[0] & 0x7F;
+                    velocity = e->value[1] & 0x7F;
                     n = playing_notes[channel][pitch];
                     if (n != NULL) {
                         n->dur = ((int) curtime) - n->strt;
@@ -501,6 +663,10 @@ void parse_tracks2(const unsigned char **tracks,
                             break;
                         }
                     }
+                    if (s->size == *note_capacity) {
+                        if (!grow_note_buffer(s, note_capacity,
+                                playing_notes)) break;
+                    }
                     n = &s->notes[s->size++];
                     n->strt = (int) curtime;
                     n->dur = 0;
@@ -537,7 +703,7 @@ void parse_tracks2(const unsigned char **tracks,
                     break;
                 case EVENT_PROGRAM_CHANGE: {
                     int channel = e->status & CHANNEL_MASK;
-                    patch[channel] = e->data[0];
+                    patch[channel] = e->value[0];
                     }
                     break;
 #if 0
@@ -557,8 +723,9 @@ void parse_tracks2(const unsigned char **tracks,
         if (e->status == EVENT_META) {
             /* Meta event */
             if (e->metatype == EVENT_TEMPO && (division_type != SMPTE)) {
-                int tempo = (((int) e->data[0]) << 16) +
-                        (((int) e->data[1]) << 8) + ((int) e->data[2]);
+                const unsigned char *data = buffer + e->data;
+                int tempo = (((int) data[0]) << 16) +
+                        (((int) data[1]) << 8) + ((int) data[2]);
                 tempo_change_time = curtime;
                 tempo_change_tick = e->tick;
                 ms_per_tick = ((double) tempo) / (1000.0 * ((double) division));
@@ -566,28 +733,29 @@ void parse_tracks2(const unsigned char **tracks,
         }
 
         if (midi_s != NULL) {
-            track_event *te = &midi_s->track_data[t][midi_s->track_size[t]++];
-            memcpy(te, e, sizeof(track_event));
-            te->tick = curtime;
+            store_midi_event(&midi_s->track_data[t][midi_s->track_size[t]++],
+                    buffer, e, curtime);
         }
 
-        /*track_last_tick = e->tick;*/
-
-        /* Parse next event */
-        r = parse_event(tracks[t], track_lengths[t], &track_pointers[t], e);
-        /* FIXME: Check for a time overflow */
-        if (r > 0) node->key1 = (int) e->tick;
-        else {
-            node->key1 = INT_MAX;
-            if ((r == 0) && (midi_s != NULL)) {
-                track_event *te =
-                        &midi_s->track_data[t][midi_s->track_size[t]++];
-                memcpy(te, e, sizeof(track_event));
-                te->tick = curtime;    
+        /* Move to the next event of the track */
+        if (++track_pos[t] < track_end[t]) {
+            int key = events[track_pos[t]].tick;
+            head[t] = key;
+            if (pq != NULL) {
+                merge_queue_update(pq, t, key, num_tracks, unique_keys);
+            }
+        } else {
+            if (track_eot[t] && (midi_s != NULL)) {
+                store_midi_event(
+                        &midi_s->track_data[t][midi_s->track_size[t]++],
+                        buffer, &events[track_end[t]], curtime);
+            }
+            head[t] = INT_MAX;
+            --num_active;
+            if (pq != NULL) {
+                merge_queue_update(pq, t, INT_MAX, num_tracks, unique_keys);
             }
         }
-
-        pq_update_key1_p3(pq, node);
     }
 
     if (s != NULL) {
@@ -604,46 +772,44 @@ void parse_tracks2(const unsigned char **tracks,
         s->duration = (int) curtime;
     }
 
-    pq_free(pq);
-    free(track_events);
-    free(track_pointers);
-    /*free(track_last_tick);*/
+    if (pq != NULL) pq_free(pq);
+    free(track_pos);
 }
 
 
 /**
- * Reads a song from a standard MIDI file.
+ * Parses a standard MIDI file that has been loaded to memory.
  *
- * @param file path to the MIDI file
+ * @param path path to the MIDI file, used for naming the song
+ * @param buffer file data followed by MIDI_BUFFER_PADDING null bytes
+ * @param filesize size of the buffer, including the padding
  * @param s pointer to a song data structure for storing the song in
  *        a geometric format. Use NULL to not store song data.
  * @param midi_s pointer to a midi data structure for storing all the events.
+ *        The events point to the buffer, which is then owned by midi_s.
  *        Use NULL to not store MIDI data.
  * @param skip_percussion 1 to skip percussion notes (MIDI channel 10),
  *        0 to parse all notes.
+ * @param only_rhythm 1 to store all notes with the same pitch
  *
  * @return 1 if successful, 0 otherwise
  */
-int read_midi_file(const char *path, song *s, midisong *midi_s,
-        int skip_percussion) {
-    return read_midi_file2(path, s, midi_s, skip_percussion, 0);
-}
-int read_midi_file2(const char *path, song *s, midisong *midi_s,
-        int skip_percussion, const int only_rhythm) {
+static int parse_midi_buffer(const char *path, unsigned char *buffer,
+        int filesize, song *s, midisong *midi_s, int skip_percussion,
+        const int only_rhythm) {
     int i, last_pos;
-    int filesize;
     int format = -1;
     const unsigned char **tracks = NULL;
     int *track_lengths = NULL;
     int header_num_tracks = 0;
     int num_tracks = 0;
+    midi_event *events = NULL;
+    int *track_first = NULL, *track_end = NULL;
+    char *track_eot = NULL;
+    int note_capacity = 0;
+    int success = 0;
     int division_type = PPQN; 
     int division = MIDI_DEFAULT_PPQN_DIVISION;
-    unsigned char *buffer;
-
-    buffer = read_file(path, SMF_MIN_SIZE, 10, &filesize);
-    if (buffer == NULL) return 0;
-
 
     for (i=0; i<filesize - SMF_MIN_SIZE; ++i) {
         if ((buffer[i] == 'M') && (buffer[i+1] == 'T') &&
@@ -665,10 +831,7 @@ int read_midi_file2(const char *path, song *s, midisong *midi_s,
             break;
         }
     }
-    if (i > filesize - 8) {
-        free(buffer);
-        return 0;
-    }
+    if (i > filesize - 8) return 0;
     if (format > 3) {
         fprintf(stderr, "Warning in read_midi_file(): unknown MIDI file type %d, parsing anyway...\n", format + 1);
         fprintf(stderr, "    File: %s\n", path);
@@ -740,10 +903,27 @@ int read_midi_file2(const char *path, song *s, midisong *midi_s,
         }
     }
     if (num_tracks > 0) {
-        int num_events = filesize >> 1;
+        int num_events = 0;
+        int event_capacity = 0;
+        int num_notes = 0;
+
+        /* Decode the tracks first to allocate buffers of the right size.
+         * The event array grows while decoding. */
+        track_first = (int *) malloc(2 * num_tracks * sizeof(int));
+        track_eot = (char *) malloc(num_tracks * sizeof(char));
+        if ((track_first == NULL) || (track_eot == NULL)) goto EXIT;
+        track_end = track_first + num_tracks;
+        for (i=0; i<num_tracks; ++i) {
+            track_first[i] = num_events;
+            if (!decode_track_events(buffer, tracks[i], track_lengths[i],
+                    skip_percussion, &events, &event_capacity, &num_events,
+                    &track_eot[i], &num_notes)) goto EXIT;
+            track_end[i] = num_events - track_eot[i];
+        }
 
         if (s != NULL) {
-            s->notes = (vector *) malloc(num_events * sizeof(vector));
+            note_capacity = MAX2(num_notes, 1);
+            s->notes = (vector *) malloc(note_capacity * sizeof(vector));
             if (s->notes == NULL) goto EXIT;
             s->size = 0;
             s->duration = 0;
@@ -762,8 +942,8 @@ int read_midi_file2(const char *path, song *s, midisong *midi_s,
                     goto EXIT;
                 }
                 midi_s->track_size[0] = 0;
-                midi_s->track_data[0] = (track_event *) malloc(num_events *
-                        sizeof(track_event));
+                midi_s->track_data[0] = (track_event *) malloc(
+                        MAX2(num_events, 1) * sizeof(track_event));
                 if (midi_s->track_data[0] == NULL) {
                     free(midi_s->track_size);
                     free(midi_s->track_data);
@@ -775,8 +955,10 @@ int read_midi_file2(const char *path, song *s, midisong *midi_s,
             }
 
             for (i=0; i<num_tracks; ++i) {
-                parse_tracks2(&tracks[i], &track_lengths[i], 1, s, midi_s,
-                        division_type, division, skip_percussion, only_rhythm);
+                parse_tracks2(buffer, events, &track_first[i], &track_end[i],
+                        &track_eot[i], 1, s, &note_capacity, midi_s,
+                        division_type, division, skip_percussion,
+                        only_rhythm);
             }
         } else {
             /* Normal Type 1 or Type 2 file is parsed directly */
@@ -794,7 +976,8 @@ int read_midi_file2(const char *path, song *s, midisong *midi_s,
                 for (i=0; i<num_tracks; ++i) {
                     midi_s->track_size[i] = 0;
                     midi_s->track_data[i] = (track_event *) malloc(
-                            (track_lengths[i] >> 1) * sizeof(track_event));
+                            MAX2(track_end[i] - track_first[i] +
+                            track_eot[i], 1) * sizeof(track_event));
                     if (midi_s->track_data[i] == NULL) {
                         for (--i; i>=0; --i) {
                             free(midi_s->track_data[i]);
@@ -809,32 +992,18 @@ int read_midi_file2(const char *path, song *s, midisong *midi_s,
                 midi_s->buffer_size = filesize;
             }
 
-            parse_tracks2(tracks, track_lengths, num_tracks, s, midi_s,
-                    division_type, division, skip_percussion, only_rhythm);
+            parse_tracks2(buffer, events, track_first, track_end, track_eot,
+                    num_tracks, s, &note_capacity, midi_s, division_type,
+                    division, skip_percussion, only_rhythm);
         }
 
-        if (MIDI_READ_TRIM_BUFFERS) {
-            if (s != NULL) {
-                vector *notes = (vector *) malloc(s->size * sizeof(vector));
-                if (notes != NULL) {
-                    memcpy(notes, s->notes, s->size * sizeof(vector));
-                    free(s->notes);
-                    s->notes = notes;
-                }
-            }
-            if (midi_s != NULL) {
-                for (i=0; i<num_tracks; ++i) {
-                    int tsize = midi_s->track_size[i];
-                    track_event *events = (track_event *)
-                            malloc(tsize * sizeof(track_event));
-                    if (events != NULL) {
-                        memcpy(events, midi_s->track_data[i], tsize *
-                                sizeof(track_event));
-                        free(midi_s->track_data[i]);
-                        midi_s->track_data[i] = events;
-                    }
-                }
-            }
+        /* The note buffer was enlarged while parsing only if the count was
+         * too low. Shrinking it normally happens in place. */
+        if ((s != NULL) && (note_capacity > MAX2(num_notes, 1)) &&
+                (s->size > 0)) {
+            vector *notes = (vector *) realloc(s->notes,
+                    s->size * sizeof(vector));
+            if (notes != NULL) s->notes = notes;
         }
 
         /* Name the song */
@@ -851,20 +1020,364 @@ int read_midi_file2(const char *path, song *s, midisong *midi_s,
                 memcpy(midi_s->name, path, (i+1) * sizeof(char));
             }
         }
+        success = 1;
 
 EXIT:
-        if ((midi_s == NULL) || (midi_s->buffer != buffer)) {
-            free(buffer);
+        if ((!success) && (s != NULL) && (note_capacity > 0)) {
+            free(s->notes);
+            s->notes = NULL;
+            s->size = 0;
         }
         free(tracks);
         free(track_lengths);
-        return 1;
+        free(events);
+        free(track_first);
+        free(track_eot);
+        return success;
     } else {
+        free(tracks);
+        free(track_lengths);
+        return 0;
+    }
+}
+
+/**
+ * Reads a song from a standard MIDI file.
+ *
+ * Events at the same tick on different tracks are processed in track
+ * order. When tracks share a channel, this order decides which note a
+ * note-off ends if another track starts or stops the same pitch at the same
+ * tick, so the note durations of such files depend on the track order.
+ *
+ * @param file path to the MIDI file
+ * @param s pointer to a song data structure for storing the song in
+ *        a geometric format. Use NULL to not store song data.
+ * @param midi_s pointer to a midi data structure for storing all the events.
+ *        Use NULL to not store MIDI data.
+ * @param skip_percussion 1 to skip percussion notes (MIDI channel 10),
+ *        0 to parse all notes.
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int read_midi_file(const char *path, song *s, midisong *midi_s,
+        int skip_percussion) {
+    return read_midi_file2(path, s, midi_s, skip_percussion, 0);
+}
+int read_midi_file2(const char *path, song *s, midisong *midi_s,
+        int skip_percussion, const int only_rhythm) {
+    int filesize, r;
+    unsigned char *buffer;
+
+    buffer = read_file(path, SMF_MIN_SIZE, MIDI_BUFFER_PADDING, &filesize);
+    if (buffer == NULL) return 0;
+
+    r = parse_midi_buffer(path, buffer, filesize, s, midi_s, skip_percussion,
+            only_rhythm);
+    if ((!r) || (midi_s == NULL) || (midi_s->buffer != buffer)) {
         free(buffer);
+    }
+    return r;
+}
+
+
+/**
+ * A list of file paths.
+ */
+typedef struct {
+    char **files;
+    int size;
+    int capacity;
+} midi_file_list;
+
+
+/**
+ * Recursive function that collects the files in a tree of directories.
+ * Directory entries are visited in alphabetical order.
+ *
+ * @param path the directory or file to scan
+ * @param list list where the file paths will be appended
+ *
+ * @return 1 if successful, 0 if memory allocation failed
+ */
+static int list_midi_files(const char *path, midi_file_list *list) {
+    struct stat statbuf;
+
+    if (stat(path, &statbuf) != 0) return 1;
+
+    if (S_ISDIR(statbuf.st_mode)) {
+        struct dirent **files = NULL;
+        char *fn;
+        int pathlen = strlen(path);
+        int i, n, maxlen = 0, ok = 1;
+
+        n = scandir(path, &files, 0, alphasort);
+        if (n < 0) {
+            fprintf(stderr, "Error: couldn't open directory: %s\n", path);
+            return 1;
+        }
+        for (i=0; i<n; ++i) {
+            int l = strlen(files[i]->d_name);
+            if (l > maxlen) maxlen = l;
+        }
+        fn = (char *) malloc((pathlen + maxlen + 2) * sizeof(char));
+        if (fn == NULL) ok = 0;
+        else {
+            strcpy(fn, path);
+            if ((pathlen > 0) && (path[pathlen-1] != '/')) {
+                fn[pathlen] = '/';
+                ++pathlen;
+            }
+        }
+        for (i=0; i<n; ++i) {
+            if (ok && (strcmp(files[i]->d_name, "..") != 0) &&
+                    (strcmp(files[i]->d_name, ".") != 0)) {
+                strcpy(fn + pathlen, files[i]->d_name);
+                ok = list_midi_files(fn, list);
+            }
+            free(files[i]);
+        }
+        free(fn);
+        free(files);
+        return ok;
+    } else if (S_ISREG(statbuf.st_mode)) {
+        if (list->size == list->capacity) {
+            int capacity = MAX2(2 * list->capacity, 64);
+            char **files = (char **) realloc(list->files,
+                    capacity * sizeof(char *));
+            if (files == NULL) return 0;
+            list->files = files;
+            list->capacity = capacity;
+        }
+        list->files[list->size] = (char *) malloc((strlen(path) + 1) *
+                sizeof(char));
+        if (list->files[list->size] == NULL) return 0;
+        strcpy(list->files[list->size], path);
+        ++list->size;
+    }
+    return 1;
+}
+
+
+/**
+ * Reads a song from a standard MIDI file by mapping the file to memory
+ * instead of copying it. Falls back to read_midi_file2() when the mapped
+ * pages do not have room for the null padding that the parser expects.
+ *
+ * @param path path to the MIDI file
+ * @param s pointer to a song data structure for storing the song
+ * @param skip_percussion 1 to skip percussion notes (MIDI channel 10),
+ *        0 to parse all notes.
+ * @param only_rhythm 1 to store all notes with the same pitch
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int read_midi_file_mapped(const char *path, song *s,
+        int skip_percussion, int only_rhythm) {
+    struct stat statbuf;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int fd, r;
+    void *buffer;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error in read_midi_file_mapped(): failed to open file '%s'\n", path);
+        return 0;
+    }
+    if (fstat(fd, &statbuf) != 0) {
+        close(fd);
+        return 0;
+    }
+    if (statbuf.st_size < SMF_MIN_SIZE) {
+        fprintf(stderr, "Error in read_midi_file_mapped(): file '%s' is too short\n", path);
+        close(fd);
         return 0;
     }
+    /* The kernel fills the rest of the last page with zeros, which can
+     * serve as the padding if there are enough of them. */
+    if ((statbuf.st_size > INT_MAX - MIDI_BUFFER_PADDING) ||
+            (pagesize <= 0) || (pagesize - (statbuf.st_size % pagesize) <
+            MIDI_BUFFER_PADDING) || (statbuf.st_size % pagesize == 0)) {
+        close(fd);
+        return read_midi_file2(path, s, NULL, skip_percussion, only_rhythm);
+    }
+
+    buffer = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (buffer == MAP_FAILED) {
+        return read_midi_file2(path, s, NULL, skip_percussion, only_rhythm);
+    }
+
+    r = parse_midi_buffer(path, (unsigned char *) buffer,
+            (int) statbuf.st_size + MIDI_BUFFER_PADDING, s, NULL,
+            skip_percussion, only_rhythm);
+    munmap(buffer, statbuf.st_size);
+    return r;
+}
+
+
+/**
+ * Shared state of the corpus loader threads.
+ */
+typedef struct {
+    const midi_file_list *list;
+    song *songs;
+    char *read_ok;
+    int skip_percussion;
+    int only_rhythm;
+
+    /* Next file to read, and progress counters. Protected by lock. */
+    int next;
+    int done;
+    int failed;
+    int reported_percent;
+    pthread_mutex_t lock;
+} midi_corpus_loader;
+
+
+/**
+ * Corpus loader thread. Takes files from the shared list until none are
+ * left, parses them into their own song slots and reports progress.
+ *
+ * @param arg pointer to a midi_corpus_loader structure
+ *
+ * @return NULL
+ */
+static void *midi_corpus_worker(void *arg) {
+    midi_corpus_loader *l = (midi_corpus_loader *) arg;
+    int n = l->list->size;
+
+    while (1) {
+        int i, ok, percent;
+
+        pthread_mutex_lock(&l->lock);
+        i = l->next++;
+        pthread_mutex_unlock(&l->lock);
+        if (i >= n) break;
+
+        ok = read_midi_file_mapped(l->list->files[i], &l->songs[i],
+                l->skip_percussion, l->only_rhythm);
+        l->read_ok[i] = (char) ok;
+        /* A failed file is dropped, whatever the parser left in its slot */
+        if (!ok) free_song(&l->songs[i]);
+
+        pthread_mutex_lock(&l->lock);
+        ++l->done;
+        if (!ok) {
+            ++l->failed;
+            fprintf(stderr, "\nWarning: failed to read MIDI file: %s\n",
+                    l->list->files[i]);
+        }
+        percent = (int) ((100LL * l->done) / n);
+        if (percent != l->reported_percent) {
+            l->reported_percent = percent;
+            fprintf(stderr, "\rReading MIDI files: %d/%d (%d%%)", l->done,
+                    n, percent);
+        }
+        pthread_mutex_unlock(&l->lock);
+    }
+    return NULL;
+}
+
+
+/**
+ * Reads a directory of MIDI files recursively. The directory tree is
+ * scanned once, files are mapped to memory and parsed in parallel. Songs
+ * are stored in the alphabetical order of their paths and files that could
+ * not be read are left out.
+ *
+ * @param path the directory to scan, or a single file
+ * @param sc a song collection for the read files
+ * @param skip_percussion set to 1 to skip percussion channel in the MIDI files
+ *        that will be read
+ * @param only_rhythm set to 1 to store all notes with the same pitch
+ * @param num_threads number of parser threads. Use 0 to start one thread
+ *        per online processor.
+ *
+ * @return number of MIDI files that were successfully read
+ */
+int read_midi_corpus(const char *path, songcollection *sc,
+        int skip_percussion, int only_rhythm, int num_threads) {
+    midi_file_list list;
+    midi_corpus_loader loader;
+    pthread_t *threads = NULL;
+    int i, count = 0;
+
+    sc->size = 0;
+    sc->songs = NULL;
+
+    memset(&list, 0, sizeof(midi_file_list));
+    if (!list_midi_files(path, &list)) {
+        fputs("Error in read_midi_corpus(): failed to allocate memory\n",
+                stderr);
+        goto EXIT;
+    }
+    if (list.size == 0) goto EXIT;
+
+    sc->songs = (song *) calloc(list.size, sizeof(song));
+    loader.read_ok = (char *) calloc(list.size, sizeof(char));
+    if ((sc->songs == NULL) || (loader.read_ok == NULL)) {
+        fputs("Error in read_midi_corpus(): failed to allocate memory\n",
+                stderr);
+        free(sc->songs);
+        free(loader.read_ok);
+        sc->songs = NULL;
+        goto EXIT;
+    }
+    loader.list = &list;
+    loader.songs = sc->songs;
+    loader.skip_percussion = skip_percussion;
+    loader.only_rhythm = only_rhythm;
+    loader.next = 0;
+    loader.done = 0;
+    loader.failed = 0;
+    loader.reported_percent = -1;
+    pthread_mutex_init(&loader.lock, NULL);
+
+    if (num_threads <= 0) num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = MAX2(MIN2(num_threads, list.size), 1);
+    if (num_threads > 1) {
+        threads = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
+        if (threads == NULL) num_threads = 1;
+    }
+
+    /* The calling thread works as one of the parsers */
+    for (i=1; i<num_threads; ++i) {
+        if (pthread_create(&threads[i], NULL, midi_corpus_worker, &loader)) {
+            num_threads = i;
+            break;
+        }
+    }
+    midi_corpus_worker(&loader);
+    for (i=1; i<num_threads; ++i) pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&loader.lock);
+    fputc('\n', stderr);
+
+    /* Pack the songs that were read to the beginning of the collection.
+     * Files whose parser returned 0 are dropped. */
+    for (i=0; i<list.size; ++i) {
+        if (!loader.read_ok[i]) continue;
+        if (i != count) sc->songs[count] = sc->songs[i];
+        sc->songs[count].id = count;
+        ++count;
+    }
+    if (count < list.size) {
+        memset(&sc->songs[count], 0, (list.size - count) * sizeof(song));
+    }
+    free(loader.read_ok);
+    if (loader.failed > 0) {
+        fprintf(stderr, "%d files could not be read\n", loader.failed);
+    }
+
+EXIT:
+    for (i=0; i<list.size; ++i) free(list.files[i]);
+    free(list.files);
+    sc->size = count;
+    fprintf(stderr, "%d MIDI files read\n", count);
+    return count;
 }
 
+
 /**
  * Writes a MIDI song to a standard MIDI file.
  *
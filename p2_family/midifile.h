@@ -48,10 +48,13 @@ extern "C" {
 #define MIDI_DEFAULT_PPQN_DIVISION 96
 #define MIDI_DEFAULT_TEMPO 500.0
 
-/** Should the note buffers be reallocated after the exact number of notes is
-  * known. Otherwise the amount of memory allocated for them will usually be
-  * 2-3 times higher than necessary. */
-#define MIDI_READ_TRIM_BUFFERS 1
+/** Tracks are merged with a linear scan up to this number of tracks, and
+  * with a priority queue when there are more. The scan is faster up to
+  * about 24 tracks and the queue from about 28 tracks upwards. */
+#define MIDI_LINEAR_MERGE_TRACKS 24
+
+/** Number of null bytes after the file data in MIDI parser buffers. */
+#define MIDI_BUFFER_PADDING 10
 
 
 /* Constants */
@@ -123,6 +126,9 @@ typedef struct {
 int read_midi_directory(const char *path, songcollection *sc,
         int skip_percussion);
 
+int read_midi_corpus(const char *path, songcollection *sc,
+        int skip_percussion, int only_rhythm, int num_threads);
+
 int read_midi_file(const char *file, song *s, midisong *midi_s,
         int skip_percussion);
 
@@ -13,23 +13,58 @@
 #include "song.h"
 #include "search.h"
 #include "geometric_P2.h"
-
-std::ostream& operator << (std::ostream& o, const scale& s) {
-	o<<s.a<<" "<<s.b<<" "<<s.c<<" "<<s.w<<" "<<s.s;
-	return o;
+#include "geometric_SIA.h"
+
+// Writes a pattern as a list of [onset, pitch] pairs, with onsets relative
+// to the first note. The pattern consists of the song notes at the given
+// positions. Patterns are separated by commas after the first one.
+static void write_pattern(std::ofstream& out, const song& s,
+		const int* positions, int size, bool& added) {
+	if (added == true){
+	    out << ",";
+	}
+	added = true;
+	out << "[";
+	int start = s.notes[positions[0]].strt;
+	for (int k=0; k<size; ++k) {
+		const vector& n = s.notes[positions[k]];
+		if (k!=0){
+		    out << ",";
+		}
+		out << "["<<n.strt - start << "," << (int)n.ptch <<"]";
+	}
+	out << "]";
 }
 
-std::vector<note> P; // pattern
-std::vector<note> T; // database
-std::vector<std::vector<scale> > K;
-std::vector<std::priority_queue<scale*,std::vector<scale*>,cmp> > Q;
-
-std::vector<scale*> Kaa;
+// Writes the translational equivalence classes of the maximal translatable
+// patterns that SIATEC finds in the song. Pairs of notes are at most
+// window notes apart.
+static void write_siatec_patterns(const char* filename, const song& s,
+		int window) {
+	std::ofstream out(filename);
+	out << "[";
+	bool added = false;
+	siatable t;
+	init_sia_table(&t);
+	if (siatec_song(&t, &s, window, SIA_MIN_PATTERN_SIZE)) {
+		for (int i=0; i<t.num_patterns; ++i) {
+			const siapattern& p = t.patterns[i];
+			write_pattern(out, s, &t.notes[p.first], p.size, added);
+		}
+	}
+	free_sia_table(&t);
+	out << "]";
+	out.close();
+}
 
+// Usage: partial <midi file> <output> <pattern length> <window>
+//        <similarity> [only rhythm] [SIATEC output]
+// The SIATEC patterns are discovered from the same parsed song, with pairs
+// of notes at most one pattern length apart.
 int main(int argc, char** argv) {
 
         int only_rhythm = 0;	
-        if (argc == 7){
+        if (argc >= 7){
 	    only_rhythm = std::stoi(argv[6]);	
         }
 
@@ -40,7 +75,7 @@ int main(int argc, char** argv) {
 	read_midi_file2(argv[1],&sc->songs[0],NULL,0,only_rhythm);
 	song s =sc->songs[0];
 	
-	searchparameters* parameters = new searchparameters;
+	searchparameters* parameters = new searchparameters();
        
 	double similarity = std::stod(argv[5]);
 	int length = std::stoi(argv[3]);
@@ -55,13 +90,12 @@ int main(int argc, char** argv) {
         //std::cout << "size: " << s.size<< std::endl;
 	//std::cout << "=================="<< std::endl;
 
-	songcollection* pc = new songcollection;
-        matchset* pms = new matchset;
-	
-	generate_patterns_song(pc, &sc->songs[0], pms, length, window);
-        //std::cout << "Genreated patterns: "<< pms->num_matches << std::endl;
-	//std::cout << "=================="<< std::endl;
-	//std::cout << "Patterns " << pc->size <<std::endl;
+	// Patterns refer to the notes of the song, so generating them does not
+	// allocate anything per pattern.
+	std::vector<patternview> views(max_patterns_song(&s, length, window));
+	int num_patterns = generate_pattern_views(views.data(), views.size(),
+		&s, length, window);
+        //std::cout << "Genreated patterns: "<< num_patterns << std::endl;
 	//std::cout << "=================="<< std::endl;
 
 
@@ -69,96 +103,78 @@ int main(int argc, char** argv) {
 	out << "[";	
 	bool added = false;
 
-	for (int j=0; j<pc->size; ++j) {
-		//std::cout << "==>>>>>>>>>>>>>>>"<< std::endl;
-		//std::cout << "Size P " << pc->songs[j].size <<std::endl;
-		// cut song starting on pms->matches[i].end
-	        match m = pms->matches[j];
-		//std::cout << "START " << m.start<<std::endl;
-		//std::cout << "END " << m.end<<std::endl;
-
-		// Copy song starting from the section to match
-		song* newsong = new song;
-                newsong->notes = (vector *) malloc(sizeof(vector) * s.size);
-                
+	// One match set is reused for all the patterns. Only the best match of
+	// the single song is kept, so one slot is enough.
+	matchset* ms = new matchset;
+	init_match_set(ms, sc->size, 0, 0);
+
+	for (int j=0; j<num_patterns; ++j) {
+		const patternview& v = views[j];
+		song pattern;
+		pattern_view_song(&v, &pattern);
+		std::vector<int> positions(pattern.size);
+		for (int k=0; k<pattern.size; ++k) {
+		    positions[k] = v.position + k;
+		}
+		//std::cout << "START " << v.start<<std::endl;
+		//std::cout << "END " << v.end<<std::endl;
+
+		// The section to match starts after the first note that begins
+		// where the pattern ends. It is a view to the song notes as well.
 		int n = 0;
-		//std::cout << "M "<<m.end  <<std::endl;
-		//std::cout << "SIZE "<<s.size  <<std::endl;
-		bool found = false;
 		for (int k=0; k<s.size; ++k) {
-		    
-                    if (found == true ){//&& n<numb_notes){
-                        char pitch = s.notes[k].ptch;
-                        newsong->notes[n].ptch = pitch;
-                        newsong->notes[n].strt = s.notes[k].strt;
-                        newsong->notes[n].dur = s.notes[k].dur;
-		        n++;
-		//std::cout << "N "<<n  <<std::endl;
-                    }
-		//std::cout << "strt "<<s.notes[k].strt  <<std::endl;
-                    if (s.notes[k].strt == m.end){
-		        found = true;
+                    if (s.notes[k].strt == v.end){
+		        n = s.size - k - 1;
+		        break;
 		    }
 		}
-		newsong->size = n;
-		newsong->title = s.title;
-		newsong->duration = 0;
-                sc->songs[0] = *newsong;
+		song section = s;
+		section.notes = &s.notes[s.size - n];
+		section.size = n;
+		section.duration = 0;
+                sc->songs[0] = section;
 
+		//for (int k=0; k<pattern.size; ++k) {
 		
-		//for (int k=0; k<pc->songs[j].size; ++k) {
-		
-		//std::cout << "Note:  "<< pc->songs[j].notes[k].strt << std::endl;
+		//std::cout << "Note:  "<< pattern.notes[k].strt - v.start << std::endl;
 		//}
 
-                matchset* ms = new matchset;
-                ms->size = 0;
-	        ms->num_matches = 0;
+                clear_match_set(ms);
 
-		if (pc->songs[j].size>2){
-		// Call P2 algorithm with song sections
-		alg_p2(sc, &pc->songs[j], 2, parameters, ms);
-                //free(newsong->notes);
+		if (pattern.size>2){
+		// Call P2 algorithm with song sections. P2 is invariant to
+		// translation, so the pattern notes need not start from zero.
+		alg_p2(sc, &pattern, 2, parameters, ms);
 		if (ms->num_matches > 0){
 		    //std::cout << "=================="<< std::endl;
 		    //std::cout << "Matches: "<< ms->num_matches << std::endl;
 		    for (int i=0; i<ms->num_matches; ++i) {
 		        if (ms->matches[i].similarity >= similarity){
-                            if (added == true){
-			        out << ",";
-		            }
-			    added = true;
-		            out << "[";	
 		            //std::cout << "Pattern Matched on note: "<< std::endl;
 		            //std::cout << ms->matches[i].start<< std::endl;
 		            //std::cout << ms->matches[i].similarity<< std::endl;
 		            //std::cout << length << std::endl;
 		            //std::cout << window << std::endl;
 		            //std::cout << "=================="<< std::endl;
-			    for (int k=0; k<pc->songs[j].size; ++k) {
-				if (k!=0){
-				    out << ",";
-		                }
-			        out << "["<<pc->songs[j].notes[k].strt << "," << (int)pc->songs[j].notes[k].ptch <<"]";
-			    }
-		            out << "]";	
+			    write_pattern(out, s, positions.data(), pattern.size,
+				    added);
 			}
 		    }
 		    //std::cout << "<<<<<<<<<<<<<<====="<< std::endl;
 		}
 		}
-		//free(newsong->notes);
-		//free(newsong);
-		//free(ms->matches);
-		//free(ms);
-	//free(pc->songs);
-	//free(pc);
-	//free(pms->matches);
-	//free(pms);
 	}
         out << "]";	
 	out.close();
 
+	free_match_set(ms);
+	delete ms;
+	sc->songs[0] = s;
+
+	if (argc >= 8) {
+	    write_siatec_patterns(argv[7], s, length);
+	}
+
 
 	return 0;
 }
@@ -1,8 +1,10 @@
 #ifndef PARTIAL_HPP
 #define PARTIAL_HPP
 
+#include <iostream>
 #include <vector>
-#include <queue>
+
+#include "geometric_S2.h"
 
 #define sz(x) ((int)x.size())
 const int INF = (1<<30);
@@ -23,32 +25,20 @@ struct note {
 	}
 };
 
-struct scale {
-	int a,b,w;
-	int c,z;
-	scale* y;
-	double s;
-
-	bool operator < (const scale& s) const {
-		if(a == s.a) return this->s < s.s;
-		return a < s.a;
-	}
-
-};
-
-struct cmp {
-	bool operator () (scale* s1, scale* s2) {
-		if(s1->b == s2->b) return s1->s > s2->s;
-		return s1->b > s2->b;
-	}
-};
+// A K table entry: text notes (a,b) matched to pattern notes (z,c) with
+// time scale s. The chain continues from entry y of the same flat table
+// (-1 at the start of a chain) and is w pairs long.
+typedef s2link scale;
 
 std::ostream& operator << (std::ostream& o, const scale& s);
-typedef std::vector<std::priority_queue<scale*,std::vector<scale*>,cmp> > PQV;
 
-void create_K_table(int W, const std::vector<note>& P, const std::vector<note>& T, 
-        std::vector<std::vector<scale> >& K, PQV& Q);
-void reportOccurences(const std::vector<note>& T, const std::vector<scale*>& Kaa);
-std::vector<scale*> solve(int alpha, int m, std::vector<std::vector<scale> >& K, PQV& Q);
+// Notes at x == INF are end markers and are ignored.
+void create_K_table(int W, const std::vector<note>& P, const std::vector<note>& T,
+        s2table& K);
+void reportOccurences(const std::vector<note>& T, const s2table& K,
+        const std::vector<int>& Kaa);
+// Returns the K table indices of the last pairs of the chains that have at
+// least alpha pairs and are not continued by a longer chain.
+std::vector<int> solve(int alpha, int m, s2table& K);
 
 #endif
@@ -126,7 +126,9 @@ static INLINE pqroot *pq_create(unsigned int size) {
     int level, n;
     pqroot *pq;
 
-    leaves = 1 << (pq_log_2(size-1) + 1);
+    /* log_2(0) is undefined, so a queue of one node is built as one leaf */
+    if (size > 1) leaves = 1 << (pq_log_2(size-1) + 1);
+    else leaves = 1;
 
     pq = (pqroot *) malloc(sizeof(pqroot));
     pq->nodes = (pqnode *) malloc(leaves * sizeof(pqnode));
@@ -37,11 +37,13 @@
 
 #include "config.h"
 #include "results.h"
-/*#include "util.h"*/
+#include "util.h"
 
 
 /**
- * Frees memory used by a match result.
+ * Frees memory used by a match result. This is only for matches that own
+ * their note position arrays; matches within a matchset use the set's pooled
+ * buffer and are released with free_match_set().
  *
  * @param ms the match to free
  */
@@ -56,17 +58,39 @@ void free_match(match *m) {
  */
 void free_match_set(matchset *ms) {
     if(ms->matches != NULL) {
-        int i;
-        for (i=0; i<ms->size; ++i) {
-            free_match(&ms->matches[i]);
-        }
         free(ms->matches);
         ms->matches = NULL;
-        ms->size = 0;
-        ms->time.indexing = 0.0;
-        ms->time.verifying = 0.0;
-        ms->time.other = 0.0;
-        ms->time.measure = 0;
+    }
+    if (ms->note_buffer != NULL) {
+        free(ms->note_buffer);
+        ms->note_buffer = NULL;
+    }
+    ms->size = 0;
+    ms->num_matches = 0;
+    ms->capacity = 0;
+    ms->pattern_size = 0;
+    ms->note_capacity = 0;
+    ms->time.indexing = 0.0;
+    ms->time.verifying = 0.0;
+    ms->time.other = 0.0;
+    ms->time.measure = 0;
+    memset(&ms->cost, 0, sizeof(searchcost));
+}
+
+
+/**
+ * Divides the pooled note position buffer among the match items.
+ *
+ * @param ms a set of matches
+ */
+static void assign_match_notes(matchset *ms) {
+    int i;
+    for (i=0; i<ms->size; ++i) {
+        match *m = &ms->matches[i];
+        m->num_notes = ms->pattern_size;
+        if (ms->pattern_size > 0) {
+            m->notes = &ms->note_buffer[i * ms->pattern_size];
+        } else m->notes = NULL;
     }
 }
 
@@ -85,56 +109,90 @@ void free_match_set(matchset *ms) {
  */
 int init_match_set(matchset *ms, int size, int pattern_size,
         int multiple_matches_per_song) {
+    ms->matches = NULL;
+    ms->note_buffer = NULL;
+    ms->capacity = 0;
+    ms->note_capacity = 0;
+    ms->size = 0;
+    return reset_match_set(ms, size, pattern_size, multiple_matches_per_song);
+}
+
+
+/**
+ * Prepares an initialized (or zero-filled) set of match results for a new
+ * search. Memory is only reallocated if the current buffers are too small,
+ * so repeated searches with the same parameters do not allocate anything.
+ *
+ * @param ms the set of matches to reset
+ * @param size capacity of the set
+ * @param pattern_size space required for storing note positions of the matches.
+ *        If zero, no space is reserved for storing the positions.
+ * @param multiple_matches_per_song sets whether multiple matches per song
+ *        are stored (1) or if only the best match is kept (0)
+ *
+ * @return 1 if successful, 0 otherwise;
+ */
+int reset_match_set(matchset *ms, int size, int pattern_size,
+        int multiple_matches_per_song) {
+    int reassign;
+
+    if (size < 0) size = 0;
+    if (pattern_size < 0) pattern_size = 0;
+
     ms->multiple_matches_per_song = multiple_matches_per_song;
-    ms->time.indexing = 0.0;
-    ms->time.verifying = 0.0;
-    ms->time.other = 0.0;
-    ms->time.measure = 0;
-    ms->size = size;
-    ms->num_matches = 0;
-    ms->matches = (match *) calloc(size, sizeof(match));
-    if (ms->matches == NULL) {
-        printf("ERROR in init_match_set(): failed to allocate memory");
-        return 0;
+    clear_match_set(ms);
+
+    reassign = (size != ms->size) || (pattern_size != ms->pattern_size);
+
+    if ((ms->matches == NULL) || (size > ms->capacity)) {
+        free(ms->matches);
+        ms->matches = (match *) calloc(MAX2(size, 1), sizeof(match));
+        if (ms->matches == NULL) {
+            fputs("ERROR in reset_match_set(): failed to allocate memory\n",
+                    stderr);
+            ms->size = 0;
+            ms->capacity = 0;
+            return 0;
+        }
+        ms->capacity = MAX2(size, 1);
+        reassign = 1;
     }
-    if (pattern_size > 0) {
-        int i;
-        for (i=0; i<ms->size; ++i) {
-            match *m = &ms->matches[i];
-            m->num_notes = pattern_size;
-            m->notes = (int *) calloc(pattern_size, sizeof(int));
+    if (size * pattern_size > ms->note_capacity) {
+        free(ms->note_buffer);
+        ms->note_buffer = (int *) malloc(size * pattern_size * sizeof(int));
+        if (ms->note_buffer == NULL) {
+            fputs("ERROR in reset_match_set(): failed to allocate memory\n",
+                    stderr);
+            ms->note_capacity = 0;
+            ms->pattern_size = 0;
+            ms->size = 0;
+            return 0;
         }
+        ms->note_capacity = size * pattern_size;
+        reassign = 1;
     }
+
+    ms->size = size;
+    ms->pattern_size = pattern_size;
+    if (reassign) assign_match_notes(ms);
     return 1;
 }
 
 
 /**
- * Clears a set of match results.
+ * Clears a set of match results. This takes constant time: only the first
+ * num_matches items are considered valid, and note positions are
+ * initialized when a match is inserted.
  *
- * @param ms the set of matches to free
+ * @param ms the set of matches to clear
  */
 void clear_match_set(matchset *ms) {
     ms->time.indexing = 0.0;
     ms->time.verifying = 0.0;
     ms->time.other = 0.0;
     ms->time.measure = 0;
+    memset(&ms->cost, 0, sizeof(searchcost));
     ms->num_matches = 0;
-    if(ms->matches != NULL) {
-        int i, j;
-        match *m;
-        for (i=0; i<ms->size; ++i) {
-            m = &ms->matches[i];
-            m->song = -1;
-            m->start = 0;
-            m->end = 0;
-            m->transposition = 0;
-            m->similarity = 0.0F;
-            if (m->notes != NULL) {
-                for (j=0; j<m->num_notes; ++j) m->notes[j] = -1;
-            }
-        }
-    }
 }
 
 
@@ -159,7 +217,7 @@ static INLINE int match_overlap(match *m, int start, int end) {
  * Adds a match to a set of matches if it is good enough to fit.
  *
  * Note: caller should take care of filling the note position array within
- * the match item.
+ * the match item. All positions are initialized to -1 (no match).
  *
  * @param ms a set of matches where the new match is added
  * @param songid song number
@@ -174,7 +232,6 @@ static INLINE int match_overlap(match *m, int start, int end) {
 match *insert_match(matchset *ms, int songid, int start, int end,
         char transposition, float similarity) {
     int i;
-    int same_song = 0;
     match *m = NULL;
     int *mnotes = NULL;
 
@@ -182,8 +239,7 @@ match *insert_match(matchset *ms, int songid, int start, int end,
     for (i=0; i<ms->num_matches; ++i) {
         match *mi = &ms->matches[i];
         if (songid == mi->song) {
-            same_song++;
-	    int j;
+            int j;
             /* If multiple matches per song are allowed and the previous
                match doesn't overlap with this one, continue */
             if (ms->multiple_matches_per_song &&
@@ -191,6 +247,9 @@ match *insert_match(matchset *ms, int songid, int start, int end,
 
             if (similarity <= mi->similarity) return NULL;
 
+            /* The replaced match gives its note buffer to the new one */
+            mnotes = mi->notes;
+
             /* Move up in the array */
             for (j=i-1; j>=0; --j) {
                 if (ms->matches[j].similarity < similarity)
@@ -199,53 +258,40 @@ match *insert_match(matchset *ms, int songid, int start, int end,
                 else break;
             }
             m = &ms->matches[j+1];
-            
-	    break;
+            break;
         }
     }
     if (m == NULL) {
         /* Multiple matches per song are allowed or there was not a previous
-           result for this song */
-        for (i=0; i<ms->size; ++i) {
+           result for this song. Only the used part of the array is searched;
+           the first unused slot is taken if the set is not full. */
+        int last = ms->num_matches;
+        if (last >= ms->size) last = ms->size - 1;
+        for (i=0; i<=last; ++i) {
             match *mi = &ms->matches[i];
-            if (similarity > mi->similarity) {
+            if ((i == ms->num_matches) || (similarity > mi->similarity)) {
                 int j;
-                mnotes = ms->matches[ms->size-1].notes;
+                if (similarity <= 0.0F) break;
+
+                /* The last item drops out of the set (or an unused item is
+                   taken into use); its note buffer is recycled. */
+                mnotes = ms->matches[last].notes;
 
                 /* Move other matches down in the array */
-                if (i >= ms->num_matches) ms->num_matches = i + 1;
-                for (j=ms->size - 1; j>i; --j) {
+                if (last >= ms->num_matches) ms->num_matches = last + 1;
+                for (j=last; j>i; --j) {
                     memcpy(&ms->matches[j], &ms->matches[j-1], sizeof(match));
                 }
                 m = mi;
                 break;
             }
         }
-        /*if (same_song == 0){
-fprintf(stderr, "MATCH added %d\n", ms->size);
-m = &ms->matches[ms->size];
-if (m == NULL){
-
-fprintf(stderr, "MATCH added is NULL\n");
-}
-fprintf(stderr, "MATCH added 1\n");
-//m->notes = mnotes;
-        m->song = songid;
-        m->start = start;
-        m->end = end;
-        m->transposition = transposition;
-        m->similarity = similarity;
-fprintf(stderr, "MATCH added %d\n", ms->size);
-    
-//m = calloc(1, sizeof(match));
-//fprintf(stderr, "MATCH added 2\n");
-//ms->size += 1;
-//fprintf(stderr, "MATCH added 3\n");
-//ms->matches[0] = *m;
-	}*/
     }
     if (m != NULL) {
+        int j;
         m->notes = mnotes;
+        m->num_notes = ms->pattern_size;
+        for (j=0; j<ms->pattern_size; ++j) mnotes[j] = -1;
         m->song = songid;
         m->start = start;
         m->end = end;
@@ -254,5 +300,3 @@ fprintf(stderr, "MATCH added %d\n", ms->size);
     }
     return m;
 }
-
-
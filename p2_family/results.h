@@ -79,6 +79,26 @@ typedef struct {
 } searchtime;
 
 
+/**
+ * Verification cost of a search. Planned filters store their estimate
+ * here, and the index filters count the work they actually did, so that
+ * the two can be compared. All values accumulate over repeated searches
+ * until the match set is cleared.
+ */
+typedef struct {
+   /* Plan chosen by a planned filter; 0 if the search was not planned */
+   int plan;
+   /* Estimated number of index records read */
+   double estimated_records;
+   /* Estimated number of candidate positions verified */
+   double estimated_checks;
+   /* Number of index records read */
+   long long records;
+   /* Number of candidate positions verified */
+   long long checks;
+} searchcost;
+
+
 /**
  * A set of matches.
  */
@@ -98,8 +118,27 @@ typedef struct {
     /* Items */
     match *matches;
 
+    /* Number of allocated match items. This can be larger than size when
+       the set has been reset to hold fewer matches. */
+    int capacity;
+
+    /* Number of note positions reserved for each match */
+    int pattern_size;
+
+    /* Number of ints allocated for note_buffer */
+    int note_capacity;
+
+    /* A single pooled buffer for the note positions of all matches. The notes
+       pointer of each match points to a distinct pattern_size-long slice of
+       this buffer, and the slices move with the matches when they are
+       reordered. Matches in a set never own their note arrays. */
+    int *note_buffer;
+
     /* Search time */
     searchtime time;
+
+    /* Verification cost */
+    searchcost cost;
 } matchset;
 
 
@@ -113,6 +152,9 @@ void free_match_set(matchset *ms);
 int init_match_set(matchset *ms, int size, int pattern_size,
         int multiple_matches_per_song);
 
+int reset_match_set(matchset *ms, int size, int pattern_size,
+        int multiple_matches_per_song);
+
 void clear_match_set(matchset *ms);
 
 match *insert_match(matchset *ms, int song, int start, int end,
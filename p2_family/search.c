@@ -43,6 +43,8 @@
 #include "geometric_P3.h"
 #include "geometric_SP1.h"
 #include "geometric_SP2.h"
+#include "geometric_S2.h"
+#include "geometric_SIA.h"
 #include "sync_P3.h"
 #include "results.h"
 #include "search.h"
@@ -74,11 +76,7 @@ static void (* const SEARCH_FUNCTIONS[])(const songcollection *sc,
 /* 11 */  filter_p2_window,
 /* 12 */  filter_p2_select_local,
 /* 13 */  filter_p2_select_global,
-#ifdef ENABLE_BLOSSOM4
 /* 14 */  filter_p2_pigeonhole,
-#else
-/* 14 */  NULL,
-#endif
 /* 15 */  filter_p2_greedy_pigeonhole,
 /* 16 */  filter_p2_points,
 #ifdef ENABLE_MSM
@@ -108,6 +106,10 @@ static void (* const SEARCH_FUNCTIONS[])(const songcollection *sc,
 /* 26 */  NULL,
 #endif
 /* 27 */  NULL,
+/* 28 */  filter_p2_planned,
+/* 29 */  alg_s2,
+/* 30 */  alg_sia,
+/* 31 */  alg_sync_p3,
 };
 
 
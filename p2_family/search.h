@@ -66,6 +66,12 @@ typedef struct {
     int sync_accuracy;
     int syncmap_accuracy;
     int sync_window_size;
+
+    /* Write the synchronization map of each song to a PGM image */
+    int sync_write_maps;
+
+    /* Number of threads for sync_P3, or 0 for one per processor */
+    int sync_threads;
 } searchparameters;
 
 
@@ -0,0 +1,885 @@
+/*
+ * search_msm.c - Maximal subset matching (MSM) algorithms: sorted
+ *                difference vector counting and FFT cross-correlation of
+ *                sparse piano rolls.
+ *
+ * Version 2007-09-07
+ *
+ *
+ * Copyright (C) 2007 Niko Mikkila
+ *
+ * University of Helsinki, Department of Computer Science, C-BRAHMS project
+ *
+ * Contact: mikkila@cs.helsinki.fi
+ *
+ *
+ * This file is part of geometric-cbmr,
+ * C-BRAHMS Geometric algorithms for Content-Based Music Retrieval.
+ *
+ * Geometric-cbmr is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * Geometric-cbmr is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * geometric-cbmr; if not, write to the Free Software Foundation, Inc., 59
+ * Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "config.h"
+#include "algorithms.h"
+#include "util.h"
+#include "search_msm.h"
+
+
+/** Odd multiplier of the piano roll hash (2^64 / golden ratio) */
+#define MSM_HASH_MULTIPLIER 0x9E3779B97F4A7C15ULL
+
+
+/**
+ * 2D difference vector of the MFD algorithms. The song field is only used
+ * by the quick variant that sorts the whole collection at once.
+ */
+typedef struct {
+    int song;
+    int dt;
+    int dp;
+} msmdiff;
+
+
+/**
+ * Maps a note to a point on a line: start time in the high bits,
+ * pitch in the low 8 bits. Differences of these points identify the
+ * translation uniquely, because pitch differences stay within (-128, 128).
+ *
+ * @param v a note
+ *
+ * @return the point
+ */
+static INLINE long long note_point(const vector *v) {
+    return ((long long) v->strt << 8) + (long long) v->ptch;
+}
+
+
+/**
+ * Splits a 1D difference of two note points to time and pitch differences.
+ *
+ * @param d the difference
+ * @param dt time difference will be stored here
+ * @param dp pitch difference will be stored here
+ */
+static INLINE void split_difference(long long d, int *dt, int *dp) {
+    long long q = (d + 128) / 256;
+    if ((d + 128) % 256 < 0) --q;
+    *dt = (int) q;
+    *dp = (int) (d - q * 256);
+}
+
+
+/**
+ * Hashes a note point to a piano roll cell. The hash is linear modulo 2^64,
+ * so h(x) - h(y) is either h'(x - y) or h'(x - y) + 1 modulo the roll size,
+ * where h'(d) is the top bits of d * MSM_HASH_MULTIPLIER.
+ *
+ * @param x a note point, or a difference of two note points
+ * @param bits the roll has 2^bits cells
+ *
+ * @return the cell
+ */
+static INLINE unsigned int hash_point(long long x, int bits) {
+    return (unsigned int) (((unsigned long long) x * MSM_HASH_MULTIPLIER) >>
+            (64 - bits));
+}
+
+
+/**
+ * Reports a match at the given translation.
+ *
+ * @param ms match set
+ * @param s the song
+ * @param p the pattern
+ * @param dt time translation
+ * @param dp pitch translation
+ * @param count number of matching notes
+ */
+static void report_match(matchset *ms, const song *s, const song *p, int dt,
+        int dp, int count) {
+    int start = dt + p->notes[0].strt;
+    int end = dt + p->notes[p->size-1].strt + p->notes[p->size-1].dur;
+#ifdef P2_NORMALIZE_SIMILARITY
+    float similarity = ((float) count) / ((float) MIN2(p->size, s->size));
+#else
+    float similarity = ((float) count) / ((float) p->size);
+#endif
+    insert_match(ms, s->id, start, end, (char) dp, similarity);
+}
+
+
+/**
+ * Compares two 2D difference vectors. Used with qsort().
+ *
+ * @param aa the first difference
+ * @param bb the second difference
+ *
+ * @return -1, 0 or 1 for smaller, equal and greater
+ */
+static int compare_diffs(const void *aa, const void *bb) {
+    const msmdiff *a = (const msmdiff *) aa;
+    const msmdiff *b = (const msmdiff *) bb;
+    if (a->song != b->song) return (a->song < b->song) ? -1 : 1;
+    if (a->dt != b->dt) return (a->dt < b->dt) ? -1 : 1;
+    if (a->dp != b->dp) return (a->dp < b->dp) ? -1 : 1;
+    return 0;
+}
+
+
+/**
+ * Compares two 64-bit integers. Used with qsort().
+ *
+ * @param aa the first integer
+ * @param bb the second integer
+ *
+ * @return -1, 0 or 1 for smaller, equal and greater
+ */
+static int compare_longs(const void *aa, const void *bb) {
+    long long a = *((const long long *) aa);
+    long long b = *((const long long *) bb);
+    if (a < b) return -1;
+    else if (a > b) return 1;
+    else return 0;
+}
+
+
+/**
+ * Reports the most frequent translation in a sorted array of 2D
+ * differences that all belong to the same song.
+ *
+ * @param diffs the differences
+ * @param n number of differences
+ * @param s the song
+ * @param p the pattern
+ * @param ms match set
+ */
+static void report_diffs(const msmdiff *diffs, int n, const song *s,
+        const song *p, matchset *ms) {
+    int i, run = 0, best = 0, bestpos = 0;
+    for (i=0; i<n; ++i) {
+        if ((i > 0) && (diffs[i].dt == diffs[i-1].dt) &&
+                (diffs[i].dp == diffs[i-1].dp)) ++run;
+        else run = 1;
+        if (run > best) {
+            best = run;
+            bestpos = i;
+        }
+    }
+    if (best > 0) report_match(ms, s, p, diffs[bestpos].dt,
+            diffs[bestpos].dp, best);
+}
+
+
+/**
+ * Finds the most frequent value in a sorted array of 1D differences.
+ *
+ * @param diffs the differences
+ * @param n number of differences
+ * @param value the value will be stored here
+ *
+ * @return number of occurrences of the value
+ */
+static int most_frequent(const long long *diffs, int n, long long *value) {
+    int i, run = 0, best = 0;
+    for (i=0; i<n; ++i) {
+        if ((i > 0) && (diffs[i] == diffs[i-1])) ++run;
+        else run = 1;
+        if (run > best) {
+            best = run;
+            *value = diffs[i];
+        }
+    }
+    return best;
+}
+
+
+/**
+ * MFD 2D: sorts the 2D difference vectors between each song and the pattern
+ * and reports the most frequent one.
+ *
+ * @param sc song collection
+ * @param p pattern
+ * @param ms match set
+ */
+static void mfd_2d(const songcollection *sc, const song *p, matchset *ms) {
+    msmdiff *diffs = NULL;
+    int i, j, k, n, maxsize = 0;
+
+    for (i=0; i<sc->size; ++i) maxsize = MAX2(maxsize, sc->songs[i].size);
+    diffs = (msmdiff *) malloc((size_t) MAX2(maxsize, 1) * p->size *
+            sizeof(msmdiff));
+    if (diffs == NULL) {
+        fputs("Error in alg_msm(): failed to allocate memory\n", stderr);
+        return;
+    }
+    for (i=0; i<sc->size; ++i) {
+        const song *s = &sc->songs[i];
+        n = 0;
+        for (j=0; j<s->size; ++j) {
+            for (k=0; k<p->size; ++k) {
+                diffs[n].song = 0;
+                diffs[n].dt = s->notes[j].strt - p->notes[k].strt;
+                diffs[n].dp = s->notes[j].ptch - p->notes[k].ptch;
+                ++n;
+            }
+        }
+        qsort(diffs, n, sizeof(msmdiff), compare_diffs);
+        report_diffs(diffs, n, s, p, ms);
+    }
+    free(diffs);
+}
+
+
+/**
+ * MFD 2D quick: as mfd_2d(), but collects the difference vectors of all
+ * songs and sorts them at once.
+ *
+ * @param sc song collection
+ * @param p pattern
+ * @param ms match set
+ */
+static void mfd_2d_quick(const songcollection *sc, const song *p,
+        matchset *ms) {
+    msmdiff *diffs = NULL;
+    size_t total = 0, n = 0, first;
+    int i, j, k;
+
+    for (i=0; i<sc->size; ++i) total += (size_t) sc->songs[i].size;
+    diffs = (msmdiff *) malloc(MAX2(total, 1) * p->size * sizeof(msmdiff));
+    if (diffs == NULL) {
+        fputs("Error in alg_msm(): failed to allocate memory\n", stderr);
+        return;
+    }
+    for (i=0; i<sc->size; ++i) {
+        const song *s = &sc->songs[i];
+        for (j=0; j<s->size; ++j) {
+            for (k=0; k<p->size; ++k) {
+                diffs[n].song = i;
+                diffs[n].dt = s->notes[j].strt - p->notes[k].strt;
+                diffs[n].dp = s->notes[j].ptch - p->notes[k].ptch;
+                ++n;
+            }
+        }
+    }
+    qsort(diffs, n, sizeof(msmdiff), compare_diffs);
+    for (first=0; first<n; ) {
+        size_t end = first;
+        while ((end < n) && (diffs[end].song == diffs[first].song)) ++end;
+        report_diffs(&diffs[first], (int) (end - first),
+                &sc->songs[diffs[first].song], p, ms);
+        first = end;
+    }
+    free(diffs);
+}
+
+
+/**
+ * MFD 1D: sorts the differences of the note points (see note_point())
+ * between each song and the pattern and reports the most frequent one.
+ *
+ * @param sc song collection
+ * @param p pattern
+ * @param ms match set
+ */
+static void mfd_1d(const songcollection *sc, const song *p, matchset *ms) {
+    long long *diffs = NULL;
+    int i, j, k, n, count, dt, dp, maxsize = 0;
+
+    for (i=0; i<sc->size; ++i) maxsize = MAX2(maxsize, sc->songs[i].size);
+    diffs = (long long *) malloc((size_t) MAX2(maxsize, 1) * p->size *
+            sizeof(long long));
+    if (diffs == NULL) {
+        fputs("Error in alg_msm(): failed to allocate memory\n", stderr);
+        return;
+    }
+    for (i=0; i<sc->size; ++i) {
+        const song *s = &sc->songs[i];
+        long long value = 0;
+        n = 0;
+        for (j=0; j<s->size; ++j) {
+            long long x = note_point(&s->notes[j]);
+            for (k=0; k<p->size; ++k) {
+                diffs[n] = x - note_point(&p->notes[k]);
+                ++n;
+            }
+        }
+        qsort(diffs, n, sizeof(long long), compare_longs);
+        count = most_frequent(diffs, n, &value);
+        if (count > 0) {
+            split_difference(value, &dt, &dp);
+            report_match(ms, s, p, dt, dp, count);
+        }
+    }
+    free(diffs);
+}
+
+
+/**
+ * MFD 1D quick: as mfd_1d(), but sorts the differences of all songs at once.
+ * The song number is stored to the high bits of each sorted key.
+ *
+ * @param sc song collection
+ * @param p pattern
+ * @param ms match set
+ */
+static void mfd_1d_quick(const songcollection *sc, const song *p,
+        matchset *ms) {
+    const long long offset = 1LL << 39;
+    long long *keys = NULL;
+    size_t total = 0, n = 0, first;
+    int i, j, k;
+
+    for (i=0; i<sc->size; ++i) total += (size_t) sc->songs[i].size;
+    keys = (long long *) malloc(MAX2(total, 1) * p->size * sizeof(long long));
+    if (keys == NULL) {
+        fputs("Error in alg_msm(): failed to allocate memory\n", stderr);
+        return;
+    }
+    for (i=0; i<sc->size; ++i) {
+        const song *s = &sc->songs[i];
+        for (j=0; j<s->size; ++j) {
+            long long x = note_point(&s->notes[j]);
+            for (k=0; k<p->size; ++k) {
+                keys[n] = ((long long) i << 40) + offset + x -
+                        note_point(&p->notes[k]);
+                ++n;
+            }
+        }
+    }
+    qsort(keys, n, sizeof(long long), compare_longs);
+    for (first=0; first<n; ) {
+        int songnum = (int) (keys[first] >> 40);
+        long long value = 0;
+        size_t end = first;
+        int count, dt, dp;
+        while ((end < n) && ((int) (keys[end] >> 40) == songnum)) ++end;
+        count = most_frequent(&keys[first], (int) (end - first), &value);
+        split_difference((value & ((1LL << 40) - 1)) - offset, &dt, &dp);
+        report_match(ms, &sc->songs[songnum], p, dt, dp, count);
+        first = end;
+    }
+    free(keys);
+}
+
+
+/**
+ * MFD 1D quick space-efficient: produces the differences of each song in
+ * sorted order by merging one sorted stream per pattern note with a binary
+ * heap, so that only O(m) working space is needed.
+ *
+ * @param sc song collection
+ * @param p pattern
+ * @param ms match set
+ */
+static void mfd_1d_quick_spaceefficient(const songcollection *sc,
+        const song *p, matchset *ms) {
+    long long *heapkeys = NULL, *pnotes = NULL;
+    int *heapnotes = NULL, *pos = NULL;
+    int i, j, m = p->size;
+
+    heapkeys = (long long *) malloc(m * sizeof(long long));
+    pnotes = (long long *) malloc(m * sizeof(long long));
+    heapnotes = (int *) malloc(m * sizeof(int));
+    pos = (int *) malloc(m * sizeof(int));
+    if ((heapkeys == NULL) || (pnotes == NULL) || (heapnotes == NULL) ||
+            (pos == NULL)) {
+        fputs("Error in alg_msm(): failed to allocate memory\n", stderr);
+        goto EXIT;
+    }
+    for (j=0; j<m; ++j) pnotes[j] = note_point(&p->notes[j]);
+
+    for (i=0; i<sc->size; ++i) {
+        const song *s = &sc->songs[i];
+        long long previous = 0, value = 0;
+        int run = 0, best = 0, size = m;
+        if (s->size == 0) continue;
+
+        /* Heap of the current difference of each pattern note */
+        for (j=0; j<m; ++j) {
+            int c = j;
+            long long key = note_point(&s->notes[0]) - pnotes[j];
+            pos[j] = 0;
+            while ((c > 0) && (heapkeys[(c-1) >> 1] > key)) {
+                heapkeys[c] = heapkeys[(c-1) >> 1];
+                heapnotes[c] = heapnotes[(c-1) >> 1];
+                c = (c-1) >> 1;
+            }
+            heapkeys[c] = key;
+            heapnotes[c] = j;
+        }
+
+        while (size > 0) {
+            long long key = heapkeys[0];
+            int note = heapnotes[0], c = 0;
+
+            if ((run > 0) && (key == previous)) ++run;
+            else run = 1;
+            previous = key;
+            if (run > best) {
+                best = run;
+                value = key;
+            }
+
+            /* Advance the stream at the root and sift it down */
+            ++pos[note];
+            if (pos[note] < s->size) {
+                key = note_point(&s->notes[pos[note]]) - pnotes[note];
+            } else {
+                --size;
+                key = heapkeys[size];
+                note = heapnotes[size];
+            }
+            for (;;) {
+                int child = (c << 1) + 1;
+                if (child >= size) break;
+                if ((child + 1 < size) &&
+                        (heapkeys[child+1] < heapkeys[child])) ++child;
+                if (heapkeys[child] >= key) break;
+                heapkeys[c] = heapkeys[child];
+                heapnotes[c] = heapnotes[child];
+                c = child;
+            }
+            heapkeys[c] = key;
+            heapnotes[c] = note;
+        }
+
+        if (best > 0) {
+            int dt, dp;
+            split_difference(value, &dt, &dp);
+            report_match(ms, s, p, dt, dp, best);
+        }
+    }
+
+EXIT:
+    free(heapkeys);
+    free(pnotes);
+    free(heapnotes);
+    free(pos);
+}
+
+
+/**
+ * Calculates an in-place radix-2 fast Fourier transform.
+ *
+ * @param data 2^bits complex numbers as interleaved real and imaginary parts
+ * @param bits logarithm of the transform size
+ * @param inverse 1 for the inverse transform (without the 1/n scaling),
+ *        0 for the forward transform
+ * @param msc MSM song collection whose root table is used
+ */
+static void fft(double *data, int bits, int inverse,
+        const msmsongcollection *msc) {
+    const double *tw = msc->twiddles;
+    unsigned int n = 1U << bits, i, j, len;
+    double sign = inverse ? -1.0 : 1.0;
+
+    /* Bit-reversal permutation */
+    for (i=1, j=0; i<n; ++i) {
+        unsigned int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double t = data[2*i];
+            data[2*i] = data[2*j];
+            data[2*j] = t;
+            t = data[2*i+1];
+            data[2*i+1] = data[2*j+1];
+            data[2*j+1] = t;
+        }
+    }
+
+    /* Butterflies */
+    for (len=2; len<=n; len<<=1) {
+        unsigned int half = len >> 1;
+        unsigned int stride = (1U << msc->maxbits) / len;
+        for (i=0; i<n; i+=len) {
+            unsigned int k;
+            for (k=0; k<half; ++k) {
+                double wr = tw[2*k*stride];
+                double wi = sign * tw[2*k*stride+1];
+                double *a = &data[2*(i+k)];
+                double *b = &data[2*(i+k+half)];
+                double tr = wr * b[0] - wi * b[1];
+                double ti = wr * b[1] + wi * b[0];
+                b[0] = a[0] - tr;
+                b[1] = a[1] - ti;
+                a[0] += tr;
+                a[1] += ti;
+            }
+        }
+    }
+}
+
+
+/**
+ * Counts the translations whose hashed difference is the given cell and
+ * returns the most frequent one.
+ *
+ * @param s the song
+ * @param r piano roll of the song
+ * @param p the pattern
+ * @param cell the difference cell
+ * @param buffer pointer to a growing work buffer
+ * @param buffersize pointer to the size of the buffer
+ * @param value the most frequent difference will be stored here
+ *
+ * @return number of matching notes at the returned difference, or -1 if
+ *         memory allocation failed
+ */
+static int verify_cell(const song *s, const msmsong *r, const song *p,
+        unsigned int cell, long long **buffer, int *buffersize,
+        long long *value) {
+    unsigned int mask = (1U << r->bits) - 1;
+    int j, n = 0;
+
+    for (j=0; j<p->size; ++j) {
+        long long y = note_point(&p->notes[j]);
+        unsigned int h = hash_point(y, r->bits);
+        int c;
+        for (c=0; c<2; ++c) {
+            unsigned int target = (h + cell + c) & mask;
+            int k;
+            for (k=r->bucketstart[target]; k<r->bucketstart[target+1]; ++k) {
+                long long d = note_point(&s->notes[r->bucketnotes[k]]) - y;
+                /* Keep only the differences that belong to this cell */
+                if (hash_point(d, r->bits) != cell) continue;
+                if (n == *buffersize) {
+                    int newsize = MAX2(2 * n, 64);
+                    long long *b = (long long *) realloc(*buffer,
+                            newsize * sizeof(long long));
+                    if (b == NULL) return -1;
+                    *buffer = b;
+                    *buffersize = newsize;
+                }
+                (*buffer)[n] = d;
+                ++n;
+            }
+        }
+    }
+    qsort(*buffer, n, sizeof(long long), compare_longs);
+    return most_frequent(*buffer, n, value);
+}
+
+
+/**
+ * MSM with FFT: cross-correlates the hashed piano rolls of the pattern and
+ * each song. A hashed difference collects the matches of all translations
+ * that hash to it, so its correlation is an upper bound for their match
+ * counts. The cells are verified in the order of decreasing correlation
+ * until the bound drops to the best verified count, or until maxpeaks cells
+ * have been verified.
+ *
+ * @param sc song collection
+ * @param p pattern
+ * @param maxpeaks maximum number of cells to verify in each song
+ * @param ms match set
+ */
+static void msm_fft(const songcollection *sc, const song *p, int maxpeaks,
+        matchset *ms) {
+    const msmsongcollection *msc = (const msmsongcollection *)
+            sc->data[DATA_MSM];
+    double *patternspectra[32];
+    double *work = NULL;
+    int *scores = NULL, *order = NULL, *histogram = NULL;
+    long long *buffer = NULL;
+    int buffersize = 0;
+    int i, j;
+
+    memset(patternspectra, 0, sizeof(patternspectra));
+    if ((msc == NULL) || (msc->songs == NULL)) {
+        fputs("Error in alg_msm(): song collection does not contain MSM data.\nUse update_song_collection_data() before calling this function.\n", stderr);
+        return;
+    }
+
+    work = (double *) malloc(((size_t) 2 << msc->maxbits) * sizeof(double));
+    scores = (int *) malloc(((size_t) 1 << msc->maxbits) * sizeof(int));
+    order = (int *) malloc(((size_t) 1 << msc->maxbits) * sizeof(int));
+    histogram = (int *) malloc((p->size * 2 + 3) * sizeof(int));
+    if ((work == NULL) || (scores == NULL) || (order == NULL) ||
+            (histogram == NULL)) goto ERROR;
+
+    for (i=0; i<msc->size; ++i) {
+        const song *s = &sc->songs[i];
+        const msmsong *r = &msc->songs[i];
+        const double *ss = r->spectrum;
+        const double *ps;
+        unsigned int n, mask, k;
+        int maxscore = 0, best = 0, tried = 0, bestdt = 0, bestdp = 0;
+        int candidates = 0;
+
+        if (s->size == 0) continue;
+        n = 1U << r->bits;
+        mask = n - 1;
+
+        /* Transform the pattern roll once for each roll size */
+        if (patternspectra[r->bits] == NULL) {
+            double *pspec = (double *) calloc((size_t) 2 * n,
+                    sizeof(double));
+            if (pspec == NULL) goto ERROR;
+            for (j=0; j<p->size; ++j)
+                pspec[2 * hash_point(note_point(&p->notes[j]), r->bits)] +=
+                        1.0;
+            fft(pspec, r->bits, 0, msc);
+            patternspectra[r->bits] = pspec;
+        }
+        ps = patternspectra[r->bits];
+
+        /* Correlation: inverse transform of S * conj(P) */
+        for (k=0; k<n; ++k) {
+            work[2*k] = ss[2*k] * ps[2*k] + ss[2*k+1] * ps[2*k+1];
+            work[2*k+1] = ss[2*k+1] * ps[2*k] - ss[2*k] * ps[2*k+1];
+        }
+        fft(work, r->bits, 1, msc);
+        for (k=0; k<n; ++k) {
+            int c = (int) floor(work[2*k] / (double) n + 0.5);
+            scores[k] = MAX2(c, 0);
+        }
+        /* Pairs of a difference hash to one of two adjacent cells */
+        for (k=0; k<n; ++k) {
+            scores[k] = MIN2(scores[k] + scores[(k + 1) & mask],
+                    p->size * 2 + 1);
+            if (scores[k] > maxscore) maxscore = scores[k];
+        }
+
+        /* Order the cells by decreasing score with a counting sort */
+        memset(histogram, 0, (maxscore + 2) * sizeof(int));
+        for (k=0; k<n; ++k) ++histogram[maxscore - scores[k] + 1];
+        for (j=1; j<=maxscore+1; ++j) histogram[j] += histogram[j-1];
+        for (k=0; k<n; ++k) {
+            if (scores[k] == 0) continue;
+            order[histogram[maxscore - scores[k]]++] = (int) k;
+            ++candidates;
+        }
+
+        for (j=0; j<candidates; ++j) {
+            unsigned int cell = (unsigned int) order[j];
+            long long value = 0;
+            int count;
+            if ((scores[cell] <= best) || (tried >= maxpeaks)) break;
+            count = verify_cell(s, r, p, cell, &buffer, &buffersize, &value);
+            if (count < 0) goto ERROR;
+            ++tried;
+            if (count > best) {
+                best = count;
+                split_difference(value, &bestdt, &bestdp);
+            }
+        }
+        if (best > 0) report_match(ms, s, p, bestdt, bestdp, best);
+    }
+    goto EXIT;
+
+ERROR:
+    fputs("Error in alg_msm(): failed to allocate memory\n", stderr);
+EXIT:
+    for (i=0; i<32; ++i) free(patternspectra[i]);
+    free(work);
+    free(scores);
+    free(order);
+    free(histogram);
+    free(buffer);
+}
+
+
+/**
+ * Searches for the largest transposition-invariant partial occurrence of
+ * the pattern in each song (problem P2) with one of the MSM algorithms.
+ *
+ * The MFD variants sort and count all difference vectors between the song
+ * and the pattern notes. The FFT variants cross-correlate hashed piano rolls
+ * that are stored in the MSM data format (see build_msm_song_collection())
+ * and verify the strongest correlations: ALG_MSM_FFT verifies until the
+ * result is exact, ALG_MSM_FFT_LOOKUP_1 only the single strongest cell
+ * and ALG_MSM_FFT_LOOKUP_2 at most parameters->msm_r cells per song.
+ *
+ * @param sc a song collection
+ * @param pattern the input pattern to search for
+ * @param alg search algorithm to use. See algorithms.h for algorithm IDs.
+ * @param parameters search parameters
+ * @param ms information about the found matches will be stored here
+ */
+void alg_msm(const songcollection *sc, const song *pattern, int alg,
+        const searchparameters *parameters, matchset *ms) {
+    if (pattern->size == 0) return;
+
+    switch (alg) {
+        case ALG_MSM_MFD_2D:
+            mfd_2d(sc, pattern, ms);
+            break;
+        case ALG_MSM_MFD_2D_QUICK:
+            mfd_2d_quick(sc, pattern, ms);
+            break;
+        case ALG_MSM_MFD_1D:
+            mfd_1d(sc, pattern, ms);
+            break;
+        case ALG_MSM_MFD_1D_QUICK:
+            mfd_1d_quick(sc, pattern, ms);
+            break;
+        case ALG_MSM_MFD_1D_QUICK_SPACEEFF:
+            mfd_1d_quick_spaceefficient(sc, pattern, ms);
+            break;
+        case ALG_MSM_FFT:
+            msm_fft(sc, pattern, INT_MAX, ms);
+            break;
+        case ALG_MSM_FFT_LOOKUP_1:
+            msm_fft(sc, pattern, 1, ms);
+            break;
+        case ALG_MSM_FFT_LOOKUP_2:
+            msm_fft(sc, pattern, MAX2(parameters->msm_r, 1), ms);
+            break;
+        default:
+            fprintf(stderr, "Error in alg_msm(): unknown algorithm %d\n",
+                    alg);
+            break;
+    }
+}
+
+
+/**
+ * Initializes an MSM song collection struct.
+ *
+ * @return pointer to the data structure
+ */
+void *init_msm_song_collection(void) {
+    return calloc(1, sizeof(msmsongcollection));
+}
+
+
+/**
+ * Builds the hashed piano rolls and their Fourier transforms for the given
+ * song collection. Each song gets a roll of at least MSM_HASH_FACTOR cells
+ * per note.
+ *
+ * @param msm_sc pointer to a structure initialized with
+ *        init_msm_song_collection()
+ * @param sc song collection
+ * @param dp data parameters (not used)
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int build_msm_song_collection(void *msm_sc, const songcollection *sc,
+        const dataparameters *dp) {
+    msmsongcollection *msc = (msmsongcollection *) msm_sc;
+    unsigned int k, half;
+    int i, j;
+
+    msc->sc = sc;
+    msc->size = sc->size;
+    msc->maxbits = 1;
+    msc->songs = (msmsong *) calloc(MAX2(sc->size, 1), sizeof(msmsong));
+    if (msc->songs == NULL) goto ERROR;
+
+    for (i=0; i<sc->size; ++i) {
+        msmsong *r = &msc->songs[i];
+        for (r->bits=MSM_MIN_BITS; ((1LL << r->bits) <
+                (long long) MSM_HASH_FACTOR * sc->songs[i].size) &&
+                (r->bits < 30); ++r->bits);
+        if (r->bits > msc->maxbits) msc->maxbits = r->bits;
+    }
+
+    /* Roots of unity for the largest transform */
+    half = 1U << (msc->maxbits - 1);
+    msc->twiddles = (double *) malloc((size_t) 2 * half * sizeof(double));
+    if (msc->twiddles == NULL) goto ERROR;
+    for (k=0; k<half; ++k) {
+        double a = -2.0 * M_PI * (double) k / (double) (2 * half);
+        msc->twiddles[2*k] = cos(a);
+        msc->twiddles[2*k+1] = sin(a);
+    }
+
+    for (i=0; i<sc->size; ++i) {
+        const song *s = &sc->songs[i];
+        msmsong *r = &msc->songs[i];
+        unsigned int n = 1U << r->bits;
+        unsigned int *cells;
+
+        if (s->size == 0) continue;
+        r->spectrum = (double *) calloc((size_t) 2 * n, sizeof(double));
+        r->bucketstart = (int *) calloc(n + 1, sizeof(int));
+        r->bucketnotes = (int *) malloc(s->size * sizeof(int));
+        cells = (unsigned int *) malloc(s->size * sizeof(unsigned int));
+        if ((r->spectrum == NULL) || (r->bucketstart == NULL) ||
+                (r->bucketnotes == NULL) || (cells == NULL)) {
+            free(cells);
+            goto ERROR;
+        }
+
+        /* Roll and its transform */
+        for (j=0; j<s->size; ++j) {
+            cells[j] = hash_point(note_point(&s->notes[j]), r->bits);
+            r->spectrum[2 * cells[j]] += 1.0;
+            ++r->bucketstart[cells[j] + 1];
+        }
+        fft(r->spectrum, r->bits, 0, msc);
+
+        /* Note lists of the cells */
+        for (k=0; k<n; ++k) r->bucketstart[k+1] += r->bucketstart[k];
+        for (j=0; j<s->size; ++j) {
+            r->bucketnotes[r->bucketstart[cells[j]]] = j;
+            ++r->bucketstart[cells[j]];
+        }
+        for (k=n; k>0; --k) r->bucketstart[k] = r->bucketstart[k-1];
+        r->bucketstart[0] = 0;
+        free(cells);
+    }
+    return 1;
+
+ERROR:
+    fputs("Error in build_msm_song_collection(): failed to allocate memory\n",
+            stderr);
+    clear_msm_song_collection(msm_sc);
+    return 0;
+}
+
+
+/**
+ * Clears and re-initializes the given MSM song collection.
+ *
+ * @param msm_sc the structure to clear
+ */
+void clear_msm_song_collection(void *msm_sc) {
+    msmsongcollection *msc = (msmsongcollection *) msm_sc;
+    int i;
+    if (msc->songs != NULL) {
+        for (i=0; i<msc->size; ++i) {
+            free(msc->songs[i].spectrum);
+            free(msc->songs[i].bucketstart);
+            free(msc->songs[i].bucketnotes);
+        }
+        free(msc->songs);
+    }
+    free(msc->twiddles);
+    memset(msc, 0, sizeof(msmsongcollection));
+}
+
+
+/**
+ * Frees an MSM song collection.
+ *
+ * @param msm_sc the structure to free
+ */
+void free_msm_song_collection(void *msm_sc) {
+    if (msm_sc != NULL) {
+        clear_msm_song_collection(msm_sc);
+        free(msm_sc);
+    }
+}
+
@@ -44,6 +44,40 @@ extern "C" {
 #endif
 
 
+/**
+ * Sparse piano roll of a song for the FFT-based MSM algorithms. The notes
+ * are hashed to 2^bits cells so that the hash preserves the differences
+ * between the notes up to one cell.
+ */
+typedef struct {
+    /** The roll has 2^bits cells */
+    int bits;
+
+    /** Fourier transform of the roll as interleaved complex numbers */
+    double *spectrum;
+
+    /** Notes of the song ordered by their cells: the notes in cell c are
+     *  bucketnotes[bucketstart[c]] ... bucketnotes[bucketstart[c+1]-1] */
+    int *bucketstart;
+    int *bucketnotes;
+} msmsong;
+
+
+/**
+ * MSM data format: piano rolls of all songs in a song collection.
+ */
+typedef struct {
+    const songcollection *sc;
+    int size;
+    msmsong *songs;
+
+    /** Largest roll size (2^maxbits) and the complex roots of unity
+     *  exp(-2 pi i k / 2^maxbits), k < 2^(maxbits-1), for the transforms */
+    int maxbits;
+    double *twiddles;
+} msmsongcollection;
+
+
 /* External function declarations */
 
 void alg_msm(const songcollection *sc, const song *pattern, int alg,
@@ -34,6 +34,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "config.h"
 #include "algorithms.h"
@@ -676,18 +679,18 @@ int get_pattern(song *pattern, const song *s, match *m,
     minpitch = NOTE_PITCHES - 1;
     maxpitch = 0;
 
-    /* Fill in match information */
+    /* Fill in match information. Note positions are stored to the buffer
+     * that the match set has reserved for this match. */
     m->song = sindex;
     m->start = start;
-    m->num_notes = length;
-    m->notes = (int *) malloc(length * sizeof(int));
-    if (m->notes == NULL) {
-        fputs("Error in generate_pattern(): failed to allocate memory\n",
+    if ((m->notes == NULL) || (m->num_notes < length)) {
+        fputs("Error in generate_pattern(): match set has no room for note positions\n",
                 stderr);
         free(pattern->notes);
         free(pattern->title);
         return 0;
     }
+    m->num_notes = length;
 
     m->similarity = 1.0F;
 
@@ -724,6 +727,7 @@ int get_pattern(song *pattern, const song *s, match *m,
     m->end = start + pattern->notes[length-1].strt +
             pattern->notes[length-1].dur;
     pattern->duration = m->end - m->start;
+    return 1;
 }
 
 /**
@@ -812,18 +816,18 @@ int generate_pattern(song *pattern, const songcollection *sc, match *m,
     minpitch = NOTE_PITCHES - 1;
     maxpitch = 0;
 
-    /* Fill in match information */
+    /* Fill in match information. Note positions are stored to the buffer
+     * that the match set has reserved for this match. */
     m->song = sindex;
     m->start = start;
-    m->num_notes = length;
-    m->notes = (int *) malloc(length * sizeof(int));
-    if (m->notes == NULL) {
-        fputs("Error in generate_pattern(): failed to allocate memory\n",
+    if ((m->notes == NULL) || (m->num_notes < length)) {
+        fputs("Error in generate_pattern(): match set has no room for note positions\n",
                 stderr);
         free(pattern->notes);
         free(pattern->title);
         return 0;
     }
+    m->num_notes = length;
 
     m->similarity = 1.0F - errors;
 
@@ -951,7 +955,7 @@ int generate_patterns_song(songcollection *pc, const song *s, matchset *ms, int
         return 0;
     }
 
-    if (!init_match_set(ms, patterncount, 0, 1)) {
+    if (!init_match_set(ms, patterncount, length, 1)) {
         free_song_collection(pc);
         return 0;
     }
@@ -979,6 +983,120 @@ int generate_patterns_song(songcollection *pc, const song *s, matchset *ms, int
 }
 
 
+/**
+ * Returns the maximum number of patterns that generate_patterns_song() and
+ * generate_pattern_views() create from a song.
+ *
+ * @param s a song
+ * @param length length of a pattern
+ * @param window number of notes of overlap between patterns
+ *
+ * @return maximum number of patterns
+ */
+int max_patterns_song(const song *s, int length, int window) {
+    if ((length <= 0) || (window <= 0)) return 0;
+    return (length / window) * (s->size / length);
+}
+
+
+/**
+ * Describes a pattern in a song position without copying the notes.
+ * The pattern is the same as get_pattern() would generate: it ends before
+ * the first note that repeats the onset time and pitch of the previous one.
+ *
+ * @param v a structure that will hold the pattern description
+ * @param s a song
+ * @param length length of the pattern
+ * @param position position of the first pattern note in the song
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int get_pattern_view(patternview *v, const song *s, int length,
+        int position) {
+    const vector *notes;
+    int i;
+
+    if (length <= 0) {
+        fputs("Error in get_pattern_view(): wrong argument length\n",
+                stderr);
+        return 0;
+    }
+    if ((position < 0) || (position + length >= s->size)) {
+        fputs("Error in get_pattern_view(): wrong argument position\n",
+                stderr);
+        return 0;
+    }
+
+    notes = &s->notes[position];
+    for (i=1; i<length; ++i) {
+        if ((notes[i].strt == notes[i-1].strt) &&
+                (notes[i].ptch == notes[i-1].ptch)) break;
+    }
+
+    v->s = s;
+    v->position = position;
+    v->size = i;
+    v->start = notes[0].strt;
+    /* get_pattern() takes the end time from the last of the requested
+     * notes, which stays zeroed when the pattern is cut short. */
+    if (i == length) v->end = notes[length-1].strt + notes[length-1].dur;
+    else v->end = v->start;
+    return 1;
+}
+
+
+/**
+ * Describes the patterns of generate_patterns_song() without allocating
+ * memory. The patterns are stored in the same order.
+ *
+ * @param views an array for the pattern descriptions. See
+ *        max_patterns_song() for the required size.
+ * @param maxviews size of the views array
+ * @param s a song
+ * @param length length of a pattern
+ * @param window number of notes of overlap between patterns
+ *
+ * @return number of patterns generated
+ */
+int generate_pattern_views(patternview *views, int maxviews, const song *s,
+        int length, int window) {
+    int i, j, k = 0;
+    int numwindows, numpatterns;
+
+    if ((length <= 0) || (window <= 0)) return 0;
+    numwindows = length / window;
+    numpatterns = s->size / length;
+
+    for (j=0; j<numwindows; ++j) {
+        for (i=0; i<numpatterns; ++i) {
+            int position = (i * length) + (window * j);
+            if (position + length >= s->size) continue;
+            if (k == maxviews) return k;
+            if (get_pattern_view(&views[k], s, length, position)) ++k;
+        }
+    }
+    return k;
+}
+
+
+/**
+ * Makes a song structure that refers to the notes of a pattern view.
+ * The song shares the notes with the original song and must not be freed
+ * with free_song().
+ *
+ * @param v a pattern description
+ * @param p the song structure to fill
+ */
+void pattern_view_song(const patternview *v, song *p) {
+    memset(p, 0, sizeof(song));
+    p->id = v->s->id;
+    p->title = v->s->title;
+    p->size = v->size;
+    p->notes = &v->s->notes[v->position];
+    p->duration = v->end - v->start;
+}
+
+
 /**
  * Generates a collection of random patterns from the given song collection.
  *
@@ -1007,7 +1125,7 @@ int generate_pattern_collection(int patterncount, songcollection *pc,
         return 0;
     }
 
-    if (!init_match_set(ms, patterncount, 0, 0)) {
+    if (!init_match_set(ms, patterncount, MAX2(minlength, maxlength), 0)) {
         free_song_collection(pc);
         return 0;
     }
@@ -1217,3 +1335,279 @@ void update_song_collection_data(songcollection *sc, const int *algorithm_list,
     }
 }
 
+
+/**
+ * Updates the alternative data formats of a song collection after songs
+ * have been appended to it. Formats that support it, such as the vector
+ * index, only process the new songs; the others are rebuilt.
+ *
+ * @param sc a song collection whose data has been updated with
+ *        update_song_collection_data() before appending the songs
+ * @param first_song the first appended song
+ * @param dp data parameters
+ */
+void append_song_collection_data(songcollection *sc, int first_song,
+        const dataparameters *dp) {
+    int i;
+    for (i=1; i<=NUM_DATA_FORMATS; ++i) {
+        if (sc->data[i] == NULL) continue;
+        if (!extend_song_collection(i, sc->data[i], sc, first_song, dp)) {
+            fprintf(stderr, "Error in append_song_collection_data: updating format %d failed\n", i);
+        }
+    }
+}
+
+
+
+/**
+ * Initializes a song key structure.
+ *
+ * @param k the structure to initialize
+ */
+void init_song_keys(songkeys *k) {
+    k->s = NULL;
+    k->keys = NULL;
+    k->capacity = 0;
+    k->first = 0;
+    k->end = 0;
+}
+
+
+/**
+ * Prepares a song key structure for accessing the keys of a song. The key
+ * buffer is reused if it is large enough.
+ *
+ * @param k an initialized song key structure
+ * @param s a song
+ *
+ * @return 1 if successful, 0 if memory allocation failed
+ */
+int set_song_keys(songkeys *k, const song *s) {
+    if (k->capacity < s->size) {
+        int *keys = (int *) realloc(k->keys, s->size * sizeof(int));
+        if (keys == NULL) {
+            fputs("Error in set_song_keys(): failed to allocate memory\n",
+                    stderr);
+            return 0;
+        }
+        k->keys = keys;
+        k->capacity = s->size;
+    }
+    k->s = s;
+    k->first = 0;
+    k->end = 0;
+    return 1;
+}
+
+
+/**
+ * Frees the key buffer of a song key structure.
+ *
+ * @param k a song key structure
+ */
+void free_song_keys(songkeys *k) {
+    free(k->keys);
+    init_song_keys(k);
+}
+
+
+/**
+ * Makes the keys of the given range of notes valid. If the range does not
+ * touch the currently valid range, the old keys are discarded to avoid
+ * computing keys for the notes between them.
+ *
+ * @param k a song key structure
+ * @param from the first note
+ * @param to the position after the last note
+ */
+static void update_song_keys(songkeys *k, int from, int to) {
+    const vector *notes = k->s->notes;
+    int j;
+    if (from < 0) from = 0;
+    if (to > k->s->size) to = k->s->size;
+    if (from >= to) return;
+    if ((to < k->first) || (from > k->end) || (k->first == k->end)) {
+        k->first = from;
+        k->end = from;
+    }
+    for (j=k->end; j<to; ++j)
+        k->keys[j] = ((int) notes[j].strt << 8) + (int) notes[j].ptch;
+    if (to > k->end) k->end = to;
+    for (j=from; j<k->first; ++j)
+        k->keys[j] = ((int) notes[j].strt << 8) + (int) notes[j].ptch;
+    if (from < k->first) k->first = from;
+}
+
+
+/**
+ * Returns the packed key of a note.
+ *
+ * @param k a song key structure
+ * @param j note position, which must be inside the song
+ *
+ * @return ((strt << 8) + ptch) of the note
+ */
+int song_key(songkeys *k, int j) {
+    if ((j < k->first) || (j >= k->end)) update_song_keys(k, j, j + 16);
+    return k->keys[j];
+}
+
+
+/**
+ * Finds the first note after position j whose key relative to v0 is not
+ * smaller than pi. This is the step that the P1 and P2 alignment checks
+ * take to skip over song notes that are not in the pattern. Keys are
+ * compared four at a time with SSE2 when it is available.
+ *
+ * @param k a song key structure
+ * @param j a note position
+ * @param v0 key of the song note that is aligned with the pattern
+ * @param pi key of the searched pattern note relative to the aligned
+ *        pattern note
+ *
+ * @return the found position, or the song size if there is no such note
+ */
+int next_song_key(songkeys *k, int j, int v0, int pi) {
+    int size = k->s->size;
+    int block = 16;
+    ++j;
+    while (j < size) {
+        int end;
+        if ((j < k->first) || (j >= k->end)) update_song_keys(k, j, j + block);
+        end = k->end;
+#ifdef __SSE2__
+        {
+            __m128i vv0 = _mm_set1_epi32(v0);
+            __m128i vpi = _mm_set1_epi32(pi);
+            for (; j + 4 <= end; j += 4) {
+                __m128i d = _mm_sub_epi32(_mm_loadu_si128(
+                        (const __m128i *) &k->keys[j]), vv0);
+                int mask = _mm_movemask_ps(_mm_castsi128_ps(
+                        _mm_cmplt_epi32(d, vpi)));
+                if (mask != 0x0F) return j + __builtin_ctz(~mask);
+            }
+        }
+#endif
+        for (; j < end; ++j) {
+            if (k->keys[j] - v0 >= pi) return j;
+        }
+        block <<= 1;
+    }
+    return size;
+}
+
+
+/**
+ * Finds the last note before position j whose key relative to v0 is not
+ * smaller than pi, where the relative key of note i is (v0 - key(i)). This
+ * is the backward counterpart of next_song_key().
+ *
+ * @param k a song key structure
+ * @param j a note position
+ * @param v0 key of the song note that is aligned with the pattern
+ * @param pi key of the aligned pattern note relative to the searched
+ *        pattern note
+ *
+ * @return the found position, or -1 if there is no such note
+ */
+int previous_song_key(songkeys *k, int j, int v0, int pi) {
+    int block = 16;
+    --j;
+    while (j >= 0) {
+        int first;
+        if ((j < k->first) || (j >= k->end))
+            update_song_keys(k, j - block + 1, j + 1);
+        first = k->first;
+#ifdef __SSE2__
+        {
+            __m128i vv0 = _mm_set1_epi32(v0);
+            __m128i vpi = _mm_set1_epi32(pi);
+            for (; j - 3 >= first; j -= 4) {
+                __m128i d = _mm_sub_epi32(vv0, _mm_loadu_si128(
+                        (const __m128i *) &k->keys[j - 3]));
+                int mask = _mm_movemask_ps(_mm_castsi128_ps(
+                        _mm_cmplt_epi32(d, vpi)));
+                if (mask != 0x0F) return j - 3 + 31 - __builtin_clz(
+                        (~mask) & 0x0F);
+            }
+        }
+#endif
+        for (; j >= first; --j) {
+            if (v0 - k->keys[j] >= pi) return j;
+        }
+        block <<= 1;
+    }
+    return -1;
+}
+
+
+/**
+ * An alignment candidate with its original position, used for sorting.
+ */
+typedef struct {
+    int song;
+    int songpos;
+    int index;
+} sortedcandidate;
+
+
+/**
+ * Compares sorted candidates by song and song position. Equal candidates
+ * keep their original order.
+ *
+ * @param a a sortedcandidate
+ * @param b another sortedcandidate
+ *
+ * @return negative if a comes before b, positive otherwise
+ */
+static int compare_sorted_candidates(const void *a, const void *b) {
+    const sortedcandidate *ca = (const sortedcandidate *) a;
+    const sortedcandidate *cb = (const sortedcandidate *) b;
+    if (ca->song != cb->song) return (ca->song < cb->song) ? -1 : 1;
+    if (ca->songpos != cb->songpos)
+        return (ca->songpos < cb->songpos) ? -1 : 1;
+    return ca->index - cb->index;
+}
+
+
+/**
+ * Orders alignment candidates by song and song position, so that they can
+ * be verified with good memory locality.
+ *
+ * @param c candidates
+ * @param n number of candidates
+ * @param order the candidate indices will be stored here in sorted order
+ *
+ * @return 1 if successful, 0 if memory allocation failed
+ */
+int sort_alignment_candidates(const alignmentcandidate *c, int n,
+        int *order) {
+    int i;
+    sortedcandidate *sc;
+
+    /* Candidates read from a single index bucket are already in order */
+    for (i=1; i<n; ++i) {
+        if ((c[i].song < c[i-1].song) || ((c[i].song == c[i-1].song) &&
+                (c[i].songpos < c[i-1].songpos))) break;
+    }
+    if (i >= n) {
+        for (i=0; i<n; ++i) order[i] = i;
+        return 1;
+    }
+
+    sc = (sortedcandidate *) malloc(n * sizeof(sortedcandidate));
+    if (sc == NULL) {
+        fputs("Error in sort_alignment_candidates(): failed to allocate memory\n",
+                stderr);
+        return 0;
+    }
+    for (i=0; i<n; ++i) {
+        sc[i].song = c[i].song;
+        sc[i].songpos = c[i].songpos;
+        sc[i].index = i;
+    }
+    qsort(sc, n, sizeof(sortedcandidate), compare_sorted_candidates);
+    for (i=0; i<n; ++i) order[i] = sc[i].index;
+    free(sc);
+    return 1;
+}
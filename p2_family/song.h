@@ -176,6 +176,60 @@ typedef struct {
     mididata tempo;
 } song;
 
+/**
+ * A pattern that refers to a range of notes in a song instead of holding
+ * a copy of them. Note onset times are not shifted to start from zero, so
+ * the notes can be scanned as they are only by the translation invariant
+ * algorithms (P1 and P2).
+ */
+typedef struct {
+    /* Song that holds the notes */
+    const song *s;
+
+    /* Index of the first pattern note in the song */
+    int position;
+
+    /* Number of pattern notes */
+    int size;
+
+    /* Pattern onset and end time in the song, as stored by get_pattern() */
+    int start;
+    int end;
+} patternview;
+
+/**
+ * Packed ((strt << 8) + ptch) keys of the notes of a song. The notes are in
+ * lexicographic order, so the keys are in ascending order too. Keys are
+ * computed on demand for the range of notes that has been accessed. See
+ * next_song_key() and previous_song_key().
+ */
+typedef struct {
+    const song *s;
+
+    /* Key buffer with space for capacity notes */
+    int *keys;
+    int capacity;
+
+    /* Keys are valid for note positions first <= j < end */
+    int first;
+    int end;
+} songkeys;
+
+/**
+ * A candidate position of a pattern in a song collection, to be verified
+ * with alignment_check_p1_batch() or alignment_check_p2_batch().
+ */
+typedef struct {
+    /* Song number in the collection */
+    int song;
+
+    /* Position in the song */
+    int songpos;
+
+    /* Position in the pattern that aligns with songpos */
+    int patternpos;
+} alignmentcandidate;
+
 #if 0
 /**
  * A container for song data in algorithm-specific formats.
@@ -230,6 +284,16 @@ int generate_patterns_song(songcollection *pc, const song *s, matchset *ms, int
 int generate_pattern(song *pattern, const songcollection *sc, match *m,
         int length, int maxskip, char maxtranspose, float errors);
 
+int max_patterns_song(const song *s, int length, int window);
+
+int get_pattern_view(patternview *v, const song *s, int length,
+        int position);
+
+int generate_pattern_views(patternview *views, int maxviews, const song *s,
+        int length, int window);
+
+void pattern_view_song(const patternview *v, song *p);
+
 int generate_pattern_collection(int patterncount, songcollection *pc,
         const songcollection *sc, matchset *ms, int minlength, int maxlength,
         int maxskip, char maxtranspose, float errors);
@@ -262,6 +326,24 @@ void free_song_collection_data(songcollection *sc);
 void update_song_collection_data(songcollection *sc, const int *algorithms,
         const dataparameters *dp);
 
+void append_song_collection_data(songcollection *sc, int first_song,
+        const dataparameters *dp);
+
+void init_song_keys(songkeys *k);
+
+int set_song_keys(songkeys *k, const song *s);
+
+void free_song_keys(songkeys *k);
+
+int song_key(songkeys *k, int j);
+
+int next_song_key(songkeys *k, int j, int v0, int pi);
+
+int previous_song_key(songkeys *k, int j, int v0, int pi);
+
+int sort_alignment_candidates(const alignmentcandidate *c, int n,
+        int *order);
+
 void insert_pattern_to_song(song *s, int songpos, const song *p, float errors,
         float noise);
 
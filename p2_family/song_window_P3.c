@@ -30,6 +30,7 @@
  */
 
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <string.h>
@@ -42,11 +43,16 @@
 
 
 /**
- * Initializes a P3 song window.
+ * Initializes a P3 song window. The window is empty and placed before the
+ * first turning point until it is moved with move_p3s_window().
+ *
+ * @param w the window
+ * @param p3s song in P3 format. The window refers to its turning points, so
+ *        it must not be freed before the window.
  */
 void init_p3s_window(p3s_window *w, const p3song *p3s) {
-    w->x1 = 0;
-    w->x2 = 0;
+    w->x1 = -1;
+    w->x2 = -1;
     w->s1 = 0;
     w->s2 = 0;
     w->e1 = 0;
@@ -54,7 +60,8 @@ void init_p3s_window(p3s_window *w, const p3song *p3s) {
     memset(w->notes_on_1, 0, 4 * sizeof(unsigned int));
     memset(w->notes_on_2, 0, 4 * sizeof(unsigned int));
     w->p3s = p3s;
-    w->songend = p3s->endpoints[p3s->size-1].x;
+    if (p3s->size > 0) w->songend = p3s->endpoints[p3s->size-1].x;
+    else w->songend = 0;
     w->startpoints = (TurningPoint *) malloc(p3s->size * sizeof(TurningPoint));
     w->endpoints = (TurningPoint *) malloc(p3s->size * sizeof(TurningPoint));
     w->window.startpoints = w->startpoints;
@@ -65,10 +72,14 @@ void init_p3s_window(p3s_window *w, const p3song *p3s) {
 }
 
 
+/**
+ * Frees the turning point buffers of a P3 song window.
+ *
+ * @param w the window
+ */
 void free_p3s_window(p3s_window *w) {
     free(w->startpoints);
     free(w->endpoints);
-    free_p3_song(&w->window);
     w->startpoints = NULL;
     w->endpoints = NULL;
     w->window.startpoints = NULL;
@@ -80,48 +91,48 @@ void free_p3s_window(p3s_window *w) {
 
 
 /**
- * Selects a known position that is closest to the new position.
+ * Selects a known position that is closest to the new position: the current
+ * scanning position, either edge of the previous window, or the beginning
+ * or the end of the song.
  */
 static void move_p3s_window_edge_init(const p3s_window *w,
         int new_x, int *x, int *s, int *e, unsigned int *notes_on) {
 
     int delta = ABS(new_x - *x);
 
-    if (new_x < ((w->x1 + w->x2) >> 1)) {
-        if (new_x < (w->x1 >> 1)) {
-            /* Return if the edge is already at the closest position */
-            if (delta <= new_x) return;
-            *x = 0;
-            memset(notes_on, 0, 4 * sizeof(unsigned int));
-            *s = 0;
-            *e = 0;
-        } else {
-            if (delta <= ABS(new_x - w->x1)) return;
-            *x = w->x1;
-            memcpy(notes_on, w->notes_on_1, 4 * sizeof(unsigned int));
-            *s = w->s1;
-            *e = w->e1;
-        }
-    } else {
-        if (new_x > ((w->x2 + w->songend) >> 1)) {
-            if (delta <= ABS(new_x - w->songend)) return;
-            *x = w->songend;
-            memset(notes_on, 0, 4 * sizeof(unsigned int));
-            *s = w->p3s->size;
-            *e = w->p3s->size;
-        } else {
-            if (delta <= ABS(new_x - w->x1)) return;
-            *x = w->x2;
-            memcpy(notes_on, w->notes_on_2, 4 * sizeof(unsigned int));
-            *s = w->s2;
-            *e = w->e2;
-        }
+    if (ABS(new_x - w->x1) < delta) {
+        delta = ABS(new_x - w->x1);
+        *x = w->x1;
+        memcpy(notes_on, w->notes_on_1, 4 * sizeof(unsigned int));
+        *s = w->s1;
+        *e = w->e1;
+    }
+    if (ABS(new_x - w->x2) < delta) {
+        delta = ABS(new_x - w->x2);
+        *x = w->x2;
+        memcpy(notes_on, w->notes_on_2, 4 * sizeof(unsigned int));
+        *s = w->s2;
+        *e = w->e2;
+    }
+    if (new_x + 1 < delta) {
+        delta = new_x + 1;
+        *x = -1;
+        memset(notes_on, 0, 4 * sizeof(unsigned int));
+        *s = 0;
+        *e = 0;
+    }
+    if (ABS(w->songend - new_x) < delta) {
+        *x = w->songend;
+        memset(notes_on, 0, 4 * sizeof(unsigned int));
+        *s = w->p3s->size;
+        *e = w->p3s->size;
     }
 }
 
 
 /**
- * Keeps track of playing notes while moving a window edge.
+ * Keeps track of playing notes while moving a window edge. An edge at x has
+ * passed all turning points at or before x.
  */
 static void move_p3s_window_edge(int new_x, int old_x,
         int *spos, int *epos, unsigned int *notes_on, int num_turningpoints,
@@ -161,11 +172,11 @@ static void move_p3s_window_edge(int new_x, int old_x,
 
             if (start) {
                 /* Set the corresponding bit in the vector */
-                notes_on[slot] |= 1 << bit;
+                notes_on[slot] |= 1U << bit;
                 next_spos++;
             } else {
                 /* Clear the corresponding bit in the vector */
-                notes_on[slot] &= 0xFFFFFFFF - (1 << bit);
+                notes_on[slot] &= 0xFFFFFFFF - (1U << bit);
                 next_epos++;
             }
         }
@@ -181,7 +192,7 @@ static void move_p3s_window_edge(int new_x, int old_x,
 
             if (next_epos >= 0) {
                 cur_x = endpoints[next_epos].x;
-                if ((next_spos >= 0) && (cur_x < startpoints[next_spos].x)) {
+                if ((next_spos >= 0) && (cur_x <= startpoints[next_spos].x)) {
                     end = 0;
                     cur_x = startpoints[next_spos].x;
                     cur_y = startpoints[next_spos].y;
@@ -193,7 +204,7 @@ static void move_p3s_window_edge(int new_x, int old_x,
                 cur_x = startpoints[next_spos].x;
                 cur_y = startpoints[next_spos].y;
             } else break;
-            if (cur_x < new_x) break;
+            if (cur_x <= new_x) break;
 
             /* Calculate pitch vector bit position for the note */
             slot = cur_y >> 5;
@@ -201,12 +212,12 @@ static void move_p3s_window_edge(int new_x, int old_x,
 
             if (end) {
                 /* Set the corresponding bit in the vector */
-                notes_on[slot] |= 1 << bit;
-                next_spos--;
+                notes_on[slot] |= 1U << bit;
+                next_epos--;
             } else {
                 /* Clear the corresponding bit in the vector */
-                notes_on[slot] &= 0xFFFFFFFF - (1 << bit);
-                next_epos--;
+                notes_on[slot] &= 0xFFFFFFFF - (1U << bit);
+                next_spos--;
             }
         }
         next_spos++;
@@ -260,7 +271,15 @@ static void move_p3s_window_mark_playing_notes(unsigned int *notes_on,
 }
 
 /**
- * Moves a window within P3 song.
+ * Moves a window within P3 song. Afterwards w->window contains the turning
+ * points of the notes that overlap the window, cut at its edges: notes
+ * playing at x1 start at x1 and notes playing at x2 end at x2. Turning
+ * points are in absolute time. Only the turning points between the old
+ * and the new window edges are scanned and copied.
+ *
+ * @param w the window
+ * @param x1 start time of the window
+ * @param x2 end time of the window
  */
 void move_p3s_window(p3s_window *w, int x1, int x2) {
     const p3song *s = w->p3s;
@@ -270,7 +289,7 @@ void move_p3s_window(p3s_window *w, int x1, int x2) {
     int i, j;
 
     unsigned int notes_on_1[4], notes_on_2[4];
-    int old_x1 = 0, s1 = 0, e1 = 0;
+    int old_x1 = -1, s1 = 0, e1 = 0;
     int old_x2, s2, e2;
 
     if (x1 > x2) INT_SWAP(x1, x2);
@@ -280,11 +299,11 @@ void move_p3s_window(p3s_window *w, int x1, int x2) {
     move_p3s_window_edge_init(w, x1, &old_x1, &s1, &e1, notes_on_1);
     move_p3s_window_edge(x1, old_x1, &s1, &e1, notes_on_1, ssize, sp, ep);
 
-    /* Move the right edge */
-    old_x2 = old_x1;
+    /* Move the right edge, starting from the new left edge by default */
+    old_x2 = x1;
     s2 = s1;
     e2 = e1;
-    memcpy(notes_on_2, w->notes_on_1, 4 * sizeof(unsigned int));
+    memcpy(notes_on_2, notes_on_1, 4 * sizeof(unsigned int));
     move_p3s_window_edge_init(w, x2, &old_x2, &s2, &e2, notes_on_2);
     move_p3s_window_edge(x2, old_x2, &s2, &e2, notes_on_2, ssize, sp, ep);
 
@@ -338,24 +357,402 @@ void move_p3s_window(p3s_window *w, int x1, int x2) {
 }
 
 
+/* Digit size of the radix sort of translation events */
+#define P3S_SCAN_RADIX_BITS 11
+
+
+/**
+ * Initializes an empty incremental P3 scan.
+ *
+ * @param sc the scan state
+ */
+void init_p3s_scan(p3s_scan *sc) {
+    memset(sc, 0, sizeof(p3s_scan));
+}
+
+
+/**
+ * Frees the buffers of an incremental P3 scan and re-initializes it.
+ *
+ * @param sc the scan state
+ */
+void free_p3s_scan(p3s_scan *sc) {
+    free(sc->events);
+    free(sc->tmp);
+    free(sc->added);
+    free(sc->addedtmp);
+    free(sc->startpoints);
+    free(sc->endpoints);
+    free(sc->startids);
+    free(sc->endids);
+    free(sc->newstartpoints);
+    free(sc->newendpoints);
+    free(sc->newstartids);
+    free(sc->newendids);
+    free(sc->alive);
+    free(sc->freeids);
+    init_p3s_scan(sc);
+}
+
+
+/**
+ * Empties an incremental P3 scan so that it can be used with another target
+ * song. The buffers are kept for reuse.
+ *
+ * @param sc the scan state
+ */
+void clear_p3s_scan(p3s_scan *sc) {
+    sc->size = 0;
+    sc->num_startpoints = 0;
+    sc->num_endpoints = 0;
+    sc->num_free = 0;
+    sc->num_ids = 0;
+}
+
+
+/**
+ * Resizes a buffer with realloc() unless an earlier resize has failed.
+ * The contents are kept.
+ *
+ * @param buffer the buffer
+ * @param size new size in bytes
+ * @param ok set to 0 if the buffer cannot be resized
+ *
+ * @return the resized buffer, or the original buffer on failure
+ */
+static void *resize_p3s_scan_buffer(void *buffer, size_t size, int *ok) {
+    void *b;
+    if (!*ok) return buffer;
+    b = realloc(buffer, size);
+    if (b == NULL) {
+        *ok = 0;
+        return buffer;
+    }
+    return b;
+}
+
+
+/**
+ * Makes sure that a pair of event buffers has room for the given number of
+ * events.
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int reserve_p3s_scan_events(unsigned long long **a,
+        unsigned long long **b, int *allocated, long long size) {
+    int ok = 1;
+    if (size <= *allocated) return 1;
+    if (size > INT_MAX) return 0;
+    size = MIN2(MAX2(size, 2 * (long long) *allocated), INT_MAX);
+    *a = (unsigned long long *) resize_p3s_scan_buffer(*a,
+            size * sizeof(unsigned long long), &ok);
+    *b = (unsigned long long *) resize_p3s_scan_buffer(*b,
+            size * sizeof(unsigned long long), &ok);
+    if (!ok) return 0;
+    *allocated = (int) size;
+    return 1;
+}
+
+
+/**
+ * Makes sure that the turning point buffers have room for the given number
+ * of window turning points.
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int reserve_p3s_scan_points(p3s_scan *sc, int size) {
+    int ok = 1;
+    if (size <= sc->pointsallocated) return 1;
+    size = MAX2(size, 2 * sc->pointsallocated);
+    sc->startpoints = (TurningPoint *) resize_p3s_scan_buffer(
+            sc->startpoints, size * sizeof(TurningPoint), &ok);
+    sc->endpoints = (TurningPoint *) resize_p3s_scan_buffer(
+            sc->endpoints, size * sizeof(TurningPoint), &ok);
+    sc->newstartpoints = (TurningPoint *) resize_p3s_scan_buffer(
+            sc->newstartpoints, size * sizeof(TurningPoint), &ok);
+    sc->newendpoints = (TurningPoint *) resize_p3s_scan_buffer(
+            sc->newendpoints, size * sizeof(TurningPoint), &ok);
+    sc->startids = (int *) resize_p3s_scan_buffer(sc->startids,
+            size * sizeof(int), &ok);
+    sc->endids = (int *) resize_p3s_scan_buffer(sc->endids,
+            size * sizeof(int), &ok);
+    sc->newstartids = (int *) resize_p3s_scan_buffer(sc->newstartids,
+            size * sizeof(int), &ok);
+    sc->newendids = (int *) resize_p3s_scan_buffer(sc->newendids,
+            size * sizeof(int), &ok);
+    if (!ok) return 0;
+    sc->pointsallocated = size;
+    return 1;
+}
+
+
+/**
+ * Gives an ID to a turning point that enters the window. IDs of removed
+ * turning points are reused once their events have been removed.
+ *
+ * @return the ID, or -1 if there are too many turning points
+ */
+static int new_p3s_scan_id(p3s_scan *sc) {
+    int id;
+    if (sc->num_free > 0) {
+        id = sc->freeids[--sc->num_free];
+    } else {
+        if (sc->num_ids == sc->idsallocated) {
+            int ok = 1;
+            int size = MAX2(64, 2 * sc->idsallocated);
+            if (sc->num_ids >= P3S_SCAN_MAX_POINTS) return -1;
+            size = MIN2(size, P3S_SCAN_MAX_POINTS);
+            sc->alive = (char *) resize_p3s_scan_buffer(sc->alive,
+                    size * sizeof(char), &ok);
+            sc->freeids = (int *) resize_p3s_scan_buffer(sc->freeids,
+                    size * sizeof(int), &ok);
+            if (!ok) return -1;
+            sc->idsallocated = size;
+        }
+        id = sc->num_ids++;
+    }
+    /* 2 marks a turning point whose events have not been generated yet */
+    sc->alive[id] = 2;
+    return id;
+}
+
+
+/**
+ * Compares the turning points of the previous and the next window. Points
+ * that were removed are marked dead, points that remain keep their IDs and
+ * new points get new IDs.
+ *
+ * @return number of new turning points, or -1 if IDs run out
+ */
+static int diff_p3s_scan_points(p3s_scan *sc, const TurningPoint *oldpoints,
+        const int *oldids, int oldsize, const TurningPoint *newpoints,
+        int *newids, int size, int *num_removed) {
+    int i = 0, j = 0, num_added = 0;
+    while ((i < oldsize) || (j < size)) {
+        int c;
+        if (i == oldsize) c = 1;
+        else if (j == size) c = -1;
+        else c = compare_turningpoints(&oldpoints[i], &newpoints[j]);
+        if (c == 0) {
+            newids[j++] = oldids[i++];
+        } else if (c < 0) {
+            sc->alive[oldids[i++]] = 0;
+            ++(*num_removed);
+        } else {
+            newids[j] = new_p3s_scan_id(sc);
+            if (newids[j++] < 0) return -1;
+            ++num_added;
+        }
+    }
+    return num_added;
+}
+
+
+/**
+ * Generates the translation events of the new turning points of a window.
+ * A pattern start and a target start, as well as a pattern end and a
+ * target end, decrease the slope; the other pairs increase it.
+ *
+ * @return number of generated events
+ */
+static int add_p3s_scan_events(p3s_scan *sc, const TurningPoint *points,
+        const int *ids, int size, int pattern_is_start,
+        const TurningPoint *startpoints, const TurningPoint *endpoints,
+        int num_tpoints, unsigned long long *events) {
+    int i, j, n = 0;
+    for (i=0; i<size; ++i) {
+        const TurningPoint *p = &points[i];
+        int id = ids[i];
+        if (sc->alive[id] != 2) continue;
+        sc->alive[id] = 1;
+        for (j=0; j<num_tpoints; ++j) {
+            events[n++] = P3S_SCAN_EVENT(startpoints[j].x - p->x,
+                    startpoints[j].y - p->y, !pattern_is_start, id);
+        }
+        for (j=0; j<num_tpoints; ++j) {
+            events[n++] = P3S_SCAN_EVENT(endpoints[j].x - p->x,
+                    endpoints[j].y - p->y, pattern_is_start, id);
+        }
+    }
+    return n;
+}
+
+
+/**
+ * Sorts translation events by x and y with a radix sort that skips the
+ * digits that are the same in all events. The slope change and turning
+ * point ID bits do not affect the scan, so they are not sorted.
+ *
+ * @param c the events
+ * @param tmp work space for n events
+ * @param n number of events
+ *
+ * @return pointer to the sorted events, either c or tmp
+ */
+static unsigned long long *sort_p3s_scan_events(unsigned long long *c,
+        unsigned long long *tmp, int n) {
+    int counts[1 << P3S_SCAN_RADIX_BITS];
+    int i, shift;
+
+    if (n <= 1) return c;
+    for (shift=24; shift<64; shift+=P3S_SCAN_RADIX_BITS) {
+        const unsigned int mask = (1 << P3S_SCAN_RADIX_BITS) - 1;
+        unsigned long long *t;
+        int sum = 0;
+        memset(counts, 0, sizeof(counts));
+        for (i=0; i<n; ++i) ++counts[(c[i] >> shift) & mask];
+        if (counts[(c[0] >> shift) & mask] == n) continue;
+        for (i=0; i<=(int) mask; ++i) {
+            int k = counts[i];
+            counts[i] = sum;
+            sum += k;
+        }
+        for (i=0; i<n; ++i) tmp[counts[(c[i] >> shift) & mask]++] = c[i];
+        t = c;
+        c = tmp;
+        tmp = t;
+    }
+    return c;
+}
+
+
+/**
+ * Moves an incremental P3 scan to a new window. Afterwards sc->events
+ * contains the sorted translation events of the window turning points
+ * against the target turning points, and the vertical translation table of
+ * P3 can be updated by scanning them in order. Translation x of an event
+ * moves window time x_w to target time x_w + x. The turning points that
+ * are in both the previous and the next window keep their events, so
+ * a window that slides by a small step costs one merge of the events
+ * instead of a full sort.
+ *
+ * @param sc the scan state
+ * @param startpoints target start points in lexicographical order
+ * @param endpoints target end points in lexicographical order
+ * @param num_tpoints number of target turning points of each type
+ * @param window_startpoints start points of the window, in any order
+ * @param num_window_startpoints number of window start points
+ * @param window_endpoints end points of the window, in any order
+ * @param num_window_endpoints number of window end points
+ *
+ * @return 1 if successful, 0 otherwise. The state must not be updated
+ *         again after a failure.
+ */
+int update_p3s_scan(p3s_scan *sc, const TurningPoint *startpoints,
+        const TurningPoint *endpoints, int num_tpoints,
+        const TurningPoint *window_startpoints, int num_window_startpoints,
+        const TurningPoint *window_endpoints, int num_window_endpoints) {
+    unsigned long long *added;
+    int ns = num_window_startpoints;
+    int ne = num_window_endpoints;
+    int i, j, k, num_added, num_added_s, num_added_e;
+    int num_removed = 0;
+
+    if (!reserve_p3s_scan_points(sc, MAX2(ns, ne))) goto NO_MEMORY;
+    memcpy(sc->newstartpoints, window_startpoints, ns * sizeof(TurningPoint));
+    memcpy(sc->newendpoints, window_endpoints, ne * sizeof(TurningPoint));
+    sort_turningpoints(sc->newstartpoints, ns);
+    sort_turningpoints(sc->newendpoints, ne);
+
+    num_added_s = diff_p3s_scan_points(sc, sc->startpoints, sc->startids,
+            sc->num_startpoints, sc->newstartpoints, sc->newstartids, ns,
+            &num_removed);
+    num_added_e = diff_p3s_scan_points(sc, sc->endpoints, sc->endids,
+            sc->num_endpoints, sc->newendpoints, sc->newendids, ne,
+            &num_removed);
+    if ((num_added_s < 0) || (num_added_e < 0)) {
+        fputs("Error in update_p3s_scan(): too many turning points\n",
+                stderr);
+        return 0;
+    }
+    if ((num_added_s == 0) && (num_added_e == 0) && (num_removed == 0))
+        return 1;
+
+    /* Events of the new turning points */
+    if (!reserve_p3s_scan_events(&sc->added, &sc->addedtmp,
+            &sc->addedallocated, 2LL * (num_added_s + num_added_e) *
+            num_tpoints)) goto NO_MEMORY;
+    num_added = add_p3s_scan_events(sc, sc->newstartpoints, sc->newstartids,
+            ns, 1, startpoints, endpoints, num_tpoints, sc->added);
+    num_added += add_p3s_scan_events(sc, sc->newendpoints, sc->newendids,
+            ne, 0, startpoints, endpoints, num_tpoints,
+            &sc->added[num_added]);
+    added = sort_p3s_scan_events(sc->added, sc->addedtmp, num_added);
+
+    /* Merge with the remaining events */
+    if (!reserve_p3s_scan_events(&sc->events, &sc->tmp, &sc->allocated,
+            (long long) sc->size + num_added + 1)) goto NO_MEMORY;
+    for (i=0, j=0, k=0; i<sc->size; ++i) {
+        unsigned long long e = sc->events[i];
+        if (!sc->alive[P3S_SCAN_EVENT_OWNER(e)]) continue;
+        while ((j < num_added) && (added[j] < e)) sc->tmp[k++] = added[j++];
+        sc->tmp[k++] = e;
+    }
+    while (j < num_added) sc->tmp[k++] = added[j++];
+    sc->tmp[k] = P3S_SCAN_END;
+    VOIDPTR_SWAP(sc->events, sc->tmp);
+    sc->size = k;
+
+    /* IDs of the removed turning points can be reused now */
+    for (i=0; i<sc->num_startpoints; ++i) {
+        if (!sc->alive[sc->startids[i]])
+            sc->freeids[sc->num_free++] = sc->startids[i];
+    }
+    for (i=0; i<sc->num_endpoints; ++i) {
+        if (!sc->alive[sc->endids[i]])
+            sc->freeids[sc->num_free++] = sc->endids[i];
+    }
+    VOIDPTR_SWAP(sc->startpoints, sc->newstartpoints);
+    VOIDPTR_SWAP(sc->endpoints, sc->newendpoints);
+    VOIDPTR_SWAP(sc->startids, sc->newstartids);
+    VOIDPTR_SWAP(sc->endids, sc->newendids);
+    sc->num_startpoints = ns;
+    sc->num_endpoints = ne;
+    return 1;
+
+NO_MEMORY:
+    fputs("Error in update_p3s_scan(): failed to allocate memory\n", stderr);
+    return 0;
+}
+
+
 #ifdef ENABLE_UNIT_TESTS
 
-void test_p3s_window(const song *s, int moves, int resets, int relative_time,
+/**
+ * Compares the turning points of a P3 window with those of a window song.
+ */
+static int compare_p3s_window_points(const char *type, int size,
+        TurningPoint *gt, TurningPoint *w) {
+    int i;
+    qsort(w, size, sizeof(TurningPoint), compare_turningpoints);
+    for (i=0; i<size; ++i) {
+        if ((gt[i].x != w[i].x) || (gt[i].y != w[i].y)) {
+            fprintf(stderr, "Error in test_p3s_window: wrong %s point (%d, %d) instead of (%d, %d)\n", type, w[i].x, w[i].y, gt[i].x, gt[i].y);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+void test_p3s_window(const song *s, int moves, int resets,
         int window_length) {
 
     int r;
-    p3song p3s;
+    const p3song *p3s;
     p3s_window sw;
     song testw;
     p3song testw_p3s;
+    TurningPoint *wsp, *wep;
     int x1, x2;
-    int song_duration = s->endpoints[s->size-1].x;
-
-    song_to_p3(s, &p3s);
+    int song_duration = s->notes[s->size-1].strt;
 
+    p3s = acquire_p3_song(s);
+    if (p3s == NULL) return;
     init_song(&testw, 0, NULL, s->size);
-
-    init_p3s_window(&sw, s, relative_time);
+    init_p3s_window(&sw, p3s);
+    wsp = (TurningPoint *) malloc(s->size * sizeof(TurningPoint));
+    wep = (TurningPoint *) malloc(s->size * sizeof(TurningPoint));
 
     for (r=0; r<resets; ++r) {
         int m;
@@ -371,62 +768,51 @@ void test_p3s_window(const song *s, int moves, int resets, int relative_time,
                 vector *n = &s->notes[i];
                 int start = n->strt;
                 int end = start + n->dur;
-                if ((start < x2) && (end > x1)) {
+                if ((start <= x2) && (end > x1)) {
                     vector *tn = &testw.notes[testw.size];
                     memcpy(tn, n, sizeof(vector));
                     tn->strt = MAX2(start, x1);
-                    if (relative_time) {
-                        tn->strt -= x1;
-                    }
-                    tn->dur = MIN2(end, x2) - MAX2(start, x1);
+                    tn->dur = MIN2(end, x2) - tn->strt;
                     ++testw.size;
                 }
             }
             lexicographic_sort(&testw);
             song_to_p3(&testw, &testw_p3s);
+            qsort(testw_p3s.startpoints, testw_p3s.size, sizeof(TurningPoint),
+                    compare_turningpoints);
 
             /* Move the window */
-            move_song_window(&sw, x1, x2);
+            move_p3s_window(&sw, x1, x2);
 
             /* Compare to ground truth */
-            for (i=0; i<testw_p3s.size; ++i) {
-                TurningPoint *sp = &testw_p3s.startpoints[i];
-                if (i >= sw.window.size) {
-                    fprintf(stderr, "Error in test_p3s_window: too few notes within the window (%d instead of %d)\n", sw.window.size, testw_p3s.size);
-                    break;
-                }
-                if (sp.x != sw.window.startpoints[i].x) {
-                    fprintf(stderr, "Error in test_song_window: wrong note start time(%d instead of %d)\n", sw.window.startpoints[i].x, sp.x);
-                    break;
-                }
-                if (sp.y != sw.window.startpoints[i].y) {
-                    fprintf(stderr, "Error in test_song_window: wrong note pitch (%d instead of %d)\n", sw.window.startpoints[i].y, sp.y);
-                    break;
+            if (sw.window.size != testw_p3s.size) {
+                fprintf(stderr, "Error in test_p3s_window: %d notes within the window instead of %d (x1:%d, x2:%d)\n", sw.window.size, testw_p3s.size, x1, x2);
+            } else {
+                memcpy(wsp, sw.window.startpoints,
+                        sw.window.size * sizeof(TurningPoint));
+                memcpy(wep, sw.window.endpoints,
+                        sw.window.size * sizeof(TurningPoint));
+                if (!compare_p3s_window_points("start", testw_p3s.size,
+                        testw_p3s.startpoints, wsp) ||
+                        !compare_p3s_window_points("end", testw_p3s.size,
+                        testw_p3s.endpoints, wep)) {
+                    fprintf(stderr, "Window x1:%d, x2:%d\n", x1, x2);
                 }
             }
-            if (i < testw_p3s.size) {
-                fprintf(stderr, "Window x1:%d, x2:%d\n", x1, x2);
-                fputs("GT:     ", stderr);
-                for (i=0; i<testw_p3s.size; ++i) {
-                    TurningPoint *sp = &testw_p3s.startpoints[i];
-                    fprintf(stderr, "(%d, %d) ", sp.x, sp.y);
-                }
-                fputs("\nWindow: ", stderr);
-                for (i=0; i<sw.window.size; ++i) {
-                    TurningPoint *sp = &sw.window.startpoints[i];
-                    fprintf(stderr, "(%d, %d) ", sp.x, sp.y);
-                }
-                fputs("\n\n", stderr);
+            free_p3_song(&testw_p3s);
 
-            }
-            x1 += (int) (randf() * 2.0F * (float) window_length);
-            x2 += (int) (randf() * 2.0F * (float) window_length);
+            x1 += (int) ((randf() - 0.5F) * 2.0F * (float) window_length);
+            x2 += (int) ((randf() - 0.5F) * 2.0F * (float) window_length);
+            x1 = MAX2(x1, 0);
+            x2 = MAX2(x2, 0);
         }
     }
 
-    free_p3_song(&testw);
+    free(wsp);
+    free(wep);
+    free_song(&testw);
     free_p3s_window(&sw);
+    release_p3_song(p3s);
 }
 
 #endif /* ENABLE_UNIT_TESTS */
-
@@ -58,12 +58,107 @@ typedef struct {
 } p3s_window;
 
 
+/**
+ * Translation events of an incremental P3 scan are packed to 64-bit keys in
+ * the order of the scan: translation x (signed), vertical translation y,
+ * slope change (1 for up, 0 for down) and the ID of the window turning
+ * point that the event belongs to.
+ */
+#define P3S_SCAN_EVENT(x, y, up, owner) \
+        ((((unsigned long long) ((unsigned int) (x) ^ 0x80000000U)) << 32) | \
+        (((unsigned long long) ((y) + NOTE_PITCHES)) << 24) | \
+        (((unsigned long long) (up)) << 23) | ((unsigned long long) (owner)))
+
+#define P3S_SCAN_EVENT_X(e) ((int) (((unsigned int) ((e) >> 32)) ^ 0x80000000U))
+
+#define P3S_SCAN_EVENT_Y(e) (((int) (((e) >> 24) & 0xFF)) - NOTE_PITCHES)
+
+#define P3S_SCAN_EVENT_UP(e) ((int) (((e) >> 23) & 1))
+
+#define P3S_SCAN_EVENT_OWNER(e) ((int) ((e) & 0x7FFFFF))
+
+/**
+ * Marker after the last event of an incremental P3 scan. Its translation is
+ * larger than that of any event, also after adding a window offset.
+ */
+#define P3S_SCAN_END P3S_SCAN_EVENT(0x3FFFFFFF, 0, 0, 0)
+
+/** Maximum number of turning points in an incremental P3 scan window */
+#define P3S_SCAN_MAX_POINTS 0x800000
+
+
+/**
+ * State of an incremental P3 scan of a sliding window against a target
+ * song. The translation events of all window turning points are kept in
+ * sorted order. When the window moves, only the events of the turning
+ * points that left the window are removed and the events of the new
+ * turning points are sorted and merged in, instead of sorting all events
+ * again. Event x coordinates do not depend on the window position, so the
+ * caller adds its own offset when it scans the events with a vertical
+ * translation table.
+ */
+typedef struct {
+    /** Sorted translation events, followed by P3S_SCAN_END */
+    unsigned long long *events;
+    int size;
+    int allocated;
+
+    /* Merge buffer and the events of new turning points (work space) */
+    unsigned long long *tmp;
+    unsigned long long *added;
+    unsigned long long *addedtmp;
+    int addedallocated;
+
+    /* Window turning points in lexicographical order and their IDs */
+    TurningPoint *startpoints;
+    TurningPoint *endpoints;
+    int *startids;
+    int *endids;
+    int num_startpoints;
+    int num_endpoints;
+
+    /* Turning points of the next window (work space) */
+    TurningPoint *newstartpoints;
+    TurningPoint *newendpoints;
+    int *newstartids;
+    int *newendids;
+    int pointsallocated;
+
+    /* Turning point IDs: alive[id] is zero for removed points, and free
+     * IDs are stacked to freeids. */
+    char *alive;
+    int *freeids;
+    int num_free;
+    int num_ids;
+    int idsallocated;
+} p3s_scan;
+
+
 void init_p3s_window(p3s_window *w, const p3song *p3s);
 
 void free_p3s_window(p3s_window *w);
 
 void move_p3s_window(p3s_window *w, int x1, int x2);
 
+void init_p3s_scan(p3s_scan *sc);
+
+void free_p3s_scan(p3s_scan *sc);
+
+void clear_p3s_scan(p3s_scan *sc);
+
+int update_p3s_scan(p3s_scan *sc, const TurningPoint *startpoints,
+        const TurningPoint *endpoints, int num_tpoints,
+        const TurningPoint *window_startpoints, int num_window_startpoints,
+        const TurningPoint *window_endpoints, int num_window_endpoints);
+
+
+#ifdef ENABLE_UNIT_TESTS
+
+void test_p3s_window(const song *s, int moves, int resets,
+        int window_length);
+
+#endif
+
 
 #ifdef __cplusplus
 }
@@ -35,11 +35,14 @@
 #include <limits.h>
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "search.h"
 #include "song.h"
 #include "geometric_P3.h"
 #include "sync_P3.h"
+#include "song_window_P3.h"
 #include "priority_queue.h"
 #include "util.h"
 
@@ -54,294 +57,328 @@
  * Computer Science in Perspective (LNCS 2598), R. Klein, H.-W. Six, L. Wegner
  * (Eds.), pp. 330-342, 2003.
  *
- * The algorithm described in this article had a flaw that allowed the total
- * duration of a match to exceed the total duration of the pattern. This
- * problem has been solved by merging overlapping segments in the note data
- * during the calculation of turning points. However overlapping notes in the
- * pattern are currently not checked for. The problem can also be solved using
- * counters.
+ * The translation vectors of a pattern window are kept in sorted order by an
+ * incremental scan as the window slides over the pattern (see
+ * update_p3s_scan()), so instead of merging them with a priority queue, this
+ * function only processes them in order with the help of an array of
+ * vertical translations, which stores value, slope and previous x
+ * translation for each vertical translation y. For each vector we check the
+ * type of the turning point associated with it and adjust the slope and
+ * value accordingly. The best common duration of each translation is stored
+ * to the correlation array at the position of the window start, which is
+ * divided by the correlation accuracy. Translations are processed in
+ * increasing order, so the position is advanced with a counter instead of
+ * a division.
  *
- * Rough description of the algorithm: First a priority queue is created, which
- * will give translations in sorted order. Translation vectors for first source
- * note and all pattern notes are inserted to the queue. The priority queue is
- * then processed with the help of an array of vertical translations, which
- * stores value, slope and previous x translation for each vertical translation
- * y. For each vector extracted from the priority queue, we check the type of
- * the turning point associated with this vector and adjust the slope and value
- * accordingly. Then we move on in the source and add to the queue a new
- * translation vector for each new source note and the pattern note associated
- * with the previous translation vector. This loop is repeated until the end of
- * source. After the processing we have acquired the longest common time for
- * this pattern and source. This method returns only the best match for each
- * song. Consult the article for details.
- *
- * @param pattern_size number of notes in the pattern
- * @param pattern pattern as a note vector array
- * @param num_tpoints number of turning points (notes in the text)
- * @param startpoints array of note starting points in lexicographical order
- * @param endpoints array of note ending points in lexicographical order
- * @param ms pointer to a structure where the results will be stored
- *
- * @return 1 when successful, 0 otherwise
+ * @param sc incremental scan of the pattern window
+ * @param offset window start time in the pattern
+ * @param accuracy milliseconds per correlation array item
+ * @param unscaled_corr_size window start times from 0 to
+ *        unscaled_corr_size - 1 are stored
+ * @param corr_size size of the correlation array. The last item also
+ *        stores the times beyond corr_size * accuracy.
+ * @param corr correlation array
+ * @param verticaltranslationtable work space for 2 * NOTE_PITCHES items
  */
-static void sync_turningpoints_p3(int pattern_size, const vector *pattern,
-        int num_tpoints, const TurningPoint *startpoints,
-        const TurningPoint *endpoints, int corr_size, int *corr) {
-
-    int i, j, num_loops;
-    VerticalTranslationTableItem *verticaltranslationtable;
-    int best = 0;
-    VerticalTranslationTableItem *item = NULL;
-    float pattern_duration = 0.0;
-
-    /* Create a priority queue */
-    pqroot *pq;
-    pqnode *min;
-    TranslationVector *translation_vectors;
-    
-    if ((pattern_size <= 0) || (num_tpoints <= 0)) return;
-
-    pq = pq_create(pattern_size * 4);
-    translation_vectors = (TranslationVector *)
-            malloc(pattern_size * 4 * sizeof(TranslationVector));
-
-    /* Initialize a vertical translation array */
-    verticaltranslationtable = (VerticalTranslationTableItem *) malloc(
-            NOTE_PITCHES * 2 * sizeof(VerticalTranslationTableItem));
-    for (i = 0; i < (NOTE_PITCHES * 2); i++) {
-        verticaltranslationtable[i].value = 0;
-        verticaltranslationtable[i].slope = 0;
-        verticaltranslationtable[i].prev_x = 0;
-    }
+static void sync_turningpoints_p3(const p3s_scan *sc, int offset,
+        int accuracy, int unscaled_corr_size, int corr_size, int *corr,
+        VerticalTranslationTableItem *verticaltranslationtable) {
 
+    int column = 0;
+    int column_end = accuracy;
+    int i;
 
-    /* Create an array whose items have two pointers each: one for startpoints
-     * and one for endpoints. Each item points to turning point array item Also
-     * populate the priority queue with initial items. */
-    for (i = 0, j = 0; i < pattern_size; i++) {
-        TranslationVector *v;
-        pattern_duration += (float) pattern[i].dur;
-
-
-        /* Add translation vectors calculated from the note start points */
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) startpoints[0].y - (int) pattern[i].ptch;
-        v->x = (int) startpoints[0].x -
-                (int) (pattern[i].strt + pattern[i].dur);
-        v->pattern_is_start = 0;
-        v->text_is_start = 1;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) startpoints[0].y - (int) pattern[i].ptch;
-        v->x = (int) startpoints[0].x - (int) pattern[i].strt;
-        v->pattern_is_start = 1;
-        v->text_is_start = 1;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
-
-
-        /* Add translation vectors calculated from the note end points */
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) endpoints[0].y - (int) pattern[i].ptch;
-        v->x = (int) endpoints[0].x - (int) (pattern[i].strt +
-                pattern[i].dur);
-        v->pattern_is_start = 0;
-        v->text_is_start = 0;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
-
-        min = pq_getnode(pq, j);
-        v = &translation_vectors[j];
-        v->tpindex = 0;
-        v->patternindex = i;
-        v->y = (int) endpoints[0].y - (int) pattern[i].ptch;
-        v->x = (int) endpoints[0].x - (int) pattern[i].strt;
-        v->pattern_is_start = 1;
-        v->text_is_start = 0;
-        min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-        min->pointer = v;
-        pq_update_key1_p3(pq, min);
-        ++j;
-    }
+    memset(verticaltranslationtable, 0, NOTE_PITCHES * 2 *
+            sizeof(VerticalTranslationTableItem));
 
-    best = 0;
-    num_loops = (pattern_size * num_tpoints) << 2;
+    for (i = 0; i < sc->size; i++) {
+        unsigned long long event = sc->events[i];
+        int x = P3S_SCAN_EVENT_X(event);
+        int y = P3S_SCAN_EVENT_Y(event);
+        int start = x + offset;
+        VerticalTranslationTableItem *item =
+                &verticaltranslationtable[NOTE_PITCHES + y];
 
-    for (i = 0; i < num_loops; i++) {
-        int x, y;
-        int start;
-        /* Get the minimum element */
-        TranslationVector *v;
-        min = pq_getmin(pq);
-        v = (TranslationVector *) min->pointer;
-        x = v->x;
-        y = v->y;
+        if (start >= unscaled_corr_size) break;
 
         /* Update value */
-        item = &verticaltranslationtable[NOTE_PITCHES + y];
         item->value += item->slope * (x - item->prev_x);
         item->prev_x = x;
 
         /* Adjust slope */
-        if (v->text_is_start != v->pattern_is_start)
+        if (P3S_SCAN_EVENT_UP(event))
             item->slope++;
         else
             item->slope--;
 
         /* Check for a match */
-        start = x + pattern[0].strt;
-        if ((start >= 0) && (start < corr_size))
-            corr[start] = MAX2(corr[start], item->value);
-
-        /* Move the pointer and insert a new translation vector according to
-         * the turning point type. */
-        if (v->tpindex < num_tpoints - 1) {
-            const vector *patp = &pattern[v->patternindex];
-            v->tpindex++;
-
-            if (v->text_is_start) {
-                const TurningPoint *startp = &startpoints[v->tpindex];
-                v->x = (int) startp->x - (int) patp->strt;
-                v->y = (int) startp->y - (int) patp->ptch;
-            } else {
-                const TurningPoint *endp = &endpoints[v->tpindex];
-                v->x = (int) endp->x - (int) patp->strt;
-                v->y = (int) endp->y - (int) patp->ptch;
-            }
-            if (!v->pattern_is_start) {
-                v->x -= (int) patp->dur;
+        if (start >= 0) {
+            int c;
+            while (start >= column_end) {
+                ++column;
+                column_end += accuracy;
             }
-            min->key1 = (v->x << 8) + v->y + NOTE_PITCHES;
-            pq_update_key1_p3(pq, min);
-        } else {
-            /* 'Remove' a translation vector by making it very large.
-             * It won't be extracted since there will be only as many loops as 
-             * there are real vectors. */
-            min->key1 = INT_MAX;
-            pq_update_key1_p3(pq, min);
+            c = MIN2(column, corr_size - 1);
+            corr[c] = MAX2(corr[c], item->value);
         }
     }
+}
+
+
+/**
+ * Work space of a thread that calculates correlation lines.
+ */
+typedef struct {
+    p3s_scan scan;
+    TurningPoint *window_startpoints;
+    TurningPoint *window_endpoints;
+    size_t windowstartallocated;
+    size_t windowendallocated;
+#ifdef CORRELATION_CUTOFF
+    int *mediancorr;
+    size_t medianallocated;
+#endif
+    VerticalTranslationTableItem verticaltranslationtable[NOTE_PITCHES * 2];
+} syncworker;
+
+
+/**
+ * Buffers of sync_song_p3(). They are allocated once for a song collection
+ * and grown when a song needs more room.
+ */
+typedef struct {
+    int *ppos;
+    size_t pposallocated;
+    int *lines;
+    size_t linesallocated;
+    int *linemap;
+    size_t linemapallocated;
+    int *cpath;
+    size_t cpathallocated;
+    float *slope;
+    size_t slopeallocated;
+    float *newslope;
+    size_t newslopeallocated;
+    unsigned char *syncmap;
+    size_t syncmapallocated;
+    int num_workers;
+    syncworker workers[SYNC_MAX_THREADS];
+} syncbuffers;
+
+
+/**
+ * A range of pattern windows whose correlation lines are calculated by one
+ * thread.
+ */
+typedef struct {
+    const song *pattern;
+    const TurningPoint *startpoints;
+    const TurningPoint *endpoints;
+    int num_tpoints;
+    const int *ppos;
+    int first_window;
+    int end_window;
+    int window_size;
+    int accuracy;
+    int unscaled_corr_size;
+    int corr_size;
+    int *lines;
+    syncworker *worker;
+    int ok;
+} syncpart;
+
 
-    /* Free the reserved memory. */
-    pq_free(pq);
-    free(translation_vectors);
-    free(verticaltranslationtable);
+/**
+ * Makes sure that a buffer has room for the given number of items. The
+ * contents are not kept.
+ *
+ * @param buffer the buffer
+ * @param allocated number of items allocated for the buffer
+ * @param size required number of items
+ * @param itemsize size of an item in bytes
+ * @param ok set to 0 if the buffer cannot be resized
+ *
+ * @return the resized buffer, or the original buffer on failure
+ */
+static void *reserve_sync_buffer(void *buffer, size_t *allocated,
+        size_t size, size_t itemsize, int *ok) {
+    void *b;
+    if (!*ok || (size <= *allocated)) return buffer;
+    b = realloc(buffer, size * itemsize);
+    if (b == NULL) {
+        *ok = 0;
+        return buffer;
+    }
+    *allocated = size;
+    return b;
 }
 
 
 /**
- * Preprocesses a query for the P3 algorithm. The searched pattern is not
- * modified, but the target text is converted to two separate sets of turning
- * points: one for the note start points and one for the end points, both
- * lexicographically ordered.
+ * Frees the buffers of sync_song_p3().
  *
- * @param s the song to scan
- * @param p pattern to search for
- * @param ms pointer to a structure where the results will be stored
+ * @param b the buffers
+ */
+static void free_sync_buffers(syncbuffers *b) {
+    int i;
+    for (i=0; i<b->num_workers; ++i) {
+        syncworker *w = &b->workers[i];
+        free_p3s_scan(&w->scan);
+        free(w->window_startpoints);
+        free(w->window_endpoints);
+#ifdef CORRELATION_CUTOFF
+        free(w->mediancorr);
+#endif
+    }
+    free(b->ppos);
+    free(b->lines);
+    free(b->linemap);
+    free(b->cpath);
+    free(b->slope);
+    free(b->newslope);
+    free(b->syncmap);
+    free(b);
+}
+
+
+/**
+ * Calculates the correlation lines of a range of pattern windows. Each
+ * line contains the best common durations of the window at every
+ * correlation array position of the song, relative to the duration of the
+ * window notes.
  *
- * @return 1 when successful, 0 otherwise
+ * @param arg a syncpart struct
  *
- * @see c_geometric_p3_scan_turningpoints()
+ * @return NULL
  */
-static void sync_song_p3(const song *s, const song *p,
-        const searchparameters *parameters, matchset *ms) {
+static void *sync_lines_p3(void *arg) {
+    syncpart *part = (syncpart *) arg;
+    syncworker *w = part->worker;
+    const vector *pattern = part->pattern->notes;
+    int corr_size = part->corr_size;
+    int i, j;
+
+    clear_p3s_scan(&w->scan);
+    for (i=part->first_window; i<part->end_window; ++i) {
+#ifdef CORRELATION_CUTOFF
+        int average_corr = 0;
+#endif
+        int pos = part->ppos[i];
+        int window_notes = MIN2(part->pattern->size - pos, part->window_size);
+        float pattern_duration = 0.0F;
+        int *corr = &part->lines[(size_t) i * corr_size];
+
+        for (j=0; j<window_notes; ++j) {
+            w->window_startpoints[j].x = pattern[pos+j].strt;
+            w->window_startpoints[j].y = pattern[pos+j].ptch;
+            w->window_endpoints[j].x = pattern[pos+j].strt +
+                    pattern[pos+j].dur;
+            w->window_endpoints[j].y = pattern[pos+j].ptch;
+        }
+        if (!update_p3s_scan(&w->scan, part->startpoints, part->endpoints,
+                part->num_tpoints, w->window_startpoints, window_notes,
+                w->window_endpoints, window_notes)) {
+            part->ok = 0;
+            return NULL;
+        }
+        memset(corr, 0, corr_size * sizeof(int));
+        sync_turningpoints_p3(&w->scan, pattern[pos].strt, part->accuracy,
+                part->unscaled_corr_size, corr_size, corr,
+                w->verticaltranslationtable);
+        for (j=pos; j<(pos+window_notes); ++j)
+            pattern_duration += (float) pattern[j].dur;
+#ifdef CORRELATION_CUTOFF
+        memcpy(w->mediancorr, corr, corr_size * sizeof(int));
+        average_corr = kth_smallest(w->mediancorr, corr_size,
+                3 * corr_size / 4);
+        for (j=0; j<corr_size; ++j) {
+            if (corr[j] < average_corr) {
+                corr[j] = (int) (1000.0F * ((float) (corr[j] - average_corr)) / pattern_duration);
+            } else {
+                corr[j] = (int) (1000.0F * (float) corr[j] / pattern_duration);
+            }
+
+        }
+#else 
+        for (j=0; j<corr_size; ++j) {
+            corr[j] = (int) (1000.0F * (float) corr[j] / pattern_duration);
+        }
+#endif
+    }
+    return NULL;
+}
+
+
+/**
+ * Synchronizes a pattern with a song. The pattern is cut to windows of
+ * sync_window_size notes that start at every fifth onset time, and a
+ * correlation line of each window against the song is calculated with P3.
+ * The lines are divided between threads. A synchronization path that
+ * maximizes the sum of the correlations along the lines is then searched
+ * line by line, and the best path is reported as a match. An image of the
+ * correlation lines is written to sync_<pattern>_<song>.pgm if
+ * sync_write_maps is set.
+ *
+ * @param t the song to scan in the P3 format
+ * @param p pattern to search for
+ * @param parameters search parameters
+ * @param b buffers that are reused between songs
+ * @param ms pointer to a structure where the results will be stored
+ */
+static void sync_song_p3(const p3song *t, const song *p,
+        const searchparameters *parameters, syncbuffers *b, matchset *ms) {
 
     int i;
     int strt;
-    TurningPoint *startpoints, *endpoints;
-    vector *text = s->notes;
+    const song *s = t->song;
+    const TurningPoint *startpoints = t->startpoints;
+    const TurningPoint *endpoints = t->endpoints;
     vector *pattern = p->notes;
-    unsigned char *syncmap;
+    unsigned char *syncmap = NULL;
     int *linemap;
     int syncmap_w, syncmap_h;
     int num_windows;
-    int *unscaled_corr, *corr, *cpath;
-#ifdef CORRELATION_CUTOFF
-    int *mediancorr;
-#endif
+    int *cpath;
     float *slope, *newslope;
     int unscaled_corr_size, corr_size;
     char output_file[256];
     int lastrow = -1;
     int lastwindowpos = INT_MAX;
-    pqroot *maxlinepq = pq_create(1);
+    int bestlinecorr = INT_MIN;
+    int bestlinecol = 0;
+    int bestlinerow = 0;
     int *ppos;
     int map_accuracy = parameters->syncmap_accuracy / parameters->sync_accuracy;
+    int window_size = MIN2(p->size, parameters->sync_window_size);
     int match_start = 0;
     int match_end = 0;
     float similarity = 0.0F;
     int wcount = 0;
+    int num_threads;
+    int ok = 1;
+    syncpart parts[SYNC_MAX_THREADS];
+    pthread_t threads[SYNC_MAX_THREADS];
+    int started[SYNC_MAX_THREADS];
 #ifdef ALLOW_SKIPS
     int lastbestcorr = 0;
     int lastbestpos = 0;
     float lastbestslope = 1.0F;
 #endif
 
-    if ((p->size == 0) || (s->size == 0)) return;
-
-    startpoints = (TurningPoint *) malloc(s->size * sizeof(TurningPoint));
-    endpoints = (TurningPoint *) malloc(s->size * sizeof(TurningPoint));
-
-    for (i = 0; i < s->size; i++) {
-        startpoints[i].x = (int)((float)text[i].strt*1.0F);
-        startpoints[i].y = text[i].ptch;
+    if ((p->size == 0) || (t->size == 0)) return;
 
-        endpoints[i].x = (int)((float)text[i].strt*1.0F) + text[i].dur;
-        endpoints[i].y = text[i].ptch;
-    }
-    /* Sort the endpoints */
-    qsort(endpoints, s->size, sizeof(TurningPoint), compare_turningpoints);
-
-    for (i=0; i<1; ++i) {
-        pqnode *node = pq_getnode(maxlinepq, i);
-        node->key1 = INT_MIN;
-        pq_update_key1_p3(maxlinepq, node);
-    }
-
-    /* Initialize a correlation array */
-    unscaled_corr_size = startpoints[s->size-1].x;
-    unscaled_corr = (int *) malloc(unscaled_corr_size * sizeof(int));
-    corr_size = startpoints[s->size-1].x / parameters->sync_accuracy;
-    corr = (int *) malloc(corr_size * sizeof(int));
-#ifdef CORRELATION_CUTOFF
-    mediancorr = (int *) malloc(corr_size * sizeof(int));
-#endif
-    cpath = (int *) calloc(corr_size, sizeof(int));
-    slope = (float *) malloc(corr_size * sizeof(float));
-    newslope = (float *) malloc(corr_size * sizeof(float));
-    for (i=0; i<corr_size; ++i) {
-        slope[i] = 1.0F;
-        newslope[i] = 1.0F;
-    }
+    b->ppos = (int *) reserve_sync_buffer(b->ppos, &b->pposallocated,
+            p->size, sizeof(int), &ok);
+    if (!ok) goto NO_MEMORY;
+    ppos = b->ppos;
 
-    syncmap_w = MAX2(1, unscaled_corr_size / parameters->syncmap_accuracy);
-    syncmap_h = MAX2(1, pattern[p->size-1].strt / parameters->syncmap_accuracy);
-    syncmap = (unsigned char *) malloc(syncmap_w * syncmap_h *
-            sizeof(unsigned char));
-    memset(syncmap, 255, syncmap_w * syncmap_h * sizeof(unsigned char));
+    unscaled_corr_size = startpoints[t->size-1].x;
+    corr_size = startpoints[t->size-1].x / parameters->sync_accuracy;
+    if (corr_size <= 0) return;
 
+    /* Window positions. Windows with less than two notes are not used. */
     strt = -1;
     num_windows = 0;
-    ppos = (int *) malloc(p->size * sizeof(int));
     for (i=0; i<p->size; ++i) {
         if (pattern[i].strt > strt) {
             strt = pattern[i].strt;
@@ -355,72 +392,121 @@ static void sync_song_p3(const song *s, const song *p,
     }
     /*num_windows = 4 * p->size / parameters->sync_window_size - 1;
     if (num_windows < 1) num_windows = 1;*/
+    for (i=0; i<num_windows; ++i) {
+        if (MIN2(p->size - ppos[i], parameters->sync_window_size) <= 1) {
+            num_windows = i;
+            break;
+        }
+    }
 
-    linemap = (int *) calloc(num_windows * corr_size, sizeof(int));
-    if (linemap == NULL) {
-        fprintf(stderr, "Error in sync_song_p3: failed to allocate memory for a synchronization line map\n");
-        goto end;
+    /* Initialize the correlation lines and the path arrays */
+    b->lines = (int *) reserve_sync_buffer(b->lines, &b->linesallocated,
+            (size_t) num_windows * corr_size, sizeof(int), &ok);
+    b->linemap = (int *) reserve_sync_buffer(b->linemap,
+            &b->linemapallocated, (size_t) num_windows * corr_size,
+            sizeof(int), &ok);
+    b->cpath = (int *) reserve_sync_buffer(b->cpath, &b->cpathallocated,
+            corr_size, sizeof(int), &ok);
+    b->slope = (float *) reserve_sync_buffer(b->slope, &b->slopeallocated,
+            corr_size, sizeof(float), &ok);
+    b->newslope = (float *) reserve_sync_buffer(b->newslope,
+            &b->newslopeallocated, corr_size, sizeof(float), &ok);
+    if (!ok) goto NO_MEMORY;
+    linemap = b->linemap;
+    cpath = b->cpath;
+    slope = b->slope;
+    newslope = b->newslope;
+    memset(linemap, 0, (size_t) num_windows * corr_size * sizeof(int));
+    memset(cpath, 0, corr_size * sizeof(int));
+    for (i=0; i<corr_size; ++i) {
+        slope[i] = 1.0F;
+        newslope[i] = 1.0F;
     }
 
-    for (i=0; i<num_windows; ++i) {
-        int j;
+    syncmap_w = MAX2(1, unscaled_corr_size / parameters->syncmap_accuracy);
+    syncmap_h = MAX2(1, pattern[p->size-1].strt / parameters->syncmap_accuracy);
+    if (parameters->sync_write_maps) {
+        b->syncmap = (unsigned char *) reserve_sync_buffer(b->syncmap,
+                &b->syncmapallocated, (size_t) syncmap_w * syncmap_h,
+                sizeof(unsigned char), &ok);
+        if (!ok) goto NO_MEMORY;
+        syncmap = b->syncmap;
+        memset(syncmap, 255, syncmap_w * syncmap_h * sizeof(unsigned char));
+    }
+
+    /* Correlation lines, calculated in parallel */
+    num_threads = MIN2(b->num_workers, num_windows);
+    for (i=0; i<num_threads; ++i) {
+        syncworker *w = &b->workers[i];
+        w->window_startpoints = (TurningPoint *) reserve_sync_buffer(
+                w->window_startpoints, &w->windowstartallocated,
+                window_size, sizeof(TurningPoint), &ok);
+        w->window_endpoints = (TurningPoint *) reserve_sync_buffer(
+                w->window_endpoints, &w->windowendallocated, window_size,
+                sizeof(TurningPoint), &ok);
 #ifdef CORRELATION_CUTOFF
-        int average_corr = 0;
+        w->mediancorr = (int *) reserve_sync_buffer(w->mediancorr,
+                &w->medianallocated, corr_size, sizeof(int), &ok);
 #endif
+        parts[i].pattern = p;
+        parts[i].startpoints = startpoints;
+        parts[i].endpoints = endpoints;
+        parts[i].num_tpoints = t->size;
+        parts[i].ppos = ppos;
+        parts[i].first_window = (int) ((long long) num_windows * i /
+                num_threads);
+        parts[i].end_window = (int) ((long long) num_windows * (i + 1) /
+                num_threads);
+        parts[i].window_size = parameters->sync_window_size;
+        parts[i].accuracy = parameters->sync_accuracy;
+        parts[i].unscaled_corr_size = unscaled_corr_size;
+        parts[i].corr_size = corr_size;
+        parts[i].lines = b->lines;
+        parts[i].worker = w;
+        parts[i].ok = 1;
+    }
+    if (!ok) goto NO_MEMORY;
+    if (num_threads > 0) {
+        /* The calling thread calculates the first part */
+        for (i=1; i<num_threads; ++i) {
+            started[i] = (pthread_create(&threads[i], NULL, sync_lines_p3,
+                    &parts[i]) == 0);
+        }
+        sync_lines_p3(&parts[0]);
+        for (i=1; i<num_threads; ++i) {
+            if (started[i]) pthread_join(threads[i], NULL);
+            else sync_lines_p3(&parts[i]);
+        }
+        for (i=0; i<num_threads; ++i) {
+            if (!parts[i].ok) return;
+        }
+    }
+
+    /* Synchronization path */
+    for (i=0; i<num_windows; ++i) {
+        int j;
         int pos = ppos[i];
-        float pattern_duration = 0.0F;
         int row = MAX2(0, syncmap_h - 1 - (pattern[pos].strt /
                 parameters->syncmap_accuracy));
-        unsigned char *syncmap_row = &syncmap[syncmap_w * row];
+        int *corr = &b->lines[(size_t) i * corr_size];
         int *linemap_row = &linemap[(i-1) * corr_size];
-        int window_notes = MIN2(p->size - pos, parameters->sync_window_size);
         int windowpos = pattern[pos].strt;
-        /*fprintf(stderr, "Pos: %d : %d : %d\n", pos, window_notes, (int) syncmap_row);*/
-        fprintf(stderr, "Pos: %d/%d : %d : %d\n", i, num_windows, pos, syncmap_w*row);
-        if (window_notes <= 1) break;
-        memset(unscaled_corr, 0, unscaled_corr_size * sizeof(int));
-        memset(corr, 0, corr_size * sizeof(int));
-        sync_turningpoints_p3(window_notes,
-                &pattern[pos], s->size, startpoints, endpoints,
-                unscaled_corr_size, unscaled_corr);
-        for (j=pos; j<(pos+window_notes); ++j)
-            pattern_duration += (float) pattern[j].dur;
-        for (j=0; j<unscaled_corr_size; ++j) {
-            int cpos = MIN2(j / parameters->sync_accuracy, corr_size-1);
-            corr[cpos] = MAX2(corr[cpos], unscaled_corr[j]);
-        }
-/*        for (j=0; j<corr_size; ++j) {
-            average_corr += corr[j];
-        }
-        average_corr = average_corr / corr_size;*/
-#ifdef CORRELATION_CUTOFF
-        memcpy(mediancorr, corr, corr_size * sizeof(int));
-        average_corr = kth_smallest(mediancorr, corr_size, 3 * corr_size / 4);
-        for (j=0; j<corr_size; ++j) {
-            if (corr[j] < average_corr) {
-                corr[j] = (int) (1000.0F * ((float) (corr[j] - average_corr)) / pattern_duration);
-            } else {
-                corr[j] = (int) (1000.0F * (float) corr[j] / pattern_duration);
+        if (syncmap != NULL) {
+            unsigned char *syncmap_row = &syncmap[syncmap_w * row];
+            for (j=0; j<corr_size; ++j) {
+                /* TODO: optimize the integer division out */
+                int syncmap_column = MIN2(syncmap_w - 1, j / map_accuracy);
+                unsigned char color = 255 - (unsigned char)
+                        (255.0 * MIN2((float)MAX2(corr[j],0) / 1000.0F, 1.0F));
+                syncmap_row[syncmap_column] = MIN2(
+                        syncmap_row[syncmap_column], color);
             }
-
-        }
-#else 
-        for (j=0; j<corr_size; ++j) {
-            corr[j] = (int) (1000.0F * (float) corr[j] / pattern_duration);
-        }
-#endif
-        for (j=0; j<corr_size; ++j) {
-            /* TODO: optimize the integer division out */
-            int syncmap_column = MIN2(syncmap_w - 1, j / map_accuracy);
-            unsigned char color = 255 - (unsigned char)
-                    (255.0 * MIN2((float)MAX2(corr[j],0) / 1000.0F, 1.0F));
-            syncmap_row[syncmap_column] = MIN2(syncmap_row[syncmap_column],
-                    color);
-        }
-        if ((lastrow > 0) && (lastrow > row + 1)) {
-            for (j=lastrow-1; j>row; --j) {
-                memcpy(&syncmap[syncmap_w * j], &syncmap[syncmap_w * lastrow],
-                        syncmap_w * sizeof(unsigned char));
+            if ((lastrow > 0) && (lastrow > row + 1)) {
+                for (j=lastrow-1; j>row; --j) {
+                    memcpy(&syncmap[syncmap_w * j],
+                            &syncmap[syncmap_w * lastrow],
+                            syncmap_w * sizeof(unsigned char));
+                }
             }
         }
         if (lastwindowpos < windowpos) {
@@ -521,109 +607,59 @@ static void sync_song_p3(const song *s, const song *p,
                 linemap_row[j] = (unsigned short) (j-maxpos);
             }*/
             pq_free(pq);
-            {
-                for (j=0; j<corr_size; ++j) {
-                    pqnode *node = pq_getmin(maxlinepq);
-                    int c = corr[j];
-                    /*int c = (int) (1000.0F * (float) corr[j] /
-                            sqrtf((float) MAX2(j * parameters->sync_accuracy,
-                            pattern[pos].strt)));*/
-                    if (node->key1 < c) {
-                        node->key1 = c;
-                        node->key2 = j;
-                        node->pointer = (void *) i;
-                        pq_update_key1_p3(maxlinepq, node);
-                    }
+            for (j=0; j<corr_size; ++j) {
+                if (bestlinecorr < corr[j]) {
+                    bestlinecorr = corr[j];
+                    bestlinecol = j;
+                    bestlinerow = i;
                 }
             }
-/*            if (i == num_windows - 1) {
-                int r = i-1;
-                w1 = corr_size;
-                for (j=0; j<corr_size;) {
-                    int end = MIN2(corr_size, j + 5000);
-                    int max = j;
-                    pqnode *node = pq_getmin(maxlinepq);
-                    for (; j<end; ++j) {
-                        if (corr[max] < corr[j]) max = j;
-                    }
-                    if (node->key1 < corr[max]) {
-                        node->key1 = corr[max];
-                        node->key2 = max;
-                        node->pointer = (void *) r;
-                        pq_update_key1_p3(maxlinepq, node);
-                    }
-                }
-            } else {
-                int r = i-2;
-                int max = MAX2(0, corr_size - w1 - 2);
-                pqnode *node = pq_getmin(maxlinepq);
-                for (j=max+1; j<corr_size; ++j) {
-                    if (cpath[j] > cpath[max]) max = j;
-                }
-                if (node->key1 < cpath[max]) {
-                    node->key1 = cpath[max];
-                    node->key2 = max;
-                    node->pointer = (void *) r;
-                    pq_update_key1_p3(maxlinepq, node);
-                }
-            }*/
             memcpy(cpath, corr, corr_size * sizeof(int));
             VOIDPTR_SWAP(slope, newslope);
         }
         lastrow = row;
         lastwindowpos = windowpos;
     }
-    while(1) {
-        pqnode *node = pq_getmin(maxlinepq);
-        if (node->key1 == INT_MAX) break;
-        if (node->key1 > 0) {
-            int row = (int) node->pointer;
-            int col = node->key2;
-            while(row >= 0) {
-                int pos = ppos[row];
-                int map_row = MAX2(0, syncmap_h - 1 - (pattern[pos].strt /
-                    parameters->syncmap_accuracy));
-                int c;
-                /*syncmap[syncmap_w * map_row + col/map_accuracy] = 0;*/
-                if (row > 0) {
-                    c = linemap[(row-1) * corr_size + col];
-                    if (c == INT_MAX) break;
-                    else col = c;
-                }
-                --row;
+    if (bestlinecorr > 0) {
+        int row = bestlinerow;
+        int col = bestlinecol;
+        while(row >= 0) {
+            int c;
+            /*int pos = ppos[row];
+            int map_row = MAX2(0, syncmap_h - 1 - (pattern[pos].strt /
+                parameters->syncmap_accuracy));
+            syncmap[syncmap_w * map_row + col/map_accuracy] = 0;*/
+            if (row > 0) {
+                c = linemap[(row-1) * corr_size + col];
+                if (c == INT_MAX) break;
+                else col = c;
             }
-            similarity = (float) ((double) node->key1 / (1000.0 * (double) ((int) node->pointer - MAX2(0, row))));
-            match_start = col * parameters->sync_accuracy; 
-            match_end = node->key2 * parameters->sync_accuracy;
+            --row;
         }
-        node->key1 = INT_MAX;
-        pq_update_key1_p3(maxlinepq, node);
+        similarity = (float) ((double) bestlinecorr / (1000.0 * (double) (bestlinerow - MAX2(0, row))));
+        match_start = col * parameters->sync_accuracy; 
+        match_end = bestlinecol * parameters->sync_accuracy;
+    }
+    if (syncmap != NULL) {
+        snprintf(output_file, 256, "sync_%d_%d.pgm", p->id, s->id);
+        write_pgm(output_file, syncmap, syncmap_w, syncmap_h);
     }
-    snprintf(output_file, 256, "sync_%d_%d.pgm", p->id, s->id);
-    write_pgm(output_file, syncmap, syncmap_w, syncmap_h);
     insert_match(ms, s->id, match_start, match_end, 0, similarity);
+    return;
 
-end:
-    pq_free(maxlinepq);
-    free(ppos);
-    free(linemap);
-    free(syncmap);
-    free(newslope);
-    free(slope);
-#ifdef CORRELATION_CUTOFF
-    free(mediancorr);
-#endif
-    free(cpath);
-    free(corr);
-    free(unscaled_corr);
-    free(startpoints);
-    free(endpoints);
+NO_MEMORY:
+    fputs("Error in sync_song_p3(): failed to allocate memory\n", stderr);
 }
 
 
 
 /**
- * Scan a song collection with sync_song_p3().
+ * Scan a song collection with sync_song_p3(). The buffers and the
+ * correlation threads' work space are shared by all songs. The P3 data of
+ * the collection is used when it has been built with
+ * update_song_collection_data(), so that the target songs are converted
+ * only once for all patterns. Otherwise each song is taken from the shared
+ * P3 song cache and may be converted again for the next pattern.
  *
  * @param sc a song collection to scan
  * @param pattern pattern to search for
@@ -633,9 +669,30 @@ end:
  */
 void alg_sync_p3(const songcollection *sc, const song *pattern, int alg,
         const searchparameters *parameters, matchset *ms) {
+    syncbuffers *b = (syncbuffers *) calloc(1, sizeof(syncbuffers));
+    const p3songcollection *p3sc = (const p3songcollection *)
+            sc->data[DATA_P3];
+    int num_threads = parameters->sync_threads;
     int i;
-    for (i=0; i<sc->size; ++i) {
-        sync_song_p3(&sc->songs[i], pattern, parameters, ms);
+    if (b == NULL) {
+        fputs("Error in alg_sync_p3(): failed to allocate memory\n", stderr);
+        return;
+    }
+    if (num_threads <= 0) num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    b->num_workers = MIN2(MAX2(num_threads, 1), SYNC_MAX_THREADS);
+    for (i=0; i<b->num_workers; ++i) init_p3s_scan(&b->workers[i].scan);
+    if ((p3sc != NULL) && (p3sc->size == sc->size)) {
+        for (i=0; i<p3sc->size; ++i) {
+            sync_song_p3(p3sc->p3_songs[i], pattern, parameters, b, ms);
+        }
+    } else {
+        for (i=0; i<sc->size; ++i) {
+            const p3song *t = acquire_p3_song(&sc->songs[i]);
+            if (t == NULL) break;
+            sync_song_p3(t, pattern, parameters, b, ms);
+            release_p3_song(t);
+        }
     }
+    free_sync_buffers(b);
 }
 
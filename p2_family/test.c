@@ -87,6 +87,13 @@
 #define TEST_ARG_VERBOSE            'v'
 #define TEST_ARG_TIME_INDEXING      'I'
 #define TEST_ARG_P3_REMOVE_GAPS     524
+#define TEST_ARG_VECTOR_INDEX       525
+#define TEST_ARG_COMPRESS_INDEX     526
+#define TEST_ARG_INDEX_THREADS      527
+#define TEST_ARG_APPEND_SONGS       528
+#define TEST_ARG_SEARCH_THREADS     529
+#define TEST_ARG_SYNC_THREADS       530
+#define TEST_ARG_SYNC_WRITE_MAPS    531
 
 static const struct option LONG_OPTIONS[] = {
     {"help",                no_argument,        0, TEST_ARG_HELP},
@@ -103,8 +110,15 @@ static const struct option LONG_OPTIONS[] = {
     {"p2-threshold",        required_argument,  0, TEST_ARG_P2_THRESHOLD},
     {"p2-fixed-points",     required_argument,  0, TEST_ARG_P2_FIXED_POINTS},
     {"p3-remove-gaps",      required_argument,  0, TEST_ARG_P3_REMOVE_GAPS},
+    {"sync-threads",        required_argument,  0, TEST_ARG_SYNC_THREADS},
+    {"sync-write-maps",     no_argument,        0, TEST_ARG_SYNC_WRITE_MAPS},
     {"vector-width",        required_argument,  0, TEST_ARG_VECTOR_WIDTH},
     {"vector-height",       required_argument,  0, TEST_ARG_VECTOR_HEIGHT},
+    {"vector-index",        required_argument,  0, TEST_ARG_VECTOR_INDEX},
+    {"compress-index",      no_argument,        0, TEST_ARG_COMPRESS_INDEX},
+    {"index-threads",       required_argument,  0, TEST_ARG_INDEX_THREADS},
+    {"append-songs",        required_argument,  0, TEST_ARG_APPEND_SONGS},
+    {"search-threads",      required_argument,  0, TEST_ARG_SEARCH_THREADS},
     {"quantize",            required_argument,  0, TEST_ARG_QUANTIZE},
     {"remove-octaves",      no_argument,        0, TEST_ARG_REMOVE_OCTAVES},
     {"skip-percussion",     no_argument,        0, TEST_ARG_SKIP_PERCUSSION},
@@ -179,6 +193,21 @@ void test_print_usage(const test_parameters *p) {
     printf("  -H, --vector-height <int>  Maximum height of an index vector in halftones [%d]\n\n",
             p->data_parameters.avindex_vector_max_height);
 
+    puts(  "      --vector-index <path>  Load the vector index from a file, or build it");
+    puts(  "                             and save it there if the file does not match");
+    puts(  "                             the song collection [no]\n");
+
+    puts(  "      --compress-index       Compress the vector index records [no]\n");
+
+    puts(  "      --index-threads <int>  Number of threads for building the index,");
+    puts(  "                             0 for one per processor [0]\n");
+
+    puts(  "      --append-songs <int>   Index the last songs of the collection by");
+    puts(  "                             appending them one at a time [0]\n");
+
+    puts(  "      --search-threads <int> Number of threads for batched searches,");
+    puts(  "                             0 for one per processor [0]\n");
+
     printf("  -Q, --quantize <int>       Quantization in milliseconds [%d]\n",
             p->search_parameters.quantization);
     puts(  "                             This is applied to both songs and patterns.");
@@ -213,6 +242,11 @@ void test_print_usage(const test_parameters *p) {
     puts(  "      --p2-fixed-points <int>    P2' indexing: Number of fixed points that must");
     printf("                                 be in the matches [1/%d of pattern notes]\n\n",
             -p->search_parameters.p2_num_points);
+    puts(  "      --sync-threads <int>   Sync P3: Number of threads for the correlation");
+    printf("                             lines, 0 for one per processor [%d]\n\n",
+            p->search_parameters.sync_threads);
+    puts(  "      --sync-write-maps      Sync P3: Write the synchronization map of each");
+    puts(  "                             song to sync_<pattern>_<song>.pgm [no]\n");
 
 
     puts(  "Pattern input:\n");
@@ -421,6 +455,8 @@ void test_init_parameters(test_parameters *p) {
     p->multiple_matches_per_song = 0;
     p->distance_matrix_file = NULL;
     p->output_indexing_time = NULL;
+    p->append_songs = 0;
+    p->search_threads = 0;
 
     p->measurement_points = 0;
     p->result_row_label = 0.0F;
@@ -428,6 +464,9 @@ void test_init_parameters(test_parameters *p) {
     p->data_parameters.avindex_vector_max_width = 10000;
     p->data_parameters.avindex_vector_max_height = 36;
     p->data_parameters.c_window = 30;
+    p->data_parameters.vindex_file = NULL;
+    p->data_parameters.compress_vindex = 0;
+    p->data_parameters.num_threads = 0;
 
     p->search_parameters.c_window = p->data_parameters.c_window;
     p->search_parameters.d_window = 3;
@@ -444,6 +483,8 @@ void test_init_parameters(test_parameters *p) {
     p->search_parameters.sync_window_size = 25;
     p->search_parameters.sync_accuracy = 200;
     p->search_parameters.syncmap_accuracy = 200;
+    p->search_parameters.sync_write_maps = 0;
+    p->search_parameters.sync_threads = 0;
 
     p->next_parameter_group = NULL;
 }
@@ -562,6 +603,12 @@ int test_parse_arguments(int argc, char **argv, test_parameters *p) {
             case TEST_ARG_P3_REMOVE_GAPS:
                 p->search_parameters.p3_remove_gaps = atoi(optarg);
                 break;
+            case TEST_ARG_SYNC_THREADS:
+                p->search_parameters.sync_threads = MAX2(atoi(optarg), 0);
+                break;
+            case TEST_ARG_SYNC_WRITE_MAPS:
+                p->search_parameters.sync_write_maps = 1;
+                break;
             case TEST_ARG_VECTOR_WIDTH:
                 if (p == global_parameters) {
                     p->data_parameters.avindex_vector_max_width =
@@ -576,6 +623,36 @@ int test_parse_arguments(int argc, char **argv, test_parameters *p) {
                 } else fputs("Warning: parameter --vector-height cannot be used locally\n",
                         stderr);
                 break;
+            case TEST_ARG_VECTOR_INDEX:
+                if (p == global_parameters) {
+                    p->data_parameters.vindex_file = optarg;
+                } else fputs("Warning: parameter --vector-index cannot be used locally\n",
+                        stderr);
+                break;
+            case TEST_ARG_COMPRESS_INDEX:
+                if (p == global_parameters) {
+                    p->data_parameters.compress_vindex = 1;
+                } else fputs("Warning: parameter --compress-index cannot be used locally\n",
+                        stderr);
+                break;
+            case TEST_ARG_INDEX_THREADS:
+                if (p == global_parameters) {
+                    p->data_parameters.num_threads = MAX2(atoi(optarg), 0);
+                } else fputs("Warning: parameter --index-threads cannot be used locally\n",
+                        stderr);
+                break;
+            case TEST_ARG_APPEND_SONGS:
+                if (p == global_parameters) {
+                    p->append_songs = MAX2(atoi(optarg), 0);
+                } else fputs("Warning: parameter --append-songs cannot be used locally\n",
+                        stderr);
+                break;
+            case TEST_ARG_SEARCH_THREADS:
+                if (p == global_parameters) {
+                    p->search_threads = MAX2(atoi(optarg), 0);
+                } else fputs("Warning: parameter --search-threads cannot be used locally\n",
+                        stderr);
+                break;
             case TEST_ARG_QUANTIZE:
                 if (p == global_parameters) {
                     p->search_parameters.quantization = MAX2(atoi(optarg), 0);
@@ -880,11 +957,19 @@ int test_generate_patterns(const test_parameters *p,
 void test_init_song_collection_data(const test_parameters *p,
         songcollection *sc, int *algorithms) {
     struct timeval start, end;
+    int num_songs = sc->size;
+    int first_appended = MAX2(num_songs - p->append_songs, 0);
 
     if (p->verbose >= LOG_IMPORTANT) fputs("\nIndexing and converting to algorithm-specific formats...\n", stderr);
     gettimeofday(&start, NULL);
 
+    /* Appended songs are added to the data one at a time */
+    sc->size = first_appended;
     update_song_collection_data(sc, algorithms, &p->data_parameters);
+    while (sc->size < num_songs) {
+        ++sc->size;
+        append_song_collection_data(sc, sc->size - 1, &p->data_parameters);
+    }
 
     gettimeofday(&end, NULL);
     if (p->verbose >= LOG_IMPORTANT)
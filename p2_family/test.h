@@ -74,6 +74,8 @@ typedef struct _test_parameters {
     int multiple_matches_per_song;
     char *distance_matrix_file;
     char *output_indexing_time;
+    int append_songs;
+    int search_threads;
     dataparameters data_parameters;
     searchparameters search_parameters;
     struct _test_parameters *next_parameter_group;
@@ -38,6 +38,8 @@
 
 #include "test.h"
 #include "algorithms.h"
+#include "filter_P2.h"
+#include "search.h"
 #include "song.h"
 #include "util.h"
 
@@ -77,23 +79,58 @@ static void free_matrix(float **m, int a) {
 }
 
 /**
- * Writes a distance matrix to a file.
+ * Searches all patterns with the batched P2/F4 filter.
+ *
+ * @param p operation parameters
+ * @param sc a song collection
+ * @param patterns searched patterns as a song collection
+ * @param distances the distance matrix to fill
+ */
+static void batch_distances(const test_parameters *p,
+        const songcollection *sc, const songcollection *patterns,
+        float **distances) {
+    matchset *ms = (matchset *) malloc(patterns->size * sizeof(matchset));
+    int i, j;
+
+    if (ms == NULL) {
+        fputs("\nError: failed to allocate memory for the match sets\n", stderr);
+        return;
+    }
+    for (i=0; i<patterns->size; ++i) init_match_set(&ms[i], sc->size, 0, 0);
+
+    filter_p2_window_batch(sc, patterns, &p->search_parameters, ms,
+            p->search_threads);
+
+    for (i=0; i<patterns->size; ++i) {
+        for (j=0; j<ms[i].num_matches; ++j)
+            distances[i][ms[i].matches[j].song] = -ms[i].matches[j].similarity;
+        free_match_set(&ms[i]);
+    }
+    free(ms);
+}
+
+/**
+ * Writes a distance matrix to a file. Patterns are searched with P2/F4 as
+ * a single batch and with other algorithms one at a time.
  *
  * @param p operation parameters
  * @param algorithm the search algorithm or index filter to use
  * @param sc a song collection
  * @param patterns searched patterns as a song collection
+ * @param pattern_matches original pattern positions; not used here
+ *
+ * @return NULL
  */
-static void write_distance_matrix(indextest_parameters *p, int algorithm,
-        songcollection *sc, songcollection *patterns) {
+static char *write_distance_matrix(const test_parameters *p, int algorithm,
+        const songcollection *sc, const songcollection *patterns,
+        const matchset *pattern_matches) {
     float **distances;
     FILE *f;
     int i;
     struct timeval start, end;
     double diff;
-    matchset ms;
 
-    init_match_set(&ms, sc->size, 0, 0);
+    if ((sc->size == 0) || (patterns->size == 0)) return NULL;
     distances = init_matrix(patterns->size, sc->size);
 
     /* Append to the file */
@@ -102,31 +139,34 @@ static void write_distance_matrix(indextest_parameters *p, int algorithm,
         fprintf(stderr, "\nError: Unable to write to file: %s",
                 p->distance_matrix_file);
         free_matrix(distances, patterns->size);
-        free_match_set(&ms);
-        return;
+        return NULL;
     }
 
     gettimeofday(&start, NULL);
 
-    if (p->verbose)
+    if (p->verbose >= LOG_INFO)
         fprintf(stderr, "\nCalculating distances with algorithm %s\n",
                 get_algorithm_name(algorithm));
-    for (i=0; i<patterns->size; ++i) {
-        int j;
-        clear_match_set(&ms);
-        for (j=0; j<sc->size; ++j)
-            distances[i][j] = 0.0F;
+    if (algorithm == FILTER_P2_WINDOW) {
+        batch_distances(p, sc, patterns, distances);
+    } else {
+        matchset ms;
+        init_match_set(&ms, sc->size, 0, 0);
+        for (i=0; i<patterns->size; ++i) {
+            int j;
+            clear_match_set(&ms);
 
-        if (p->verbose)
-            fprintf(stderr, "%d: %s\n", i, patterns->songs[i].title);
+            if (p->verbose >= LOG_INFO)
+                fprintf(stderr, "%d: %s\n", i, patterns->songs[i].title);
 
-        search(sc, &patterns->songs[i], algorithm,
-                &p->search_parameters, &ms);
+            search(sc, &patterns->songs[i], algorithm,
+                    &p->search_parameters, &ms);
 
-        for (j=0; j<ms.num_matches; ++j)
-            distances[i][ms.matches[j].song] = -ms.matches[j].similarity;
+            for (j=0; j<ms.num_matches; ++j)
+                distances[i][ms.matches[j].song] = -ms.matches[j].similarity;
+        }
+        free_match_set(&ms);
     }
-    free_match_set(&ms);
 
     gettimeofday(&end, NULL);
 
@@ -151,37 +191,35 @@ static void write_distance_matrix(indextest_parameters *p, int algorithm,
 
     fclose(f);
     free_matrix(distances, patterns->size);
+    return NULL;
 }
 
 
 /**
- * Vector index test program.
+ * Distance matrix test program.
  *
  * @param argc number of arguments
  * @param argv argument array
  *
- * @return 0
+ * @return 0 if successful, 1 otherwise
  */
 int main(int argc, char **argv) {
-    songcollection scollection;
-    songcollection pcollection;
-    matchset pmatches;
-    indextest_parameters p;
-    int i;
+    test_parameters p;
 
-    indextest_init_parameters(&p);
-    if (!indextest_parse_arguments(argc, argv, &p)) return 1;
+    test_init_parameters(&p);
+    if (!test_parse_arguments(argc, argv, &p)) return 1;
 
-    if (p->distance_matrix_file == NULL) {
-        indextest_run_test(&p, indextest_measure_searchtime);
-    } else {
-        indextest_run_test(&p, write_distance_matrix);
+    if (p.distance_matrix_file == NULL) {
+        fputs("Error: output file not specified. Use --distance-matrix <path>\n",
+                stderr);
+        test_free_parameters(&p);
+        return 1;
     }
+    run_test(&p, &write_distance_matrix);
 
-    indextest_free_parameters(&p);
+    test_free_parameters(&p);
 
     if (p.verbose) fputs(" Done.\n", stderr);
 
     return 0;
 }
-
@@ -39,6 +39,7 @@
 
 #include "test.h"
 #include "algorithms.h"
+#include "filter_P2.h"
 #include "song.h"
 #include "util.h"
 
@@ -63,6 +64,9 @@ static void search_patterns(const test_parameters *p, int algorithm,
     double *t;
     matchset ms;
     searchparameters *sp;
+    double estimated_records = 0.0, estimated_checks = 0.0;
+    double records = 0.0, checks = 0.0;
+    int planned = 0;
 #ifdef MEASURE_TIME_ALLOCATION
     double *t_indexing;
     double *t_other;
@@ -118,6 +122,10 @@ static void search_patterns(const test_parameters *p, int algorithm,
         if ((algorithm == FILTER_P2_POINTS) || (algorithm == ALG_P2_POINTS))
             test_p2_select_points(sp, &patterns->songs[i], p->verbose);
 
+        /* Reuse the match set buffers; clearing takes constant time */
+        clear_match_set(&ms);
+        ms.time.measure = sp->measure_time_allocation;
+
         gettimeofday(&start, NULL);
 
         for (j=0; j<p->num_repeats; ++j) {
@@ -138,6 +146,26 @@ static void search_patterns(const test_parameters *p, int algorithm,
         if (delta < m->lowest) m->lowest = delta;
         if (delta > m->highest) m->highest = delta;
 
+        /* Compare the cost estimate of a planned filter to the work that
+         * was actually done */
+        if (ms.cost.plan) {
+            double n = (double) p->num_repeats;
+            estimated_records += ms.cost.estimated_records / n;
+            estimated_checks += ms.cost.estimated_checks / n;
+            records += (double) ms.cost.records / n;
+            checks += (double) ms.cost.checks / n;
+            ++planned;
+            if (p->verbose >= LOG_INFO) {
+                fprintf(stderr, "Plan: %s, records estimated:%.0f actual:%.0f, checks estimated:%.0f actual:%.0f\n",
+                        (ms.cost.plan == P2_PLAN_PIGEONHOLE) ?
+                        "pigeonhole" : "window",
+                        ms.cost.estimated_records / n,
+                        (double) ms.cost.records / n,
+                        ms.cost.estimated_checks / n,
+                        (double) ms.cost.checks / n);
+            }
+        }
+
         if (p->verbose >= LOG_INFO) print_results(&ms, sc);
 
     }
@@ -152,6 +180,11 @@ static void search_patterns(const test_parameters *p, int algorithm,
         fprintf(stderr, "\nTime mean:%f lowest:%f q1:%f q2:%f q3:%f highest:%f\n",
                 m->mean, m->lowest, m->q1, m->q2, m->q3, m->highest);
 
+    if ((p->verbose >= LOG_INFO) && (planned > 0))
+        fprintf(stderr, "Cost mean: records estimated:%.0f actual:%.0f, checks estimated:%.0f actual:%.0f\n",
+                estimated_records / planned, records / planned,
+                estimated_checks / planned, checks / planned);
+
 
 #ifdef MEASURE_TIME_ALLOCATION
     if (p->search_parameters.measure_time_allocation) {
@@ -1,7 +1,8 @@
 /*
  * vindex_array.c - Vector-based index structure for polyphonic music
- *                  retrieval. This variant is stored and accessed as
- *                  a two-dimensional array.
+ *                  retrieval. The indexed vectors are stored in
+ *                  a continuous buffer and accessed through a hashed
+ *                  bucket directory.
  *
  * Version 2007-08-21
  *
@@ -37,6 +38,12 @@
 #include <limits.h>
 #include <math.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "data.h"
@@ -44,119 +51,437 @@
 #include "vindex_array.h"
 
 
+
+/**
+ * Selects the record format for indexing songs of a collection. Song
+ * numbers and note positions are stored in 16 bits if they fit.
+ *
+ * @param sc a song collection
+ * @param first_song the first song to index
+ * @param end_song the song after the last one to index
+ * @param compress set to 1 to compress the records
+ *
+ * @return record format
+ */
+static int select_record_format(const songcollection *sc, int first_song,
+        int end_song, int compress) {
+    int i;
+    if (compress) return VINDEX_RECORDS_COMPRESSED;
+#ifdef VINDEX_WIDE_RECORDS
+    return VINDEX_RECORDS_32BIT;
+#endif
+    if (end_song > USHRT_MAX + 1) return VINDEX_RECORDS_32BIT;
+    for (i=first_song; i<end_song; ++i) {
+        if (sc->songs[i].size > USHRT_MAX + 1) return VINDEX_RECORDS_32BIT;
+    }
+    return VINDEX_RECORDS_16BIT;
+}
+
+
+/**
+ * Returns the number of bytes needed for encoding a variable-length
+ * integer in compressed index records.
+ *
+ * @param value a non-negative integer
+ *
+ * @return number of bytes
+ */
+static INLINE int index_varint_size(unsigned int value) {
+    int n = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++n;
+    }
+    return n;
+}
+
+/**
+ * Encodes a variable-length integer for compressed index records.
+ *
+ * @param p output buffer
+ * @param value a non-negative integer
+ *
+ * @return pointer to the byte after the encoded integer
+ */
+static INLINE unsigned char *write_index_varint(unsigned char *p,
+        unsigned int value) {
+    while (value >= 0x80) {
+        *p++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char) value;
+    return p;
+}
+
+/**
+ * Encodes a compressed index record as the difference to the previous
+ * record of the block.
+ *
+ * @param p output buffer, or NULL to only count the bytes
+ * @param last the previous record
+ * @param song song number of the record
+ * @param note note position of the record
+ *
+ * @return number of bytes in the encoded record
+ */
+static INLINE int encode_index_record(unsigned char *p,
+        const wideindexrec *last, int song, int note) {
+    int d = song - last->song;
+    if (d == 0) {
+        unsigned int value = (unsigned int) (note - last->note) << 1;
+        if (p != NULL) write_index_varint(p, value);
+        return index_varint_size(value);
+    } else {
+        unsigned int value = ((unsigned int) d << 1) | 1;
+        int n = index_varint_size(value);
+        if (p != NULL) write_index_varint(write_index_varint(p, value), note);
+        return n + index_varint_size(note);
+    }
+}
+
+
 /**
- * Returns the position of the specified vector in the index structure.
+ * Returns the key of the specified vector in the bucket directory.
  *
  * @param vindex the index structure
  * @param x vector's x component
  * @param y vector's y component
  *
- * @return position of the vector
+ * @return key of the vector, or -1 if the vector is outside the index
  */
-static INLINE int index_vector_position(const vectorindex *vindex, int x, int y) {
+static INLINE int index_vector_key(const vectorindex *vindex, int x, int y) {
     y += vindex->height >> 1;
     if ((y < 0) || (x < 0) || (y >= vindex->height) || (x >= vindex->width))
         return -1;
     return (y * vindex->width + x);
 }
 
+/**
+ * Finds the slot of a key in a bucket directory.
+ *
+ * @param table the bucket directory
+ * @param table_size number of slots, a power of two
+ * @param table_shift 32 - log2(table_size)
+ * @param key a vector key
+ *
+ * @return the slot that holds the key, or the empty slot where it would
+ *         be inserted
+ */
+static INLINE int find_index_bucket(const indexbucket *table, int table_size,
+        int table_shift, int key) {
+    /* Fibonacci hashing: the high bits of the product are well mixed */
+    int h = (int) (((unsigned int) key * 2654435761U) >> table_shift);
+    while ((table[h].key != key) && (table[h].key >= 0))
+        h = (h + 1) & (table_size - 1);
+    return h;
+}
 
 /**
- * Adds a new record to the index structure. The memory buffer that
- * contains all the index records for the vector is set if it hasn't been
- * done before.
+ * Returns an indexed vector of a segment.
  *
- * @param vindex the index structure
- * @param x the x component of the indexed vector
- * @param y the y component of the indexed vector
- * @param songid song id in the song collection
- * @param note vector start position in the song
- * @param records pointer to a buffer where the index records should be stored
- *        to. This is actually only needed when the buffer pointer has not yet
- *        been set for the vector in question.
- *
- * @return the number of index records reserved from the records buffer. This
- * is usually 0.
- *
- * @see populate_vectorindex()
- */
-#if 0
-static INLINE int index_add(vectorindex *vindex, int x, int y,
-        unsigned short songid, unsigned short note, indexrec *records) {
-    indexvector *v;
-    int pos = index_vector_position(vindex, x, y);
-    if (pos < 0) return 0;
-
-    v = &vindex->vectors[pos];
-    if (v->allocate < 0) return 0;
-
-    if (v->allocate > 0) {
-        /* The record buffer has not yet been set; use the given pointer and
-         * return the number of records needed (that information is stored
-         * in v->allocate). */
-        v->records = records;
-        pos = v->allocate;
-        v->allocate = 0;
-    } else {
-        pos = 0;
+ * @param seg an index segment
+ * @param key vector key
+ *
+ * @return the indexed vector, or NULL if it has no records in the segment
+ */
+static INLINE const indexvector *segment_vector(const indexsegment *seg,
+        int key) {
+    const indexbucket *b = &seg->table[find_index_bucket(seg->table,
+            seg->table_size, seg->table_shift, key)];
+    if (b->key < 0) return NULL;
+    return (const indexvector *) &seg->buffer[b->offset];
+}
+
+/**
+ * Returns the size of an indexed vector in the record buffer.
+ *
+ * @param format record format
+ * @param num_records number of records in the vector
+ * @param bytes size of the encoded records for compressed vectors
+ *
+ * @return size in bytes
+ */
+static INLINE size_t index_vector_bytes(int format, int num_records,
+        int bytes) {
+    size_t size = sizeof(indexvector);
+    switch (format) {
+        case VINDEX_RECORDS_16BIT:
+            return size + (size_t) num_records * sizeof(indexrec);
+        case VINDEX_RECORDS_32BIT:
+            return size + (size_t) num_records * sizeof(wideindexrec);
+        default:
+            /* Keep the vectors aligned */
+            return size + (size_t) ((num_records - 1) / VINDEX_BLOCK_SIZE) *
+                    sizeof(indexblock) + (((size_t) bytes + 3) & ~3);
     }
-    v->records[v->size].song = songid;
-    v->records[v->size].note = note;
-    v->size++;
-    return pos;
 }
-#endif
+
 
 /**
- * Initializes a vector index structure.
+ * Adds to the record count or the encoded size of an indexed vector.
+ * The records of a vector are addressed with ints, so the sum must leave
+ * room for the alignment padding of index_vector_bytes().
  *
- * @return pointer to the index structure.
+ * @param sum the count or size to add to
+ * @param n the amount to add
+ *
+ * @return 1 if successful, 0 if the sum would be too large
  */
-void *init_vectorindex(void) {
-    vectorindex *vindex = calloc(1, sizeof(vectorindex));
-    return vindex;
+static INLINE int add_index_vector_size(int *sum, long long n) {
+    if (*sum + n > INT_MAX - 3) return 0;
+    *sum += (int) n;
+    return 1;
+}
+
+
+/**
+ * Temporary data for building the index records of a part of a song
+ * collection. The parts are processed in parallel and each part numbers
+ * the vectors locally in the order they are found.
+ */
+typedef struct {
+    vectorindex *vindex;
+    indexsegment *segment;
+    const songcollection *sc;
+    /* Songs of the part: first_song to end_song - 1 */
+    int first_song;
+    int end_song;
+    /* Bucket directory for counting; the offset field holds the local
+     * vector number */
+    indexbucket *table;
+    int table_size;
+    int table_shift;
+    /* Number of vectors, allocated size of the key, count and last record
+     * arrays, a flag that is set if the arrays could not be grown and
+     * a flag that is set if a vector has too many records */
+    int num_vectors;
+    int capacity;
+    int failed;
+    int too_large;
+    /* Key and number of records for each vector */
+    int *keys;
+    int *counts;
+    /* Number of each vector in the segment, or -1 if it is not indexed */
+    int *vectors;
+    /* Position of the first record of the part in the index vector, and
+     * the position of the next record to add */
+    int *first;
+    int *added;
+    /* Last record added. For compressed vectors the record before the
+     * part is stored in previous, and the position of the encoded data of
+     * the part in first_byte. The next byte to write to, or the size of
+     * the encoded data while measuring, is in bytes. */
+    wideindexrec *last;
+    wideindexrec *previous;
+    int *first_byte;
+    int *bytes;
+    /* The indexed vectors, shared by all parts */
+    indexvector **indexed;
+} indexbuilder;
+
+
+/**
+ * Allocates an empty bucket directory.
+ *
+ * @param num_vectors number of vectors the directory should hold
+ * @param table pointer to the directory will be stored here
+ * @param table_size number of slots will be stored here
+ * @param table_shift hash shift for the slot count will be stored here
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int alloc_index_directory(int num_vectors, indexbucket **table,
+        int *table_size, int *table_shift) {
+    int size = 2, shift = 31;
+
+    /* Keep the load factor at most 1/2 */
+    while ((size >> 1) < num_vectors) {
+        if (size > (INT_MAX >> 1) / (int) sizeof(indexbucket)) return 0;
+        size <<= 1;
+        --shift;
+    }
+    *table = (indexbucket *) malloc(size * sizeof(indexbucket));
+    if (*table == NULL) return 0;
+    /* All bits set: key -1 marks an empty slot */
+    memset(*table, 0xFF, size * sizeof(indexbucket));
+    *table_size = size;
+    *table_shift = shift;
+    return 1;
 }
 
+
 /**
- * Initializes and builds a vector index for a song collection.
+ * Compares the keys of two bucket directory slots. Used with qsort().
  *
- * @param data pointer to a vector index structure
- * @param sc the song collection for which the index is built
- * @param max_x maximum width of an index vector
- * @param max_y maximum height of an index vector
- * @param c_window maximum number of consecutive notes the algorithm is
- *        allowed to skip when selecting indexed vectors
- * @param indexing_time if not NULL, time spent on populating the index
- *        is written here in seconds
+ * @param a a slot
+ * @param b another slot
+ *
+ * @return difference of the keys
  */
-int build_vectorindex(void *data, const songcollection *sc,
-        const dataparameters *dp) {
-    int i, bp;
-    int *vector_counts;
-    int total_vcount;
-    int indexed_vectors;
-    vectorindex *vindex = (vectorindex *) data;
+static int compare_index_buckets(const void *a, const void *b) {
+    int k1 = ((const indexbucket *) a)->key;
+    int k2 = ((const indexbucket *) b)->key;
+    return (k1 > k2) - (k1 < k2);
+}
+
+
+/**
+ * Adds a vector to the counting directory of an index builder. The
+ * directory and the vector arrays are grown as needed.
+ *
+ * @param b temporary build data
+ * @param key vector key
+ *
+ * @return the local vector number, or -1 if memory could not be allocated
+ */
+static int add_builder_vector(indexbuilder *b, int key) {
+    int h = find_index_bucket(b->table, b->table_size, b->table_shift, key);
+    if (b->table[h].key >= 0) return b->table[h].offset;
 
-    vindex->width = dp->avindex_vector_max_width;
-    vindex->height = dp->avindex_vector_max_height << 1;
-    vindex->size = vindex->width * vindex->height;
-    vector_counts = (int *) calloc(vindex->size,  sizeof(int));
-    if (vector_counts == NULL) return 0;
-
-/*    for (y=0; y<vindex->height; ++y) {
-        for (x=0; x<vindex->width; ++x) {
-            indexvector *v = vindex->vectors[y * vindex->width + x];
-            v->size = 0;
-            v->records = NULL;
+    if (b->failed) return -1;
+    if (b->num_vectors == b->capacity) {
+        int capacity = MAX2(b->capacity << 1, 1024);
+        int *keys = (int *) realloc(b->keys, capacity * sizeof(int));
+        int *counts;
+        wideindexrec *last;
+        if (keys != NULL) b->keys = keys;
+        counts = (int *) realloc(b->counts, capacity * sizeof(int));
+        if (counts != NULL) b->counts = counts;
+        last = (wideindexrec *) realloc(b->last,
+                capacity * sizeof(wideindexrec));
+        if (last != NULL) b->last = last;
+        if ((keys == NULL) || (counts == NULL) || (last == NULL)) {
+            b->failed = 1;
+            return -1;
         }
+        b->capacity = capacity;
     }
-*/
-    vindex->c_window = dp->c_window;
-    vindex->scollection = sc;
+    if (((b->num_vectors + 1) << 1) > b->table_size) {
+        indexbucket *table;
+        int size, shift, i;
+        if (!alloc_index_directory(b->num_vectors + 1, &table, &size,
+                &shift)) {
+            b->failed = 1;
+            return -1;
+        }
+        for (i=0; i<b->num_vectors; ++i) {
+            int j = find_index_bucket(table, size, shift, b->keys[i]);
+            table[j].key = b->keys[i];
+            table[j].offset = i;
+        }
+        free(b->table);
+        b->table = table;
+        b->table_size = size;
+        b->table_shift = shift;
+        h = find_index_bucket(b->table, b->table_size, b->table_shift, key);
+    }
+    b->table[h].key = key;
+    b->table[h].offset = b->num_vectors;
+    b->keys[b->num_vectors] = key;
+    b->counts[b->num_vectors] = 0;
+    return b->num_vectors++;
+}
 
-    /* Count all vectors so that we can allocate the right amount of memory */
-    total_vcount = 0;
-    for (i=0; i<sc->size; ++i) {
+
+/**
+ * Returns the local number of a vector that is indexed.
+ *
+ * @param b temporary build data
+ * @param key vector key
+ *
+ * @return local vector number, or -1 if the vector is not indexed
+ */
+static INLINE int indexed_builder_vector(const indexbuilder *b, int key) {
+    const indexbucket *bucket = &b->table[find_index_bucket(b->table,
+            b->table_size, b->table_shift, key)];
+    if ((bucket->key < 0) || (b->vectors[bucket->offset] < 0)) return -1;
+    return bucket->offset;
+}
+
+
+/**
+ * Frees the temporary data of an index builder.
+ *
+ * @param b temporary build data
+ */
+static void free_index_builder(indexbuilder *b) {
+    free(b->table);
+    free(b->keys);
+    free(b->counts);
+    free(b->vectors);
+    free(b->first);
+    free(b->added);
+    free(b->last);
+    free(b->previous);
+    free(b->first_byte);
+    free(b->bytes);
+}
+
+
+/**
+ * Numbers the vectors that will be indexed to a segment in the order of
+ * their keys, so that the buffer layout does not depend on the order they
+ * were found in, and creates the bucket directory of the segment. The
+ * directory refers to the vectors by their numbers until the records have
+ * been stored.
+ *
+ * @param b vector keys and record counts. Vectors that exceed
+ *        MAX_INDEX_BUCKET_SIZE are left out and the keys and counts of
+ *        the others are sorted to the beginning of the arrays.
+ * @param seg the segment
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int number_index_vectors(indexbuilder *b, indexsegment *seg) {
+    indexbucket *vectors = (indexbucket *) malloc(MAX2(b->num_vectors, 1) *
+            sizeof(indexbucket));
+    int i, n = 0;
+
+    if (vectors == NULL) return 0;
+    for (i=0; i<b->num_vectors; ++i) {
+        if (b->counts[i] > MAX_INDEX_BUCKET_SIZE) continue;
+        vectors[n].key = b->keys[i];
+        vectors[n].offset = b->counts[i];
+        ++n;
+    }
+    qsort(vectors, n, sizeof(indexbucket), compare_index_buckets);
+    seg->size = n;
+    seg->num_records = 0;
+    for (i=0; i<n; ++i) {
+        b->keys[i] = vectors[i].key;
+        b->counts[i] = vectors[i].offset;
+        seg->num_records += b->counts[i];
+    }
+    free(vectors);
+
+    if (!alloc_index_directory(seg->size, &seg->table, &seg->table_size,
+            &seg->table_shift)) return 0;
+    for (i=0; i<seg->size; ++i) {
+        int h = find_index_bucket(seg->table, seg->table_size,
+                seg->table_shift, b->keys[i]);
+        seg->table[h].key = b->keys[i];
+        seg->table[h].offset = i;
+    }
+    return 1;
+}
+
+
+/**
+ * Calls a function for each vector that the index covers in a part of
+ * a song collection, in the order of songs and note positions.
+ *
+ * @param vindex the index structure
+ * @param sc the song collection
+ * @param add the function to call with the key of the index vector
+ *        and the song number and note position of the record
+ * @param b temporary build data that is passed to the function. It also
+ *        specifies the songs to scan.
+ */
+static void scan_index_records(vectorindex *vindex, const songcollection *sc,
+        void (*add)(vectorindex *, indexbuilder *, int, int, int),
+        indexbuilder *b) {
+    int i;
+    for (i=b->first_song; i<b->end_song; ++i) {
         int j;
         song *s = &sc->songs[i];
         for (j=0; j<s->size-1; ++j) {
@@ -167,91 +492,1379 @@ int build_vectorindex(void *data, const songcollection *sc,
                 if (end >= s->size) end = s->size - 1;
             }
             for (k=j+1; k<=end; ++k) {
-                int x, pos;
+                int x, key;
                 char y;
                 x = s->notes[k].strt - s->notes[j].strt;
                 y = s->notes[k].ptch - s->notes[j].ptch;
-                pos = index_vector_position(vindex, x, y);
-                if (pos >= 0) {
-                    ++vector_counts[pos];
-                    ++total_vcount;
-                } else if (x >= vindex->width) break;
+                key = index_vector_key(vindex, x, y);
+                if (key >= 0) add(vindex, b, key, i, j);
+                else if (x >= vindex->width) break;
             }
         }
     }
-    indexed_vectors = 0;
-    for (i=0; i<vindex->size; ++i) {
-        if (vector_counts[i] > MAX_INDEX_BUCKET_SIZE) vector_counts[i] = 0;
-        else if (vector_counts[i] > 0) ++indexed_vectors;
+}
+
+/* Record functions for scan_index_records() */
+
+static void count_index_record(vectorindex *vindex, indexbuilder *b,
+        int key, int songid, int note) {
+    int n = add_builder_vector(b, key);
+    if (n >= 0) {
+        if (!add_index_vector_size(&b->counts[n], 1)) b->too_large = 1;
+        b->last[n].song = songid;
+        b->last[n].note = note;
     }
+}
 
-    /* Calculate total memory usage */
-    vindex->memory_usage = total_vcount * sizeof(indexrec) +
-            indexed_vectors * sizeof(indexvector);
+static void store_index_record(vectorindex *vindex, indexbuilder *b,
+        int key, int songid, int note) {
+    int n = indexed_builder_vector(b, key);
+    indexvector *iv;
+    int k;
+    if (n < 0) return;
 
+    iv = b->indexed[b->vectors[n]];
+    k = b->added[n]++;
+    if (b->segment->record_format == VINDEX_RECORDS_32BIT) {
+        wideindexrec *r = (wideindexrec *) iv->records;
+        r[k].song = songid;
+        r[k].note = note;
+    } else {
+        iv->records[k].song = songid;
+        iv->records[k].note = note;
+    }
+}
 
-    /* Allocate a continuous memory buffer for index vectors and records */
-    vindex->buffer = (char *) malloc(vindex->memory_usage);
+static void measure_compressed_record(vectorindex *vindex, indexbuilder *b,
+        int key, int songid, int note) {
+    int pos = indexed_builder_vector(b, key);
+    wideindexrec *last;
+    int k;
+    if (pos < 0) return;
+
+    last = &b->last[pos];
+    k = b->added[pos]++;
+    if ((((k % VINDEX_BLOCK_SIZE) != 0) || (k == 0)) &&
+            !add_index_vector_size(&b->bytes[pos],
+            encode_index_record(NULL, last, songid, note)))
+        b->too_large = 1;
+    last->song = songid;
+    last->note = note;
+}
+
+static void store_compressed_record(vectorindex *vindex, indexbuilder *b,
+        int key, int songid, int note) {
+    int pos = indexed_builder_vector(b, key);
+    indexvector *iv;
+    indexblock *blocks;
+    wideindexrec *last;
+    int k;
+    if (pos < 0) return;
+
+    iv = b->indexed[b->vectors[pos]];
+    last = &b->last[pos];
+    blocks = (indexblock *) iv->records;
+    k = b->added[pos]++;
+    if (((k % VINDEX_BLOCK_SIZE) == 0) && (k > 0)) {
+        indexblock *block = &blocks[k / VINDEX_BLOCK_SIZE - 1];
+        block->song = songid;
+        block->note = note;
+        block->offset = b->bytes[pos];
+    } else {
+        unsigned char *data = (unsigned char *) (blocks +
+                index_vector_blocks(iv));
+        b->bytes[pos] += encode_index_record(&data[b->bytes[pos]], last,
+                songid, note);
+    }
+    last->song = songid;
+    last->note = note;
+}
+
+
+/**
+ * A pass over the records of one part of a song collection.
+ */
+typedef struct {
+    indexbuilder *b;
+    void (*add)(vectorindex *, indexbuilder *, int, int, int);
+} indexpass;
+
+/**
+ * Index builder thread.
+ *
+ * @param arg pointer to an indexpass structure
+ *
+ * @return NULL
+ */
+static void *index_pass_worker(void *arg) {
+    indexpass *pass = (indexpass *) arg;
+    scan_index_records(pass->b->vindex, pass->b->sc, pass->add, pass->b);
+    return NULL;
+}
+
+/**
+ * Scans the parts of a song collection in parallel, one thread per part.
+ * The calling thread scans the first part.
+ *
+ * @param parts temporary build data for each part
+ * @param num_parts number of parts
+ * @param add the record function to call
+ */
+static void run_index_pass(indexbuilder *parts, int num_parts,
+        void (*add)(vectorindex *, indexbuilder *, int, int, int)) {
+    indexpass passes[VINDEX_MAX_THREADS];
+    pthread_t threads[VINDEX_MAX_THREADS];
+    int i, started;
+
+    for (i=0; i<num_parts; ++i) {
+        passes[i].b = &parts[i];
+        passes[i].add = add;
+    }
+    /* Parts whose thread could not be started are scanned here */
+    started = num_parts;
+    for (i=1; i<num_parts; ++i) {
+        if (pthread_create(&threads[i], NULL, index_pass_worker,
+                &passes[i])) {
+            started = i;
+            break;
+        }
+    }
+    index_pass_worker(&passes[0]);
+    for (i=started; i<num_parts; ++i) index_pass_worker(&passes[i]);
+    for (i=1; i<started; ++i) pthread_join(threads[i], NULL);
+}
+
+/**
+ * Resets the record positions of the parts for a pass that adds records
+ * to the index vectors.
+ *
+ * @param parts temporary build data for each part
+ * @param num_parts number of parts
+ * @param compressed 1 if the records are compressed
+ * @param measure 1 to reset the sizes of encoded data to zero for
+ *        measuring them, 0 to set the write positions
+ */
+static void rewind_index_parts(indexbuilder *parts, int num_parts,
+        int compressed, int measure) {
+    int i;
+    for (i=0; i<num_parts; ++i) {
+        indexbuilder *b = &parts[i];
+        memcpy(b->added, b->first, b->num_vectors * sizeof(int));
+        if (compressed) {
+            memcpy(b->last, b->previous, b->num_vectors *
+                    sizeof(wideindexrec));
+            if (measure) memset(b->bytes, 0, b->num_vectors * sizeof(int));
+            else memcpy(b->bytes, b->first_byte, b->num_vectors * sizeof(int));
+        }
+    }
+}
+
+
+/**
+ * Frees the memory of an index segment.
+ *
+ * @param seg the segment
+ */
+static void free_index_segment(indexsegment *seg) {
+    if (seg->mapping != NULL) munmap(seg->mapping, seg->mapping_size);
+    else {
+        free(seg->buffer);
+        free(seg->table);
+    }
+    memset(seg, 0, sizeof(indexsegment));
+}
+
+
+/**
+ * Updates the memory usage of a vector index.
+ *
+ * @param vindex the index structure
+ */
+static void update_vectorindex_memory(vectorindex *vindex) {
+    int i;
+    vindex->memory_usage = sizeof(vectorindex);
+    for (i=0; i<vindex->num_segments; ++i) {
+        const indexsegment *seg = &vindex->segments[i];
+        vindex->memory_usage += seg->buffer_size + seg->table_size *
+                sizeof(indexbucket);
+    }
+}
+
+
+/**
+ * Initializes a vector index structure.
+ *
+ * @return pointer to the index structure.
+ */
+void *init_vectorindex(void) {
+    vectorindex *vindex = calloc(1, sizeof(vectorindex));
+    return vindex;
+}
+
+/**
+ * Builds an index segment for songs of a collection in memory. The songs
+ * are divided to parts of consecutive songs that are scanned in parallel,
+ * first to count the records of each vector and then to store them. The
+ * records of a part are stored to the range that follows the records of
+ * the previous parts, so the segment does not depend on the number of
+ * threads.
+ *
+ * @param vindex the index structure, with the vector parameters set
+ * @param seg the segment to build
+ * @param sc the song collection
+ * @param first_song the first song to index
+ * @param end_song the song after the last one to index
+ * @param dp index parameters
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int build_index_segment(vectorindex *vindex, indexsegment *seg,
+        const songcollection *sc, int first_song, int end_song,
+        const dataparameters *dp) {
+    int i, n, p;
+    size_t bp;
+    int compressed;
+    int num_parts, total_notes, notes;
+    indexbuilder *parts = NULL;
+    indexbuilder merged;
+    indexvector **indexed = NULL;
+    wideindexrec *previous = NULL;
+    int *positions = NULL;
+    int *bytes = NULL;
+
+    memset(&merged, 0, sizeof(indexbuilder));
+    memset(seg, 0, sizeof(indexsegment));
+    seg->first_song = first_song;
+    seg->end_song = end_song;
+    seg->record_format = select_record_format(sc, first_song, end_song,
+            dp->compress_vindex);
+    compressed = (seg->record_format == VINDEX_RECORDS_COMPRESSED);
 
-    /* Allocate space for pointers to index vectors */
-    vindex->vectors = (indexvector **) malloc(vindex->size
-            * sizeof(indexvector *));
+    /* Divide the songs to parts with about the same number of notes */
+    num_parts = dp->num_threads;
+    if (num_parts <= 0) num_parts = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_parts = MIN2(MIN2(num_parts, end_song - first_song),
+            VINDEX_MAX_THREADS);
+    num_parts = MAX2(num_parts, 1);
+    parts = (indexbuilder *) calloc(num_parts, sizeof(indexbuilder));
+    if (parts == NULL) goto NO_MEMORY;
+    total_notes = 0;
+    for (i=first_song; i<end_song; ++i) total_notes += sc->songs[i].size;
+    notes = 0;
+    for (i=first_song, p=0; p<num_parts; ++p) {
+        indexbuilder *b = &parts[p];
+        b->vindex = vindex;
+        b->segment = seg;
+        b->sc = sc;
+        b->first_song = i;
+        if (p == num_parts - 1) i = end_song;
+        else {
+            long long limit = (long long) total_notes * (p + 1) / num_parts;
+            while ((i < end_song) && (notes < limit))
+                notes += sc->songs[i++].size;
+        }
+        b->end_song = i;
+        if (!alloc_index_directory(1024, &b->table, &b->table_size,
+                &b->table_shift)) goto NO_MEMORY;
+    }
 
-    vindex->memory_usage += vindex->size * sizeof(indexvector *)
-            + sizeof(vectorindex);
+    /* Count all vectors so that we can allocate the right amount of memory */
+    run_index_pass(parts, num_parts, count_index_record);
+    for (p=0; p<num_parts; ++p) {
+        if (parts[p].failed) goto NO_MEMORY;
+        if (parts[p].too_large) goto TOO_LARGE;
+    }
+
+    /* Sum the counts of the parts */
+    if (!alloc_index_directory(1024, &merged.table, &merged.table_size,
+            &merged.table_shift)) goto NO_MEMORY;
+    for (p=0; p<num_parts; ++p) {
+        indexbuilder *b = &parts[p];
+        for (i=0; i<b->num_vectors; ++i) {
+            n = add_builder_vector(&merged, b->keys[i]);
+            if (n < 0) goto NO_MEMORY;
+            if (!add_index_vector_size(&merged.counts[n], b->counts[i]))
+                goto TOO_LARGE;
+        }
+    }
+    if (!number_index_vectors(&merged, seg)) goto NO_MEMORY;
+
+    /* Give each part the range that follows the records of the previous
+     * parts. For compressed vectors the parts also need the record that
+     * precedes the range. */
+    positions = (int *) calloc(MAX2(seg->size, 1), sizeof(int));
+    bytes = (int *) calloc(MAX2(seg->size, 1), sizeof(int));
+    previous = (wideindexrec *) calloc(MAX2(seg->size, 1),
+            sizeof(wideindexrec));
+    if ((positions == NULL) || (bytes == NULL) || (previous == NULL))
+        goto NO_MEMORY;
+    for (p=0; p<num_parts; ++p) {
+        indexbuilder *b = &parts[p];
+        int size = MAX2(b->num_vectors, 1);
+        b->vectors = (int *) malloc(size * sizeof(int));
+        b->first = (int *) malloc(size * sizeof(int));
+        b->added = (int *) malloc(size * sizeof(int));
+        if ((b->vectors == NULL) || (b->first == NULL) || (b->added == NULL))
+            goto NO_MEMORY;
+        if (compressed) {
+            b->previous = (wideindexrec *) malloc(size *
+                    sizeof(wideindexrec));
+            b->first_byte = (int *) malloc(size * sizeof(int));
+            b->bytes = (int *) malloc(size * sizeof(int));
+            if ((b->previous == NULL) || (b->first_byte == NULL) ||
+                    (b->bytes == NULL)) goto NO_MEMORY;
+        }
+        for (i=0; i<b->num_vectors; ++i) {
+            int h = find_index_bucket(seg->table, seg->table_size,
+                    seg->table_shift, b->keys[i]);
+            n = (seg->table[h].key < 0) ? -1 : seg->table[h].offset;
+            b->vectors[i] = n;
+            if (n < 0) continue;
+            b->first[i] = positions[n];
+            positions[n] += b->counts[i];
+            if (compressed) {
+                b->previous[i] = previous[n];
+                previous[n] = b->last[i];
+            }
+        }
+    }
+
+    /* Compressed vectors are encoded once to find out their sizes. The
+     * encoded data of each part follows the data of the previous parts. */
+    if (compressed) {
+        rewind_index_parts(parts, num_parts, 1, 1);
+        run_index_pass(parts, num_parts, measure_compressed_record);
+        for (p=0; p<num_parts; ++p) {
+            indexbuilder *b = &parts[p];
+            if (b->too_large) goto TOO_LARGE;
+            for (i=0; i<b->num_vectors; ++i) {
+                n = b->vectors[i];
+                if (n < 0) continue;
+                b->first_byte[i] = bytes[n];
+                if (!add_index_vector_size(&bytes[n], b->bytes[i]))
+                    goto TOO_LARGE;
+            }
+        }
+    }
+
+    /* Allocate a continuous memory buffer for index vectors and records */
+    seg->buffer_size = 0;
+    for (i=0; i<seg->size; ++i) {
+        seg->buffer_size += index_vector_bytes(seg->record_format,
+                positions[i], bytes[i]);
+    }
+    seg->buffer = (char *) malloc(MAX2(seg->buffer_size, 1));
+    indexed = (indexvector **) malloc(MAX2(seg->size, 1) *
+            sizeof(indexvector *));
+    if ((seg->buffer == NULL) || (indexed == NULL)) goto NO_MEMORY;
 
     /* Divide the buffer among the vectors */
     bp = 0;
-    for (i=0; i<vindex->size; ++i) {
-        if (vector_counts[i] > 0) {
-            vindex->vectors[i] = (indexvector *) (&vindex->buffer[bp]);
-            vindex->vectors[i]->size = 0;
-            bp += vector_counts[i] * sizeof(indexrec)
-                    + sizeof(indexvector);
-        } else vindex->vectors[i] = NULL;
+    for (i=0; i<seg->size; ++i) {
+        indexvector *iv = (indexvector *) (&seg->buffer[bp]);
+        indexed[i] = iv;
+        iv->size = positions[i];
+        bp += index_vector_bytes(seg->record_format, positions[i], bytes[i]);
+        /* Zero the alignment padding */
+        if (compressed) memset(&seg->buffer[bp - 4], 0, 4);
     }
 
     /* Scan and store individual records */
+    for (p=0; p<num_parts; ++p) parts[p].indexed = indexed;
+    rewind_index_parts(parts, num_parts, compressed, 0);
+    if (compressed)
+        run_index_pass(parts, num_parts, store_compressed_record);
+    else run_index_pass(parts, num_parts, store_index_record);
+
+    /* Point the directory to the vectors */
+    for (i=0; i<seg->table_size; ++i) {
+        indexbucket *bucket = &seg->table[i];
+        if (bucket->key >= 0) {
+            bucket->offset = (size_t) ((char *) indexed[bucket->offset] -
+                    seg->buffer);
+        }
+    }
+
+    for (p=0; p<num_parts; ++p) free_index_builder(&parts[p]);
+    free_index_builder(&merged);
+    free(parts);
+    free(indexed);
+    free(previous);
+    free(positions);
+    free(bytes);
+    return 1;
+
+TOO_LARGE:
+    fputs("Error in build_vectorindex(): a vector has more records than an index vector can hold\n",
+            stderr);
+    goto FAIL;
+
+NO_MEMORY:
+    fputs("Error in build_vectorindex(): failed to allocate memory\n",
+            stderr);
+FAIL:
+    if (parts != NULL) {
+        for (p=0; p<num_parts; ++p) free_index_builder(&parts[p]);
+    }
+    free_index_builder(&merged);
+    free(parts);
+    free(indexed);
+    free(previous);
+    free(positions);
+    free(bytes);
+    free_index_segment(seg);
+    return 0;
+}
+
+
+/**
+ * Moves a cursor to the start of the records of its vector in a segment.
+ *
+ * @param c the cursor
+ * @param segment the segment
+ * @param iv the indexed vector in the segment
+ */
+static void start_index_part(indexcursor *c, int segment,
+        const indexvector *iv) {
+    c->segment = segment;
+    c->iv = iv;
+    c->format = c->vindex->segments[segment].record_format;
+    c->part_start = c->part_end;
+    c->part_end += iv->size;
+    if (c->format == VINDEX_RECORDS_COMPRESSED) {
+        c->record.song = 0;
+        c->record.note = 0;
+        c->data = (const unsigned char *) (((const indexblock *)
+                iv->records) + index_vector_blocks(iv));
+        c->next = c->data;
+    } else {
+        c->record.song = -1;
+        c->record.note = -1;
+        c->data = NULL;
+        c->next = NULL;
+    }
+}
+
+/**
+ * Finds the next segment after the current one that has records of
+ * the cursor's vector.
+ *
+ * @param c the cursor
+ * @param iv the indexed vector in the segment will be stored here
+ *
+ * @return the segment, or -1 if there are no more records
+ */
+static int find_next_index_part(const indexcursor *c, const indexvector **iv) {
+    int s;
+    for (s=c->segment+1; s<c->vindex->num_segments; ++s) {
+        *iv = segment_vector(&c->vindex->segments[s], c->key);
+        if (*iv != NULL) return s;
+    }
+    return -1;
+}
+
+/**
+ * Moves a cursor to the next segment that has records of its vector.
+ * This is called by read_index_record() when the records of the current
+ * segment have been read.
+ *
+ * @param c the cursor
+ */
+void next_index_part(indexcursor *c) {
+    const indexvector *iv;
+    int s = find_next_index_part(c, &iv);
+    if (s >= 0) start_index_part(c, s, iv);
+}
+
+/**
+ * Initializes a cursor to the first record of a vector.
+ *
+ * @param vindex the index structure
+ * @param key vector key, or -1 for a vector outside the index
+ * @param c the cursor
+ *
+ * @return number of records of the vector in all segments
+ */
+static int open_index_key(const vectorindex *vindex, int key,
+        indexcursor *c) {
+    const indexvector *first = NULL;
+    int s, first_segment = -1;
+
+    memset(c, 0, sizeof(indexcursor));
+    c->vindex = vindex;
+    c->key = key;
+    c->segment = -1;
+    if (key < 0) return 0;
+    for (s=vindex->num_segments-1; s>=0; --s) {
+        const indexvector *iv = segment_vector(&vindex->segments[s], key);
+        if (iv != NULL) {
+            c->size += iv->size;
+            first = iv;
+            first_segment = s;
+        }
+    }
+    if (first != NULL) start_index_part(c, first_segment, first);
+    return c->size;
+}
+
+/**
+ * Initializes a cursor to the first record of the specified vector. The
+ * cursor reads the records from all segments of the index in the order
+ * of song numbers and note positions.
+ *
+ * @param vindex the index structure
+ * @param x vector's x component
+ * @param y vector's y component
+ * @param c the cursor
+ *
+ * @return number of records of the vector, 0 if it has none
+ */
+int open_index_vector(const vectorindex *vindex, int x, int y,
+        indexcursor *c) {
+    return open_index_key(vindex, index_vector_key(vindex, x, y), c);
+}
+
+
+/**
+ * Moves a cursor past the records of songs before the given song, so that
+ * the next record read is the first one with a song number that is at
+ * least the given one. Segments that start before the song are skipped
+ * as a whole. Within a segment, uncompressed records are searched with
+ * a binary search and compressed records with the block skip pointers.
+ *
+ * @param c the cursor
+ * @param song song number
+ */
+void skip_index_records(indexcursor *c, int song) {
+    const indexvector *iv;
+
+    if ((c->position >= c->size) || (c->record.song >= song)) return;
+
+    /* Records in the segments before the last one that starts at or
+     * before the song are all smaller */
+    while (c->part_end < c->size) {
+        int s = find_next_index_part(c, &iv);
+        if ((s < 0) || (c->vindex->segments[s].first_song > song)) break;
+        c->position = c->part_end;
+        start_index_part(c, s, iv);
+    }
+    if (c->position == c->part_end) return;
+
+    iv = c->iv;
+    if (c->format != VINDEX_RECORDS_COMPRESSED) {
+        int low = c->position - c->part_start, high = iv->size;
+        while (low < high) {
+            int mid = (low + high) >> 1;
+            int s;
+            if (c->format == VINDEX_RECORDS_32BIT)
+                s = ((const wideindexrec *) iv->records)[mid].song;
+            else s = iv->records[mid].song;
+            if (s < song) low = mid + 1;
+            else high = mid;
+        }
+        c->position = c->part_start + low;
+    } else {
+        const indexblock *blocks = (const indexblock *) iv->records;
+        int num_blocks = index_vector_blocks(iv);
+        /* Block b + 1 starts at position (b + 1) * VINDEX_BLOCK_SIZE */
+        int b = MAX2((c->position - c->part_start + VINDEX_BLOCK_SIZE - 1) /
+                VINDEX_BLOCK_SIZE - 1, 0);
+
+        /* Jump to the last block that starts before the song */
+        if ((b < num_blocks) && (blocks[b].song < song)) {
+            while ((b + 1 < num_blocks) && (blocks[b+1].song < song)) ++b;
+            c->position = c->part_start + (b + 1) * VINDEX_BLOCK_SIZE;
+            c->next = c->data + blocks[b].offset;
+        }
+        /* Then read ahead in the block */
+        while (c->position < c->part_end) {
+            indexcursor ahead = *c;
+            if (read_index_record(&ahead)->song >= song) break;
+            *c = ahead;
+        }
+    }
+}
+
+
+/**
+ * Reads the records of a vector with a cursor and writes them to
+ * an indexed vector.
+ *
+ * @param c a cursor at the first record of the vector
+ * @param format record format of the indexed vector
+ * @param iv the indexed vector, with its size set. For compressed vectors
+ *        this can be NULL to only measure the encoded size.
+ *
+ * @return size of the encoded records of a compressed vector in bytes,
+ *         0 for other formats
+ */
+static long long copy_index_records(indexcursor *c, int format,
+        indexvector *iv) {
+    indexblock *blocks = NULL;
+    unsigned char *data = NULL;
+    wideindexrec last;
+    long long bytes = 0;
+    int k;
+
+    if ((iv != NULL) && (format == VINDEX_RECORDS_COMPRESSED)) {
+        blocks = (indexblock *) iv->records;
+        data = (unsigned char *) (blocks + index_vector_blocks(iv));
+    }
+    last.song = 0;
+    last.note = 0;
+    for (k=0; k<c->size; ++k) {
+        const wideindexrec *r = read_index_record(c);
+        switch (format) {
+            case VINDEX_RECORDS_16BIT:
+                iv->records[k].song = r->song;
+                iv->records[k].note = r->note;
+                break;
+            case VINDEX_RECORDS_32BIT:
+                ((wideindexrec *) iv->records)[k] = *r;
+                break;
+            default:
+                if (((k % VINDEX_BLOCK_SIZE) == 0) && (k > 0)) {
+                    if (blocks != NULL) {
+                        indexblock *block = &blocks[k / VINDEX_BLOCK_SIZE - 1];
+                        block->song = r->song;
+                        block->note = r->note;
+                        block->offset = (int) bytes;
+                    }
+                } else {
+                    bytes += encode_index_record((data != NULL) ?
+                            &data[bytes] : NULL, &last, r->song, r->note);
+                }
+                last = *r;
+                break;
+        }
+    }
+    return bytes;
+}
+
+
+/**
+ * Merges index segments to a single segment. The result is the same as
+ * a segment built for the songs of the merged segments, except that the
+ * bucket size limit is applied to each segment separately. The songs are
+ * not accessed, so the collection can be modified during the merge.
+ *
+ * @param view an index structure with only the segments to merge
+ * @param out the merged segment
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+static int merge_index_segments(const vectorindex *view, indexsegment *out) {
+    indexbuilder m;
+    indexcursor c;
+    indexvector **indexed = NULL;
+    int *bytes = NULL;
+    int i, s, n;
+    size_t bp;
+
+    memset(&m, 0, sizeof(indexbuilder));
+    memset(out, 0, sizeof(indexsegment));
+    out->first_song = view->segments[0].first_song;
+    out->end_song = view->segments[view->num_segments - 1].end_song;
+    out->record_format = VINDEX_RECORDS_16BIT;
+    for (s=0; s<view->num_segments; ++s) {
+        int format = view->segments[s].record_format;
+        if (format == VINDEX_RECORDS_COMPRESSED)
+            out->record_format = VINDEX_RECORDS_COMPRESSED;
+        else if ((format == VINDEX_RECORDS_32BIT) &&
+                (out->record_format == VINDEX_RECORDS_16BIT))
+            out->record_format = VINDEX_RECORDS_32BIT;
+    }
+
+    /* Sum the record counts of the segments */
+    if (!alloc_index_directory(1024, &m.table, &m.table_size,
+            &m.table_shift)) goto NO_MEMORY;
+    for (s=0; s<view->num_segments; ++s) {
+        const indexsegment *seg = &view->segments[s];
+        for (i=0; i<seg->table_size; ++i) {
+            const indexbucket *bucket = &seg->table[i];
+            if (bucket->key < 0) continue;
+            n = add_builder_vector(&m, bucket->key);
+            if (n < 0) goto NO_MEMORY;
+            if (!add_index_vector_size(&m.counts[n], ((const indexvector *)
+                    &seg->buffer[bucket->offset])->size)) goto TOO_LARGE;
+        }
+    }
+    if (!number_index_vectors(&m, out)) goto NO_MEMORY;
+
+    /* Compressed vectors are encoded once to find out their sizes */
+    bytes = (int *) calloc(MAX2(out->size, 1), sizeof(int));
+    indexed = (indexvector **) malloc(MAX2(out->size, 1) *
+            sizeof(indexvector *));
+    if ((bytes == NULL) || (indexed == NULL)) goto NO_MEMORY;
+    if (out->record_format == VINDEX_RECORDS_COMPRESSED) {
+        for (i=0; i<out->size; ++i) {
+            open_index_key(view, m.keys[i], &c);
+            if (!add_index_vector_size(&bytes[i], copy_index_records(&c,
+                    out->record_format, NULL))) goto TOO_LARGE;
+        }
+    }
+
+    out->buffer_size = 0;
+    for (i=0; i<out->size; ++i) {
+        out->buffer_size += index_vector_bytes(out->record_format,
+                m.counts[i], bytes[i]);
+    }
+    out->buffer = (char *) malloc(MAX2(out->buffer_size, 1));
+    if (out->buffer == NULL) goto NO_MEMORY;
+
+    /* Copy the records of each vector from the segments in order */
+    bp = 0;
+    for (i=0; i<out->size; ++i) {
+        indexvector *iv = (indexvector *) (&out->buffer[bp]);
+        indexed[i] = iv;
+        iv->size = m.counts[i];
+        bp += index_vector_bytes(out->record_format, m.counts[i], bytes[i]);
+        /* Zero the alignment padding */
+        if (out->record_format == VINDEX_RECORDS_COMPRESSED)
+            memset(&out->buffer[bp - 4], 0, 4);
+        open_index_key(view, m.keys[i], &c);
+        copy_index_records(&c, out->record_format, iv);
+    }
+
+    /* Point the directory to the vectors */
+    for (i=0; i<out->table_size; ++i) {
+        indexbucket *bucket = &out->table[i];
+        if (bucket->key >= 0) {
+            bucket->offset = (size_t) ((char *) indexed[bucket->offset] -
+                    out->buffer);
+        }
+    }
+
+    free_index_builder(&m);
+    free(indexed);
+    free(bytes);
+    return 1;
+
+TOO_LARGE:
+    fputs("Error in append_vectorindex(): a vector has more records than an index vector can hold\n",
+            stderr);
+    goto FAIL;
+
+NO_MEMORY:
+    fputs("Error in append_vectorindex(): failed to allocate memory for merging index segments\n",
+            stderr);
+FAIL:
+    free_index_builder(&m);
+    free(indexed);
+    free(bytes);
+    free_index_segment(out);
+    return 0;
+}
+
+
+/**
+ * A merge of index segments that runs in a separate thread.
+ */
+typedef struct {
+    /* The merged segments first..last of the index */
+    int first;
+    int last;
+    /* A copy of the index with only the segments to merge */
+    vectorindex view;
+    /* The merged segment and 1 if the merge was successful */
+    indexsegment result;
+    int ok;
+    /* Set when the merge has finished. Protected by lock. */
+    int done;
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int threaded;
+} indexmerge;
+
+
+/**
+ * Index merge thread.
+ *
+ * @param arg pointer to an indexmerge structure
+ *
+ * @return NULL
+ */
+static void *index_merge_worker(void *arg) {
+    indexmerge *m = (indexmerge *) arg;
+    m->ok = merge_index_segments(&m->view, &m->result);
+    pthread_mutex_lock(&m->lock);
+    m->done = 1;
+    pthread_mutex_unlock(&m->lock);
+    return NULL;
+}
+
+
+/**
+ * Starts merging the newest segments of an index in the background if
+ * there are VINDEX_MERGE_SEGMENTS segments and no merge is running. The
+ * run of merged segments is extended to older segments that are not
+ * larger than the run, so that each record is merged about log(n) times
+ * when songs are appended one by one.
+ *
+ * @param vindex the index structure
+ */
+static void start_index_merge(vectorindex *vindex) {
+    const indexsegment *segs = vindex->segments;
+    indexmerge *m;
+    int i, first, last = vindex->num_segments - 1;
+    long long records;
+
+    if ((vindex->merge != NULL) ||
+            (vindex->num_segments < VINDEX_MERGE_SEGMENTS)) return;
+
+    first = last - 1;
+    records = segs[first].num_records + segs[last].num_records;
+    while ((first > 0) && (segs[first-1].num_records <= records)) {
+        --first;
+        records += segs[first].num_records;
+    }
+
+    m = (indexmerge *) calloc(1, sizeof(indexmerge));
+    if (m == NULL) {
+        fputs("Error in append_vectorindex(): failed to allocate memory for merging index segments\n",
+                stderr);
+        return;
+    }
+    m->first = first;
+    m->last = last;
+    m->view = *vindex;
+    m->view.num_segments = last - first + 1;
+    for (i=0; i<m->view.num_segments; ++i)
+        m->view.segments[i] = segs[first + i];
+    m->view.merge = NULL;
+    pthread_mutex_init(&m->lock, NULL);
+    vindex->merge = m;
+
+    if (pthread_create(&m->thread, NULL, index_merge_worker, m) == 0)
+        m->threaded = 1;
+    else index_merge_worker(m);
+}
+
+
+/**
+ * Replaces the merged segments of an index with the result of a finished
+ * merge.
+ *
+ * @param vindex the index structure
+ * @param wait 1 to wait for a running merge to finish, 0 to leave it
+ *        running
+ */
+static void finish_index_merge(vectorindex *vindex, int wait) {
+    indexmerge *m = (indexmerge *) vindex->merge;
+    int i, done, removed;
+
+    if (m == NULL) return;
+    pthread_mutex_lock(&m->lock);
+    done = m->done;
+    pthread_mutex_unlock(&m->lock);
+    if (!done && !wait) return;
+
+    if (m->threaded) pthread_join(m->thread, NULL);
+    pthread_mutex_destroy(&m->lock);
+    if (m->ok) {
+        for (i=m->first; i<=m->last; ++i)
+            free_index_segment(&vindex->segments[i]);
+        vindex->segments[m->first] = m->result;
+        removed = m->last - m->first;
+        for (i=m->last+1; i<vindex->num_segments; ++i)
+            vindex->segments[i - removed] = vindex->segments[i];
+        vindex->num_segments -= removed;
+        for (i=0; i<removed; ++i) {
+            memset(&vindex->segments[vindex->num_segments + i], 0,
+                    sizeof(indexsegment));
+        }
+    }
+    free(m);
+    vindex->merge = NULL;
+    update_vectorindex_memory(vindex);
+}
+
+
+/**
+ * Sets the width and height of the vector key space from the index
+ * parameters. The keys are ints, so the key space must not have more than
+ * INT_MAX keys.
+ *
+ * @param vindex the index structure
+ * @param dp index parameters
+ *
+ * @return 1 if successful, 0 if the width or height is invalid
+ */
+static int set_index_dimensions(vectorindex *vindex,
+        const dataparameters *dp) {
+    int width = dp->avindex_vector_max_width;
+    int max_height = dp->avindex_vector_max_height;
+    if ((width <= 0) || (max_height <= 0) || (max_height > INT_MAX >> 1) ||
+            (width > INT_MAX / (max_height << 1))) return 0;
+    vindex->width = width;
+    vindex->height = max_height << 1;
+    return 1;
+}
+
+
+/**
+ * Initializes and builds a vector index for a song collection. If
+ * dp->vindex_file is set, the index is loaded from that file when it
+ * matches the song collection and the parameters. Otherwise the index is
+ * built and written to the file for the next run.
+ *
+ * @param data pointer to a vector index structure
+ * @param sc the song collection for which the index is built
+ * @param dp index parameters: maximum width and height of an index vector,
+ *        the maximum number of consecutive notes the algorithm is allowed
+ *        to skip when selecting indexed vectors and the index file
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int build_vectorindex(void *data, const songcollection *sc,
+        const dataparameters *dp) {
+    vectorindex *vindex = (vectorindex *) data;
+
+    if (!set_index_dimensions(vindex, dp)) {
+        fputs("Error in build_vectorindex(): invalid index vector width or height\n",
+                stderr);
+        return 0;
+    }
+    if (dp->vindex_file != NULL) {
+        if (load_vectorindex(vindex, sc, dp, dp->vindex_file)) return 1;
+    }
+
+    vindex->c_window = dp->c_window;
+    vindex->scollection = sc;
+    if (!build_index_segment(vindex, &vindex->segments[0], sc, 0, sc->size,
+            dp)) return 0;
+    vindex->num_segments = 1;
+    update_vectorindex_memory(vindex);
+
+    /* A failed save is reported but the index can still be used */
+    if (dp->vindex_file != NULL) save_vectorindex(vindex, dp->vindex_file);
+    return 1;
+}
+
+
+/**
+ * Adds songs that were appended to an indexed song collection to the
+ * index. The songs are indexed to a new segment in O(new notes) time, and
+ * the newest segments are merged in the background when there are
+ * VINDEX_MERGE_SEGMENTS of them. The index can be searched during the
+ * merge, but it must not be modified from other threads.
+ *
+ * @param data pointer to a vector index structure built for the collection
+ * @param sc the song collection
+ * @param first_song the first appended song; songs before it are indexed
+ * @param dp index parameters
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int append_vectorindex(void *data, const songcollection *sc,
+        int first_song, const dataparameters *dp) {
+    vectorindex *vindex = (vectorindex *) data;
+    indexsegment *seg;
+
+    if ((vindex->num_segments == 0) || (sc != vindex->scollection) ||
+            (first_song != vindex->segments[vindex->num_segments - 1].end_song) ||
+            (first_song > sc->size)) {
+        fputs("Error in append_vectorindex(): the songs do not follow the indexed songs\n",
+                stderr);
+        return 0;
+    }
+    if (first_song == sc->size) return 1;
+
+    finish_index_merge(vindex, 0);
+    if (vindex->num_segments == VINDEX_MAX_SEGMENTS) {
+        /* Wait for the running merge, or merge now if none was started */
+        start_index_merge(vindex);
+        finish_index_merge(vindex, 1);
+        if (vindex->num_segments == VINDEX_MAX_SEGMENTS) return 0;
+    }
+
+    seg = &vindex->segments[vindex->num_segments];
+    if (!build_index_segment(vindex, seg, sc, first_song, sc->size, dp))
+        return 0;
+    ++vindex->num_segments;
+    update_vectorindex_memory(vindex);
+    start_index_merge(vindex);
+    return 1;
+}
+
+
+/**
+ * Calculates a fingerprint of the notes in a song collection. Index files
+ * are only loaded for collections with the same fingerprint.
+ *
+ * @param sc a song collection
+ * @param num_notes the total number of notes will be stored here
+ * @param fingerprint two hash values will be stored here
+ */
+static void vectorindex_fingerprint(const songcollection *sc, int *num_notes,
+        unsigned int *fingerprint) {
+    /* 32-bit FNV-1a and a multiplicative hash with a different prime,
+     * over the song sizes and the note positions */
+    unsigned int h1 = 2166136261U, h2 = 5381U;
+    int i, j, n = 0;
+
     for (i=0; i<sc->size; ++i) {
-        int j;
-        song *s = &sc->songs[i];
-        for (j=0; j<s->size-1; ++j) {
-            int end, k;
-            if (vindex->c_window == INT_MAX) end = s->size - 1;
-            else {
-                end = j + vindex->c_window;
-                if (end >= s->size) end = s->size - 1;
-            }
-            for (k=j+1; k<=end; ++k) {
-                int x = s->notes[k].strt - s->notes[j].strt;
-                char y = s->notes[k].ptch - s->notes[j].ptch;
-                indexvector *iv = get_index_vector(vindex, x, y);
-                if (iv != NULL) {
-                    iv->records[iv->size].song = i;
-                    iv->records[iv->size].note = j;
-                    iv->size++;
-                } else if (x >= vindex->width) break;
-            }
+        const song *s = &sc->songs[i];
+        h1 = (h1 ^ (unsigned int) s->size) * 16777619U;
+        h2 = h2 * 31U + (unsigned int) s->size;
+        for (j=0; j<s->size; ++j) {
+            h1 = (h1 ^ (unsigned int) s->notes[j].strt) * 16777619U;
+            h1 = (h1 ^ (unsigned int) s->notes[j].ptch) * 16777619U;
+            h2 = h2 * 31U + (unsigned int) s->notes[j].strt;
+            h2 = h2 * 31U + (unsigned int) s->notes[j].ptch;
+        }
+        n += s->size;
+    }
+    *num_notes = n;
+    fingerprint[0] = h1;
+    fingerprint[1] = h2;
+}
+
+
+/**
+ * Fills a vector index file header for an index segment.
+ *
+ * @param vindex the index structure
+ * @param seg the segment
+ * @param sc the indexed song collection
+ * @param header the header to fill
+ */
+static void vectorindex_file_header(const vectorindex *vindex,
+        const indexsegment *seg, const songcollection *sc,
+        vindexfileheader *header) {
+    memset(header, 0, sizeof(vindexfileheader));
+    strncpy(header->magic, VINDEX_FILE_MAGIC, sizeof(header->magic));
+    header->version = VINDEX_FILE_VERSION;
+    header->record_format = seg->record_format;
+    header->size = seg->size;
+    header->width = vindex->width;
+    header->height = vindex->height;
+    header->c_window = vindex->c_window;
+    header->max_bucket_size = MAX_INDEX_BUCKET_SIZE;
+    header->table_size = seg->table_size;
+    header->num_songs = sc->size;
+    vectorindex_fingerprint(sc, &header->num_notes, header->fingerprint);
+    header->buffer_size = (long long) seg->buffer_size;
+}
+
+
+/**
+ * Writes a vector index to a file that load_vectorindex() can map to
+ * memory. The index must have a single segment. The file is first written
+ * with a temporary name and then renamed, so that a concurrent reader
+ * never sees a partial index.
+ *
+ * @param vindex the index structure
+ * @param path output file path
+ *
+ * @return 1 if successful, 0 otherwise
+ */
+int save_vectorindex(const vectorindex *vindex, const char *path) {
+    const indexsegment *seg = &vindex->segments[0];
+    vindexfileheader header;
+    char *tmppath;
+    FILE *f;
+    int ok;
+
+    if ((vindex->num_segments == 0) || (vindex->scollection == NULL)) {
+        fputs("Error in save_vectorindex(): the index has not been built\n",
+                stderr);
+        return 0;
+    }
+    if (vindex->num_segments > 1) {
+        fputs("Error in save_vectorindex(): the index has appended segments\n",
+                stderr);
+        return 0;
+    }
+
+    tmppath = (char *) malloc(strlen(path) + 5);
+    if (tmppath == NULL) {
+        fputs("Error in save_vectorindex(): failed to allocate memory\n",
+                stderr);
+        return 0;
+    }
+    vectorindex_file_header(vindex, seg, vindex->scollection, &header);
+
+    sprintf(tmppath, "%s.tmp", path);
+    f = fopen(tmppath, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Error in save_vectorindex(): unable to open %s: %s\n",
+                tmppath, strerror(errno));
+        free(tmppath);
+        return 0;
+    }
+    ok = (fwrite(&header, sizeof(vindexfileheader), 1, f) == 1) &&
+            (fwrite(seg->table, sizeof(indexbucket), seg->table_size,
+            f) == (size_t) seg->table_size) &&
+            ((seg->buffer_size == 0) ||
+            (fwrite(seg->buffer, seg->buffer_size, 1, f) == 1));
+    if (fclose(f) != 0) ok = 0;
+    if (ok && (rename(tmppath, path) != 0)) ok = 0;
+    if (!ok) {
+        fprintf(stderr, "Error in save_vectorindex(): unable to write %s: %s\n",
+                path, strerror(errno));
+        remove(tmppath);
+    }
+    free(tmppath);
+    return ok;
+}
+
+
+/**
+ * Skips a variable-length integer of compressed index records without
+ * reading past the end of the data.
+ *
+ * @param p the integer to skip, moved past it
+ * @param end end of the data
+ *
+ * @return 1 if successful, 0 if the integer is truncated or too long
+ */
+static int skip_index_varint(const unsigned char **p,
+        const unsigned char *end) {
+    int n;
+    for (n=0; n<5; ++n) {
+        if (*p >= end) return 0;
+        if ((*(*p)++ & 0x80) == 0) return 1;
+    }
+    return 0;
+}
+
+/**
+ * Decodes the records of a compressed indexed vector from a file to check
+ * that they fit in its part of the record buffer and that the block skip
+ * pointers point to the start of each block's records.
+ *
+ * @param iv the indexed vector
+ * @param data_size size of the encoded data after the blocks, including
+ *        the alignment padding
+ *
+ * @return 1 if the records are valid, 0 otherwise
+ */
+static int check_compressed_index_vector(const indexvector *iv,
+        size_t data_size) {
+    const indexblock *blocks = (const indexblock *) iv->records;
+    const unsigned char *data = (const unsigned char *) (blocks +
+            index_vector_blocks(iv));
+    const unsigned char *p = data, *end = data + data_size;
+    int k;
+    for (k=0; k<iv->size; ++k) {
+        if (((k % VINDEX_BLOCK_SIZE) == 0) && (k > 0)) {
+            if ((size_t) blocks[k / VINDEX_BLOCK_SIZE - 1].offset !=
+                    (size_t) (p - data)) return 0;
+        } else {
+            const unsigned char *d = p;
+            if (!skip_index_varint(&p, end)) return 0;
+            if ((*d & 1) && !skip_index_varint(&p, end)) return 0;
+        }
+    }
+    /* Only the alignment padding may follow the records */
+    return (end - p < 4);
+}
+
+
+/**
+ * Checks that the indexed vectors of a segment loaded from a file fill its
+ * record buffer in the order of their keys, as build_vectorindex() lays
+ * them out, and that the records of each vector stay within its part of
+ * the buffer. Compressed vectors are decoded for the check. Also counts
+ * the records of the segment.
+ *
+ * @param seg the segment, with the directory and the buffer mapped
+ *
+ * @return 1 if the vectors are valid, 0 otherwise
+ */
+static int check_index_file_vectors(indexsegment *seg) {
+    indexbucket *vectors = (indexbucket *) malloc(MAX2(seg->size, 1) *
+            sizeof(indexbucket));
+    int i, n = 0, ok = 1;
+
+    if (vectors == NULL) {
+        fputs("Error in load_vectorindex(): failed to allocate memory\n",
+                stderr);
+        return 0;
+    }
+    for (i=0; i<seg->table_size; ++i) {
+        if (seg->table[i].key >= 0) vectors[n++] = seg->table[i];
+    }
+    qsort(vectors, n, sizeof(indexbucket), compare_index_buckets);
+
+    seg->num_records = 0;
+    for (i=0; (i<n) && ok; ++i) {
+        const indexvector *iv;
+        size_t start = vectors[i].offset, end, bytes;
+        end = (i + 1 < n) ? vectors[i+1].offset : seg->buffer_size;
+        /* Each vector starts where the previous one ends */
+        if (((i == 0) && (start != 0)) || (end < start) ||
+                (end - start < sizeof(indexvector))) {
+            ok = 0;
+            break;
+        }
+        iv = (const indexvector *) &seg->buffer[start];
+        if (iv->size <= 0) {
+            ok = 0;
+            break;
+        }
+        bytes = index_vector_bytes(seg->record_format, iv->size, 0);
+        if (seg->record_format != VINDEX_RECORDS_COMPRESSED) {
+            ok = (bytes == end - start);
+        } else if (bytes > end - start) {
+            ok = 0;
+        } else {
+            ok = check_compressed_index_vector(iv, end - start - bytes);
         }
+        seg->num_records += iv->size;
     }
+    if (n == 0) ok = (seg->buffer_size == 0);
+    free(vectors);
+    return ok;
+}
+
+
+/**
+ * Loads a vector index from a file written by save_vectorindex(). The file
+ * is mapped to memory and the records are used in place. The index is
+ * only loaded if the file was built with the same parameters for a song
+ * collection with the same notes.
+ *
+ * @param vindex an initialized, empty index structure
+ * @param sc the song collection that the index should match
+ * @param dp index parameters that the index should match
+ * @param path index file path
+ *
+ * @return 1 if successful, 0 if the file does not exist, does not match or
+ *         cannot be read. A missing file is not reported as an error.
+ */
+int load_vectorindex(vectorindex *vindex, const songcollection *sc,
+        const dataparameters *dp, const char *path) {
+    indexsegment *seg = &vindex->segments[0];
+    struct stat statbuf;
+    vindexfileheader expected;
+    const vindexfileheader *header;
+    const indexbucket *table;
+    char *mapping;
+    size_t table_size;
+    int fd, i, num_vectors;
 
-    free(vector_counts);
+    if (!set_index_dimensions(vindex, dp)) {
+        fputs("Error in load_vectorindex(): invalid index vector width or height\n",
+                stderr);
+        return 0;
+    }
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        if (errno != ENOENT) {
+            fprintf(stderr, "Error in load_vectorindex(): unable to open %s: %s\n",
+                    path, strerror(errno));
+        }
+        return 0;
+    }
+    if ((fstat(fd, &statbuf) != 0) ||
+            (statbuf.st_size < (off_t) sizeof(vindexfileheader))) {
+        fprintf(stderr, "Error in load_vectorindex(): %s is not an index file\n",
+                path);
+        close(fd);
+        return 0;
+    }
+    mapping = (char *) mmap(NULL, statbuf.st_size, PROT_READ, MAP_SHARED,
+            fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error in load_vectorindex(): unable to map %s: %s\n",
+                path, strerror(errno));
+        return 0;
+    }
+    header = (const vindexfileheader *) mapping;
+
+    /* Compare the header with the one that would be written for this
+     * collection */
+    memset(seg, 0, sizeof(indexsegment));
+    vindex->c_window = dp->c_window;
+    seg->record_format = select_record_format(sc, 0, sc->size,
+            dp->compress_vindex);
+    seg->size = header->size;
+    seg->table_size = header->table_size;
+    seg->buffer_size = (size_t) header->buffer_size;
+    vectorindex_file_header(vindex, seg, sc, &expected);
+    if (memcmp(header, &expected, sizeof(vindexfileheader)) != 0) {
+        if (memcmp(header->magic, expected.magic, sizeof(expected.magic))) {
+            fprintf(stderr, "Error in load_vectorindex(): %s is not an index file\n",
+                    path);
+        } else {
+            fprintf(stderr, "Warning: index file %s does not match the song collection or the index parameters\n",
+                    path);
+        }
+        goto FAIL;
+    }
+    /* The directory size must be a power of two with free slots */
+    seg->table_shift = 32;
+    for (i=header->table_size; i>1; i>>=1) --seg->table_shift;
+    if ((header->table_size < 2) || (header->size < 0) ||
+            (header->buffer_size < 0) ||
+            (header->table_size & (header->table_size - 1)) ||
+            (header->size > header->table_size >> 1)) {
+        fprintf(stderr, "Error in load_vectorindex(): %s is corrupted\n",
+                path);
+        goto FAIL;
+    }
+    table_size = header->table_size * sizeof(indexbucket);
+    if ((size_t) statbuf.st_size != sizeof(vindexfileheader) + table_size +
+            header->buffer_size) {
+        fprintf(stderr, "Error in load_vectorindex(): %s is truncated\n",
+                path);
+        goto FAIL;
+    }
+
+    /* The directory and the buffer are used in place */
+    table = (const indexbucket *) (mapping + sizeof(vindexfileheader));
+    seg->table = (indexbucket *) table;
+    seg->buffer = mapping + sizeof(vindexfileheader) + table_size;
+    num_vectors = 0;
+    for (i=0; i<header->table_size; ++i) {
+        if (table[i].key < 0) continue;
+        if (table[i].key >= vindex->width * vindex->height) {
+            fprintf(stderr, "Error in load_vectorindex(): %s is corrupted\n",
+                    path);
+            goto FAIL;
+        }
+        ++num_vectors;
+    }
+    if ((num_vectors != header->size) || !check_index_file_vectors(seg)) {
+        fprintf(stderr, "Error in load_vectorindex(): %s is corrupted\n",
+                path);
+        goto FAIL;
+    }
+
+    seg->first_song = 0;
+    seg->end_song = sc->size;
+    seg->mapping = mapping;
+    seg->mapping_size = statbuf.st_size;
+    vindex->num_segments = 1;
+    vindex->scollection = sc;
+    update_vectorindex_memory(vindex);
     return 1;
+
+FAIL:
+    munmap(mapping, statbuf.st_size);
+    memset(seg, 0, sizeof(indexsegment));
+    return 0;
 }
 
 
 /**
- * Frees memory buffers of a vector index and re-initializes it.
+ * Frees memory buffers of a vector index and re-initializes it. A running
+ * segment merge is finished first.
  *
  * @param data the index structure
  */
 void clear_vectorindex(void *data) {
     vectorindex *vindex = (vectorindex *) data;
     if (vindex != NULL) {
-        if (vindex->buffer != NULL) free(vindex->buffer);
-        if (vindex->vectors != NULL) free(vindex->vectors);
+        int i;
+        finish_index_merge(vindex, 1);
+        for (i=0; i<vindex->num_segments; ++i)
+            free_index_segment(&vindex->segments[i]);
+        vindex->num_segments = 0;
         vindex->memory_usage = 0;
-        vindex->size = 0;
     }
 }
 
@@ -268,5 +1881,3 @@ void free_vectorindex(void *data) {
         free(vindex);
     }
 }
-
-
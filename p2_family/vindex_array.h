@@ -34,6 +34,8 @@
 #ifndef __VINDEX_ARRAY_H__
 #define __VINDEX_ARRAY_H__
 
+#include <stddef.h>
+
 #include "config.h"
 #include "data.h"
 #include "song.h"
@@ -51,24 +53,112 @@ typedef struct {
     unsigned short note;
 } indexrec;
 
+/**
+ * Index record for collections that have more than 65536 songs or songs
+ * with more than 65536 notes.
+ */
+typedef struct {
+    int song;
+    int note;
+} wideindexrec;
+
 /**
  * Indexed vector (contains multiple position records).
  */
 typedef struct {
     int size;
     /* Variable-length buffer for records. This is called "flexible array
-       member" in C99. */
+       member" in C99. The buffer holds wideindexrecs or compressed records
+       instead, depending on the record format of the index. */
     indexrec records[];
 } indexvector;
 
 
+/* Record formats */
+
+/** Records are stored as indexrecs */
+#define VINDEX_RECORDS_16BIT 0
+
+/** Records are stored as wideindexrecs */
+#define VINDEX_RECORDS_32BIT 1
+
+/**
+ * Records are compressed. The records of an index vector are divided to
+ * blocks of VINDEX_BLOCK_SIZE records. The vector starts with an indexblock
+ * for each block except the first one, followed by the other records
+ * encoded as variable-length integers. A record in the same song as the
+ * previous one is stored as the note position difference times two.
+ * A record in a later song is stored as the song number difference times
+ * two plus one, followed by the note position. The first record is encoded
+ * relative to song 0, note 0.
+ */
+#define VINDEX_RECORDS_COMPRESSED 2
+
+/** Number of records in a block of a compressed index vector */
+#define VINDEX_BLOCK_SIZE 64
+
+/**
+ * The first record of a block in a compressed index vector, and the offset
+ * of the encoded data for the rest of the block. This works as a skip
+ * pointer to the block.
+ */
+typedef struct {
+    int song;
+    int note;
+    int offset;
+} indexblock;
+
+
 /**
- * Vector index structure.
+ * Slot of the bucket directory that maps vectors to indexed vectors.
  */
 typedef struct {
-    /* Number of index vectors. In this implementation this is
-     * the same as width * height. */
+    /* Vector key y * width + x, or -1 for an empty slot */
+    int key;
+    /* Offset of the indexed vector within the record buffer */
+    size_t offset;
+} indexbucket;
+
+
+/**
+ * A segment of a vector index. The segment holds the records of songs
+ * first_song..end_song-1 of the indexed collection.
+ */
+typedef struct {
+    int first_song;
+    int end_song;
+    /* Number of indexed vectors, i.e. vectors that have records */
     int size;
+    /* Number of records in all the vectors */
+    long long num_records;
+    /* Record format: VINDEX_RECORDS_16BIT, VINDEX_RECORDS_32BIT or
+     * VINDEX_RECORDS_COMPRESSED */
+    int record_format;
+    /* A continuous buffer of index records for all the vectors */
+    char *buffer;
+    /* Size of the buffer in bytes */
+    size_t buffer_size;
+    /* Bucket directory: an open-addressing hash table with linear probing
+     * that holds only the indexed vectors, so that empty vectors of wide
+     * and high windows take no space */
+    indexbucket *table;
+    /* Number of slots in the directory (a power of two) and the shift that
+     * maps hash values to slots */
+    int table_size;
+    int table_shift;
+    /* Memory-mapped index file that holds the buffer and the directory, or
+     * NULL if the segment was built in memory */
+    void *mapping;
+    size_t mapping_size;
+} indexsegment;
+
+
+/**
+ * Vector index structure. The index is built as a single segment. Songs
+ * appended to the collection later are indexed to new segments, which
+ * are merged in the background.
+ */
+typedef struct {
     /* Maximum vector width */
     int width;
     /* Maximum vector height */
@@ -76,36 +166,156 @@ typedef struct {
     /* Maximum number of consecutive notes the algorithm is allowed to skip when
      * building an index for a song collection */
     int c_window;
-    /* A continuous buffer of index records for all the vectors */
-    char *buffer;
-    /* Pointers to indexed vectors within the buffer */
-    indexvector **vectors;
+    /* Segments in the order of their songs */
+    int num_segments;
+    indexsegment segments[VINDEX_MAX_SEGMENTS];
     /* The indexed song collection */
     const songcollection *scollection;
     /* Index memory usage in bytes */
-    int memory_usage;
+    size_t memory_usage;
+    /* Segment merge that runs in the background, or NULL */
+    void *merge;
 } vectorindex;
 
 
+/** Identifier at the start of vector index files */
+#define VINDEX_FILE_MAGIC "CBMRVIX"
+
+/** Vector index file format version */
+#define VINDEX_FILE_VERSION 5
+
+/**
+ * Vector index file header. The header is followed by the bucket directory
+ * (table_size indexbuckets) and the record buffer of an index with a single
+ * segment, exactly as build_vectorindex() lays them out in memory. The file
+ * is in the native byte order.
+ */
+typedef struct {
+    char magic[8];
+    int version;
+    /* Record format */
+    int record_format;
+    /* Index parameters */
+    int size;
+    int width;
+    int height;
+    int c_window;
+    int max_bucket_size;
+    /* Bucket directory size */
+    int table_size;
+    /* Number of songs and notes in the indexed collection, and
+     * a fingerprint of the notes */
+    int num_songs;
+    int num_notes;
+    unsigned int fingerprint[2];
+    /* Size of the record buffer in bytes */
+    long long buffer_size;
+} vindexfileheader;
+
+
 
 /* Global inline functions */
 
 
 /**
- * Returns the position of the specified vector in the index structure.
+ * Cursor for reading the records of an indexed vector in order. The
+ * records are read from all the segments of the index. Cursors can be
+ * copied to read ahead and return to the copied position.
+ */
+typedef struct {
+    const vectorindex *vindex;
+    /* Vector key */
+    int key;
+    /* Total number of records in all segments */
+    int size;
+    /* Number of records read */
+    int position;
+    /* Segment of the current part of the records, the indexed vector and
+     * the record format in that segment, and the range of positions in
+     * the part */
+    int segment;
+    const indexvector *iv;
+    int format;
+    int part_start;
+    int part_end;
+    /* The last record read */
+    wideindexrec record;
+    /* Start of compressed record data and the next byte to decode */
+    const unsigned char *data;
+    const unsigned char *next;
+} indexcursor;
+
+
+/**
+ * Returns the number of indexblocks in a compressed indexed vector.
  *
- * @param vindex the index structure
- * @param x vector's x component
- * @param y vector's y component
+ * @param iv an indexed vector
  *
- * @return position of the vector
+ * @return number of blocks after the first one
  */
-static INLINE indexvector *get_index_vector(const vectorindex *vindex,
-        int x, int y) {
-    y += vindex->height >> 1;
-    if ((y < 0) || (x < 0) || (y >= vindex->height) || (x >= vindex->width))
-        return NULL;
-    return vindex->vectors[y * vindex->width + x];
+static INLINE int index_vector_blocks(const indexvector *iv) {
+    return (iv->size - 1) / VINDEX_BLOCK_SIZE;
+}
+
+/**
+ * Decodes a variable-length integer of compressed index records.
+ *
+ * @param p pointer to the data pointer, which is moved past the integer
+ *
+ * @return the decoded value
+ */
+static INLINE int read_index_varint(const unsigned char **p) {
+    const unsigned char *d = *p;
+    int value = *d & 0x7F;
+    int shift = 7;
+    while (*d & 0x80) {
+        ++d;
+        value |= (*d & 0x7F) << shift;
+        shift += 7;
+    }
+    *p = d + 1;
+    return value;
+}
+
+/* Moves a cursor to the next segment that has records of its vector */
+void next_index_part(indexcursor *c);
+
+/**
+ * Reads the next record with a cursor. The caller must check that
+ * the cursor position is smaller than the vector size.
+ *
+ * @param c the cursor
+ *
+ * @return the record, which stays valid until the cursor is moved
+ */
+static INLINE const wideindexrec *read_index_record(indexcursor *c) {
+    int k;
+    if (c->position == c->part_end) next_index_part(c);
+    k = c->position++ - c->part_start;
+    switch (c->format) {
+        case VINDEX_RECORDS_16BIT:
+            c->record.song = c->iv->records[k].song;
+            c->record.note = c->iv->records[k].note;
+            break;
+        case VINDEX_RECORDS_32BIT:
+            c->record = ((const wideindexrec *) c->iv->records)[k];
+            break;
+        default:
+            if (((k % VINDEX_BLOCK_SIZE) == 0) && (k > 0)) {
+                const indexblock *b = &((const indexblock *)
+                        c->iv->records)[k / VINDEX_BLOCK_SIZE - 1];
+                c->record.song = b->song;
+                c->record.note = b->note;
+            } else {
+                int d = read_index_varint(&c->next);
+                if (d & 1) {
+                    c->record.song += d >> 1;
+                    c->record.note = read_index_varint(&c->next);
+                } else c->record.note += d >> 1;
+            }
+            break;
+    }
+    return &c->record;
 }
 
 /* External function declarations. */
@@ -116,8 +326,21 @@ void *init_vectorindex(void);
 int build_vectorindex(void *index, const songcollection *sc,
 	const dataparameters *dp);
 
+int append_vectorindex(void *index, const songcollection *sc,
+        int first_song, const dataparameters *dp);
+
 void clear_vectorindex(void *index);
 
+int open_index_vector(const vectorindex *vindex, int x, int y,
+        indexcursor *c);
+
+void skip_index_records(indexcursor *c, int song);
+
+int save_vectorindex(const vectorindex *vindex, const char *path);
+
+int load_vectorindex(vectorindex *vindex, const songcollection *sc,
+        const dataparameters *dp, const char *path);
+
 void free_vectorindex(void *index);
 
 